@@ -0,0 +1,584 @@
+/* vxi11.hpp
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Header-only C++ wrapper around the libvxi11 user library. Provides a
+ * move-only Device class that owns a VXI11_CLINK, typed queries and block
+ * reads into caller-owned storage, a scoped LockGuard, and std::error_code
+ * based error reporting. Requires C++20.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#ifndef	_VXI11_HPP_
+#define	_VXI11_HPP_
+
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include "vxi11_user.h"
+
+namespace vxi11 {
+
+/* Error codes. Values below 100 are the VXI-11 device error codes (from the
+ * published VXI-11 protocol, section B.5.2) and the VXI11_NULL_*_RESP codes,
+ * so that a negative return value from the C library maps directly onto an
+ * errc by negating it. */
+enum class errc {
+	syntax_error = 1,
+	device_not_accessible = 3,
+	invalid_link = 4,
+	parameter_error = 5,
+	channel_not_established = 6,
+	operation_not_supported = 8,
+	out_of_resources = 9,
+	device_locked = 11,
+	no_lock_held = 12,
+	io_timeout = 15,
+	io_error = 17,
+	invalid_address = 21,
+	abort = 23,
+	channel_already_established = 29,
+	null_read_response = VXI11_NULL_READ_RESP,
+	null_write_response = VXI11_NULL_WRITE_RESP,
+	buffer_too_small = 100,
+	open_failed,
+	not_open,
+	out_of_memory,
+	bad_block,
+	parse_error,
+};
+
+namespace detail {
+
+class error_category_impl : public std::error_category {
+public:
+	const char *name() const noexcept override
+	{
+		return "vxi11";
+	}
+
+	std::string message(int ev) const override
+	{
+		switch (static_cast<errc>(ev)) {
+		case errc::syntax_error: return "syntax error";
+		case errc::device_not_accessible: return "device not accessible";
+		case errc::invalid_link: return "invalid link identifier";
+		case errc::parameter_error: return "parameter error";
+		case errc::channel_not_established: return "channel not established";
+		case errc::operation_not_supported: return "operation not supported";
+		case errc::out_of_resources: return "out of resources";
+		case errc::device_locked: return "device locked by another link";
+		case errc::no_lock_held: return "no lock held by this link";
+		case errc::io_timeout: return "I/O timeout";
+		case errc::io_error: return "I/O error";
+		case errc::invalid_address: return "invalid address";
+		case errc::abort: return "abort";
+		case errc::channel_already_established: return "channel already established";
+		case errc::null_read_response: return "instrument did not respond to read";
+		case errc::null_write_response: return "instrument did not respond to write";
+		case errc::buffer_too_small: return "buffer too small";
+		case errc::open_failed: return "could not open device";
+		case errc::not_open: return "device not open";
+		case errc::out_of_memory: return "out of memory";
+		case errc::bad_block: return "malformed definite-length block";
+		case errc::parse_error: return "could not parse response";
+		}
+		return "unknown vxi11 error " + std::to_string(ev);
+	}
+};
+
+/* Map a C library return value (<0 for errors) onto an error_code. */
+inline std::error_code from_return(long ret) noexcept;
+
+} /* namespace detail */
+
+inline const std::error_category &error_category() noexcept
+{
+	static const detail::error_category_impl category;
+	return category;
+}
+
+inline std::error_code make_error_code(errc e) noexcept
+{
+	return std::error_code(static_cast<int>(e), error_category());
+}
+
+inline std::error_code detail::from_return(long ret) noexcept
+{
+	if (ret >= 0) {
+		return std::error_code();
+	}
+	return std::error_code(static_cast<int>(-ret), error_category());
+}
+
+} /* namespace vxi11 */
+
+template <>
+struct std::is_error_code_enum<vxi11::errc> : std::true_type {};
+
+namespace vxi11 {
+
+namespace detail {
+
+/* Parse a numeric response, allowing for the leading whitespace and '+' that
+ * SCPI instruments often send. bool is parsed as an integer. */
+template <typename T>
+T parse(std::string_view s, std::error_code &ec) noexcept
+{
+	T value{};
+	std::from_chars_result res;
+
+	while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+		s.remove_prefix(1);
+	}
+	if (!s.empty() && s.front() == '+') {
+		s.remove_prefix(1);
+	}
+
+	if constexpr (std::is_same_v<T, bool>) {
+		long v = 0;
+		res = std::from_chars(s.data(), s.data() + s.size(), v);
+		value = (v != 0);
+	} else if constexpr (std::is_floating_point_v<T>) {
+		res = std::from_chars(s.data(), s.data() + s.size(), value,
+				      std::chars_format::general);
+	} else {
+		res = std::from_chars(s.data(), s.data() + s.size(), value);
+	}
+
+	if (res.ec != std::errc()) {
+		ec = errc::parse_error;
+		return T{};
+	}
+	return value;
+}
+
+} /* namespace detail */
+
+/* Class: Device
+ *
+ * Owns a single link to an instrument. The link is closed when the Device is
+ * destroyed. Devices can be moved but not copied.
+ *
+ * None of the member functions throw; failures are reported through the
+ * std::error_code out parameter, which is cleared on success.
+ */
+class Device {
+public:
+	Device() noexcept = default;
+
+	Device(const Device &) = delete;
+	Device &operator=(const Device &) = delete;
+
+	Device(Device &&other) noexcept
+		: clink_(std::exchange(other.clink_, nullptr)),
+		  address_(std::move(other.address_))
+	{
+	}
+
+	Device &operator=(Device &&other) noexcept
+	{
+		if (this != &other) {
+			close();
+			clink_ = std::exchange(other.clink_, nullptr);
+			address_ = std::move(other.address_);
+		}
+		return *this;
+	}
+
+	~Device()
+	{
+		close();
+	}
+
+	/* Function: open
+	 *
+	 * Open a connection to an instrument, see vxi11_open_device().
+	 *
+	 * Parameters:
+	 *  address - the IP address or (where supported) USB address for the
+	 *            instrument to connect to.
+	 *  ec      - set to errc::open_failed on failure.
+	 *  device  - the instrument interface, or NULL for the default of
+	 *            "inst0".
+	 *
+	 * Returns:
+	 *  an open Device on success, or a Device for which is_open() is false
+	 *  on failure.
+	 */
+	static Device open(std::string_view address, std::error_code &ec,
+			   const char *device = nullptr)
+	{
+		Device dev;
+		std::string dev_name;
+
+		ec.clear();
+		dev.address_.assign(address);
+		if (device) {
+			dev_name = device;
+		}
+		if (vxi11_open_device(&dev.clink_, dev.address_.c_str(),
+				      device ? dev_name.data() : nullptr)) {
+			dev.clink_ = nullptr;
+			ec = errc::open_failed;
+		}
+		return dev;
+	}
+
+	/* Function: close
+	 *
+	 * Close the link. Safe to call more than once.
+	 */
+	void close() noexcept
+	{
+		if (clink_) {
+			vxi11_close_device(clink_, address_.c_str());
+			clink_ = nullptr;
+		}
+	}
+
+	bool is_open() const noexcept
+	{
+		return clink_ != nullptr;
+	}
+
+	explicit operator bool() const noexcept
+	{
+		return is_open();
+	}
+
+	const std::string &address() const noexcept
+	{
+		return address_;
+	}
+
+	/* The underlying handle, for use with the C API. Ownership is kept by
+	 * the Device. */
+	VXI11_CLINK *native_handle() const noexcept
+	{
+		return clink_;
+	}
+
+	/* Function: send
+	 *
+	 * Send a command to the instrument.
+	 *
+	 * Returns:
+	 *  an empty error_code on success
+	 */
+	std::error_code send(std::string_view cmd) noexcept
+	{
+		int ret;
+
+		if (!clink_) {
+			return errc::not_open;
+		}
+		ret = vxi11_send(clink_, cmd.data(), cmd.size());
+		if (ret == 1) {
+			return errc::out_of_memory;
+		}
+		return detail::from_return(ret);
+	}
+
+	/* Function: receive_into
+	 *
+	 * Receive a response into caller-owned storage.
+	 *
+	 * Parameters:
+	 *  buf     - the storage to receive into. The whole response must fit.
+	 *  ec      - set on failure.
+	 *  timeout - the number of milliseconds to wait before returning if no
+	 *            data is received.
+	 *
+	 * Returns:
+	 *  the number of bytes received, or 0 on failure.
+	 */
+	std::size_t receive_into(std::span<std::byte> buf, std::error_code &ec,
+				 unsigned long timeout = VXI11_READ_TIMEOUT) noexcept
+	{
+		ssize_t ret;
+
+		ec.clear();
+		if (!clink_) {
+			ec = errc::not_open;
+			return 0;
+		}
+		ret = vxi11_receive_timeout(clink_,
+					    reinterpret_cast<char *>(buf.data()),
+					    buf.size(), timeout);
+		if (ret < 0) {
+			ec = detail::from_return(ret);
+			return 0;
+		}
+		return static_cast<std::size_t>(ret);
+	}
+
+	/* Function: query
+	 *
+	 * Send a query and parse the response as a T. Arithmetic types (including
+	 * bool, which is parsed as an integer) are received into a small stack
+	 * buffer and parsed with std::from_chars, so no memory is allocated
+	 * unless the response doesn't fit, when the rest is fetched with
+	 * vxi11_receive_alloc() so that none is left on the link.
+	 * std::string returns the response, of any length, with any trailing
+	 * newline removed. It is received with vxi11_receive_alloc(), so the
+	 * only allocation is the string itself.
+	 *
+	 * Parameters:
+	 *  cmd     - the query to send, e.g. "*IDN?"
+	 *  ec      - set on failure, errc::parse_error if the response could not
+	 *            be converted.
+	 *  timeout - the number of milliseconds to wait before returning if no
+	 *            data is received.
+	 *
+	 * Returns:
+	 *  the parsed value, or a value initialised T on failure.
+	 */
+	template <typename T>
+	T query(std::string_view cmd, std::error_code &ec,
+		unsigned long timeout = VXI11_READ_TIMEOUT)
+	{
+		static_assert(std::is_arithmetic_v<T> || std::is_same_v<T, std::string>,
+			      "vxi11::Device::query supports arithmetic types and std::string");
+
+		ec = send(cmd);
+		if (ec) {
+			return T{};
+		}
+
+		if constexpr (std::is_same_v<T, std::string>) {
+			char *buf;
+			ssize_t n;
+
+			n = vxi11_receive_alloc(clink_, &buf, timeout);
+			if (n < 0) {
+				ec = detail::from_return(n);
+				return T{};
+			}
+			while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\r')) {
+				n--;
+			}
+			std::string reply(buf, static_cast<std::size_t>(n));
+			vxi11_release(clink_, buf);
+			return reply;
+		} else {
+			/* Plenty for any number in ascii */
+			std::array<char, 64> buf;
+			std::size_t n;
+
+			n = receive_into(std::as_writable_bytes(std::span<char>(buf)), ec, timeout);
+			if (ec == errc::buffer_too_small) {
+				/* e.g. padded, or a list of which we parse the first */
+				char *rest;
+				ssize_t m;
+
+				ec.clear();
+				m = vxi11_receive_alloc(clink_, &rest, timeout);
+				if (m < 0) {
+					ec = detail::from_return(m);
+					return T{};
+				}
+				std::string reply(buf.data(), buf.size());
+				reply.append(rest, static_cast<std::size_t>(m));
+				vxi11_release(clink_, rest);
+				return detail::parse<T>(reply, ec);
+			}
+			if (ec) {
+				return T{};
+			}
+			return detail::parse<T>(std::string_view(buf.data(), n), ec);
+		}
+	}
+
+	/* Function: read_block
+	 *
+	 * Send a query and receive a definite-length block response (see
+	 * vxi11_receive_data_block()) directly into caller-owned storage.
+	 *
+	 * Parameters:
+	 *  cmd     - the query to send, e.g. "CURV?"
+	 *  out     - storage for the block data. T must be trivially copyable;
+	 *            the data is copied as-is with no byte order conversion.
+	 *  ec      - set on failure, errc::bad_block if the response is not a
+	 *            complete definite-length block.
+	 *  timeout - the number of milliseconds to wait before returning if no
+	 *            data is received.
+	 *
+	 * Returns:
+	 *  the number of complete elements of T received, or 0 on failure.
+	 */
+	template <typename T>
+	std::size_t read_block(std::string_view cmd, std::span<T> out,
+			       std::error_code &ec,
+			       unsigned long timeout = VXI11_READ_TIMEOUT)
+	{
+		static_assert(std::is_trivially_copyable_v<T> && !std::is_const_v<T>,
+			      "vxi11::Device::read_block needs a writable, trivially copyable T");
+		VXI11_ERROR err;
+		ssize_t ret;
+
+		ec = send(cmd);
+		if (ec) {
+			return 0;
+		}
+		vxi11_clear_error();
+		ret = vxi11_receive_data_block(clink_,
+					       reinterpret_cast<char *>(out.data()),
+					       out.size_bytes(), timeout);
+		vxi11_last_error(&err);
+		/* -1 and -3 are also the instrument's syntax error and device not
+		 * accessible, passed through from receiving the response */
+		if ((ret == -1 || ret == -3) && err.error == 0 && err.function &&
+		    std::string_view(err.function) == "vxi11_receive_data_block") {
+			ec = ret == -1 ? errc::out_of_memory : errc::bad_block;
+			return 0;
+		} else if (ret < 0) {
+			ec = detail::from_return(ret);
+			return 0;
+		}
+		return static_cast<std::size_t>(ret) / sizeof(T);
+	}
+
+	/* Function: lock
+	 *
+	 * Take the instrument's exclusive lock, see vxi11_lock(). Prefer
+	 * LockGuard, which releases the lock when it goes out of scope.
+	 *
+	 * Parameters:
+	 *  timeout - how long to wait, in ms, if another link holds the lock.
+	 *
+	 * Returns:
+	 *  an empty error_code on success, errc::device_locked if another link
+	 *  still holds the lock.
+	 */
+	std::error_code lock(unsigned long timeout) noexcept
+	{
+		if (!clink_) {
+			return errc::not_open;
+		}
+		return detail::from_return(vxi11_lock(clink_, timeout));
+	}
+
+	/* Function: unlock
+	 *
+	 * Release the lock taken with lock().
+	 */
+	std::error_code unlock() noexcept
+	{
+		if (!clink_) {
+			return errc::not_open;
+		}
+		return detail::from_return(vxi11_unlock(clink_));
+	}
+
+	/* How long other operations wait for another link's lock, see
+	 * vxi11_set_lock_timeout(). */
+	void set_lock_timeout(unsigned long timeout) noexcept
+	{
+		if (clink_) {
+			vxi11_set_lock_timeout(clink_, timeout);
+		}
+	}
+
+	struct LockStats {
+		unsigned long count = 0;
+		unsigned long failed = 0;
+		unsigned long wait_ms = 0;
+		unsigned long hold_ms = 0;
+	};
+
+	/* Lock metrics for this link, see vxi11_lock_stats(). */
+	LockStats lock_stats() const noexcept
+	{
+		LockStats st;
+
+		if (clink_) {
+			vxi11_lock_stats(clink_, &st.count, &st.failed, &st.wait_ms,
+					 &st.hold_ms);
+		}
+		return st;
+	}
+
+	/* Maximum response size for string queries in vxi11_async.hpp, which
+	 * receive into a buffer allocated up front. */
+	static constexpr std::size_t string_reply_size = 4096;
+
+private:
+	VXI11_CLINK *clink_ = nullptr;
+	std::string address_;
+};
+
+/* Class: LockGuard
+ *
+ * Holds a Device's lock for the lifetime of the guard, so that a sequence of
+ * commands runs without other links getting in between:
+ *
+ *   vxi11::LockGuard guard(dev, 5000, ec);
+ *   if (!ec) {
+ *           dev.send(":ROUT:CLOS (@101)");
+ *           v = dev.query<double>("MEAS?", ec);
+ *   }
+ *
+ * If the lock could not be taken, ec is set and owns_lock() is false.
+ */
+class LockGuard {
+public:
+	LockGuard(Device &dev, unsigned long timeout, std::error_code &ec) noexcept
+		: dev_(dev)
+	{
+		ec = dev_.lock(timeout);
+		owns_ = !ec;
+	}
+
+	LockGuard(const LockGuard &) = delete;
+	LockGuard &operator=(const LockGuard &) = delete;
+
+	~LockGuard()
+	{
+		unlock();
+	}
+
+	/* Release the lock before the guard goes out of scope. */
+	std::error_code unlock() noexcept
+	{
+		if (!owns_) {
+			return {};
+		}
+		owns_ = false;
+		return dev_.unlock();
+	}
+
+	bool owns_lock() const noexcept
+	{
+		return owns_;
+	}
+
+private:
+	Device &dev_;
+	bool owns_ = false;
+};
+
+} /* namespace vxi11 */
+
+#endif
@@ -0,0 +1,1089 @@
+/* vxi11_archive.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Waveform archives. Blocks are delta and Rice coded by a pool of worker
+ * threads, off the thread receiving them, and appended to a file in the
+ * order written, with an index at the end so that any block can be found and
+ * decoded on its own. See vxi11_archive.h for the file format.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vxi11_internal.h"
+
+#ifdef WIN32
+
+int vxi11_archive_create(VXI11_ARCHIVE ** ar, const char *filename, int threads)
+{
+	return -8;
+}
+
+int vxi11_archive_open(VXI11_ARCHIVE ** ar, const char *filename)
+{
+	return -8;
+}
+
+int vxi11_archive_write(VXI11_ARCHIVE * ar, int format, const void *data, size_t len,
+			const char *query, const char *preamble)
+{
+	return -8;
+}
+
+ssize_t vxi11_archive_write_data_block(VXI11_ARCHIVE * ar, VXI11_CLINK * clink, int format,
+				       const char *query, const char *preamble, unsigned long timeout)
+{
+	return -8;
+}
+
+size_t vxi11_archive_count(VXI11_ARCHIVE * ar)
+{
+	return 0;
+}
+
+int vxi11_archive_record(VXI11_ARCHIVE * ar, size_t index, VXI11_ARCHIVE_RECORD * rec)
+{
+	return -8;
+}
+
+ssize_t vxi11_archive_read(VXI11_ARCHIVE * ar, size_t index, void *buffer, size_t len)
+{
+	return -8;
+}
+
+int vxi11_archive_close(VXI11_ARCHIVE * ar)
+{
+	return 0;
+}
+
+#else
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vxi11_archive.h"
+
+/* Blocks in hand per worker thread, waiting to be coded or written */
+#define	JOBS_PER_THREAD	2
+
+/* Most bytes one group can add to the output: the parameter and escapes
+ * throughout, plus the bits held back from the group before */
+#define	GROUP_MAX_BYTES	((5 + VXI11_ARCHIVE_GROUP * (VXI11_ARCHIVE_ESCAPE + VXI11_ARCHIVE_RAW_BITS)) / 8 + 8)
+
+/* Job states */
+#define	JOB_FREE	0
+#define	JOB_FILLING	1	/* data being copied in by vxi11_archive_write() */
+#define	JOB_QUEUED	2
+#define	JOB_CODING	3
+#define	JOB_DONE	4	/* ready to write to the file */
+
+struct _vxi11_archive_job {
+	int state;
+	int error;
+	int format;
+	unsigned long long timestamp_us;
+	unsigned char *raw;
+	size_t raw_len;
+	size_t raw_alloc;
+	char *meta;		/* query then preamble, each with its null */
+	size_t query_len;
+	size_t preamble_len;
+	size_t meta_alloc;
+	unsigned char *out;	/* the whole record, ready to write */
+	size_t out_len;
+	size_t out_alloc;
+};
+
+struct _VXI11_ARCHIVE {
+	int writing;
+	int fd;
+	int error;
+
+	/* Writing */
+	pthread_mutex_t lock;
+	pthread_cond_t queued;	/* a job is ready to code, or stopping */
+	pthread_cond_t freed;	/* a job has been written */
+	pthread_t *threads;
+	int nthreads;
+	int stop;
+	struct _vxi11_archive_job *jobs;
+	size_t njobs;
+	unsigned long long next_fill;	/* sequence number of the next job filled */
+	unsigned long long next_code;
+	unsigned long long next_write;
+	int flushing;		/* a thread in _flush() is writing jobs out */
+	unsigned long long file_len;
+	VXI11_SEGMENTS segments;	/* for vxi11_archive_write_data_block() */
+
+	/* Reading */
+	const unsigned char *map;
+	size_t map_len;
+
+	/* Offsets of the records */
+	unsigned long long *offsets;
+	size_t count;
+	size_t alloc;
+};
+
+static void _put64(uint32_t * w, unsigned long long v)
+{
+	w[0] = htonl((uint32_t) (v >> 32));
+	w[1] = htonl((uint32_t) v);
+}
+
+static unsigned long long _get64(const uint32_t * w)
+{
+	return ((unsigned long long)ntohl(w[0]) << 32) | ntohl(w[1]);
+}
+
+static int _sample_size(int format)
+{
+	switch (format & ~VXI11_SAMPLE_BIG_ENDIAN) {
+	case 0:
+	case VXI11_SAMPLE_INT8:
+	case VXI11_SAMPLE_UINT8:
+		return 1;
+	case VXI11_SAMPLE_INT16:
+	case VXI11_SAMPLE_UINT16:
+		return 2;
+	case VXI11_SAMPLE_FLOAT32:
+		return 4;
+	}
+	return 0;
+}
+
+static int _add_offset(VXI11_ARCHIVE * ar, unsigned long long offset)
+{
+	unsigned long long *bigger;
+	size_t alloc;
+
+	if (ar->count == ar->alloc) {
+		alloc = ar->alloc ? ar->alloc * 2 : 256;
+		bigger = (unsigned long long *)realloc(ar->offsets, alloc * sizeof(unsigned long long));
+		if (!bigger) {
+			return -9;
+		}
+		ar->offsets = bigger;
+		ar->alloc = alloc;
+	}
+	ar->offsets[ar->count++] = offset;
+	return 0;
+}
+
+/* Coding. Each group is first converted to values, then to zigzag coded
+ * differences, in simple loops the compiler can vectorise, before the bit
+ * by bit Rice coding. */
+
+static void _load(int format, const unsigned char *p, size_t n, int32_t * v)
+{
+	size_t i;
+
+	switch (format) {
+	case VXI11_SAMPLE_INT8:
+	case VXI11_SAMPLE_INT8 | VXI11_SAMPLE_BIG_ENDIAN:
+		for (i = 0; i < n; i++) {
+			v[i] = (signed char)p[i];
+		}
+		break;
+	case VXI11_SAMPLE_UINT8:
+	case VXI11_SAMPLE_UINT8 | VXI11_SAMPLE_BIG_ENDIAN:
+		for (i = 0; i < n; i++) {
+			v[i] = p[i];
+		}
+		break;
+	case VXI11_SAMPLE_INT16:
+		for (i = 0; i < n; i++) {
+			v[i] = (int16_t) (p[2 * i] | p[2 * i + 1] << 8);
+		}
+		break;
+	case VXI11_SAMPLE_INT16 | VXI11_SAMPLE_BIG_ENDIAN:
+		for (i = 0; i < n; i++) {
+			v[i] = (int16_t) (p[2 * i] << 8 | p[2 * i + 1]);
+		}
+		break;
+	case VXI11_SAMPLE_UINT16:
+		for (i = 0; i < n; i++) {
+			v[i] = p[2 * i] | p[2 * i + 1] << 8;
+		}
+		break;
+	case VXI11_SAMPLE_UINT16 | VXI11_SAMPLE_BIG_ENDIAN:
+		for (i = 0; i < n; i++) {
+			v[i] = p[2 * i] << 8 | p[2 * i + 1];
+		}
+		break;
+	}
+}
+
+static void _store(int format, unsigned char *p, size_t n, const int32_t * v)
+{
+	size_t i;
+
+	switch (_sample_size(format)) {
+	case 1:
+		for (i = 0; i < n; i++) {
+			p[i] = (unsigned char)v[i];
+		}
+		break;
+	case 2:
+		if (format & VXI11_SAMPLE_BIG_ENDIAN) {
+			for (i = 0; i < n; i++) {
+				p[2 * i] = (unsigned char)(v[i] >> 8);
+				p[2 * i + 1] = (unsigned char)v[i];
+			}
+		} else {
+			for (i = 0; i < n; i++) {
+				p[2 * i] = (unsigned char)v[i];
+				p[2 * i + 1] = (unsigned char)(v[i] >> 8);
+			}
+		}
+		break;
+	}
+}
+
+static int _codable(int format)
+{
+	switch (format & ~VXI11_SAMPLE_BIG_ENDIAN) {
+	case VXI11_SAMPLE_INT8:
+	case VXI11_SAMPLE_UINT8:
+	case VXI11_SAMPLE_INT16:
+	case VXI11_SAMPLE_UINT16:
+		return 1;
+	}
+	return 0;
+}
+
+struct _bit_writer {
+	unsigned char *p;
+	unsigned long long acc;
+	int n;
+};
+
+/* Append the low n bits of v, n at most 32 */
+static void _put(struct _bit_writer *w, unsigned long long v, int n)
+{
+	w->acc |= v << w->n;
+	w->n += n;
+	if (w->n >= 32) {
+		w->p[0] = (unsigned char)w->acc;
+		w->p[1] = (unsigned char)(w->acc >> 8);
+		w->p[2] = (unsigned char)(w->acc >> 16);
+		w->p[3] = (unsigned char)(w->acc >> 24);
+		w->p += 4;
+		w->acc >>= 32;
+		w->n -= 32;
+	}
+}
+
+/* Code n samples into out, which has room for limit + GROUP_MAX_BYTES
+ * bytes. Returns the bytes used, or 0 if that would be more than limit. */
+static size_t _encode(int format, const unsigned char *raw, size_t n, unsigned char *out, size_t limit)
+{
+	int32_t v[VXI11_ARCHIVE_GROUP];
+	uint32_t u[VXI11_ARCHIVE_GROUP];
+	struct _bit_writer w;
+	int size = _sample_size(format);
+	int32_t prev = 0;
+	unsigned long long sum;
+	uint32_t q;
+	size_t start;
+	size_t m;
+	size_t i;
+	int k;
+
+	w.p = out;
+	w.acc = 0;
+	w.n = 0;
+	for (start = 0; start < n; start += m) {
+		if ((size_t)(w.p - out) > limit) {
+			return 0;
+		}
+		m = n - start < VXI11_ARCHIVE_GROUP ? n - start : VXI11_ARCHIVE_GROUP;
+		_load(format, raw + start * size, m, v);
+		u[0] = (uint32_t) (v[0] - prev);
+		for (i = 1; i < m; i++) {
+			u[i] = (uint32_t) (v[i] - v[i - 1]);
+		}
+		prev = v[m - 1];
+		sum = 0;
+		for (i = 0; i < m; i++) {
+			u[i] = (u[i] << 1) ^ (uint32_t) ((int32_t) u[i] >> 31);
+			sum += u[i];
+		}
+
+		/* The smallest k with 2^(k+1) at least the mean */
+		k = 0;
+		while (k < 16 && ((unsigned long long)m << (k + 1)) < sum) {
+			k++;
+		}
+		_put(&w, k, 5);
+		for (i = 0; i < m; i++) {
+			q = u[i] >> k;
+			if (q < VXI11_ARCHIVE_ESCAPE) {
+				_put(&w, ((1ULL << q) - 1) | (unsigned long long)(u[i] & ((1U << k) - 1)) << (q + 1),
+				     q + 1 + k);
+			} else {
+				_put(&w, (1ULL << VXI11_ARCHIVE_ESCAPE) - 1, VXI11_ARCHIVE_ESCAPE);
+				_put(&w, u[i], VXI11_ARCHIVE_RAW_BITS);
+			}
+		}
+	}
+	while (w.n > 0) {
+		*w.p++ = (unsigned char)w.acc;
+		w.acc >>= 8;
+		w.n -= 8;
+	}
+	if ((size_t)(w.p - out) >= limit) {
+		return 0;
+	}
+	return w.p - out;
+}
+
+struct _bit_reader {
+	const unsigned char *p;
+	const unsigned char *end;
+	unsigned long long acc;
+	int n;
+	size_t past;		/* zero bytes supplied beyond the end */
+};
+
+/* Make at least 33 bits available */
+static void _refill(struct _bit_reader *r)
+{
+	while (r->n <= 32) {
+		if (r->end - r->p >= 4) {
+			r->acc |= (unsigned long long)(r->p[0] | (uint32_t) r->p[1] << 8 |
+						       (uint32_t) r->p[2] << 16 | (uint32_t) r->p[3] << 24) << r->n;
+			r->p += 4;
+			r->n += 32;
+		} else {
+			if (r->p < r->end) {
+				r->acc |= (unsigned long long)*r->p++ << r->n;
+			} else {
+				r->past++;
+			}
+			r->n += 8;
+		}
+	}
+}
+
+static int _ones(unsigned long long acc)
+{
+	unsigned int x = (unsigned int)~acc & ((1U << VXI11_ARCHIVE_ESCAPE) - 1);
+#ifdef __GNUC__
+	return x ? __builtin_ctz(x) : VXI11_ARCHIVE_ESCAPE;
+#else
+	int q = 0;
+
+	while (q < VXI11_ARCHIVE_ESCAPE && !(x & (1U << q))) {
+		q++;
+	}
+	return q;
+#endif
+}
+
+/* Decode n samples from stored_len bytes of in. Returns 0, or -3 if the data
+ * is corrupt. */
+static int _decode(int format, const unsigned char *in, size_t stored_len, unsigned char *raw, size_t n)
+{
+	int32_t v[VXI11_ARCHIVE_GROUP];
+	uint32_t u[VXI11_ARCHIVE_GROUP];
+	struct _bit_reader r;
+	int size = _sample_size(format);
+	int32_t prev = 0;
+	size_t start;
+	size_t m;
+	size_t i;
+	int k;
+	int q;
+
+	r.p = in;
+	r.end = in + stored_len;
+	r.acc = 0;
+	r.n = 0;
+	r.past = 0;
+	for (start = 0; start < n; start += m) {
+		m = n - start < VXI11_ARCHIVE_GROUP ? n - start : VXI11_ARCHIVE_GROUP;
+		_refill(&r);
+		k = (int)(r.acc & 0x1f);
+		r.acc >>= 5;
+		r.n -= 5;
+		if (k > 16) {
+			return -3;
+		}
+		for (i = 0; i < m; i++) {
+			_refill(&r);
+			q = _ones(r.acc);
+			if (q == VXI11_ARCHIVE_ESCAPE) {
+				r.acc >>= VXI11_ARCHIVE_ESCAPE;
+				u[i] = (uint32_t) (r.acc & ((1U << VXI11_ARCHIVE_RAW_BITS) - 1));
+				r.acc >>= VXI11_ARCHIVE_RAW_BITS;
+				r.n -= VXI11_ARCHIVE_ESCAPE + VXI11_ARCHIVE_RAW_BITS;
+			} else {
+				r.acc >>= q + 1;
+				u[i] = ((uint32_t) q << k) | (uint32_t) (r.acc & ((1U << k) - 1));
+				r.acc >>= k;
+				r.n -= q + 1 + k;
+			}
+		}
+		for (i = 0; i < m; i++) {
+			prev += (int32_t) (u[i] >> 1) ^ -(int32_t) (u[i] & 1);
+			v[i] = prev;
+		}
+		_store(format, raw + start * size, m, v);
+	}
+	/* Bits used beyond the end mean the data was cut short */
+	if (r.past * 8 > (size_t)r.n) {
+		return -3;
+	}
+	return 0;
+}
+
+/* Writing */
+
+static int _fill(struct _vxi11_archive_job *job, int format, const void *data, size_t len,
+		 const char *query, const char *preamble)
+{
+	struct timespec ts;
+	size_t meta_len;
+	void *bigger;
+
+	job->query_len = query && query[0] ? strlen(query) + 1 : 0;
+	job->preamble_len = preamble && preamble[0] ? strlen(preamble) + 1 : 0;
+	meta_len = job->query_len + job->preamble_len;
+	if (len > job->raw_alloc) {
+		bigger = realloc(job->raw, len);
+		if (!bigger) {
+			return -9;
+		}
+		job->raw = (unsigned char *)bigger;
+		job->raw_alloc = len;
+	}
+	if (meta_len > job->meta_alloc) {
+		bigger = realloc(job->meta, meta_len);
+		if (!bigger) {
+			return -9;
+		}
+		job->meta = (char *)bigger;
+		job->meta_alloc = meta_len;
+	}
+	memcpy(job->raw, data, len);
+	job->raw_len = len;
+	memcpy(job->meta, query, job->query_len);
+	memcpy(job->meta + job->query_len, preamble, job->preamble_len);
+	job->format = format;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	job->timestamp_us = (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	job->error = 0;
+	return 0;
+}
+
+/* Build the record to write */
+static void _code(struct _vxi11_archive_job *job)
+{
+	struct _vxi11_archive_record h;
+	size_t meta_len = job->query_len + job->preamble_len;
+	size_t need = sizeof(h) + meta_len + job->raw_len + GROUP_MAX_BYTES;
+	unsigned char *data;
+	size_t stored_len = 0;
+	void *bigger;
+
+	if (need > job->out_alloc) {
+		bigger = realloc(job->out, need);
+		if (!bigger) {
+			job->error = -9;
+			return;
+		}
+		job->out = (unsigned char *)bigger;
+		job->out_alloc = need;
+	}
+	data = job->out + sizeof(h) + meta_len;
+	if (_codable(job->format)) {
+		stored_len = _encode(job->format, job->raw, job->raw_len / _sample_size(job->format),
+				     data, job->raw_len);
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, VXI11_ARCHIVE_RECORD_MAGIC, sizeof(h.magic));
+	h.format = htonl(job->format);
+	if (stored_len > 0) {
+		h.method = htonl(VXI11_ARCHIVE_DELTA_RICE);
+	} else {
+		h.method = htonl(VXI11_ARCHIVE_STORED);
+		memcpy(data, job->raw, job->raw_len);
+		stored_len = job->raw_len;
+	}
+	h.query_len = htonl(job->query_len);
+	h.preamble_len = htonl(job->preamble_len);
+	_put64(h.timestamp_us, job->timestamp_us);
+	_put64(h.len, job->raw_len);
+	_put64(h.stored_len, stored_len);
+	memcpy(job->out, &h, sizeof(h));
+	memcpy(job->out + sizeof(h), job->meta, meta_len);
+	job->out_len = sizeof(h) + meta_len + stored_len;
+}
+
+static int _write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *)buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, p, len);
+		if (ret <= 0) {
+			return -17;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Write finished jobs to the file in order. Called with the lock held, which
+ * is dropped around each write so that vxi11_archive_write() and the workers
+ * carry on meanwhile. Only one thread writes at a time; a job finished while
+ * it does is picked up by its loop. */
+static void _flush(VXI11_ARCHIVE * ar)
+{
+	struct _vxi11_archive_job *job;
+	int ret;
+
+	if (ar->flushing) {
+		return;
+	}
+	ar->flushing = 1;
+	while (ar->next_write < ar->next_fill) {
+		job = &ar->jobs[ar->next_write % ar->njobs];
+		if (job->state != JOB_DONE) {
+			break;
+		}
+		if (!ar->error) {
+			ar->error = job->error;
+		}
+		if (!ar->error) {
+			/* The job stays JOB_DONE, so nobody else touches it */
+			pthread_mutex_unlock(&ar->lock);
+			ret = _write_all(ar->fd, job->out, job->out_len);
+			pthread_mutex_lock(&ar->lock);
+			if (ret) {
+				_vxi11_log(VXI11_LOG_ERROR, "vxi11_archive_write: write failed");
+				ar->error = ret;
+			}
+		}
+		if (!ar->error) {
+			ar->error = _add_offset(ar, ar->file_len);
+			ar->file_len += job->out_len;
+		}
+		job->state = JOB_FREE;
+		ar->next_write++;
+		pthread_cond_broadcast(&ar->freed);
+	}
+	ar->flushing = 0;
+}
+
+static void *_worker(void *arg)
+{
+	VXI11_ARCHIVE *ar = (VXI11_ARCHIVE *) arg;
+	struct _vxi11_archive_job *job;
+
+	pthread_mutex_lock(&ar->lock);
+	while (1) {
+		job = &ar->jobs[ar->next_code % ar->njobs];
+		if (ar->next_code < ar->next_fill && job->state == JOB_QUEUED) {
+			job->state = JOB_CODING;
+			ar->next_code++;
+			pthread_mutex_unlock(&ar->lock);
+			_code(job);
+			pthread_mutex_lock(&ar->lock);
+			job->state = JOB_DONE;
+			_flush(ar);
+		} else if (ar->stop) {
+			break;
+		} else {
+			pthread_cond_wait(&ar->queued, &ar->lock);
+		}
+	}
+	pthread_mutex_unlock(&ar->lock);
+	return NULL;
+}
+
+static void _free(VXI11_ARCHIVE * ar)
+{
+	size_t i;
+
+	for (i = 0; i < ar->njobs; i++) {
+		free(ar->jobs[i].raw);
+		free(ar->jobs[i].meta);
+		free(ar->jobs[i].out);
+	}
+	free(ar->jobs);
+	free(ar->threads);
+	free(ar->segments.segments);
+	free(ar->offsets);
+	free(ar);
+}
+
+int vxi11_archive_create(VXI11_ARCHIVE ** ar, const char *filename, int threads)
+{
+	struct _vxi11_archive_header header;
+	VXI11_ARCHIVE *a;
+	int i;
+
+	if (!ar || !filename || threads < 0) {
+		return -5;
+	}
+	a = (VXI11_ARCHIVE *) calloc(1, sizeof(VXI11_ARCHIVE));
+	if (!a) {
+		return -9;
+	}
+	a->writing = 1;
+	a->njobs = threads ? (size_t)threads * JOBS_PER_THREAD : 1;
+	a->jobs = (struct _vxi11_archive_job *)calloc(a->njobs, sizeof(struct _vxi11_archive_job));
+	a->threads = (pthread_t *) calloc(threads ? threads : 1, sizeof(pthread_t));
+	if (!a->jobs || !a->threads) {
+		_free(a);
+		return -9;
+	}
+
+	a->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (a->fd < 0) {
+		_vxi11_log(VXI11_LOG_ERROR, "vxi11_archive_create: could not create %s", filename);
+		_free(a);
+		return -17;
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, VXI11_ARCHIVE_MAGIC, sizeof(header.magic));
+	header.version = htonl(VXI11_ARCHIVE_VERSION);
+	if (_write_all(a->fd, &header, sizeof(header))) {
+		close(a->fd);
+		_free(a);
+		return -17;
+	}
+	a->file_len = sizeof(header);
+
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->queued, NULL);
+	pthread_cond_init(&a->freed, NULL);
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&a->threads[i], NULL, _worker, a)) {
+			break;
+		}
+		a->nthreads++;
+	}
+	if (a->nthreads < threads) {
+		vxi11_archive_close(a);
+		return -9;
+	}
+	*ar = a;
+	return 0;
+}
+
+int vxi11_archive_write(VXI11_ARCHIVE * ar, int format, const void *data, size_t len,
+			const char *query, const char *preamble)
+{
+	struct _vxi11_archive_job *job;
+	int size;
+	int ret;
+
+	if (!ar || !ar->writing || (!data && len > 0)) {
+		return -5;
+	}
+	size = _sample_size(format);
+	if (size == 0 || len % size) {
+		return -5;
+	}
+
+	pthread_mutex_lock(&ar->lock);
+	job = &ar->jobs[ar->next_fill % ar->njobs];
+	while (!ar->error && job->state != JOB_FREE) {
+		pthread_cond_wait(&ar->freed, &ar->lock);
+	}
+	if (ar->error) {
+		ret = ar->error;
+		pthread_mutex_unlock(&ar->lock);
+		return ret;
+	}
+	job->state = JOB_FILLING;
+	pthread_mutex_unlock(&ar->lock);
+
+	ret = _fill(job, format, data, len, query, preamble);
+
+	if (!ret && ar->nthreads == 0) {
+		_code(job);
+	}
+	pthread_mutex_lock(&ar->lock);
+	if (ret) {
+		job->state = JOB_FREE;
+	} else if (ar->nthreads == 0) {
+		job->state = JOB_DONE;
+		ar->next_fill++;
+		ar->next_code++;
+		_flush(ar);
+		ret = ar->error;
+	} else {
+		job->state = JOB_QUEUED;
+		ar->next_fill++;
+		pthread_cond_signal(&ar->queued);
+	}
+	pthread_mutex_unlock(&ar->lock);
+	return ret;
+}
+
+ssize_t vxi11_archive_write_data_block(VXI11_ARCHIVE * ar, VXI11_CLINK * clink, int format,
+				       const char *query, const char *preamble, unsigned long timeout)
+{
+	VXI11_SEGMENT *block = NULL;
+	ssize_t ret;
+	size_t i;
+
+	if (!ar || !ar->writing) {
+		return -5;
+	}
+	ret = vxi11_receive_segments(clink, &ar->segments, timeout);
+	if (ret < 0) {
+		return ret;
+	}
+	for (i = 0; i < ar->segments.count; i++) {
+		if (ar->segments.segments[i].header_len > 0) {
+			block = &ar->segments.segments[i];
+			break;
+		}
+	}
+	if (!block) {
+		_vxi11_log(VXI11_LOG_ERROR, "vxi11_archive_write_data_block: no data block in the reply");
+		ret = -3;
+	} else {
+		ret = vxi11_archive_write(ar, format, block->data, block->len, query, preamble);
+		if (ret == 0) {
+			ret = (ssize_t)block->len;
+		}
+	}
+	/* Back to the link's pool, keeping the index for next time */
+	vxi11_release(clink, ar->segments.buffer);
+	ar->segments.buffer = NULL;
+	return ret;
+}
+
+static int _write_index(VXI11_ARCHIVE * ar)
+{
+	struct _vxi11_archive_trailer trailer;
+	struct _vxi11_archive_index *index;
+	size_t i;
+	int ret;
+
+	index = (struct _vxi11_archive_index *)malloc(ar->count * sizeof(*index) + 1);
+	if (!index) {
+		return -9;
+	}
+	for (i = 0; i < ar->count; i++) {
+		_put64(index[i].offset, ar->offsets[i]);
+	}
+	memset(&trailer, 0, sizeof(trailer));
+	_put64(trailer.count, ar->count);
+	_put64(trailer.index_offset, ar->file_len);
+	memcpy(trailer.magic, VXI11_ARCHIVE_INDEX_MAGIC, sizeof(trailer.magic));
+	ret = _write_all(ar->fd, index, ar->count * sizeof(*index));
+	if (!ret) {
+		ret = _write_all(ar->fd, &trailer, sizeof(trailer));
+	}
+	free(index);
+	return ret;
+}
+
+/* Reading */
+
+/* Length of the record at offset, whose header h is known to be in the map,
+ * or 0 if the rest of it runs past the end */
+static unsigned long long _record_len(VXI11_ARCHIVE * ar, unsigned long long offset,
+				      const struct _vxi11_archive_record *h)
+{
+	unsigned long long left = ar->map_len - offset - sizeof(*h);
+	unsigned long long query_len = ntohl(h->query_len);
+	unsigned long long preamble_len = ntohl(h->preamble_len);
+	unsigned long long stored_len = _get64(h->stored_len);
+
+	if (query_len > left) {
+		return 0;
+	}
+	left -= query_len;
+	if (preamble_len > left) {
+		return 0;
+	}
+	left -= preamble_len;
+	if (stored_len > left) {
+		return 0;
+	}
+	return sizeof(*h) + query_len + preamble_len + stored_len;
+}
+
+/* Check record index and find its parts */
+static int _record(VXI11_ARCHIVE * ar, size_t index, struct _vxi11_archive_record *h,
+		   const unsigned char **meta, const unsigned char **data)
+{
+	unsigned long long offset;
+
+	if (!ar || ar->writing || index >= ar->count) {
+		return -5;
+	}
+	offset = ar->offsets[index];
+	if (offset > ar->map_len || ar->map_len - offset < sizeof(*h)) {
+		return -3;
+	}
+	memcpy(h, ar->map + offset, sizeof(*h));
+	if (memcmp(h->magic, VXI11_ARCHIVE_RECORD_MAGIC, sizeof(h->magic)) || !_record_len(ar, offset, h)) {
+		return -3;
+	}
+	*meta = ar->map + offset + sizeof(*h);
+	*data = *meta + ntohl(h->query_len) + ntohl(h->preamble_len);
+	return 0;
+}
+
+/* Record offsets from the index, or if there is none, by walking the records */
+static int _load_index(VXI11_ARCHIVE * ar)
+{
+	struct _vxi11_archive_trailer trailer;
+	struct _vxi11_archive_record h;
+	struct _vxi11_archive_index entry;
+	unsigned long long count;
+	unsigned long long index_offset;
+	unsigned long long pos;
+	unsigned long long len;
+	size_t i;
+	int ret;
+
+	if (ar->map_len >= sizeof(struct _vxi11_archive_header) + sizeof(trailer)) {
+		memcpy(&trailer, ar->map + ar->map_len - sizeof(trailer), sizeof(trailer));
+		count = _get64(trailer.count);
+		index_offset = _get64(trailer.index_offset);
+		if (!memcmp(trailer.magic, VXI11_ARCHIVE_INDEX_MAGIC, sizeof(trailer.magic)) &&
+		    count <= ar->map_len / sizeof(struct _vxi11_archive_index) &&
+		    count * sizeof(struct _vxi11_archive_index) + sizeof(trailer) <= ar->map_len &&
+		    index_offset == ar->map_len - count * sizeof(struct _vxi11_archive_index) - sizeof(trailer)) {
+			for (i = 0; i < count; i++) {
+				memcpy(&entry, ar->map + index_offset + i * sizeof(entry), sizeof(entry));
+				ret = _add_offset(ar, _get64(entry.offset));
+				if (ret) {
+					return ret;
+				}
+			}
+			return 0;
+		}
+	}
+
+	_vxi11_log(VXI11_LOG_WARNING, "vxi11_archive_open: no index, reading the records");
+	pos = sizeof(struct _vxi11_archive_header);
+	while (pos + sizeof(h) <= ar->map_len) {
+		memcpy(&h, ar->map + pos, sizeof(h));
+		if (memcmp(h.magic, VXI11_ARCHIVE_RECORD_MAGIC, sizeof(h.magic))) {
+			break;
+		}
+		len = _record_len(ar, pos, &h);
+		if (!len) {
+			break;
+		}
+		ret = _add_offset(ar, pos);
+		if (ret) {
+			return ret;
+		}
+		pos += len;
+	}
+	return 0;
+}
+
+int vxi11_archive_open(VXI11_ARCHIVE ** ar, const char *filename)
+{
+	struct _vxi11_archive_header header;
+	struct stat st;
+	VXI11_ARCHIVE *a;
+	void *map;
+	int fd;
+	int ret;
+
+	if (!ar || !filename) {
+		return -5;
+	}
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return -17;
+	}
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(header)) {
+		close(fd);
+		return -3;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return -17;
+	}
+	memcpy(&header, map, sizeof(header));
+	if (memcmp(header.magic, VXI11_ARCHIVE_MAGIC, sizeof(header.magic)) ||
+	    ntohl(header.version) != VXI11_ARCHIVE_VERSION) {
+		munmap(map, st.st_size);
+		return -3;
+	}
+
+	a = (VXI11_ARCHIVE *) calloc(1, sizeof(VXI11_ARCHIVE));
+	if (!a) {
+		munmap(map, st.st_size);
+		return -9;
+	}
+	a->fd = -1;
+	a->map = (const unsigned char *)map;
+	a->map_len = st.st_size;
+	ret = _load_index(a);
+	if (ret) {
+		vxi11_archive_close(a);
+		return ret;
+	}
+	*ar = a;
+	return 0;
+}
+
+size_t vxi11_archive_count(VXI11_ARCHIVE * ar)
+{
+	size_t count;
+
+	if (!ar) {
+		return 0;
+	}
+	if (!ar->writing) {
+		return ar->count;
+	}
+	pthread_mutex_lock(&ar->lock);
+	count = ar->count;
+	pthread_mutex_unlock(&ar->lock);
+	return count;
+}
+
+int vxi11_archive_record(VXI11_ARCHIVE * ar, size_t index, VXI11_ARCHIVE_RECORD * rec)
+{
+	struct _vxi11_archive_record h;
+	const unsigned char *meta;
+	const unsigned char *data;
+	size_t query_len;
+	size_t preamble_len;
+	int ret;
+
+	if (!rec) {
+		return -5;
+	}
+	ret = _record(ar, index, &h, &meta, &data);
+	if (ret) {
+		return ret;
+	}
+	query_len = ntohl(h.query_len);
+	preamble_len = ntohl(h.preamble_len);
+	if ((query_len && meta[query_len - 1]) || (preamble_len && meta[query_len + preamble_len - 1])) {
+		return -3;
+	}
+	rec->format = ntohl(h.format);
+	rec->len = _get64(h.len);
+	rec->stored_len = _get64(h.stored_len);
+	rec->timestamp_us = _get64(h.timestamp_us);
+	rec->query = query_len ? (const char *)meta : "";
+	rec->preamble = preamble_len ? (const char *)meta + query_len : "";
+	return 0;
+}
+
+ssize_t vxi11_archive_read(VXI11_ARCHIVE * ar, size_t index, void *buffer, size_t len)
+{
+	struct _vxi11_archive_record h;
+	const unsigned char *meta;
+	const unsigned char *data;
+	size_t raw_len;
+	size_t stored_len;
+	int format;
+	int size;
+	int ret;
+
+	ret = _record(ar, index, &h, &meta, &data);
+	if (ret) {
+		return ret;
+	}
+	raw_len = _get64(h.len);
+	stored_len = _get64(h.stored_len);
+	format = ntohl(h.format);
+	if (len < raw_len) {
+		return -100;
+	}
+	switch (ntohl(h.method)) {
+	case VXI11_ARCHIVE_STORED:
+		if (stored_len != raw_len) {
+			return -3;
+		}
+		memcpy(buffer, data, raw_len);
+		break;
+	case VXI11_ARCHIVE_DELTA_RICE:
+		size = _sample_size(format);
+		if (!_codable(format) || raw_len % size) {
+			return -3;
+		}
+		ret = _decode(format, data, stored_len, (unsigned char *)buffer, raw_len / size);
+		if (ret) {
+			return ret;
+		}
+		break;
+	default:
+		return -3;
+	}
+	return (ssize_t)raw_len;
+}
+
+int vxi11_archive_close(VXI11_ARCHIVE * ar)
+{
+	int ret = 0;
+	int i;
+
+	if (!ar) {
+		return 0;
+	}
+	if (!ar->writing) {
+		munmap((void *)ar->map, ar->map_len);
+		_free(ar);
+		return 0;
+	}
+
+	/* The workers finish what is queued before stopping */
+	pthread_mutex_lock(&ar->lock);
+	ar->stop = 1;
+	pthread_cond_broadcast(&ar->queued);
+	pthread_mutex_unlock(&ar->lock);
+	for (i = 0; i < ar->nthreads; i++) {
+		pthread_join(ar->threads[i], NULL);
+	}
+	ret = ar->error;
+	if (!ret) {
+		ret = _write_index(ar);
+	}
+	if (close(ar->fd) && !ret) {
+		ret = -17;
+	}
+	pthread_cond_destroy(&ar->freed);
+	pthread_cond_destroy(&ar->queued);
+	pthread_mutex_destroy(&ar->lock);
+	_free(ar);
+	return ret;
+}
+
+#endif
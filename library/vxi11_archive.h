@@ -0,0 +1,93 @@
+/* vxi11_archive.h
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Format of the waveform archives written by vxi11_archive_write() and read
+ * by vxi11_archive_read().
+ *
+ * An archive starts with a struct _vxi11_archive_header, followed by one
+ * record per block written, in the order written. Each record is a struct
+ * _vxi11_archive_record, then query_len bytes of query, then preamble_len
+ * bytes of preamble, both null terminated unless empty, then stored_len bytes
+ * of sample data stored as given by method. Closing the archive appends an
+ * index, count offsets of records from the start of the file as
+ * struct _vxi11_archive_index entries, and a struct _vxi11_archive_trailer.
+ * An archive without a trailer, e.g. from a writer that crashed, is read by
+ * walking the records up to the last complete one. All header fields are in
+ * network byte order; 64 bit values are two words, high word first.
+ *
+ * VXI11_ARCHIVE_DELTA_RICE data holds the differences between successive
+ * samples, the first taken from 0, mapped to unsigned values by zigzag
+ * encoding (0, -1, 1, -2 ... become 0, 1, 2, 3 ...), and Rice coded in groups
+ * of VXI11_ARCHIVE_GROUP values. The bit stream is filled from the least
+ * significant bit of each byte. Each group starts with its Rice parameter k in
+ * 5 bits; each value u is then q = u >> k one bits, a zero bit and the low k
+ * bits of u, or for q of VXI11_ARCHIVE_ESCAPE or more, VXI11_ARCHIVE_ESCAPE
+ * one bits and u in VXI11_ARCHIVE_RAW_BITS bits. Decoding gives back the
+ * samples exactly, in the byte order they were written.
+ *
+ * Not installed, this is not part of the public interface.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#ifndef	_VXI11_ARCHIVE_H_
+#define	_VXI11_ARCHIVE_H_
+
+#include <stdint.h>
+
+#define	VXI11_ARCHIVE_MAGIC		"VXI11ARC"
+#define	VXI11_ARCHIVE_RECORD_MAGIC	"VXRC"
+#define	VXI11_ARCHIVE_INDEX_MAGIC	"VXI11IDX"
+#define	VXI11_ARCHIVE_VERSION		1
+
+/* methods */
+#define	VXI11_ARCHIVE_STORED		0	/* the samples as given */
+#define	VXI11_ARCHIVE_DELTA_RICE	1
+
+#define	VXI11_ARCHIVE_GROUP	256
+#define	VXI11_ARCHIVE_ESCAPE	16
+#define	VXI11_ARCHIVE_RAW_BITS	17	/* enough for any 16 bit difference */
+
+struct _vxi11_archive_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+struct _vxi11_archive_record {
+	char magic[4];
+	uint32_t format;	/* VXI11_SAMPLE_INT8 etc., 0 for bytes */
+	uint32_t method;
+	uint32_t query_len;
+	uint32_t preamble_len;
+	uint32_t timestamp_us[2];	/* when it was written, in microseconds
+					   since the epoch */
+	uint32_t len[2];	/* bytes of samples */
+	uint32_t stored_len[2];
+};
+
+struct _vxi11_archive_index {
+	uint32_t offset[2];
+};
+
+struct _vxi11_archive_trailer {
+	uint32_t count[2];
+	uint32_t index_offset[2];
+	char magic[8];
+};
+
+#endif
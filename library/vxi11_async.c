@@ -0,0 +1,676 @@
+/* vxi11_async.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Non-blocking send/receive for the VXI11 user library. Rather than going
+ * through clnt_call(), which blocks until the reply arrives, the RPC messages
+ * for device_write and device_read are encoded here and exchanged over the
+ * link's own TCP connection with non-blocking socket I/O. This lets a single
+ * thread drive many instruments at once from a poll()/epoll() loop.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vxi11_internal.h"
+
+#ifdef WIN32
+
+/* There is no socket to poll underneath a VISA session, so non-blocking
+ * operation isn't available. */
+
+int vxi11_async_fd(VXI11_CLINK * clink)
+{
+	return -1;
+}
+
+int vxi11_async_start(VXI11_CLINK * clink, const char *cmd, size_t len,
+		      char *buffer, size_t buflen, unsigned long timeout)
+{
+	return -8;
+}
+
+int vxi11_async_process(VXI11_CLINK * clink)
+{
+	return -8;
+}
+
+ssize_t vxi11_async_result(VXI11_CLINK * clink)
+{
+	return -8;
+}
+
+long vxi11_async_timeout(VXI11_CLINK * clink)
+{
+	return -1;
+}
+
+void vxi11_async_cancel(VXI11_CLINK * clink)
+{
+}
+
+void _vxi11_async_free(VXI11_CLINK * clink)
+{
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+/* How long past the io_timeout we give the instrument to reply before
+ * giving up on it, in ms. */
+#define ASYNC_GRACE		1000
+
+/* Space for the RPC call header in front of the procedure arguments. */
+#define ASYNC_CALL_HEADER	64
+
+#define LAST_FRAG		0x80000000UL
+
+enum _vxi11_async_phase {
+	ASYNC_IDLE = 0,
+	ASYNC_WRITE,		/* device_write in flight */
+	ASYNC_READ,		/* device_read in flight */
+	ASYNC_DONE,
+};
+
+struct _vxi11_async {
+	enum _vxi11_async_phase phase;
+	int fd;
+	int fd_flags;		/* restored when the operation completes */
+	u_int32_t xid;
+	unsigned long timeout;		/* of the call in flight */
+	unsigned long read_timeout;
+	unsigned long deadline;
+	ssize_t result;
+
+	/* Command being written, and how much of it has been acknowledged */
+	char *cmd;
+	size_t cmd_len;
+	size_t cmd_alloc;
+	size_t cmd_pos;
+
+	/* Caller's reply buffer, NULL for a command with no reply */
+	char *buffer;
+	size_t buflen;
+	size_t curr_pos;
+
+	/* Encoded call record, and how much of it has gone out */
+	char *tx;
+	size_t tx_len;
+	size_t tx_alloc;
+	size_t tx_pos;
+
+	/* Reply record being assembled from one or more fragments */
+	char *rx;
+	size_t rx_len;
+	size_t rx_alloc;
+	unsigned char rx_mark[4];
+	size_t rx_mark_pos;
+	size_t rx_frag_left;
+	int rx_last;
+
+	/* The call in flight, for vxi11_capture_start() */
+	Device_WriteParms write_parms;
+	Device_ReadParms read_parms;
+	unsigned long long capture;
+};
+
+static int _grow(char **buf, size_t *alloc, size_t need)
+{
+	char *p;
+	size_t n = *alloc ? *alloc : 256;
+
+	if (need <= *alloc) {
+		return 0;
+	}
+	while (n < need) {
+		n *= 2;
+	}
+	p = (char *)realloc(*buf, n);
+	if (!p) {
+		return 1;
+	}
+	*buf = p;
+	*alloc = n;
+	return 0;
+}
+
+/* Encode a call to DEVICE_CORE procedure proc as a single record fragment. */
+static int _encode_call(struct _vxi11_async *a, rpcproc_t proc,
+			xdrproc_t xargs, void *args, size_t args_len)
+{
+	XDR xdrs;
+	struct rpc_msg call;
+	u_int32_t mark;
+	size_t need = 4 + ASYNC_CALL_HEADER + args_len;
+	u_int len;
+
+	if (_grow(&a->tx, &a->tx_alloc, need)) {
+		return 1;
+	}
+
+	memset(&call, 0, sizeof(call));
+	call.rm_xid = ++a->xid;
+	call.rm_direction = CALL;
+	call.rm_call.cb_rpcvers = RPC_MSG_VERSION;
+	call.rm_call.cb_prog = DEVICE_CORE;
+	call.rm_call.cb_vers = DEVICE_CORE_VERSION;
+	call.rm_call.cb_proc = proc;
+	call.rm_call.cb_cred = _null_auth;
+	call.rm_call.cb_verf = _null_auth;
+
+	xdrmem_create(&xdrs, a->tx + 4, a->tx_alloc - 4, XDR_ENCODE);
+	if (!xdr_callmsg(&xdrs, &call) || !xargs(&xdrs, args)) {
+		xdr_destroy(&xdrs);
+		return 1;
+	}
+	len = xdr_getpos(&xdrs);
+	xdr_destroy(&xdrs);
+
+	mark = htonl(LAST_FRAG | len);
+	memcpy(a->tx, &mark, 4);
+	a->tx_len = len + 4;
+	a->tx_pos = 0;
+
+	a->rx_len = 0;
+	a->rx_mark_pos = 0;
+	a->rx_frag_left = 0;
+	a->rx_last = 0;
+	a->deadline = _vxi11_now_ms() + a->timeout + ASYNC_GRACE;
+	return 0;
+}
+
+/* Decode a reply record. Returns 0 on success, 1 if the record is a stale
+ * reply to an earlier call (e.g. one that timed out) and should be skipped,
+ * -1 on an RPC level failure. */
+static int _decode_reply(struct _vxi11_async *a, xdrproc_t xres, void *res)
+{
+	XDR xdrs;
+	struct rpc_msg reply;
+	u_int32_t xid;
+	int ok;
+
+	if (a->rx_len < 4) {
+		return -1;
+	}
+	memcpy(&xid, a->rx, 4);
+	if (ntohl(xid) != a->xid) {
+		return 1;
+	}
+
+	memset(&reply, 0, sizeof(reply));
+	reply.acpted_rply.ar_verf = _null_auth;
+	reply.acpted_rply.ar_results.where = (caddr_t) res;
+	reply.acpted_rply.ar_results.proc = xres;
+
+	xdrmem_create(&xdrs, a->rx, a->rx_len, XDR_DECODE);
+	ok = xdr_replymsg(&xdrs, &reply);
+	xdr_destroy(&xdrs);
+
+	if (!ok || reply.rm_reply.rp_stat != MSG_ACCEPTED
+	    || reply.acpted_rply.ar_stat != SUCCESS) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Send as much of the pending call as the socket will take.
+ * Returns 0 when it has all gone, 1 if we need to wait, -1 on error. */
+static int _flush(struct _vxi11_async *a)
+{
+	ssize_t n;
+
+	while (a->tx_pos < a->tx_len) {
+		n = send(a->fd, a->tx + a->tx_pos, a->tx_len - a->tx_pos,
+			 MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 1;
+			}
+			return -1;
+		}
+		a->tx_pos += n;
+	}
+	return 0;
+}
+
+/* Read as much of the reply record as is available.
+ * Returns 0 when a whole record is in a->rx, 1 if we need to wait, -1 on
+ * error or if the connection was closed. */
+static int _fill(struct _vxi11_async *a)
+{
+	ssize_t n;
+	u_int32_t mark;
+
+	while (1) {
+		if (a->rx_frag_left == 0) {
+			if (a->rx_last && a->rx_mark_pos == 4) {
+				return 0;
+			}
+			n = recv(a->fd, a->rx_mark + a->rx_mark_pos,
+				 4 - a->rx_mark_pos, 0);
+			if (n > 0) {
+				a->rx_mark_pos += n;
+				if (a->rx_mark_pos < 4) {
+					continue;
+				}
+				memcpy(&mark, a->rx_mark, 4);
+				mark = ntohl(mark);
+				a->rx_last = (mark & LAST_FRAG) != 0;
+				a->rx_frag_left = mark & ~LAST_FRAG;
+				if (_grow(&a->rx, &a->rx_alloc,
+					  a->rx_len + a->rx_frag_left)) {
+					return -1;
+				}
+				if (a->rx_frag_left == 0 && !a->rx_last) {
+					a->rx_mark_pos = 0;
+				}
+				continue;
+			}
+		} else {
+			n = recv(a->fd, a->rx + a->rx_len, a->rx_frag_left, 0);
+			if (n > 0) {
+				a->rx_len += n;
+				a->rx_frag_left -= n;
+				if (a->rx_frag_left == 0 && !a->rx_last) {
+					a->rx_mark_pos = 0;
+				}
+				continue;
+			}
+		}
+		if (n == 0) {
+			return -1;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 1;
+		}
+		return -1;
+	}
+}
+
+/* Leave the connection at a record boundary, so that the next call on it,
+ * from this or any other link sharing it, starts cleanly: finish sending a
+ * partly sent call, and read to the end of a partly received reply. If either
+ * takes longer than ASYNC_GRACE, the connection is marked lost, so that later
+ * calls on it fail rather than read from the middle of a record. */
+static void _resync(VXI11_CLINK * clink)
+{
+	struct _vxi11_async *a = clink->async;
+	unsigned long deadline = _vxi11_now_ms() + ASYNC_GRACE;
+	unsigned long now;
+	struct pollfd pfd;
+	int rc;
+
+	pfd.fd = a->fd;
+	while (1) {
+		if (a->tx_pos > 0 && a->tx_pos < a->tx_len) {
+			rc = _flush(a);
+			pfd.events = POLLOUT;
+		} else if (a->rx_mark_pos > 0 || a->rx_len > 0) {
+			rc = _fill(a);
+			pfd.events = POLLIN;
+		} else {
+			rc = 0;
+		}
+		if (rc <= 0) {
+			break;
+		}
+		now = _vxi11_now_ms();
+		if (now >= deadline || poll(&pfd, 1, deadline - now) <= 0) {
+			rc = -1;
+			break;
+		}
+	}
+	a->rx_len = 0;
+	a->rx_mark_pos = 0;
+	a->rx_frag_left = 0;
+	a->rx_last = 0;
+	if (rc < 0) {
+		_vxi11_connection_lost(clink);
+	}
+}
+
+static int _next_write(VXI11_CLINK * clink)
+{
+	struct _vxi11_async *a = clink->async;
+	Device_WriteParms write_parms;
+	size_t bytes_left = a->cmd_len - a->cmd_pos;
+	size_t max_chunk;
+
+	/* See vxi11_send() for why maxRecvSize is checked. */
+	max_chunk = clink->link->maxRecvSize > 0 ? clink->link->maxRecvSize : 4096;
+
+	write_parms.lid = clink->link->lid;
+	write_parms.io_timeout = VXI11_DEFAULT_TIMEOUT;
+	write_parms.lock_timeout = clink->lock_timeout;
+	if (bytes_left <= max_chunk) {
+		write_parms.flags = FLAG_END | LOCK_FLAGS(clink);
+		write_parms.data.data_len = bytes_left;
+	} else {
+		write_parms.flags = LOCK_FLAGS(clink);
+		write_parms.data.data_len = max_chunk;
+	}
+	write_parms.data.data_val = a->cmd + a->cmd_pos;
+
+	a->phase = ASYNC_WRITE;
+	a->timeout = VXI11_DEFAULT_TIMEOUT + clink->lock_timeout;
+	a->write_parms = write_parms;
+	a->capture = _vxi11_capture_begin();
+	return _encode_call(a, device_write, (xdrproc_t) xdr_Device_WriteParms,
+			    &write_parms, write_parms.data.data_len);
+}
+
+static int _next_read(VXI11_CLINK * clink)
+{
+	struct _vxi11_async *a = clink->async;
+	Device_ReadParms read_parms;
+
+	read_parms.lid = clink->link->lid;
+	read_parms.requestSize = a->buflen - a->curr_pos;
+	read_parms.io_timeout = a->read_timeout;
+	read_parms.lock_timeout = clink->lock_timeout;
+	read_parms.flags = LOCK_FLAGS(clink);
+	read_parms.termChar = 0;
+
+	a->phase = ASYNC_READ;
+	a->timeout = a->read_timeout + clink->lock_timeout;
+	a->read_parms = read_parms;
+	a->capture = _vxi11_capture_begin();
+	return _encode_call(a, device_read, (xdrproc_t) xdr_Device_ReadParms,
+			    &read_parms, 0);
+}
+
+static int _finish(struct _vxi11_async *a, ssize_t result)
+{
+	fcntl(a->fd, F_SETFL, a->fd_flags);
+	a->phase = ASYNC_DONE;
+	a->result = result;
+	return result < 0 ? (int)result : 0;
+}
+
+/* Handle a complete reply record. Returns as vxi11_async_process(), or 2 if
+ * the record was a stale reply that has been discarded. */
+static int _handle_reply(VXI11_CLINK * clink)
+{
+	struct _vxi11_async *a = clink->async;
+	int rc;
+
+	if (a->phase == ASYNC_WRITE) {
+		Device_WriteResp write_resp;
+
+		memset(&write_resp, 0, sizeof(write_resp));
+		rc = _decode_reply(a, (xdrproc_t) xdr_Device_WriteResp, &write_resp);
+		if (rc == 1) {
+			return 2;
+		}
+		_vxi11_capture(device_write, (xdrproc_t) xdr_Device_WriteParms, &a->write_parms,
+			       (xdrproc_t) xdr_Device_WriteResp, rc < 0 ? NULL : &write_resp,
+			       a->capture);
+		if (rc < 0) {
+			_vxi11_error("vxi11_async_process", RPC_CANTDECODERES, 0, a->cmd_pos);
+			return _finish(a, -VXI11_NULL_WRITE_RESP);
+		}
+		if (write_resp.error != 0) {
+			_vxi11_error("vxi11_async_process", 0, write_resp.error, a->cmd_pos);
+			return _finish(a, -(ssize_t)write_resp.error);
+		}
+		if ((write_resp.size == 0 && a->write_parms.data.data_len > 0)
+		    || write_resp.size > a->write_parms.data.data_len) {
+			/* A confused instrument, see vxi11_send() */
+			_vxi11_error("vxi11_async_process", RPC_CANTDECODERES, 0, a->cmd_pos);
+			_vxi11_log(VXI11_LOG_ERROR, "vxi11_async_process: instrument accepted %lu of %lu bytes",
+				   (unsigned long)write_resp.size,
+				   (unsigned long)a->write_parms.data.data_len);
+			return _finish(a, -VXI11_NULL_WRITE_RESP);
+		}
+		a->cmd_pos += write_resp.size;
+		if (a->cmd_pos < a->cmd_len) {
+			rc = _next_write(clink);
+		} else if (a->buffer) {
+			rc = _next_read(clink);
+		} else {
+			return _finish(a, 0);
+		}
+	} else {
+		Device_ReadResp read_resp;
+
+		memset(&read_resp, 0, sizeof(read_resp));
+		read_resp.data.data_val = a->buffer + a->curr_pos;
+		rc = _decode_reply(a, (xdrproc_t) xdr_Device_ReadResp, &read_resp);
+		if (rc == 1) {
+			return 2;
+		}
+		_vxi11_capture(device_read, (xdrproc_t) xdr_Device_ReadParms, &a->read_parms,
+			       (xdrproc_t) xdr_Device_ReadResp, rc < 0 ? NULL : &read_resp,
+			       a->capture);
+		if (rc < 0) {
+			_vxi11_error("vxi11_async_process", RPC_CANTDECODERES, 0, a->curr_pos);
+			return _finish(a, -VXI11_NULL_READ_RESP);
+		}
+		if (read_resp.error != 0) {
+			_vxi11_error("vxi11_async_process", 0, read_resp.error, a->curr_pos);
+			return _finish(a, -(ssize_t)read_resp.error);
+		}
+		if ((a->curr_pos + read_resp.data.data_len) <= a->buflen) {
+			a->curr_pos += read_resp.data.data_len;
+		}
+		if ((read_resp.reason & RCV_END_BIT) || (read_resp.reason & RCV_CHR_BIT)) {
+			return _finish(a, a->curr_pos);
+		} else if (a->curr_pos == a->buflen) {
+			return _finish(a, -100);
+		}
+		rc = _next_read(clink);
+	}
+	if (rc) {
+		return _finish(a, -9);
+	}
+	return 1;
+}
+
+int vxi11_async_fd(VXI11_CLINK * clink)
+{
+	int fd;
+
+	if (!clink->client || !clnt_control(clink->client, CLGET_FD, (char *)&fd)) {
+		return -1;
+	}
+	return fd;
+}
+
+int vxi11_async_start(VXI11_CLINK * clink, const char *cmd, size_t len,
+		      char *buffer, size_t buflen, unsigned long timeout)
+{
+	struct _vxi11_async *a = clink->async;
+	int fd;
+	int rc;
+
+	if (a && a->phase != ASYNC_IDLE && a->phase != ASYNC_DONE) {
+		return -8;
+	}
+	fd = vxi11_async_fd(clink);
+	if (fd < 0) {
+		return -8;
+	}
+	if (_vxi11_connection_check(clink, "vxi11_async_start")) {
+		return -17;
+	}
+	if (!a) {
+		a = (struct _vxi11_async *)calloc(1, sizeof(struct _vxi11_async));
+		if (!a) {
+			return 1;
+		}
+		/* Keep well clear of the xids that clnt_call() is using. */
+		a->xid = (u_int32_t)(_vxi11_now_ms() << 16) ^ (u_int32_t)(uintptr_t)clink;
+		clink->async = a;
+	}
+
+	if (_grow(&a->cmd, &a->cmd_alloc, len)) {
+		return 1;
+	}
+	memcpy(a->cmd, cmd, len);
+	a->cmd_len = len;
+	_vxi11_cache_sent(clink, cmd, len);
+	a->cmd_pos = 0;
+	a->buffer = buffer;
+	a->buflen = buflen;
+	a->curr_pos = 0;
+	a->read_timeout = timeout;
+	a->result = 0;
+	a->fd = fd;
+	a->fd_flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, a->fd_flags | O_NONBLOCK);
+
+	if (len > 0) {
+		rc = _next_write(clink);
+	} else if (buffer) {
+		rc = _next_read(clink);
+	} else {
+		_finish(a, 0);
+		return 0;
+	}
+	if (rc) {
+		_finish(a, -9);
+		a->phase = ASYNC_IDLE;
+		return 1;
+	}
+	return 0;
+}
+
+int vxi11_async_process(VXI11_CLINK * clink)
+{
+	struct _vxi11_async *a = clink->async;
+	enum clnt_stat status = RPC_TIMEDOUT;
+	int rc;
+
+	if (!a || a->phase == ASYNC_IDLE) {
+		return -8;
+	}
+	if (a->phase == ASYNC_DONE) {
+		return a->result < 0 ? (int)a->result : 0;
+	}
+	while (1) {
+		rc = _flush(a);
+		if (rc < 0) {
+			status = RPC_CANTSEND;
+			break;
+		} else if (rc > 0) {
+			if (_vxi11_now_ms() >= a->deadline) {
+				break;
+			}
+			return VXI11_ASYNC_WRITE;
+		}
+
+		rc = _fill(a);
+		if (rc < 0) {
+			status = RPC_CANTRECV;
+			break;
+		} else if (rc > 0) {
+			if (_vxi11_now_ms() >= a->deadline) {
+				break;
+			}
+			return VXI11_ASYNC_READ;
+		}
+
+		rc = _handle_reply(clink);
+		if (rc <= 0) {
+			return rc;
+		} else if (rc == 2) {
+			/* Stale reply skipped, wait for ours. */
+			a->rx_len = 0;
+			a->rx_mark_pos = 0;
+			a->rx_frag_left = 0;
+			a->rx_last = 0;
+		}
+	}
+
+	_resync(clink);
+	if (a->phase == ASYNC_WRITE) {
+		_vxi11_error("vxi11_async_process", status, 0, a->cmd_pos);
+		_vxi11_capture(device_write, (xdrproc_t) xdr_Device_WriteParms,
+			       &a->write_parms, NULL, NULL, a->capture);
+		return _finish(a, -VXI11_NULL_WRITE_RESP);
+	}
+	_vxi11_error("vxi11_async_process", status, 0, a->curr_pos);
+	_vxi11_capture(device_read, (xdrproc_t) xdr_Device_ReadParms,
+		       &a->read_parms, NULL, NULL, a->capture);
+	return _finish(a, -VXI11_NULL_READ_RESP);
+}
+
+ssize_t vxi11_async_result(VXI11_CLINK * clink)
+{
+	struct _vxi11_async *a = clink->async;
+
+	if (!a || a->phase != ASYNC_DONE) {
+		return -8;
+	}
+	return a->result;
+}
+
+long vxi11_async_timeout(VXI11_CLINK * clink)
+{
+	struct _vxi11_async *a = clink->async;
+	unsigned long now;
+
+	if (!a || a->phase == ASYNC_IDLE || a->phase == ASYNC_DONE) {
+		return -1;
+	}
+	now = _vxi11_now_ms();
+	return now >= a->deadline ? 0 : (long)(a->deadline - now);
+}
+
+void vxi11_async_cancel(VXI11_CLINK * clink)
+{
+	struct _vxi11_async *a = clink->async;
+
+	if (!a || a->phase == ASYNC_IDLE || a->phase == ASYNC_DONE) {
+		return;
+	}
+	/* A partly sent or received record would corrupt the stream for the
+	 * next call. A reply not yet started is discarded later by its xid. */
+	_resync(clink);
+	_finish(a, -VXI11_NULL_READ_RESP);
+	a->phase = ASYNC_IDLE;
+}
+
+void _vxi11_async_free(VXI11_CLINK * clink)
+{
+	struct _vxi11_async *a = clink->async;
+
+	if (!a) {
+		return;
+	}
+	vxi11_async_cancel(clink);
+	free(a->cmd);
+	free(a->tx);
+	free(a->rx);
+	free(a);
+	clink->async = NULL;
+}
+
+#endif
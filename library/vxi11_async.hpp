@@ -0,0 +1,419 @@
+/* vxi11_async.hpp
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * C++20 coroutine support for the libvxi11 user library. A Scheduler runs any
+ * number of instrument coroutines on the calling thread, using the
+ * non-blocking vxi11_async_*() functions and a single poll() loop, so that
+ * sequences on many instruments can be written linearly:
+ *
+ *   vxi11::Task measure(vxi11::Device &dmm)
+ *   {
+ *   	co_await vxi11::async_send(dmm, "CONF:VOLT:DC");
+ *   	auto v = co_await vxi11::async_query<double>(dmm, "READ?");
+ *   	...
+ *   }
+ *
+ *   vxi11::Scheduler sched;
+ *   sched.spawn(measure(dmm1));
+ *   sched.spawn(measure(dmm2));
+ *   sched.run();
+ *
+ * POSIX only.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#ifndef	_VXI11_ASYNC_HPP_
+#define	_VXI11_ASYNC_HPP_
+
+#include <poll.h>
+
+#include <algorithm>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <vector>
+
+#include "vxi11.hpp"
+
+namespace vxi11 {
+
+class Scheduler;
+
+/* The result of an awaited query: the parsed value and any error. */
+template <typename T>
+struct Result {
+	T value{};
+	std::error_code ec;
+};
+
+/* Class: Task
+ *
+ * The return type of instrument coroutines. A Task does nothing until it is
+ * handed to Scheduler::spawn(). Tasks cannot await other Tasks; factor shared
+ * steps into plain functions that return awaitables instead.
+ */
+class Task {
+public:
+	struct promise_type {
+		Scheduler *scheduler = nullptr;
+		std::exception_ptr exception;
+
+		Task get_return_object() noexcept
+		{
+			return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		std::suspend_always initial_suspend() noexcept
+		{
+			return {};
+		}
+		std::suspend_always final_suspend() noexcept
+		{
+			return {};
+		}
+		void return_void() noexcept
+		{
+		}
+		void unhandled_exception() noexcept
+		{
+			exception = std::current_exception();
+		}
+	};
+	using handle_type = std::coroutine_handle<promise_type>;
+
+	Task(const Task &) = delete;
+	Task &operator=(const Task &) = delete;
+
+	Task(Task &&other) noexcept
+		: handle_(std::exchange(other.handle_, nullptr))
+	{
+	}
+
+	Task &operator=(Task &&other) noexcept
+	{
+		if (this != &other) {
+			if (handle_) {
+				handle_.destroy();
+			}
+			handle_ = std::exchange(other.handle_, nullptr);
+		}
+		return *this;
+	}
+
+	~Task()
+	{
+		if (handle_) {
+			handle_.destroy();
+		}
+	}
+
+private:
+	friend class Scheduler;
+
+	explicit Task(handle_type h) noexcept : handle_(h)
+	{
+	}
+
+	handle_type release() noexcept
+	{
+		return std::exchange(handle_, nullptr);
+	}
+
+	handle_type handle_;
+};
+
+/* Class: Scheduler
+ *
+ * Runs Tasks on the thread that calls run(). While a Task is waiting for an
+ * instrument, the others carry on. Each Device may only have one operation
+ * outstanding at a time, and Devices opened to the same address share a
+ * connection (see vxi11_async_fd()), so must not be awaited concurrently.
+ */
+class Scheduler {
+public:
+	Scheduler() = default;
+	Scheduler(const Scheduler &) = delete;
+	Scheduler &operator=(const Scheduler &) = delete;
+
+	~Scheduler()
+	{
+		for (auto &w : waiting_) {
+			vxi11_async_cancel(w.clink);
+		}
+		for (auto h : tasks_) {
+			h.destroy();
+		}
+	}
+
+	/* Add a task. It starts running on the next call to run(). */
+	void spawn(Task task)
+	{
+		Task::handle_type h = task.release();
+
+		if (!h) {
+			return;
+		}
+		h.promise().scheduler = this;
+		tasks_.push_back(h);
+		ready_.push_back(h);
+	}
+
+	/* Run until every task has finished. If a task exits with an exception,
+	 * the remaining tasks are left suspended and the exception is rethrown;
+	 * run() may be called again to continue them. */
+	void run()
+	{
+		while (!tasks_.empty()) {
+			while (!ready_.empty()) {
+				Task::handle_type h = ready_.front();
+				ready_.pop_front();
+				h.resume();
+				if (h.done()) {
+					std::exception_ptr e = h.promise().exception;
+					tasks_.erase(std::find(tasks_.begin(), tasks_.end(), h));
+					h.destroy();
+					if (e) {
+						std::rethrow_exception(e);
+					}
+				}
+			}
+			if (waiting_.empty()) {
+				break;
+			}
+			poll_once();
+		}
+	}
+
+	/* Used by the awaitables: park h until the operation on clink completes. */
+	void wait(VXI11_CLINK *clink, int flags, Task::handle_type h)
+	{
+		waiting_.push_back(Waiter{clink, flags, h});
+	}
+
+private:
+	struct Waiter {
+		VXI11_CLINK *clink;
+		int flags;
+		Task::handle_type handle;
+	};
+
+	void poll_once()
+	{
+		long timeout = -1;
+
+		pfds_.resize(waiting_.size());
+		for (std::size_t i = 0; i < waiting_.size(); i++) {
+			long t = vxi11_async_timeout(waiting_[i].clink);
+
+			pfds_[i].fd = vxi11_async_fd(waiting_[i].clink);
+			pfds_[i].events = (waiting_[i].flags & VXI11_ASYNC_READ ? POLLIN : 0)
+				| (waiting_[i].flags & VXI11_ASYNC_WRITE ? POLLOUT : 0);
+			pfds_[i].revents = 0;
+			if (t >= 0 && (timeout < 0 || t < timeout)) {
+				timeout = t;
+			}
+		}
+
+		if (poll(pfds_.data(), pfds_.size(), static_cast<int>(timeout)) < 0) {
+			return;
+		}
+
+		/* Waiters are only removed here, so indices still line up with pfds_. */
+		std::size_t j = 0;
+		for (std::size_t i = 0; i < waiting_.size(); i++) {
+			Waiter w = waiting_[i];
+			int rc;
+
+			if (pfds_[i].revents || vxi11_async_timeout(w.clink) == 0) {
+				rc = vxi11_async_process(w.clink);
+				if (rc <= 0) {
+					ready_.push_back(w.handle);
+					continue;
+				}
+				w.flags = rc;
+			}
+			waiting_[j++] = w;
+		}
+		waiting_.resize(j);
+	}
+
+	std::vector<Task::handle_type> tasks_;
+	std::deque<Task::handle_type> ready_;
+	std::vector<Waiter> waiting_;
+	std::vector<pollfd> pfds_;
+};
+
+namespace detail {
+
+/* Common part of the awaitables: start the operation, and if it can't finish
+ * straight away, suspend the coroutine on the scheduler until it does. */
+class AsyncOp {
+public:
+	AsyncOp(Device &dev, std::string_view cmd, char *buffer,
+		std::size_t buflen, unsigned long timeout)
+		: dev_(dev), cmd_(cmd), buffer_(buffer), buflen_(buflen),
+		  timeout_(timeout)
+	{
+	}
+
+	bool await_ready() noexcept
+	{
+		int rc;
+
+		if (!dev_.is_open()) {
+			ec_ = errc::not_open;
+			return true;
+		}
+		rc = vxi11_async_start(dev_.native_handle(), cmd_.data(), cmd_.size(),
+				       buffer_, buflen_, timeout_);
+		if (rc == 1) {
+			ec_ = errc::out_of_memory;
+			return true;
+		} else if (rc != 0) {
+			ec_ = detail::from_return(rc);
+			return true;
+		}
+		flags_ = vxi11_async_process(dev_.native_handle());
+		return flags_ <= 0;
+	}
+
+	void await_suspend(Task::handle_type h)
+	{
+		h.promise().scheduler->wait(dev_.native_handle(), flags_, h);
+	}
+
+protected:
+	/* Bytes received, with ec_ set on failure. */
+	std::size_t finish() noexcept
+	{
+		ssize_t ret;
+
+		if (ec_) {
+			return 0;
+		}
+		ret = vxi11_async_result(dev_.native_handle());
+		if (ret < 0) {
+			ec_ = detail::from_return(ret);
+			return 0;
+		}
+		return static_cast<std::size_t>(ret);
+	}
+
+	Device &dev_;
+	std::string_view cmd_;
+	char *buffer_;
+	std::size_t buflen_;
+	unsigned long timeout_;
+	int flags_ = 0;
+	std::error_code ec_;
+};
+
+class SendAwaitable : public AsyncOp {
+public:
+	SendAwaitable(Device &dev, std::string_view cmd)
+		: AsyncOp(dev, cmd, nullptr, 0, VXI11_DEFAULT_TIMEOUT)
+	{
+	}
+
+	std::error_code await_resume() noexcept
+	{
+		finish();
+		return ec_;
+	}
+};
+
+template <typename T>
+class QueryAwaitable : public AsyncOp {
+public:
+	QueryAwaitable(Device &dev, std::string_view cmd, unsigned long timeout)
+		: AsyncOp(dev, cmd, nullptr, 0, timeout)
+	{
+		if constexpr (std::is_same_v<T, std::string>) {
+			reply_.resize(Device::string_reply_size);
+			buffer_ = reply_.data();
+			buflen_ = reply_.size();
+		} else {
+			buffer_ = buf_.data();
+			buflen_ = buf_.size();
+		}
+	}
+
+	/* The buffer lives in the awaitable, which in turn lives in the
+	 * suspended coroutine's frame, so it must not move. */
+	QueryAwaitable(const QueryAwaitable &) = delete;
+
+	Result<T> await_resume()
+	{
+		Result<T> result;
+		std::size_t n = finish();
+
+		result.ec = ec_;
+		if (ec_) {
+			return result;
+		}
+		if constexpr (std::is_same_v<T, std::string>) {
+			reply_.resize(n);
+			while (!reply_.empty() && (reply_.back() == '\n' || reply_.back() == '\r')) {
+				reply_.pop_back();
+			}
+			result.value = std::move(reply_);
+		} else {
+			result.value = detail::parse<T>(std::string_view(buf_.data(), n), result.ec);
+		}
+		return result;
+	}
+
+private:
+	std::array<char, 64> buf_;
+	std::string reply_;
+};
+
+} /* namespace detail */
+
+/* Function: async_send
+ *
+ * Awaitable that sends a command. The command must remain valid until the
+ * co_await completes.
+ *
+ * co_await returns:
+ *  an empty std::error_code on success
+ */
+inline detail::SendAwaitable async_send(Device &dev, std::string_view cmd)
+{
+	return detail::SendAwaitable(dev, cmd);
+}
+
+/* Function: async_query
+ *
+ * Awaitable that sends a query and parses the response as a T, as
+ * Device::query(). The query must remain valid until the co_await completes.
+ *
+ * co_await returns:
+ *  a Result<T> holding the value and any error
+ */
+template <typename T = std::string>
+detail::QueryAwaitable<T> async_query(Device &dev, std::string_view cmd,
+				      unsigned long timeout = VXI11_READ_TIMEOUT)
+{
+	static_assert(std::is_arithmetic_v<T> || std::is_same_v<T, std::string>,
+		      "vxi11::async_query supports arithmetic types and std::string");
+	return detail::QueryAwaitable<T>(dev, cmd, timeout);
+}
+
+} /* namespace vxi11 */
+
+#endif
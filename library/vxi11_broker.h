@@ -0,0 +1,76 @@
+/* vxi11_broker.h
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Wire protocol between libvxi11 and the vxi11_broker daemon. The broker holds
+ * a single VXI11 link per instrument and shares it between any number of
+ * local client processes, which talk to it over a Unix domain socket.
+ *
+ * Every message, in either direction, starts with a struct
+ * _vxi11_broker_msg, in host byte order, followed by len bytes of payload
+ * unless VXI11_BROKER_SHM_DATA is set in flags, in which case the payload is at
+ * the start of the client's shared memory region instead. Each request gets
+ * exactly one reply, and a client has at most one request outstanding.
+ *
+ * While a client holds the lock, other clients' requests wait in the queue
+ * for up to their lock_timeout, then fail with -11.
+ *
+ * Not installed, this is not part of the public interface.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#ifndef	_VXI11_BROKER_H_
+#define	_VXI11_BROKER_H_
+
+#include <stdint.h>
+
+/* Environment variable holding the broker socket path. When set, all links
+ * opened with vxi11_open_device() go through the broker. */
+#define	VXI11_BROKER_ENV	"VXI11_BROKER"
+
+/* Socket path used by vxi11_broker if none is given. */
+#define	VXI11_BROKER_DEFAULT_PATH	"/tmp/vxi11_broker.sock"
+
+/* Transfers at least this large go through shared memory. */
+#define	VXI11_BROKER_SHM_MIN	65536
+
+/* Requests. The reply status is the return value of the equivalent libvxi11
+ * function unless noted. */
+enum _vxi11_broker_op {
+	VXI11_BROKER_OPEN = 1,	/* payload: "address\0device\0". status 0 or 1 */
+	VXI11_BROKER_CLOSE,	/* no reply, the broker closes the connection */
+	VXI11_BROKER_SEND,	/* payload: the command */
+	VXI11_BROKER_RECEIVE,	/* len: bytes wanted. reply payload: the data */
+	VXI11_BROKER_CLEAR,
+	VXI11_BROKER_SHM,	/* shared memory fd attached, len: its size */
+	VXI11_BROKER_LOCK,	/* timeout: how long to wait for the lock */
+	VXI11_BROKER_UNLOCK,
+};
+
+/* flags */
+#define	VXI11_BROKER_SHM_DATA	0x01
+
+struct _vxi11_broker_msg {
+	uint32_t op;
+	int32_t status;
+	uint32_t timeout;
+	uint32_t lock_timeout;	/* see vxi11_set_lock_timeout() */
+	uint32_t flags;
+	uint64_t len;
+};
+
+#endif
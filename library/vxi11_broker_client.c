@@ -0,0 +1,336 @@
+/* vxi11_broker_client.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Broker transport for the VXI11 user library. When the VXI11_BROKER
+ * environment variable names a vxi11_broker socket, links are opened through
+ * the broker rather than directly to the instrument, so that several
+ * processes can share an instrument without competing for links and locks.
+ * See vxi11_broker.h for the protocol.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#ifndef WIN32
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "vxi11_internal.h"
+#include "vxi11_broker.h"
+
+struct _vxi11_broker_link {
+	int fd;
+	char *shm;
+	size_t shm_size;
+};
+
+static int _write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *)buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int _read_all(int fd, void *buf, size_t len)
+{
+	char *p = (char *)buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = recv(fd, p, len, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Send a request and wait for its reply header, which is returned in msg.
+ * If passfd is not -1 it is passed to the broker alongside the request. */
+static int _transact(VXI11_CLINK * clink, struct _vxi11_broker_msg *msg,
+		     const void *payload, size_t plen, int passfd)
+{
+	struct _vxi11_broker_link *b = clink->broker;
+	struct msghdr mh;
+	struct iovec iov;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct cmsghdr *cmsg;
+
+	msg->lock_timeout = clink->lock_timeout;
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = msg;
+	iov.iov_len = sizeof(*msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if (passfd != -1) {
+		memset(&control, 0, sizeof(control));
+		mh.msg_control = control.buf;
+		mh.msg_controllen = sizeof(control.buf);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &passfd, sizeof(int));
+	}
+	while (sendmsg(b->fd, &mh, MSG_NOSIGNAL) < 0) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+	if (plen > 0 && _write_all(b->fd, payload, plen)) {
+		return -1;
+	}
+	return _read_all(b->fd, msg, sizeof(*msg));
+}
+
+/* Make sure the shared memory region is at least len bytes. */
+static int _shm_reserve(VXI11_CLINK * clink, size_t len)
+{
+	struct _vxi11_broker_link *b = clink->broker;
+	struct _vxi11_broker_msg msg;
+	size_t size = b->shm_size ? b->shm_size : 1024 * 1024;
+	char *shm;
+	int fd;
+
+	if (len <= b->shm_size) {
+		return 0;
+	}
+	while (size < len) {
+		size *= 2;
+	}
+
+#ifdef MFD_CLOEXEC
+	fd = memfd_create("vxi11_broker", MFD_CLOEXEC);
+#else
+	{
+		char name[64];
+
+		snprintf(name, sizeof(name), "/vxi11_broker.%ld.%p", (long)getpid(), (void *)b);
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		shm_unlink(name);
+	}
+#endif
+	if (fd < 0) {
+		return -1;
+	}
+	if (ftruncate(fd, size)) {
+		close(fd);
+		return -1;
+	}
+	shm = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = VXI11_BROKER_SHM;
+	msg.len = size;
+	if (_transact(clink, &msg, NULL, 0, fd) || msg.status != 0) {
+		munmap(shm, size);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	if (b->shm) {
+		munmap(b->shm, b->shm_size);
+	}
+	b->shm = shm;
+	b->shm_size = size;
+	return 0;
+}
+
+int _vxi11_broker_open(VXI11_CLINK * clink, const char *path,
+		       const char *address, const char *device)
+{
+	struct _vxi11_broker_link *b;
+	struct _vxi11_broker_msg msg;
+	struct sockaddr_un sun;
+	size_t alen = strlen(address) + 1;
+	size_t dlen = strlen(device) + 1;
+	char *payload;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		return 1;
+	}
+	b = (struct _vxi11_broker_link *)calloc(1, sizeof(struct _vxi11_broker_link));
+	if (!b) {
+		return 1;
+	}
+	payload = (char *)malloc(alen + dlen);
+	if (!payload) {
+		free(b);
+		return 1;
+	}
+	memcpy(payload, address, alen);
+	memcpy(payload + alen, device, dlen);
+
+	b->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (b->fd < 0) {
+		free(payload);
+		free(b);
+		return 1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = VXI11_BROKER_OPEN;
+	msg.len = alen + dlen;
+	clink->broker = b;
+	if (connect(b->fd, (struct sockaddr *)&sun, sizeof(sun))
+	    || _transact(clink, &msg, payload, alen + dlen, -1)
+	    || msg.status != 0) {
+		clink->broker = NULL;
+		close(b->fd);
+		free(payload);
+		free(b);
+		return 1;
+	}
+	free(payload);
+	return 0;
+}
+
+int _vxi11_broker_close(VXI11_CLINK * clink)
+{
+	struct _vxi11_broker_link *b = clink->broker;
+	struct _vxi11_broker_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = VXI11_BROKER_CLOSE;
+	_write_all(b->fd, &msg, sizeof(msg));
+	close(b->fd);
+	if (b->shm) {
+		munmap(b->shm, b->shm_size);
+	}
+	free(b);
+	clink->broker = NULL;
+	return 0;
+}
+
+int _vxi11_broker_send(VXI11_CLINK * clink, const char *cmd, size_t len)
+{
+	struct _vxi11_broker_link *b = clink->broker;
+	struct _vxi11_broker_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = VXI11_BROKER_SEND;
+	msg.len = len;
+	if (len >= VXI11_BROKER_SHM_MIN && _shm_reserve(clink, len) == 0) {
+		memcpy(b->shm, cmd, len);
+		msg.flags = VXI11_BROKER_SHM_DATA;
+		if (_transact(clink, &msg, NULL, 0, -1)) {
+			return -VXI11_NULL_WRITE_RESP;
+		}
+	} else if (_transact(clink, &msg, cmd, len, -1)) {
+		return -VXI11_NULL_WRITE_RESP;
+	}
+	return msg.status;
+}
+
+ssize_t _vxi11_broker_receive(VXI11_CLINK * clink, char *buffer, size_t len,
+			      unsigned long timeout)
+{
+	struct _vxi11_broker_link *b = clink->broker;
+	struct _vxi11_broker_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = VXI11_BROKER_RECEIVE;
+	msg.timeout = timeout;
+	msg.len = len;
+	if (len >= VXI11_BROKER_SHM_MIN && _shm_reserve(clink, len) == 0) {
+		msg.flags = VXI11_BROKER_SHM_DATA;
+	}
+	if (_transact(clink, &msg, NULL, 0, -1) || msg.len > len) {
+		return -VXI11_NULL_READ_RESP;
+	}
+	if (msg.flags & VXI11_BROKER_SHM_DATA) {
+		memcpy(buffer, b->shm, msg.len);
+	} else if (msg.len > 0 && _read_all(b->fd, buffer, msg.len)) {
+		return -VXI11_NULL_READ_RESP;
+	}
+	return msg.status;
+}
+
+int _vxi11_broker_clear(VXI11_CLINK * clink)
+{
+	struct _vxi11_broker_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = VXI11_BROKER_CLEAR;
+	if (_transact(clink, &msg, NULL, 0, -1)) {
+		return -VXI11_NULL_WRITE_RESP;
+	}
+	return msg.status;
+}
+
+int _vxi11_broker_lock(VXI11_CLINK * clink, unsigned long timeout)
+{
+	struct _vxi11_broker_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = VXI11_BROKER_LOCK;
+	msg.timeout = timeout;
+	if (_transact(clink, &msg, NULL, 0, -1)) {
+		return -VXI11_NULL_WRITE_RESP;
+	}
+	return msg.status;
+}
+
+int _vxi11_broker_unlock(VXI11_CLINK * clink)
+{
+	struct _vxi11_broker_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = VXI11_BROKER_UNLOCK;
+	if (_transact(clink, &msg, NULL, 0, -1)) {
+		return -VXI11_NULL_WRITE_RESP;
+	}
+	return msg.status;
+}
+
+#endif
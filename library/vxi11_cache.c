@@ -0,0 +1,402 @@
+/* vxi11_cache.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Optional per-link cache of query responses, so that repeated queries for
+ * state that rarely changes (*IDN?, waveform preambles, channel scales) do
+ * not each cost a write and a read.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vxi11_internal.h"
+
+#ifdef WIN32
+#  define strncasecmp(a, b, c) _strnicmp(a, b, c)
+#else
+#  include <strings.h>
+#endif
+
+/* A query pattern that may be cached, and for how long. */
+struct _vxi11_cache_pattern {
+	struct _vxi11_cache_pattern *next;
+	char *pattern;
+	unsigned long ttl;
+};
+
+/* A command pattern whose sending invalidates matching cached queries. */
+struct _vxi11_cache_rule {
+	struct _vxi11_cache_rule *next;
+	char *send_pattern;
+	char *query_pattern;
+};
+
+/* A cached response. */
+struct _vxi11_cache_entry {
+	struct _vxi11_cache_entry *next;
+	char *query;
+	char *response;
+	size_t len;
+	unsigned long expires;	/* 0 for never */
+};
+
+struct _vxi11_cache {
+	struct _vxi11_cache_pattern *patterns;
+	struct _vxi11_cache_rule *rules;
+	struct _vxi11_cache_entry *entries;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+/* Case insensitive match of a command against a pattern, in which '*' matches
+ * any run of characters. '?' is not a wildcard, it is part of SCPI queries.
+ * A '*' starting the pattern and followed by a letter is literal, so that
+ * SCPI common commands such as "*IDN?" match only themselves; "**IDN?" is
+ * the wildcard form. The command is of length len and need not be null
+ * terminated; trailing whitespace on it is ignored. */
+static int _match(const char *pattern, const char *cmd, size_t len)
+{
+	const char *star = NULL;
+	size_t star_pos = 0;
+	size_t i = 0;
+
+	while (len > 0 && isspace((unsigned char)cmd[len - 1])) {
+		len--;
+	}
+
+	if (pattern[0] == '*' && isalpha((unsigned char)pattern[1])) {
+		if (len == 0 || cmd[0] != '*') {
+			return 0;
+		}
+		pattern++;
+		i++;
+	}
+
+	while (i < len) {
+		if (*pattern == '*') {
+			star = pattern++;
+			star_pos = i;
+		} else if (*pattern
+			   && toupper((unsigned char)*pattern) == toupper((unsigned char)cmd[i])) {
+			pattern++;
+			i++;
+		} else if (star) {
+			pattern = star + 1;
+			i = ++star_pos;
+		} else {
+			return 0;
+		}
+	}
+	while (*pattern == '*') {
+		pattern++;
+	}
+	return *pattern == '\0';
+}
+
+/* Length of the SCPI header of cmd, i.e. up to the first space. */
+static size_t _header_len(const char *cmd, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (isspace((unsigned char)cmd[i])) {
+			break;
+		}
+	}
+	return i;
+}
+
+static struct _vxi11_cache *_get_cache(VXI11_CLINK * clink)
+{
+	if (!clink->cache) {
+		clink->cache = (struct _vxi11_cache *)calloc(1, sizeof(struct _vxi11_cache));
+	}
+	return clink->cache;
+}
+
+static void _free_entry(struct _vxi11_cache_entry *entry)
+{
+	free(entry->query);
+	free(entry->response);
+	free(entry);
+}
+
+/* Remove every entry for which the test returns true. */
+static void _invalidate(struct _vxi11_cache *cache,
+			int (*test)(struct _vxi11_cache_entry *, const void *),
+			const void *arg)
+{
+	struct _vxi11_cache_entry **pentry = &cache->entries;
+	struct _vxi11_cache_entry *entry;
+
+	while (*pentry) {
+		entry = *pentry;
+		if (test(entry, arg)) {
+			*pentry = entry->next;
+			_free_entry(entry);
+		} else {
+			pentry = &entry->next;
+		}
+	}
+}
+
+static int _test_all(struct _vxi11_cache_entry *entry, const void *arg)
+{
+	(void)entry;
+	(void)arg;
+	return 1;
+}
+
+static int _test_query(struct _vxi11_cache_entry *entry, const void *arg)
+{
+	return strcmp(entry->query, (const char *)arg) == 0;
+}
+
+static int _test_pattern(struct _vxi11_cache_entry *entry, const void *arg)
+{
+	return _match((const char *)arg, entry->query, strlen(entry->query));
+}
+
+struct _header {
+	const char *cmd;
+	size_t len;
+};
+
+/* A setting command invalidates the query with the same header, e.g.
+ * ":CHAN1:SCAL 0.5" invalidates ":CHAN1:SCAL?". */
+static int _test_header(struct _vxi11_cache_entry *entry, const void *arg)
+{
+	const struct _header *h = (const struct _header *)arg;
+	size_t qlen = strlen(entry->query);
+
+	while (qlen > 0 && isspace((unsigned char)entry->query[qlen - 1])) {
+		qlen--;
+	}
+	return qlen == h->len + 1 && entry->query[h->len] == '?'
+	    && strncasecmp(entry->query, h->cmd, h->len) == 0;
+}
+
+static char *_strndup(const char *s, size_t len)
+{
+	char *d = (char *)malloc(len + 1);
+
+	if (d) {
+		memcpy(d, s, len);
+		d[len] = '\0';
+	}
+	return d;
+}
+
+int vxi11_cache_add(VXI11_CLINK * clink, const char *query_pattern,
+		    unsigned long ttl)
+{
+	struct _vxi11_cache *cache = _get_cache(clink);
+	struct _vxi11_cache_pattern *p;
+
+	if (!cache) {
+		return 1;
+	}
+	p = (struct _vxi11_cache_pattern *)calloc(1, sizeof(struct _vxi11_cache_pattern));
+	if (!p) {
+		return 1;
+	}
+	p->pattern = _strndup(query_pattern, strlen(query_pattern));
+	if (!p->pattern) {
+		free(p);
+		return 1;
+	}
+	p->ttl = ttl;
+	p->next = cache->patterns;
+	cache->patterns = p;
+	return 0;
+}
+
+int vxi11_cache_invalidate_on(VXI11_CLINK * clink, const char *send_pattern,
+			      const char *query_pattern)
+{
+	struct _vxi11_cache *cache = _get_cache(clink);
+	struct _vxi11_cache_rule *r;
+
+	if (!cache) {
+		return 1;
+	}
+	r = (struct _vxi11_cache_rule *)calloc(1, sizeof(struct _vxi11_cache_rule));
+	if (!r) {
+		return 1;
+	}
+	r->send_pattern = _strndup(send_pattern, strlen(send_pattern));
+	r->query_pattern = _strndup(query_pattern, strlen(query_pattern));
+	if (!r->send_pattern || !r->query_pattern) {
+		free(r->send_pattern);
+		free(r->query_pattern);
+		free(r);
+		return 1;
+	}
+	r->next = cache->rules;
+	cache->rules = r;
+	return 0;
+}
+
+void vxi11_cache_clear(VXI11_CLINK * clink)
+{
+	if (clink->cache) {
+		_invalidate(clink->cache, _test_all, NULL);
+	}
+}
+
+void vxi11_cache_stats(VXI11_CLINK * clink, unsigned long *hits,
+		       unsigned long *misses)
+{
+	if (hits) {
+		*hits = clink->cache ? clink->cache->hits : 0;
+	}
+	if (misses) {
+		*misses = clink->cache ? clink->cache->misses : 0;
+	}
+}
+
+ssize_t _vxi11_cache_lookup(VXI11_CLINK * clink, const char *cmd, char *buf,
+			    size_t len)
+{
+	struct _vxi11_cache *cache = clink->cache;
+	struct _vxi11_cache_entry **pentry;
+	struct _vxi11_cache_entry *entry;
+	size_t cmd_len = strlen(cmd);
+	struct _vxi11_cache_pattern *p;
+
+	if (!cache || !cache->patterns) {
+		return -1;
+	}
+
+	for (pentry = &cache->entries; *pentry; pentry = &(*pentry)->next) {
+		entry = *pentry;
+		if (strcmp(entry->query, cmd) != 0) {
+			continue;
+		}
+		if (entry->expires && _vxi11_now_ms() >= entry->expires) {
+			*pentry = entry->next;
+			_free_entry(entry);
+			break;
+		}
+		if (entry->len > len) {
+			break;
+		}
+		memcpy(buf, entry->response, entry->len);
+		cache->hits++;
+		return (ssize_t)entry->len;
+	}
+
+	for (p = cache->patterns; p; p = p->next) {
+		if (_match(p->pattern, cmd, cmd_len)) {
+			cache->misses++;
+			break;
+		}
+	}
+	return -1;
+}
+
+void _vxi11_cache_store(VXI11_CLINK * clink, const char *cmd, const char *buf,
+			size_t len)
+{
+	struct _vxi11_cache *cache = clink->cache;
+	struct _vxi11_cache_entry *entry;
+	struct _vxi11_cache_pattern *p;
+	size_t cmd_len = strlen(cmd);
+
+	if (!cache) {
+		return;
+	}
+	for (p = cache->patterns; p; p = p->next) {
+		if (_match(p->pattern, cmd, cmd_len)) {
+			break;
+		}
+	}
+	if (!p) {
+		return;
+	}
+	_invalidate(cache, _test_query, cmd);
+
+	entry = (struct _vxi11_cache_entry *)calloc(1, sizeof(struct _vxi11_cache_entry));
+	if (!entry) {
+		return;
+	}
+	entry->query = _strndup(cmd, cmd_len);
+	entry->response = _strndup(buf, len);
+	if (!entry->query || !entry->response) {
+		_free_entry(entry);
+		return;
+	}
+	entry->len = len;
+	if (p->ttl) {
+		entry->expires = _vxi11_now_ms() + p->ttl;
+	}
+	entry->next = cache->entries;
+	cache->entries = entry;
+}
+
+void _vxi11_cache_sent(VXI11_CLINK * clink, const char *cmd, size_t len)
+{
+	struct _vxi11_cache *cache = clink->cache;
+	struct _vxi11_cache_rule *r;
+	struct _header h;
+
+	if (!cache || !cache->entries) {
+		return;
+	}
+
+	h.cmd = cmd;
+	h.len = _header_len(cmd, len);
+	if (h.len > 0 && cmd[h.len - 1] != '?') {
+		_invalidate(cache, _test_header, &h);
+	}
+
+	for (r = cache->rules; r; r = r->next) {
+		if (_match(r->send_pattern, cmd, len)) {
+			_invalidate(cache, _test_pattern, r->query_pattern);
+		}
+	}
+}
+
+void _vxi11_cache_free(VXI11_CLINK * clink)
+{
+	struct _vxi11_cache *cache = clink->cache;
+	struct _vxi11_cache_pattern *p;
+	struct _vxi11_cache_rule *r;
+
+	if (!cache) {
+		return;
+	}
+	_invalidate(cache, _test_all, NULL);
+	while (cache->patterns) {
+		p = cache->patterns;
+		cache->patterns = p->next;
+		free(p->pattern);
+		free(p);
+	}
+	while (cache->rules) {
+		r = cache->rules;
+		cache->rules = r->next;
+		free(r->send_pattern);
+		free(r->query_pattern);
+		free(r);
+	}
+	free(cache);
+	clink->cache = NULL;
+}
@@ -0,0 +1,153 @@
+/* vxi11_capture.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Session capture. While a capture is running, every DEVICE_CORE call made by
+ * the library is appended to a file with its timing, arguments and results,
+ * so that vxi11_replay can later stand in for the instrument. See
+ * vxi11_capture.h for the file format.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vxi11_internal.h"
+
+#ifdef WIN32
+
+int vxi11_capture_start(const char *filename)
+{
+	return -8;
+}
+
+void vxi11_capture_stop(void)
+{
+}
+
+#else
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "vxi11_capture.h"
+
+static int capture_fd = -1;
+static unsigned long long capture_epoch;
+static pthread_once_t capture_env_once = PTHREAD_ONCE_INIT;
+
+int vxi11_capture_start(const char *filename)
+{
+	struct _vxi11_capture_header header;
+	int fd;
+
+	vxi11_capture_stop();
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (fd < 0) {
+		return 1;
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, VXI11_CAPTURE_MAGIC, sizeof(header.magic));
+	header.version = htonl(VXI11_CAPTURE_VERSION);
+	if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+		close(fd);
+		return 1;
+	}
+	capture_epoch = _vxi11_now_us();
+	capture_fd = fd;
+	return 0;
+}
+
+void vxi11_capture_stop(void)
+{
+	if (capture_fd >= 0) {
+		close(capture_fd);
+		capture_fd = -1;
+	}
+}
+
+static void _capture_env_once(void)
+{
+	const char *filename;
+
+	filename = getenv(VXI11_CAPTURE_ENV);
+	if (filename && filename[0]) {
+		vxi11_capture_start(filename);
+	}
+}
+
+/* Devices may be opened from several threads at once, so only one of them
+ * may start the capture. */
+void _vxi11_capture_env(void)
+{
+	pthread_once(&capture_env_once, _capture_env_once);
+}
+
+unsigned long long _vxi11_capture_begin(void)
+{
+	if (capture_fd < 0) {
+		return 0;
+	}
+	return _vxi11_now_us();
+}
+
+void _vxi11_capture(u_long proc, xdrproc_t xargs, void *args, xdrproc_t xres,
+		    void *res, unsigned long long start)
+{
+	struct _vxi11_capture_record *record;
+	unsigned long long offset;
+	size_t args_len;
+	size_t res_len;
+	char *buf;
+	XDR xdrs;
+
+	if (capture_fd < 0 || !start) {
+		return;
+	}
+	args_len = xdr_sizeof(xargs, args);
+	res_len = res ? xdr_sizeof(xres, res) : 0;
+	buf = (char *)malloc(sizeof(*record) + args_len + res_len);
+	if (!buf) {
+		return;
+	}
+
+	record = (struct _vxi11_capture_record *)buf;
+	offset = start - capture_epoch;
+	record->proc = htonl(proc);
+	record->flags = htonl(res ? 0 : VXI11_CAPTURE_NO_REPLY);
+	record->start_us[0] = htonl((uint32_t)(offset >> 32));
+	record->start_us[1] = htonl((uint32_t)offset);
+	record->duration_us = htonl((uint32_t)(_vxi11_now_us() - start));
+	record->args_len = htonl(args_len);
+	record->res_len = htonl(res_len);
+
+	xdrmem_create(&xdrs, buf + sizeof(*record), args_len + res_len, XDR_ENCODE);
+	if (xargs(&xdrs, args) && (!res || xres(&xdrs, res))) {
+		/* One write per record, so that with O_APPEND records from
+		 * different threads are never interleaved. */
+		if (write(capture_fd, buf, sizeof(*record) + args_len + res_len) < 0) {
+			vxi11_capture_stop();
+		}
+	}
+	xdr_destroy(&xdrs);
+	free(buf);
+}
+
+#endif
@@ -0,0 +1,64 @@
+/* vxi11_capture.h
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Format of the session capture files written by vxi11_capture_start() and
+ * read by vxi11_replay.
+ *
+ * A capture starts with a struct _vxi11_capture_header, followed by one
+ * struct _vxi11_capture_record per DEVICE_CORE call, each followed by
+ * args_len bytes of XDR encoded call arguments and then res_len bytes of XDR
+ * encoded results, exactly as they went over the wire. A call that got no
+ * reply has VXI11_CAPTURE_NO_REPLY set and no results. All header fields are
+ * in network byte order.
+ *
+ * Not installed, this is not part of the public interface.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#ifndef	_VXI11_CAPTURE_H_
+#define	_VXI11_CAPTURE_H_
+
+#include <stdint.h>
+
+/* Environment variable holding a capture file name. When set, the first
+ * vxi11_open_device() starts a capture to it. */
+#define	VXI11_CAPTURE_ENV	"VXI11_CAPTURE"
+
+#define	VXI11_CAPTURE_MAGIC	"VXI11CAP"
+#define	VXI11_CAPTURE_VERSION	1
+
+struct _vxi11_capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+/* flags */
+#define	VXI11_CAPTURE_NO_REPLY	0x01	/* the call failed or timed out */
+
+struct _vxi11_capture_record {
+	uint32_t proc;		/* DEVICE_CORE procedure number */
+	uint32_t flags;
+	uint32_t start_us[2];	/* when the call was made, since the capture
+				   started; high word first */
+	uint32_t duration_us;	/* until the reply arrived */
+	uint32_t args_len;
+	uint32_t res_len;
+};
+
+#endif
@@ -0,0 +1,564 @@
+/* vxi11_discover.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Discovery of VXI11 instruments on a network. Every address in a range is
+ * asked by its portmapper where DEVICE_CORE is, using a single UDP socket, so
+ * all probes are in flight at once and a whole subnet takes no longer than
+ * the timeout. Addresses with nothing listening just don't answer, rather than
+ * each costing a connection timeout as with vxi11_open_device(). When asked
+ * for their *IDN? strings, the responders are opened each in its own thread,
+ * so one that is slow to create a link holds up only itself, and any still
+ * not open when the timeout is up are left out.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vxi11_internal.h"
+
+#ifdef WIN32
+
+int vxi11_discover(const char *target, unsigned long timeout, int flags,
+		   vxi11_discover_callback callback, void *user)
+{
+	return -8;
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <rpc/pmap_prot.h>
+
+#define DISCOVER_IDN_LEN	256
+
+struct _vxi11_responder {
+	struct in_addr addr;
+	unsigned short port;
+};
+
+struct _vxi11_scan {
+	int fd;
+	u_int32_t xid;
+	unsigned short pmap_port;
+	u_int32_t first;	/* host byte order */
+	u_int32_t count;
+	unsigned char *answered;	/* one flag per address in the range */
+	struct _vxi11_responder *found;
+	size_t nfound;
+	size_t found_alloc;
+	char call[128];
+	size_t call_len;
+};
+
+/* Parse "host", "a.b.c.d/prefix", either optionally followed by ":port" for
+ * the portmapper port. Ranges are limited to a /16. */
+static int _parse_target(struct _vxi11_scan *scan, const char *target)
+{
+	struct addrinfo hints, *res;
+	char host[256];
+	const char *p;
+	char *end;
+	size_t len;
+	unsigned long prefix = 32;
+	unsigned long port = PMAPPORT;
+	u_int32_t addr;
+	u_int32_t mask;
+
+	len = strcspn(target, "/:");
+	if (len == 0 || len >= sizeof(host)) {
+		return -5;
+	}
+	memcpy(host, target, len);
+	host[len] = '\0';
+	p = target + len;
+
+	if (*p == '/') {
+		prefix = strtoul(p + 1, &end, 10);
+		if (end == p + 1 || prefix > 32 || prefix < 16) {
+			return -5;
+		}
+		p = end;
+	}
+	if (*p == ':') {
+		port = strtoul(p + 1, &end, 10);
+		if (end == p + 1 || port == 0 || port > 65535) {
+			return -5;
+		}
+		p = end;
+	}
+	if (*p != '\0') {
+		return -5;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+		return -21;
+	}
+	addr = ntohl(((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr);
+	freeaddrinfo(res);
+
+	mask = prefix ? ~(u_int32_t)0 << (32 - prefix) : 0;
+	scan->first = addr & mask;
+	scan->count = (u_int32_t)(1UL << (32 - prefix));
+	if (prefix <= 30) {
+		/* Leave out the network and broadcast addresses */
+		scan->first++;
+		scan->count -= 2;
+	}
+	scan->pmap_port = (unsigned short)port;
+	return 0;
+}
+
+/* Encode the PMAPPROC_GETPORT call for DEVICE_CORE over TCP. */
+static int _encode_getport(struct _vxi11_scan *scan)
+{
+	XDR xdrs;
+	struct rpc_msg call;
+	struct pmap args;
+
+	memset(&call, 0, sizeof(call));
+	call.rm_xid = scan->xid;
+	call.rm_direction = CALL;
+	call.rm_call.cb_rpcvers = RPC_MSG_VERSION;
+	call.rm_call.cb_prog = PMAPPROG;
+	call.rm_call.cb_vers = PMAPVERS;
+	call.rm_call.cb_proc = PMAPPROC_GETPORT;
+	call.rm_call.cb_cred = _null_auth;
+	call.rm_call.cb_verf = _null_auth;
+
+	args.pm_prog = DEVICE_CORE;
+	args.pm_vers = DEVICE_CORE_VERSION;
+	args.pm_prot = IPPROTO_TCP;
+	args.pm_port = 0;
+
+	xdrmem_create(&xdrs, scan->call, sizeof(scan->call), XDR_ENCODE);
+	if (!xdr_callmsg(&xdrs, &call) || !xdr_pmap(&xdrs, &args)) {
+		xdr_destroy(&xdrs);
+		return 1;
+	}
+	scan->call_len = xdr_getpos(&xdrs);
+	xdr_destroy(&xdrs);
+	return 0;
+}
+
+static int _record(struct _vxi11_scan *scan, struct in_addr addr,
+		   unsigned short port)
+{
+	struct _vxi11_responder *found;
+	u_int32_t a = ntohl(addr.s_addr);
+	size_t i;
+
+	if (a - scan->first < scan->count) {
+		scan->answered[a - scan->first] = 1;
+	}
+	for (i = 0; i < scan->nfound; i++) {
+		if (scan->found[i].addr.s_addr == addr.s_addr) {
+			return 0;
+		}
+	}
+	if (scan->nfound == scan->found_alloc) {
+		scan->found_alloc = scan->found_alloc ? scan->found_alloc * 2 : 16;
+		found = (struct _vxi11_responder *)realloc(scan->found,
+				scan->found_alloc * sizeof(struct _vxi11_responder));
+		if (!found) {
+			return 1;
+		}
+		scan->found = found;
+	}
+	scan->found[scan->nfound].addr = addr;
+	scan->found[scan->nfound].port = port;
+	scan->nfound++;
+	return 0;
+}
+
+/* Read whatever replies have arrived. Replies can come from addresses we
+ * did not probe directly, when probing a broadcast address. */
+static int _receive(struct _vxi11_scan *scan)
+{
+	char buf[512];
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	struct rpc_msg reply;
+	u_int32_t xid;
+	u_int port;
+	XDR xdrs;
+	ssize_t n;
+	int ok;
+
+	while (1) {
+		fromlen = sizeof(from);
+		n = recvfrom(scan->fd, buf, sizeof(buf), 0,
+			     (struct sockaddr *)&from, &fromlen);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 0;
+		}
+		if (n < 4) {
+			continue;
+		}
+		memcpy(&xid, buf, 4);
+		if (ntohl(xid) != scan->xid) {
+			continue;
+		}
+
+		port = 0;
+		memset(&reply, 0, sizeof(reply));
+		reply.acpted_rply.ar_verf = _null_auth;
+		reply.acpted_rply.ar_results.where = (caddr_t) &port;
+		reply.acpted_rply.ar_results.proc = (xdrproc_t) xdr_u_int;
+		xdrmem_create(&xdrs, buf, n, XDR_DECODE);
+		ok = xdr_replymsg(&xdrs, &reply);
+		xdr_destroy(&xdrs);
+
+		if (ok && reply.rm_reply.rp_stat == MSG_ACCEPTED
+		    && reply.acpted_rply.ar_stat == SUCCESS
+		    && port > 0 && port <= 65535) {
+			if (_record(scan, from.sin_addr, (unsigned short)port)) {
+				return 1;
+			}
+		}
+	}
+}
+
+/* Send a probe to every address in the range that hasn't answered yet,
+ * collecting replies as we go. */
+static int _probe(struct _vxi11_scan *scan, unsigned long deadline)
+{
+	struct sockaddr_in to;
+	struct pollfd pfd;
+	unsigned long now;
+	u_int32_t i = 0;
+	ssize_t n;
+
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_port = htons(scan->pmap_port);
+	pfd.fd = scan->fd;
+
+	while (i < scan->count) {
+		if (scan->answered[i]) {
+			i++;
+			continue;
+		}
+		to.sin_addr.s_addr = htonl(scan->first + i);
+		n = sendto(scan->fd, scan->call, scan->call_len, 0,
+			   (struct sockaddr *)&to, sizeof(to));
+		if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK
+			       && errno != ENOBUFS && errno != EINTR)) {
+			/* Sent, or unreachable in which case there is
+			 * nothing to find there. */
+			i++;
+			continue;
+		}
+		/* Socket buffer full, take in replies while it drains */
+		now = _vxi11_now_ms();
+		if (now >= deadline) {
+			break;
+		}
+		pfd.events = POLLIN | POLLOUT;
+		poll(&pfd, 1, 10);
+		if ((pfd.revents & POLLIN) && _receive(scan)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Wait until the given time for replies. */
+static int _collect(struct _vxi11_scan *scan, unsigned long until)
+{
+	struct pollfd pfd;
+	unsigned long now;
+
+	pfd.fd = scan->fd;
+	pfd.events = POLLIN;
+	while ((now = _vxi11_now_ms()) < until) {
+		if (poll(&pfd, 1, until - now) > 0 && _receive(scan)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* The responders being opened for _identify(). It is freed by whichever of
+ * the caller and the opening threads lets go of it last, since threads still
+ * stuck in vxi11_open_device() are not waited for. */
+struct _vxi11_opening {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int abandoned;		/* the caller has stopped waiting */
+	size_t pending;		/* opens not yet finished */
+	size_t refs;		/* threads still running, plus the caller */
+	struct _vxi11_open_slot *slots;
+};
+
+struct _vxi11_open_slot {
+	struct _vxi11_opening *opening;
+	char address[32];
+	VXI11_CLINK *clink;	/* set if opened in time */
+};
+
+static void _opening_release(struct _vxi11_opening *o)
+{
+	int last;
+
+	pthread_mutex_lock(&o->lock);
+	last = --o->refs == 0;
+	pthread_mutex_unlock(&o->lock);
+	if (last) {
+		pthread_cond_destroy(&o->done);
+		pthread_mutex_destroy(&o->lock);
+		free(o->slots);
+		free(o);
+	}
+}
+
+static void *_open_thread(void *arg)
+{
+	struct _vxi11_open_slot *slot = (struct _vxi11_open_slot *)arg;
+	struct _vxi11_opening *o = slot->opening;
+	VXI11_CLINK *clink;
+	int late;
+
+	if (vxi11_open_device(&clink, slot->address, NULL)) {
+		clink = NULL;
+	}
+	pthread_mutex_lock(&o->lock);
+	late = o->abandoned;
+	if (!late) {
+		slot->clink = clink;
+	}
+	o->pending--;
+	pthread_cond_signal(&o->done);
+	pthread_mutex_unlock(&o->lock);
+
+	/* Too late to be asked, nobody else will close it */
+	if (late && clink) {
+		vxi11_close_device(clink, slot->address);
+	}
+	_opening_release(o);
+	return NULL;
+}
+
+/* Open every responder at once, waiting no longer than the timeout. */
+static struct _vxi11_opening *_open_all(struct _vxi11_scan *scan, unsigned long timeout)
+{
+	struct _vxi11_opening *o;
+	struct timespec until;
+	pthread_t thread;
+	size_t i;
+
+	o = (struct _vxi11_opening *)calloc(1, sizeof(struct _vxi11_opening));
+	if (!o) {
+		return NULL;
+	}
+	o->slots = (struct _vxi11_open_slot *)calloc(scan->nfound, sizeof(struct _vxi11_open_slot));
+	if (!o->slots) {
+		free(o);
+		return NULL;
+	}
+	pthread_mutex_init(&o->lock, NULL);
+	pthread_cond_init(&o->done, NULL);
+	o->refs = 1;
+
+	for (i = 0; i < scan->nfound; i++) {
+		o->slots[i].opening = o;
+		snprintf(o->slots[i].address, sizeof(o->slots[i].address), "%s:%u",
+			 inet_ntoa(scan->found[i].addr), scan->found[i].port);
+		pthread_mutex_lock(&o->lock);
+		o->pending++;
+		o->refs++;
+		pthread_mutex_unlock(&o->lock);
+		if (pthread_create(&thread, NULL, _open_thread, &o->slots[i])) {
+			pthread_mutex_lock(&o->lock);
+			o->pending--;
+			o->refs--;
+			pthread_mutex_unlock(&o->lock);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += timeout / 1000;
+	until.tv_nsec += (timeout % 1000) * 1000000;
+	if (until.tv_nsec >= 1000000000) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&o->lock);
+	while (o->pending > 0) {
+		if (pthread_cond_timedwait(&o->done, &o->lock, &until) == ETIMEDOUT) {
+			break;
+		}
+	}
+	o->abandoned = 1;
+	pthread_mutex_unlock(&o->lock);
+	return o;
+}
+
+/* Ask each responder for its *IDN? string, all at once with a group. */
+static void _identify(struct _vxi11_scan *scan, char **idn, unsigned long timeout)
+{
+	struct _vxi11_opening *o;
+	VXI11_CLINK **clinks;
+	VXI11_GROUP *group;
+	size_t *member;
+	size_t n = 0;
+	size_t i;
+	size_t len;
+	const char *resp;
+
+	clinks = (VXI11_CLINK **)calloc(scan->nfound, sizeof(VXI11_CLINK *));
+	member = (size_t *)calloc(scan->nfound, sizeof(size_t));
+	if (!clinks || !member || vxi11_group_create(&group)) {
+		free(clinks);
+		free(member);
+		return;
+	}
+	o = _open_all(scan, timeout);
+	if (!o) {
+		vxi11_group_free(group);
+		free(clinks);
+		free(member);
+		return;
+	}
+
+	/* Only the links opened in time are ours now */
+	for (i = 0; i < scan->nfound; i++) {
+		clinks[i] = o->slots[i].clink;
+		if (clinks[i] && vxi11_group_add(group, clinks[i]) == 0) {
+			member[i] = n++;
+		} else if (clinks[i]) {
+			vxi11_close_device(clinks[i], o->slots[i].address);
+			clinks[i] = NULL;
+		}
+	}
+
+	vxi11_group_query(group, "*IDN?", DISCOVER_IDN_LEN, timeout);
+
+	for (i = 0; i < scan->nfound; i++) {
+		if (!clinks[i]) {
+			continue;
+		}
+		resp = vxi11_group_response(group, member[i]);
+		if (resp) {
+			len = strlen(resp);
+			while (len > 0 && (resp[len - 1] == '\n' || resp[len - 1] == '\r')) {
+				len--;
+			}
+			idn[i] = (char *)malloc(len + 1);
+			if (idn[i]) {
+				memcpy(idn[i], resp, len);
+				idn[i][len] = '\0';
+			}
+		}
+		vxi11_close_device(clinks[i], o->slots[i].address);
+	}
+	vxi11_group_free(group);
+	_opening_release(o);
+	free(clinks);
+	free(member);
+}
+
+int vxi11_discover(const char *target, unsigned long timeout, int flags,
+		   vxi11_discover_callback callback, void *user)
+{
+	struct _vxi11_scan scan;
+	unsigned long start = _vxi11_now_ms();
+	char **idn = NULL;
+	int on = 1;
+	int ret;
+	size_t i;
+
+	memset(&scan, 0, sizeof(scan));
+	ret = _parse_target(&scan, target);
+	if (ret) {
+		return ret;
+	}
+	scan.answered = (unsigned char *)calloc(scan.count, 1);
+	if (!scan.answered) {
+		return -9;
+	}
+	scan.xid = (u_int32_t)(start << 16) ^ (u_int32_t)getpid();
+	if (_encode_getport(&scan)) {
+		free(scan.answered);
+		return -9;
+	}
+
+	scan.fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (scan.fd < 0) {
+		free(scan.answered);
+		return -17;
+	}
+	fcntl(scan.fd, F_SETFL, fcntl(scan.fd, F_GETFL) | O_NONBLOCK);
+	setsockopt(scan.fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+
+	/* Probe everything, then once more half way through for any probes or
+	 * replies that were lost. */
+	ret = _probe(&scan, start + timeout / 2)
+	    || _collect(&scan, start + timeout / 2)
+	    || _probe(&scan, start + timeout)
+	    || _collect(&scan, start + timeout);
+	close(scan.fd);
+	free(scan.answered);
+	if (ret) {
+		free(scan.found);
+		return -9;
+	}
+
+	if ((flags & VXI11_DISCOVER_IDN) && scan.nfound > 0) {
+		idn = (char **)calloc(scan.nfound, sizeof(char *));
+		if (idn) {
+			_identify(&scan, idn, timeout);
+		}
+	}
+
+	if (callback) {
+		for (i = 0; i < scan.nfound; i++) {
+			callback(inet_ntoa(scan.found[i].addr), scan.found[i].port,
+				 idn ? idn[i] : NULL, user);
+		}
+	}
+
+	if (idn) {
+		for (i = 0; i < scan.nfound; i++) {
+			free(idn[i]);
+		}
+		free(idn);
+	}
+	free(scan.found);
+	return (int)scan.nfound;
+}
+
+#endif
@@ -0,0 +1,86 @@
+/* vxi11_error.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Error reporting. The library never prints anything itself: the details of
+ * the last failure are kept per thread for vxi11_last_error(), and messages
+ * are only formatted when a log callback has asked for them.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "vxi11_internal.h"
+
+#ifdef _MSC_VER
+#  define THREAD_LOCAL	__declspec(thread)
+#else
+#  define THREAD_LOCAL	__thread
+#endif
+
+static THREAD_LOCAL VXI11_ERROR last_error;
+
+static vxi11_log_callback log_callback;
+static int log_level;
+static void *log_user;
+
+void vxi11_last_error(VXI11_ERROR *error)
+{
+	*error = last_error;
+}
+
+void vxi11_clear_error(void)
+{
+	memset(&last_error, 0, sizeof(last_error));
+}
+
+void vxi11_set_log_callback(vxi11_log_callback callback, int level, void *user)
+{
+	log_callback = NULL;
+	log_user = user;
+	log_level = level;
+	log_callback = callback;
+}
+
+void _vxi11_error(const char *function, int rpc_status, int error, size_t bytes)
+{
+	last_error.function = function;
+	last_error.rpc_status = rpc_status;
+	last_error.error = error;
+	last_error.bytes = bytes;
+}
+
+int _vxi11_log_enabled(int level)
+{
+	return log_callback && level <= log_level;
+}
+
+void _vxi11_log(int level, const char *format, ...)
+{
+	char message[256];
+	va_list args;
+
+	if (!_vxi11_log_enabled(level)) {
+		return;
+	}
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+	log_callback(level, message, log_user);
+}
@@ -0,0 +1,373 @@
+/* vxi11_group.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Groups of links, for sending the same command or query to many instruments
+ * at once. The members' operations are run concurrently on a single thread
+ * with the non-blocking functions in vxi11_async.c, so a step over the whole
+ * group takes about as long as the slowest instrument rather than the sum of
+ * them all.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vxi11_internal.h"
+
+#ifndef WIN32
+#  include <poll.h>
+#endif
+
+enum _vxi11_member_state {
+	MEMBER_WAITING = 0,	/* not started yet */
+	MEMBER_PENDING,		/* non-blocking operation in progress */
+	MEMBER_SYNC,		/* no non-blocking support, run it blocking */
+	MEMBER_DONE,
+};
+
+struct _vxi11_group_member {
+	VXI11_CLINK *clink;
+	enum _vxi11_member_state state;
+	int fd;
+	int events;		/* what the operation in progress is waiting for */
+	ssize_t result;
+	unsigned long long started_us;
+	unsigned long long elapsed_us;
+	char *buf;		/* reply, null terminated */
+	size_t buf_size;
+};
+
+struct _VXI11_GROUP {
+	struct _vxi11_group_member *members;
+	size_t count;
+	size_t alloc;
+#ifndef WIN32
+	struct pollfd *pfds;
+	struct _vxi11_group_member **polled;
+#endif
+};
+
+int vxi11_group_create(VXI11_GROUP **group)
+{
+	*group = (VXI11_GROUP *) calloc(1, sizeof(VXI11_GROUP));
+	if (!(*group)) {
+		return 1;
+	}
+	return 0;
+}
+
+void vxi11_group_free(VXI11_GROUP *group)
+{
+	size_t i;
+
+	if (!group) {
+		return;
+	}
+	for (i = 0; i < group->count; i++) {
+		free(group->members[i].buf);
+	}
+	free(group->members);
+#ifndef WIN32
+	free(group->pfds);
+	free(group->polled);
+#endif
+	free(group);
+}
+
+int vxi11_group_add(VXI11_GROUP *group, VXI11_CLINK *clink)
+{
+	struct _vxi11_group_member *members;
+	size_t alloc;
+
+	if (group->count == group->alloc) {
+		alloc = group->alloc ? group->alloc * 2 : 8;
+#ifndef WIN32
+		{
+			struct pollfd *pfds;
+			struct _vxi11_group_member **polled;
+
+			pfds = (struct pollfd *)malloc(alloc * sizeof(struct pollfd));
+			polled = (struct _vxi11_group_member **)malloc(alloc *
+					sizeof(struct _vxi11_group_member *));
+			if (!pfds || !polled) {
+				free(pfds);
+				free(polled);
+				return 1;
+			}
+			free(group->pfds);
+			free(group->polled);
+			group->pfds = pfds;
+			group->polled = polled;
+		}
+#endif
+		members = (struct _vxi11_group_member *)realloc(group->members,
+				alloc * sizeof(struct _vxi11_group_member));
+		if (!members) {
+			return 1;
+		}
+		group->members = members;
+		group->alloc = alloc;
+	}
+	memset(&group->members[group->count], 0, sizeof(struct _vxi11_group_member));
+	group->members[group->count].clink = clink;
+	group->count++;
+	return 0;
+}
+
+size_t vxi11_group_size(VXI11_GROUP *group)
+{
+	return group->count;
+}
+
+ssize_t vxi11_group_result(VXI11_GROUP *group, size_t member)
+{
+	if (member >= group->count) {
+		return -5;
+	}
+	return group->members[member].result;
+}
+
+const char *vxi11_group_response(VXI11_GROUP *group, size_t member)
+{
+	struct _vxi11_group_member *m;
+
+	if (member >= group->count) {
+		return NULL;
+	}
+	m = &group->members[member];
+	if (m->result < 0 || !m->buf) {
+		return NULL;
+	}
+	return m->buf;
+}
+
+unsigned long long vxi11_group_elapsed_us(VXI11_GROUP *group, size_t member)
+{
+	if (member >= group->count) {
+		return 0;
+	}
+	return group->members[member].elapsed_us;
+}
+
+/* Blocking operation, for links that can't do non-blocking. */
+static void _run_sync(struct _vxi11_group_member *m, const char *cmd,
+		      size_t len, size_t buflen, unsigned long timeout)
+{
+	int ret;
+
+	m->started_us = _vxi11_now_us();
+	ret = vxi11_send(m->clink, cmd, len);
+	if (ret != 0) {
+		m->result = ret == 1 ? -9 : ret;
+	} else if (buflen > 0) {
+		m->result = vxi11_receive_timeout(m->clink, m->buf, buflen, timeout);
+	}
+	m->state = MEMBER_DONE;
+}
+
+static void _finish(struct _vxi11_group_member *m, const char *cmd, size_t buflen)
+{
+	m->state = MEMBER_DONE;
+	m->elapsed_us = _vxi11_now_us() - m->started_us;
+	if (buflen > 0 && m->result >= 0) {
+		m->buf[m->result] = '\0';
+		_vxi11_cache_store(m->clink, cmd, m->buf, m->result);
+	}
+}
+
+#ifndef WIN32
+/* Start a member's non-blocking operation, unless another member is already
+ * using the same socket, in which case it waits its turn. */
+static void _start(VXI11_GROUP *group, struct _vxi11_group_member *m,
+		   const char *cmd, size_t len, size_t buflen,
+		   unsigned long timeout)
+{
+	size_t i;
+	int rc;
+
+	for (i = 0; i < group->count; i++) {
+		if (group->members[i].state == MEMBER_PENDING
+		    && group->members[i].fd == m->fd) {
+			return;
+		}
+	}
+	m->started_us = _vxi11_now_us();
+	rc = vxi11_async_start(m->clink, cmd, len, buflen ? m->buf : NULL,
+			       buflen, timeout);
+	if (rc != 0) {
+		m->result = rc == 1 ? -9 : rc;
+		m->state = MEMBER_DONE;
+		m->elapsed_us = _vxi11_now_us() - m->started_us;
+		return;
+	}
+	m->state = MEMBER_PENDING;
+	m->events = vxi11_async_process(m->clink);
+	if (m->events <= 0) {
+		m->result = vxi11_async_result(m->clink);
+		_finish(m, cmd, buflen);
+	}
+}
+#endif
+
+/* Run cmd on every member, gathering replies of up to buflen bytes if buflen
+ * is not 0. Returns the number of members that failed. */
+static int _run(VXI11_GROUP *group, const char *cmd, size_t len,
+		size_t buflen, unsigned long timeout)
+{
+	struct _vxi11_group_member *m;
+	int remaining = 0;
+	int failed = 0;
+	size_t i;
+#ifndef WIN32
+	long wait;
+	long t;
+	nfds_t n;
+	int rc;
+#endif
+
+	for (i = 0; i < group->count; i++) {
+		m = &group->members[i];
+		m->result = 0;
+		m->elapsed_us = 0;
+		if (buflen > 0 && m->buf_size < buflen + 1) {
+			free(m->buf);
+			m->buf = (char *)malloc(buflen + 1);
+			if (!m->buf) {
+				m->buf_size = 0;
+				m->result = -9;
+				m->state = MEMBER_DONE;
+				continue;
+			}
+			m->buf_size = buflen + 1;
+		}
+		if (buflen > 0) {
+			m->result = _vxi11_cache_lookup(m->clink, cmd, m->buf, buflen);
+			if (m->result >= 0) {
+				m->buf[m->result] = '\0';
+				m->state = MEMBER_DONE;
+				continue;
+			}
+			m->result = 0;
+		}
+		m->fd = vxi11_async_fd(m->clink);
+		m->state = m->fd < 0 ? MEMBER_SYNC : MEMBER_WAITING;
+		remaining++;
+	}
+
+	while (remaining > 0) {
+#ifndef WIN32
+		/* Get everything we can in flight before blocking on anything */
+		for (i = 0; i < group->count; i++) {
+			m = &group->members[i];
+			if (m->state == MEMBER_WAITING) {
+				_start(group, m, cmd, len, buflen, timeout);
+			}
+		}
+#endif
+		for (i = 0; i < group->count; i++) {
+			m = &group->members[i];
+			if (m->state == MEMBER_SYNC) {
+				_run_sync(m, cmd, len, buflen, timeout);
+				_finish(m, cmd, buflen);
+			}
+		}
+
+#ifndef WIN32
+		n = 0;
+		wait = -1;
+		for (i = 0; i < group->count; i++) {
+			m = &group->members[i];
+			if (m->state != MEMBER_PENDING) {
+				continue;
+			}
+			group->pfds[n].fd = m->fd;
+			group->pfds[n].events =
+			    (m->events & VXI11_ASYNC_WRITE) ? POLLOUT : POLLIN;
+			group->pfds[n].revents = 0;
+			group->polled[n] = m;
+			n++;
+			t = vxi11_async_timeout(m->clink);
+			if (t >= 0 && (wait < 0 || t < wait)) {
+				wait = t;
+			}
+		}
+		if (n > 0) {
+			poll(group->pfds, n, wait);
+		}
+		for (i = 0; i < n; i++) {
+			m = group->polled[i];
+			if (!group->pfds[i].revents && vxi11_async_timeout(m->clink) != 0) {
+				continue;
+			}
+			rc = vxi11_async_process(m->clink);
+			if (rc > 0) {
+				m->events = rc;
+				continue;
+			}
+			m->result = vxi11_async_result(m->clink);
+			_finish(m, cmd, buflen);
+		}
+#endif
+
+		remaining = 0;
+		for (i = 0; i < group->count; i++) {
+			if (group->members[i].state != MEMBER_DONE) {
+				remaining++;
+			}
+		}
+	}
+
+	for (i = 0; i < group->count; i++) {
+		if (group->members[i].result < 0) {
+			failed++;
+		}
+	}
+	return failed;
+}
+
+int vxi11_group_send(VXI11_GROUP *group, const char *cmd, size_t len)
+{
+	return _run(group, cmd, len, 0, VXI11_READ_TIMEOUT);
+}
+
+int vxi11_group_query(VXI11_GROUP *group, const char *cmd, size_t buflen,
+		      unsigned long timeout)
+{
+	if (buflen == 0) {
+		return -5;
+	}
+	return _run(group, cmd, strlen(cmd), buflen, timeout);
+}
+
+int vxi11_group_obtain_double_values(VXI11_GROUP *group, const char *cmd,
+				     double *values, unsigned long timeout)
+{
+	size_t i;
+	int failed;
+
+	/* 50 as in vxi11_obtain_double_value(), plenty for one number */
+	failed = _run(group, cmd, strlen(cmd), 50, timeout);
+	for (i = 0; i < group->count; i++) {
+		if (group->members[i].result >= 0) {
+			values[i] = strtod(group->members[i].buf, (char **)NULL);
+		} else {
+			values[i] = 0.0;
+		}
+	}
+	return failed;
+}
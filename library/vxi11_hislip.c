@@ -0,0 +1,678 @@
+/* vxi11_hislip.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * HiSLIP (IVI-6.1) transport for the VXI11 user library. HiSLIP replaces the
+ * RPC calls of VXI11 with a simple framed protocol over two TCP connections:
+ * the synchronous channel carries commands and responses, and the
+ * asynchronous channel carries device clear and locking. Links are opened
+ * this way when vxi11_open_device() is given a VISA style address such as
+ * "TCPIP::192.168.1.10::hislip0::INSTR", or a device name such as "hislip0".
+ *
+ * If the instrument offers overlapped mode, several queries may be sent
+ * before any of their responses are read, and the responses come back in
+ * order. Otherwise the session is in synchronized mode, and a response is
+ * only taken if its MessageID is that of the last message sent, so that a
+ * late response to an earlier query, e.g. one that timed out, is discarded.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#ifndef WIN32
+
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "vxi11_internal.h"
+#include "vxi11_hislip.h"
+
+struct _vxi11_hislip_link {
+	int sync_fd;
+	int async_fd;
+	int overlapped;		/* else synchronized */
+	uint64_t max_payload;	/* largest Data payload the instrument accepts */
+	uint32_t message_id;	/* for the next message we send */
+	int rmt_delivered;	/* a response END arrived since we last sent */
+
+	/* Partly received header on the synchronous channel */
+	unsigned char header[HISLIP_HEADER_SIZE];
+	size_t header_pos;
+
+	/* Remainder of the message being received */
+	uint64_t payload_left;
+	int payload_type;
+	int discarding;		/* it is not for us, throw the payload away */
+};
+
+static void _put_header(unsigned char *h, int type, int control,
+			uint32_t parameter, uint64_t len)
+{
+	int i;
+
+	h[0] = 'H';
+	h[1] = 'S';
+	h[2] = (unsigned char)type;
+	h[3] = (unsigned char)control;
+	for (i = 0; i < 4; i++) {
+		h[4 + i] = (unsigned char)(parameter >> (24 - 8 * i));
+	}
+	for (i = 0; i < 8; i++) {
+		h[8 + i] = (unsigned char)(len >> (56 - 8 * i));
+	}
+}
+
+static uint32_t _get32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+	    | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t _get64(const unsigned char *p)
+{
+	return ((uint64_t)_get32(p) << 32) | _get32(p + 4);
+}
+
+/* Send a whole message. Returns 0, or -17 on a socket error. */
+static int _send_message(int fd, int type, int control, uint32_t parameter,
+			 const void *payload, uint64_t len)
+{
+	unsigned char header[HISLIP_HEADER_SIZE];
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t n;
+
+	_put_header(header, type, control, parameter, len);
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = len ? 2 : 1;
+	while (msg.msg_iovlen > 0) {
+		n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -17;
+		}
+		while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+			n -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+			msg.msg_iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/* Read up to len bytes, waiting until the deadline for the first of them.
+ * Returns the number read, or -15 on timeout or -17 on error. */
+static ssize_t _recv(int fd, void *buf, size_t len, unsigned long deadline)
+{
+	struct pollfd pfd;
+	unsigned long now;
+	ssize_t n;
+	int rc;
+
+	while (1) {
+		now = _vxi11_now_ms();
+		if (now >= deadline) {
+			return -15;
+		}
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		rc = poll(&pfd, 1, (int)(deadline - now));
+		if (rc < 0 && errno != EINTR) {
+			return -17;
+		} else if (rc <= 0) {
+			continue;
+		}
+		n = recv(fd, buf, len, 0);
+		if (n > 0) {
+			return n;
+		} else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+			return -17;
+		}
+	}
+}
+
+/* Read exactly len bytes. */
+static int _recv_all(int fd, void *buf, size_t len, unsigned long deadline)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = _recv(fd, buf, len, deadline);
+		if (n < 0) {
+			return (int)n;
+		}
+		buf = (char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Read and discard len bytes of payload. */
+static int _skip(int fd, uint64_t len, unsigned long deadline)
+{
+	char buf[4096];
+	ssize_t n;
+
+	while (len > 0) {
+		n = _recv(fd, buf, len < sizeof(buf) ? len : sizeof(buf), deadline);
+		if (n < 0) {
+			return (int)n;
+		}
+		len -= n;
+	}
+	return 0;
+}
+
+/* Read one whole message from a channel used for request and response
+ * (everything except the data on the synchronous channel). Up to
+ * payload_len bytes of its payload are stored in payload, the rest is
+ * discarded. Returns 0 or a negative error. */
+static int _recv_message(int fd, unsigned char *header, void *payload,
+			 size_t payload_len, unsigned long deadline)
+{
+	uint64_t len;
+	size_t n;
+	int rc;
+
+	rc = _recv_all(fd, header, HISLIP_HEADER_SIZE, deadline);
+	if (rc < 0) {
+		return rc;
+	}
+	if (header[0] != 'H' || header[1] != 'S') {
+		return -17;
+	}
+	len = _get64(header + 8);
+	n = len < payload_len ? (size_t)len : payload_len;
+	rc = _recv_all(fd, payload, n, deadline);
+	if (rc < 0) {
+		return rc;
+	}
+	return _skip(fd, len - n, deadline);
+}
+
+/* Report an Error or FatalError message from the instrument. */
+static void _log_error(const char *function, const unsigned char *header,
+		       const char *text, size_t len)
+{
+	_vxi11_log(VXI11_LOG_ERROR, "%s: HiSLIP %s %d: %.*s", function,
+		   header[2] == HISLIP_FATAL_ERROR ? "fatal error" : "error",
+		   header[3], (int)len, text);
+}
+
+static int _connect(const char *host, unsigned short port)
+{
+	struct addrinfo hints, *res, *ai;
+	char service[8];
+	int one = 1;
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%u", port);
+	if (getaddrinfo(host, service, &hints, &res) != 0) {
+		return -21;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		return -17;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+int _vxi11_hislip_address(const char *address, const char *device, char *host,
+			  size_t hostlen, unsigned short *port, char *sub,
+			  size_t sublen)
+{
+	const char *p = address;
+	const char *end;
+	const char *colon;
+	char *tail;
+	size_t n;
+
+	*port = HISLIP_PORT;
+
+	/* address "host" or "host:port", device "hislipN" */
+	if (strncasecmp(address, "TCPIP", 5) != 0) {
+		if (!device || strncasecmp(device, "hislip", 6) != 0
+		    || strlen(device) >= sublen) {
+			return 0;
+		}
+		colon = strrchr(address, ':');
+		n = colon ? (size_t)(colon - address) : strlen(address);
+		if (n == 0 || n >= hostlen) {
+			return 0;
+		}
+		if (colon) {
+			*port = (unsigned short)strtoul(colon + 1, NULL, 10);
+		}
+		memcpy(host, address, n);
+		host[n] = '\0';
+		strcpy(sub, device);
+		return 1;
+	}
+
+	/* TCPIP[board]::host::hislipN[,port]::INSTR */
+	p += 5;
+	while (isdigit((unsigned char)*p)) {
+		p++;
+	}
+	if (strncmp(p, "::", 2) != 0) {
+		return 0;
+	}
+	p += 2;
+	end = strstr(p, "::");
+	if (!end || end == p || (size_t)(end - p) >= hostlen) {
+		return 0;
+	}
+	memcpy(host, p, end - p);
+	host[end - p] = '\0';
+	p = end + 2;
+	if (strncasecmp(p, "hislip", 6) != 0) {
+		return 0;
+	}
+	end = strstr(p, "::");
+	if (!end || strcasecmp(end, "::INSTR") != 0) {
+		return 0;
+	}
+	n = strcspn(p, ",:");
+	if (n >= sublen) {
+		return 0;
+	}
+	memcpy(sub, p, n);
+	sub[n] = '\0';
+	if (p[n] == ',') {
+		*port = (unsigned short)strtoul(p + n + 1, &tail, 10);
+		if (tail != end) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int _vxi11_hislip_open(VXI11_CLINK * clink, const char *host, unsigned short port,
+		       const char *sub)
+{
+	struct _vxi11_hislip_link *h;
+	unsigned char header[HISLIP_HEADER_SIZE];
+	unsigned char size[8];
+	unsigned long deadline = _vxi11_now_ms() + VXI11_DEFAULT_TIMEOUT;
+	char text[256];
+	uint16_t session;
+	uint64_t max;
+	int rc;
+	int i;
+
+	h = (struct _vxi11_hislip_link *)calloc(1, sizeof(struct _vxi11_hislip_link));
+	if (!h) {
+		return 1;
+	}
+	h->async_fd = -1;
+	h->message_id = HISLIP_INITIAL_MESSAGE_ID;
+
+	h->sync_fd = _connect(host, port);
+	if (h->sync_fd < 0) {
+		rc = h->sync_fd;
+		goto fail;
+	}
+	rc = _send_message(h->sync_fd, HISLIP_INITIALIZE, 0,
+			   (HISLIP_VERSION << 16) | HISLIP_VENDOR_ID, sub, strlen(sub));
+	if (rc == 0) {
+		rc = _recv_message(h->sync_fd, header, text, sizeof(text), deadline);
+	}
+	if (rc < 0) {
+		goto fail;
+	}
+	if (header[2] != HISLIP_INITIALIZE_RESPONSE) {
+		_log_error("vxi11_open_device", header, text, _get64(header + 8));
+		rc = -3;
+		goto fail;
+	}
+	h->overlapped = header[3] & 0x01;
+	session = (uint16_t)_get32(header + 4);
+
+	h->async_fd = _connect(host, port);
+	if (h->async_fd < 0) {
+		rc = h->async_fd;
+		goto fail;
+	}
+	rc = _send_message(h->async_fd, HISLIP_ASYNC_INITIALIZE, 0, session, NULL, 0);
+	if (rc == 0) {
+		rc = _recv_message(h->async_fd, header, text, sizeof(text), deadline);
+	}
+	if (rc == 0 && header[2] != HISLIP_ASYNC_INITIALIZE_RESPONSE) {
+		_log_error("vxi11_open_device", header, text, _get64(header + 8));
+		rc = -3;
+	}
+	if (rc < 0) {
+		goto fail;
+	}
+
+	/* We can take responses of any size, ask what the instrument takes */
+	max = ~(uint64_t)0;
+	for (i = 0; i < 8; i++) {
+		size[i] = (unsigned char)(max >> (56 - 8 * i));
+	}
+	rc = _send_message(h->async_fd, HISLIP_ASYNC_MAXIMUM_MESSAGE_SIZE, 0, 0, size, 8);
+	if (rc == 0) {
+		memset(size, 0, sizeof(size));
+		rc = _recv_message(h->async_fd, header, size, sizeof(size), deadline);
+	}
+	if (rc < 0) {
+		goto fail;
+	}
+	max = header[2] == HISLIP_ASYNC_MAXIMUM_MESSAGE_SIZE_RESPONSE ? _get64(size) : 0;
+	/* The limit is for the whole message, header included */
+	h->max_payload = max > HISLIP_HEADER_SIZE ? max - HISLIP_HEADER_SIZE : 256;
+
+	clink->hislip = h;
+	return 0;
+
+fail:
+	_vxi11_error("vxi11_open_device", 0, -rc, 0);
+	_vxi11_log(VXI11_LOG_ERROR, "vxi11_open_device: could not open HiSLIP session %s on %s port %u (%d)",
+		   sub, host, port, rc);
+	if (h->sync_fd >= 0) {
+		close(h->sync_fd);
+	}
+	if (h->async_fd >= 0) {
+		close(h->async_fd);
+	}
+	free(h);
+	return 1;
+}
+
+void _vxi11_hislip_close(VXI11_CLINK * clink)
+{
+	struct _vxi11_hislip_link *h = clink->hislip;
+
+	if (h) {
+		close(h->sync_fd);
+		close(h->async_fd);
+		free(h);
+		clink->hislip = NULL;
+	}
+}
+
+int _vxi11_hislip_send(VXI11_CLINK * clink, const char *cmd, size_t len)
+{
+	struct _vxi11_hislip_link *h = clink->hislip;
+	size_t sent = 0;
+	size_t chunk;
+	int type;
+	int rc;
+
+	do {
+		chunk = len - sent;
+		type = HISLIP_DATA_END;
+		if (chunk > h->max_payload) {
+			chunk = h->max_payload;
+			type = HISLIP_DATA;
+		}
+		rc = _send_message(h->sync_fd, type, h->rmt_delivered, h->message_id,
+				   cmd + sent, chunk);
+		if (rc < 0) {
+			_vxi11_error("vxi11_send", 0, -rc, sent);
+			_vxi11_log(VXI11_LOG_ERROR, "vxi11_send: HiSLIP socket error: %s", strerror(errno));
+			return rc;
+		}
+		h->rmt_delivered = 0;
+		sent += chunk;
+	} while (sent < len);
+	h->message_id += 2;
+	return 0;
+}
+
+ssize_t _vxi11_hislip_receive(VXI11_CLINK * clink, char *buffer, size_t len,
+			      unsigned long timeout)
+{
+	struct _vxi11_hislip_link *h = clink->hislip;
+	unsigned long deadline = _vxi11_now_ms() + timeout;
+	char text[256];
+	size_t curr_pos = 0;
+	uint64_t n;
+	ssize_t rc;
+
+	while (1) {
+		if (h->payload_left == 0) {
+			if (h->discarding) {
+				h->discarding = 0;
+				h->payload_type = 0;
+			}
+			if (h->payload_type == HISLIP_DATA_END) {
+				h->payload_type = 0;
+				h->rmt_delivered = 1;
+				return curr_pos;
+			}
+			rc = _recv(h->sync_fd, h->header + h->header_pos,
+				   HISLIP_HEADER_SIZE - h->header_pos, deadline);
+			if (rc < 0) {
+				_vxi11_error("vxi11_receive", 0, -rc, curr_pos);
+				return rc;
+			}
+			h->header_pos += rc;
+			if (h->header_pos < HISLIP_HEADER_SIZE) {
+				continue;
+			}
+			h->header_pos = 0;
+			if (h->header[0] != 'H' || h->header[1] != 'S') {
+				_vxi11_error("vxi11_receive", 0, 17, curr_pos);
+				return -17;
+			}
+			h->payload_type = h->header[2];
+			h->payload_left = _get64(h->header + 8);
+			if (h->payload_type == HISLIP_ERROR || h->payload_type == HISLIP_FATAL_ERROR) {
+				n = h->payload_left < sizeof(text) ? h->payload_left : sizeof(text);
+				rc = _recv_all(h->sync_fd, text, n, deadline);
+				if (rc == 0) {
+					rc = _skip(h->sync_fd, h->payload_left - n, deadline);
+				}
+				h->payload_left = 0;
+				h->payload_type = 0;
+				_vxi11_error("vxi11_receive", 0, 17, curr_pos);
+				_log_error("vxi11_receive", h->header, text, n);
+				return -17;
+			}
+			if (h->payload_type != HISLIP_DATA && h->payload_type != HISLIP_DATA_END) {
+				/* e.g. Interrupted, nothing for us */
+				h->discarding = 1;
+			} else if (!h->overlapped && _get32(h->header + 4) != h->message_id - 2) {
+				/* A response to an earlier query */
+				_vxi11_log(VXI11_LOG_WARNING, "vxi11_receive: discarding a HiSLIP response to an earlier message");
+				h->discarding = 1;
+			}
+			continue;
+		}
+
+		if (h->discarding) {
+			n = h->payload_left < sizeof(text) ? h->payload_left : sizeof(text);
+			rc = _recv(h->sync_fd, text, n, deadline);
+			if (rc < 0) {
+				_vxi11_error("vxi11_receive", 0, -rc, curr_pos);
+				return rc;
+			}
+			h->payload_left -= rc;
+			continue;
+		}
+		if (curr_pos == len) {
+			return -100;
+		}
+		n = h->payload_left;
+		if (n > len - curr_pos) {
+			n = len - curr_pos;
+		}
+		rc = _recv(h->sync_fd, buffer + curr_pos, n, deadline);
+		if (rc < 0) {
+			_vxi11_error("vxi11_receive", 0, -rc, curr_pos);
+			return rc;
+		}
+		curr_pos += rc;
+		h->payload_left -= rc;
+	}
+}
+
+int _vxi11_hislip_clear(VXI11_CLINK * clink)
+{
+	struct _vxi11_hislip_link *h = clink->hislip;
+	unsigned long deadline = _vxi11_now_ms() + VXI11_DEFAULT_TIMEOUT;
+	unsigned char header[HISLIP_HEADER_SIZE];
+	int features;
+	int rc;
+
+	rc = _send_message(h->async_fd, HISLIP_ASYNC_DEVICE_CLEAR, 0, 0, NULL, 0);
+	if (rc == 0) {
+		rc = _recv_message(h->async_fd, header, NULL, 0, deadline);
+	}
+	if (rc == 0 && header[2] != HISLIP_ASYNC_DEVICE_CLEAR_ACKNOWLEDGE) {
+		rc = -17;
+	}
+	if (rc < 0) {
+		goto fail;
+	}
+	features = header[3];
+
+	/* Throw away the rest of any response, then everything up to the
+	 * acknowledgement of the clear */
+	rc = _skip(h->sync_fd, h->payload_left, deadline);
+	if (rc < 0) {
+		goto fail;
+	}
+	if (h->header_pos > 0) {
+		rc = _recv_all(h->sync_fd, h->header + h->header_pos,
+			       HISLIP_HEADER_SIZE - h->header_pos, deadline);
+		if (rc < 0) {
+			goto fail;
+		}
+		rc = _skip(h->sync_fd, _get64(h->header + 8), deadline);
+		if (rc < 0) {
+			goto fail;
+		}
+	}
+	h->header_pos = 0;
+	h->payload_left = 0;
+	h->payload_type = 0;
+	h->discarding = 0;
+
+	rc = _send_message(h->sync_fd, HISLIP_DEVICE_CLEAR_COMPLETE, features, 0, NULL, 0);
+	while (rc == 0) {
+		rc = _recv_message(h->sync_fd, header, NULL, 0, deadline);
+		if (rc == 0 && header[2] == HISLIP_DEVICE_CLEAR_ACKNOWLEDGE) {
+			break;
+		}
+	}
+	if (rc < 0) {
+		goto fail;
+	}
+	h->overlapped = header[3] & 0x01;
+	h->message_id = HISLIP_INITIAL_MESSAGE_ID;
+	h->rmt_delivered = 0;
+	return 0;
+
+fail:
+	_vxi11_error("vxi11_device_clear", 0, -rc, 0);
+	return rc == -15 ? -VXI11_NULL_WRITE_RESP : rc;
+}
+
+int _vxi11_hislip_lock(VXI11_CLINK * clink, unsigned long timeout)
+{
+	struct _vxi11_hislip_link *h = clink->hislip;
+	unsigned long deadline = _vxi11_now_ms() + timeout + VXI11_DEFAULT_TIMEOUT;
+	unsigned char header[HISLIP_HEADER_SIZE];
+	int rc;
+
+	/* No lock string, so an exclusive lock */
+	rc = _send_message(h->async_fd, HISLIP_ASYNC_LOCK, 1, (uint32_t)timeout, NULL, 0);
+	if (rc == 0) {
+		rc = _recv_message(h->async_fd, header, NULL, 0, deadline);
+	}
+	if (rc == 0 && header[2] != HISLIP_ASYNC_LOCK_RESPONSE) {
+		rc = -17;
+	}
+	if (rc < 0) {
+		_vxi11_error("vxi11_lock", 0, -rc, 0);
+		return rc == -15 ? -VXI11_NULL_WRITE_RESP : rc;
+	}
+	if (header[3] != 1) {
+		/* 0 is a timeout waiting for the lock, 3 an error */
+		rc = header[3] == 0 ? -11 : -17;
+		_vxi11_error("vxi11_lock", 0, -rc, 0);
+		return rc;
+	}
+	return 0;
+}
+
+int _vxi11_hislip_unlock(VXI11_CLINK * clink)
+{
+	struct _vxi11_hislip_link *h = clink->hislip;
+	unsigned long deadline = _vxi11_now_ms() + VXI11_DEFAULT_TIMEOUT;
+	unsigned char header[HISLIP_HEADER_SIZE];
+	int rc;
+
+	/* The parameter is the last message sent, which the lock covers */
+	rc = _send_message(h->async_fd, HISLIP_ASYNC_LOCK, 0, h->message_id - 2, NULL, 0);
+	if (rc == 0) {
+		rc = _recv_message(h->async_fd, header, NULL, 0, deadline);
+	}
+	if (rc == 0 && header[2] != HISLIP_ASYNC_LOCK_RESPONSE) {
+		rc = -17;
+	}
+	if (rc < 0) {
+		_vxi11_error("vxi11_unlock", 0, -rc, 0);
+		return rc == -15 ? -VXI11_NULL_WRITE_RESP : rc;
+	}
+	if (header[3] != 1 && header[3] != 2) {
+		_vxi11_error("vxi11_unlock", 0, 12, 0);
+		return -12;
+	}
+	return 0;
+}
+
+#endif
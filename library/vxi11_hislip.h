@@ -0,0 +1,70 @@
+/* vxi11_hislip.h
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * HiSLIP (IVI-6.1) message definitions, shared by the library's HiSLIP
+ * transport and the vxi11_hislip_loopback test server.
+ *
+ * Every message starts with a 16 byte header: the characters "HS", the
+ * message type, a control code, a 32 bit message parameter and a 64 bit
+ * payload length, both in network byte order. The payload follows.
+ *
+ * Not installed, this is not part of the public interface.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#ifndef	_VXI11_HISLIP_H_
+#define	_VXI11_HISLIP_H_
+
+#define	HISLIP_PORT		4880
+#define	HISLIP_HEADER_SIZE	16
+#define	HISLIP_VERSION		0x0100	/* 1.0 */
+#define	HISLIP_VENDOR_ID	(('V' << 8) | 'X')
+
+/* The first message ID a client uses, and after each device clear. IDs go
+ * up by two for each message. */
+#define	HISLIP_INITIAL_MESSAGE_ID	0xffffff00U
+
+/* Message types */
+#define	HISLIP_INITIALIZE				0
+#define	HISLIP_INITIALIZE_RESPONSE			1
+#define	HISLIP_FATAL_ERROR				2
+#define	HISLIP_ERROR					3
+#define	HISLIP_ASYNC_LOCK				4
+#define	HISLIP_ASYNC_LOCK_RESPONSE			5
+#define	HISLIP_DATA					6
+#define	HISLIP_DATA_END					7
+#define	HISLIP_DEVICE_CLEAR_COMPLETE			8
+#define	HISLIP_DEVICE_CLEAR_ACKNOWLEDGE			9
+#define	HISLIP_ASYNC_REMOTE_LOCAL_CONTROL		10
+#define	HISLIP_ASYNC_REMOTE_LOCAL_RESPONSE		11
+#define	HISLIP_TRIGGER					12
+#define	HISLIP_INTERRUPTED				13
+#define	HISLIP_ASYNC_INTERRUPTED			14
+#define	HISLIP_ASYNC_MAXIMUM_MESSAGE_SIZE		15
+#define	HISLIP_ASYNC_MAXIMUM_MESSAGE_SIZE_RESPONSE	16
+#define	HISLIP_ASYNC_INITIALIZE				17
+#define	HISLIP_ASYNC_INITIALIZE_RESPONSE		18
+#define	HISLIP_ASYNC_DEVICE_CLEAR			19
+#define	HISLIP_ASYNC_SERVICE_REQUEST			20
+#define	HISLIP_ASYNC_STATUS_QUERY			21
+#define	HISLIP_ASYNC_STATUS_RESPONSE			22
+#define	HISLIP_ASYNC_DEVICE_CLEAR_ACKNOWLEDGE		23
+#define	HISLIP_ASYNC_LOCK_INFO				24
+#define	HISLIP_ASYNC_LOCK_INFO_RESPONSE			25
+
+#endif
@@ -0,0 +1,194 @@
+/* vxi11_internal.h
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Definitions shared between the source files of the user library. Nothing in
+ * here is part of the public interface; use vxi11_user.h from your programs.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#ifndef	_VXI11_INTERNAL_H_
+#define	_VXI11_INTERNAL_H_
+
+#include "vxi11_user.h"
+
+#ifdef WIN32
+#  include <visa.h>
+#else
+#  include <rpc/rpc.h>
+#  include "vxi11.h"
+#endif
+
+#define	VXI11_CLIENT		CLIENT
+#define	VXI11_LINK		Create_LinkResp
+
+/* Connection shared by the links to one address, see vxi11_user.c */
+struct _vxi11_client_t;
+
+/* State for a non-blocking operation, see vxi11_async.c */
+struct _vxi11_async;
+
+/* Query response cache, see vxi11_cache.c */
+struct _vxi11_cache;
+
+/* Free buffers for vxi11_receive_alloc(), see vxi11_pool.c */
+struct _vxi11_pool;
+
+/* Connection to vxi11_broker, see vxi11_broker_client.c */
+struct _vxi11_broker_link;
+
+/* Raw SCPI socket connection, see vxi11_socket.c */
+struct _vxi11_socket_link;
+
+/* HiSLIP session, see vxi11_hislip.c */
+struct _vxi11_hislip_link;
+
+/* Large transfer state, see vxi11_transfer.c */
+struct _vxi11_transfer;
+
+struct _VXI11_CLINK {
+#ifdef WIN32
+	ViSession rm;
+	ViSession session;
+#else
+	VXI11_CLIENT *client;
+	VXI11_LINK *link;
+	struct _vxi11_client_t *connection;	/* shared by the links using client */
+	struct _vxi11_async *async;
+	struct _vxi11_broker_link *broker;	/* if not NULL, client and link are unused */
+	struct _vxi11_socket_link *socket;	/* likewise */
+	struct _vxi11_hislip_link *hislip;	/* likewise */
+	struct _vxi11_transfer *transfer;	/* if not NULL, large transfers are on */
+#endif
+	struct _vxi11_cache *cache;
+	struct _vxi11_pool *pool;
+
+	/* Locking, see vxi11_lock() */
+	unsigned long lock_timeout;	/* wait for other links' locks, 0 to fail at once */
+	unsigned long locked_since;	/* when our lock was taken, 0 if not held */
+	unsigned long lock_count;
+	unsigned long lock_failed;
+	unsigned long lock_wait_ms;
+	unsigned long lock_hold_ms;
+};
+
+#define RCV_END_BIT	0x04	// An end indicator has been read
+#define RCV_CHR_BIT	0x02	// A termchr is set in flags and a character which matches termChar is transferred
+#define RCV_REQCNT_BIT	0x01	// requestSize bytes have been transferred.  This includes a request size of zero.
+
+#define FLAG_WAITLOCK	0x01	// Wait up to lock_timeout for another link's lock to be released
+#define FLAG_END	0x08	// The last chunk of a write
+
+/* Flags to add to a request so that it honours the link's lock timeout. */
+#define LOCK_FLAGS(clink)	((clink)->lock_timeout ? FLAG_WAITLOCK : 0)
+
+/* Monotonic time in milliseconds, for deadlines, and in microseconds, for
+ * measuring. */
+unsigned long _vxi11_now_ms(void);
+unsigned long long _vxi11_now_us(void);
+
+/* Error reporting, see vxi11_error.c. _vxi11_error() records a failure for
+ * vxi11_last_error(); _vxi11_log() passes a message to the log callback.
+ * Check _vxi11_log_enabled() before working out anything costly to log. */
+void _vxi11_error(const char *function, int rpc_status, int error, size_t bytes);
+int _vxi11_log_enabled(int level);
+void _vxi11_log(int level, const char *format, ...);
+
+/* Release any non-blocking operation state held by clink. */
+void _vxi11_async_free(VXI11_CLINK * clink);
+
+/* Query cache hooks. _vxi11_cache_lookup() copies a cached response for cmd
+ * into buf and returns its length, or returns -1 if there is none.
+ * _vxi11_cache_store() keeps a response if cmd is cacheable, and
+ * _vxi11_cache_sent() applies the invalidation rules to a sent command. */
+ssize_t _vxi11_cache_lookup(VXI11_CLINK * clink, const char *cmd, char *buf, size_t len);
+void _vxi11_cache_store(VXI11_CLINK * clink, const char *cmd, const char *buf, size_t len);
+void _vxi11_cache_sent(VXI11_CLINK * clink, const char *cmd, size_t len);
+void _vxi11_cache_free(VXI11_CLINK * clink);
+
+/* vxi11_receive_alloc(), calling scan with the reply so far each time more
+ * of it arrives. scan returns how big a buffer it would like if the reply
+ * turns out to be longer, or 0 if it has no idea. */
+typedef size_t (*_vxi11_scan_fn)(const char *buf, size_t len, void *state);
+ssize_t _vxi11_receive_scan(VXI11_CLINK * clink, char **buffer, unsigned long timeout,
+			    _vxi11_scan_fn scan, void *state);
+
+/* Free the buffers pooled by vxi11_release(). */
+void _vxi11_pool_free(VXI11_CLINK * clink);
+
+#ifndef WIN32
+/* vxi11_receive_timeout(), except that -100 is not an error: buffer has been
+ * filled and the rest of the response can be read with another call. */
+ssize_t _vxi11_receive(VXI11_CLINK * clink, char *buffer, size_t len, unsigned long timeout);
+
+/* A call bypassing clnt_call() that is abandoned part way through sending or
+ * receiving a record leaves the connection out of step, for every link using
+ * it. _vxi11_connection_lost() marks it so, and from then on
+ * _vxi11_connection_check() records an error and returns nonzero, and calls
+ * on it should return -17. */
+void _vxi11_connection_lost(VXI11_CLINK * clink);
+int _vxi11_connection_check(VXI11_CLINK * clink, const char *function);
+
+/* Large transfers, see vxi11_transfer.c. Once vxi11_set_large_transfers() is
+ * on, _vxi11_receive() hands over to _vxi11_transfer_receive().
+ * _vxi11_transfer_sent() forgets any reply left part read. */
+ssize_t _vxi11_transfer_receive(VXI11_CLINK * clink, char *buffer, size_t len, unsigned long timeout);
+void _vxi11_transfer_sent(VXI11_CLINK * clink);
+void _vxi11_transfer_free(VXI11_CLINK * clink);
+
+/* Session capture, see vxi11_capture.c. _vxi11_capture_begin() returns the
+ * start time to give _vxi11_capture() once the call is done, or 0 if nothing
+ * is being captured. res is NULL if the call got no reply. */
+void _vxi11_capture_env(void);
+unsigned long long _vxi11_capture_begin(void);
+void _vxi11_capture(u_long proc, xdrproc_t xargs, void *args, xdrproc_t xres, void *res, unsigned long long start);
+
+/* Broker transport, equivalents of the core functions for links that go
+ * through vxi11_broker. */
+int _vxi11_broker_open(VXI11_CLINK * clink, const char *path, const char *address, const char *device);
+int _vxi11_broker_close(VXI11_CLINK * clink);
+int _vxi11_broker_send(VXI11_CLINK * clink, const char *cmd, size_t len);
+ssize_t _vxi11_broker_receive(VXI11_CLINK * clink, char *buffer, size_t len, unsigned long timeout);
+int _vxi11_broker_clear(VXI11_CLINK * clink);
+int _vxi11_broker_lock(VXI11_CLINK * clink, unsigned long timeout);
+int _vxi11_broker_unlock(VXI11_CLINK * clink);
+
+/* Raw socket transport, for links opened with a "TCPIP::host::port::SOCKET"
+ * address. _vxi11_socket_address() returns 1 and fills in host and port if
+ * address is of that form. */
+int _vxi11_socket_address(const char *address, char *host, size_t hostlen, unsigned short *port);
+int _vxi11_socket_open(VXI11_CLINK * clink, const char *host, unsigned short port);
+void _vxi11_socket_close(VXI11_CLINK * clink);
+int _vxi11_socket_send(VXI11_CLINK * clink, const char *cmd, size_t len);
+ssize_t _vxi11_socket_receive(VXI11_CLINK * clink, char *buffer, size_t len, unsigned long timeout);
+int _vxi11_socket_clear(VXI11_CLINK * clink);
+
+/* HiSLIP transport, for links opened with a "TCPIP::host::hislip0::INSTR"
+ * address or a "hislipN" device. _vxi11_hislip_address() returns 1 and fills
+ * in host, port and the sub-address if address and device ask for HiSLIP. */
+int _vxi11_hislip_address(const char *address, const char *device, char *host, size_t hostlen,
+			  unsigned short *port, char *sub, size_t sublen);
+int _vxi11_hislip_open(VXI11_CLINK * clink, const char *host, unsigned short port, const char *sub);
+void _vxi11_hislip_close(VXI11_CLINK * clink);
+int _vxi11_hislip_send(VXI11_CLINK * clink, const char *cmd, size_t len);
+ssize_t _vxi11_hislip_receive(VXI11_CLINK * clink, char *buffer, size_t len, unsigned long timeout);
+int _vxi11_hislip_clear(VXI11_CLINK * clink);
+int _vxi11_hislip_lock(VXI11_CLINK * clink, unsigned long timeout);
+int _vxi11_hislip_unlock(VXI11_CLINK * clink);
+#endif
+
+#endif
@@ -0,0 +1,237 @@
+/* vxi11_pool.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Receiving replies of any length. Buffers grow to fit the reply and are
+ * handed back to a per-link pool when the caller is done with them, so once
+ * a link has seen its largest replies, receiving allocates nothing.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vxi11_internal.h"
+
+/* Free buffers kept per link */
+#define	POOL_MAX	8
+
+/* Smallest buffer allocated */
+#define	POOL_MIN_SIZE	4096
+
+/* Room after a block for a terminator of up to two characters and the null */
+#define	BLOCK_SLACK	3
+
+/* Each buffer is preceded by its size, padded so the data stays aligned. */
+union _vxi11_buffer_header {
+	size_t size;		/* bytes the buffer holds, including the null */
+	double align_double;
+	void *align_pointer;
+};
+
+struct _vxi11_pool {
+	char *free[POOL_MAX];
+	size_t count;
+	size_t high_water;	/* size of the largest reply yet, for new buffers */
+};
+
+static size_t _size(char *buf)
+{
+	return ((union _vxi11_buffer_header *)buf - 1)->size;
+}
+
+static char *_resize(char *buf, size_t size)
+{
+	union _vxi11_buffer_header *h = buf ? (union _vxi11_buffer_header *)buf - 1 : NULL;
+
+	h = (union _vxi11_buffer_header *)realloc(h, sizeof(*h) + size);
+	if (!h) {
+		return NULL;
+	}
+	h->size = size;
+	return (char *)(h + 1);
+}
+
+static void _free(char *buf)
+{
+	free((union _vxi11_buffer_header *)buf - 1);
+}
+
+/* The largest free buffer, or a new one big enough for the largest reply yet
+ * if there are none. */
+static char *_take(struct _vxi11_pool *pool)
+{
+	size_t best = 0;
+	size_t i;
+	char *buf;
+
+	if (pool->count == 0) {
+		return _resize(NULL, pool->high_water > POOL_MIN_SIZE ? pool->high_water : POOL_MIN_SIZE);
+	}
+	for (i = 1; i < pool->count; i++) {
+		if (_size(pool->free[i]) > _size(pool->free[best])) {
+			best = i;
+		}
+	}
+	buf = pool->free[best];
+	pool->free[best] = pool->free[--pool->count];
+	return buf;
+}
+
+/* If buf starts with a definite length block header, the size of buffer the
+ * whole block needs, otherwise 0. */
+static size_t _block_size(const char *buf, size_t len, void *state)
+{
+	size_t data_len = 0;
+	int ndigits;
+	int i;
+
+	(void)state;
+	if (len < 2 || buf[0] != '#' || buf[1] < '1' || buf[1] > '9') {
+		return 0;
+	}
+	ndigits = buf[1] - '0';
+	if (len < (size_t)ndigits + 2) {
+		return 0;
+	}
+	for (i = 2; i < ndigits + 2; i++) {
+		if (buf[i] < '0' || buf[i] > '9') {
+			return 0;
+		}
+		data_len = data_len * 10 + (buf[i] - '0');
+	}
+	return ndigits + 2 + data_len + BLOCK_SLACK;
+}
+
+/* Receive into buffer, returning -100 if it fills before the end of the
+ * reply. */
+static ssize_t _receive(VXI11_CLINK * clink, char *buffer, size_t len, unsigned long timeout)
+{
+#ifdef WIN32
+	ViUInt32 count = 0;
+	ViStatus status;
+
+	status = viRead(clink->session, (ViBuf) buffer, (ViUInt32) len, &count);
+	if (status == VI_SUCCESS_MAX_CNT) {
+		return -100;
+	}
+	return count;
+#else
+	return _vxi11_receive(clink, buffer, len, timeout);
+#endif
+}
+
+ssize_t _vxi11_receive_scan(VXI11_CLINK * clink, char **buffer, unsigned long timeout,
+			   _vxi11_scan_fn scan, void *state)
+{
+	struct _vxi11_pool *pool;
+	size_t size;
+	size_t want;
+	size_t len = 0;
+	ssize_t ret;
+	char *buf;
+	char *bigger;
+
+	if (!clink->pool) {
+		clink->pool = (struct _vxi11_pool *)calloc(1, sizeof(struct _vxi11_pool));
+		if (!clink->pool) {
+			return -9;
+		}
+	}
+	pool = clink->pool;
+	buf = _take(pool);
+	if (!buf) {
+		return -9;
+	}
+	size = _size(buf);
+
+	while (1) {
+		ret = _receive(clink, buf + len, size - len - 1, timeout);
+		if (ret < 0 && ret != -100) {
+			vxi11_release(clink, buf);
+			return ret;
+		}
+		len = ret == -100 ? size - 1 : len + ret;
+		want = scan(buf, len, state);
+		if (ret != -100) {
+			break;
+		}
+		/* As big as the scan asks for, else double */
+		if (want <= size) {
+			want = size * 2;
+		}
+		bigger = _resize(buf, want);
+		if (!bigger) {
+			_free(buf);
+			return -9;
+		}
+		buf = bigger;
+		size = want;
+	}
+	buf[len] = '\0';
+	if (len + 1 > pool->high_water) {
+		pool->high_water = len + 1;
+	}
+	*buffer = buf;
+	return (ssize_t)len;
+}
+
+ssize_t vxi11_receive_alloc(VXI11_CLINK * clink, char **buffer, unsigned long timeout)
+{
+	return _vxi11_receive_scan(clink, buffer, timeout, _block_size, NULL);
+}
+
+void vxi11_release(VXI11_CLINK * clink, char *buffer)
+{
+	struct _vxi11_pool *pool = clink->pool;
+	size_t smallest = 0;
+	size_t i;
+
+	if (!buffer) {
+		return;
+	}
+	if (pool->count < POOL_MAX) {
+		pool->free[pool->count++] = buffer;
+		return;
+	}
+	/* Full, so keep the larger buffers */
+	for (i = 1; i < pool->count; i++) {
+		if (_size(pool->free[i]) < _size(pool->free[smallest])) {
+			smallest = i;
+		}
+	}
+	if (_size(buffer) > _size(pool->free[smallest])) {
+		_free(pool->free[smallest]);
+		pool->free[smallest] = buffer;
+	} else {
+		_free(buffer);
+	}
+}
+
+void _vxi11_pool_free(VXI11_CLINK * clink)
+{
+	struct _vxi11_pool *pool = clink->pool;
+
+	if (!pool) {
+		return;
+	}
+	while (pool->count > 0) {
+		_free(pool->free[--pool->count]);
+	}
+	free(pool);
+	clink->pool = NULL;
+}
@@ -0,0 +1,475 @@
+/* vxi11_reduce.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Reduction of waveform data blocks as they arrive. Rather than receiving a
+ * whole block and then scanning it, vxi11_receive_data_block_reduced() reads
+ * it a piece at a time into a fixed size buffer and folds each piece into a
+ * min/max envelope, summary statistics and a histogram, so memory use does
+ * not depend on the size of the block.
+ *
+ * The inner loops work on one sample format at a time and are written so
+ * that the compiler can vectorise them.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vxi11_internal.h"
+
+#ifdef WIN32
+
+ssize_t vxi11_receive_data_block_reduced(VXI11_CLINK * clink, VXI11_REDUCTION * r,
+					 unsigned long timeout)
+{
+	return -8;
+}
+
+#else
+
+/* How much of the block to read at a time */
+#define REDUCE_CHUNK	(1024 * 1024)
+
+/* Summary of a run of samples */
+struct _vxi11_run {
+	double min;
+	double max;
+	double sum;
+	double sumsq;
+};
+
+/* Loading one sample of each format */
+#define LOAD_INT8(p, i)		((int8_t)(p)[i])
+#define LOAD_UINT8(p, i)	((p)[i])
+#define LOAD_INT16LE(p, i)	((int16_t)((p)[2 * (i)] | ((p)[2 * (i) + 1] << 8)))
+#define LOAD_INT16BE(p, i)	((int16_t)(((p)[2 * (i)] << 8) | (p)[2 * (i) + 1]))
+#define LOAD_UINT16LE(p, i)	((uint16_t)((p)[2 * (i)] | ((p)[2 * (i) + 1] << 8)))
+#define LOAD_UINT16BE(p, i)	((uint16_t)(((p)[2 * (i)] << 8) | (p)[2 * (i) + 1]))
+
+/* Integer formats: min and max in the sample type, sums in 64 bits, which
+ * can't overflow for REDUCE_CHUNK bytes of samples. */
+#define INT_RUN(name, type, load)					\
+static void name(const unsigned char *p, size_t n, struct _vxi11_run *run)	\
+{									\
+	type lo = load(p, 0);						\
+	type hi = lo;							\
+	int64_t sum = 0;						\
+	uint64_t sumsq = 0;						\
+	size_t i;							\
+									\
+	for (i = 0; i < n; i++) {					\
+		type v = load(p, i);					\
+		lo = v < lo ? v : lo;					\
+		hi = v > hi ? v : hi;					\
+		sum += v;						\
+		sumsq += (uint64_t)((int64_t)v * v);			\
+	}								\
+	run->min = lo;							\
+	run->max = hi;							\
+	run->sum = (double)sum;						\
+	run->sumsq = (double)sumsq;					\
+}
+
+/* Histogram of a run, values outside the range going in the end bins. */
+#define HIST_RUN(name, load)					\
+static void name(const unsigned char *p, size_t n, const VXI11_REDUCTION *r,	\
+		 double scale)						\
+{									\
+	double top = (double)(r->bins - 1);				\
+	double bin;							\
+	size_t i;							\
+									\
+	for (i = 0; i < n; i++) {					\
+		bin = ((double)load(p, i) - r->hist_low) * scale;	\
+		bin = bin < 0.0 ? 0.0 : bin;				\
+		bin = bin > top ? top : bin;				\
+		r->histogram[(size_t)bin]++;				\
+	}								\
+}
+
+INT_RUN(_run_int8, int8_t, LOAD_INT8)
+INT_RUN(_run_uint8, uint8_t, LOAD_UINT8)
+INT_RUN(_run_int16le, int16_t, LOAD_INT16LE)
+INT_RUN(_run_int16be, int16_t, LOAD_INT16BE)
+INT_RUN(_run_uint16le, uint16_t, LOAD_UINT16LE)
+INT_RUN(_run_uint16be, uint16_t, LOAD_UINT16BE)
+
+HIST_RUN(_hist_int8, LOAD_INT8)
+HIST_RUN(_hist_uint8, LOAD_UINT8)
+HIST_RUN(_hist_int16le, LOAD_INT16LE)
+HIST_RUN(_hist_int16be, LOAD_INT16BE)
+HIST_RUN(_hist_uint16le, LOAD_UINT16LE)
+HIST_RUN(_hist_uint16be, LOAD_UINT16BE)
+
+static float _load_float32(const unsigned char *p, size_t i, int big_endian)
+{
+	uint32_t u;
+	float f;
+
+	p += 4 * i;
+	if (big_endian) {
+		u = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+	} else {
+		u = ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+	}
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+static void _run_float32(const unsigned char *p, size_t n, int big_endian,
+			 struct _vxi11_run *run)
+{
+	float lo = _load_float32(p, 0, big_endian);
+	float hi = lo;
+	double sum = 0.0;
+	double sumsq = 0.0;
+	float v;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		v = _load_float32(p, i, big_endian);
+		lo = v < lo ? v : lo;
+		hi = v > hi ? v : hi;
+		sum += v;
+		sumsq += (double)v * v;
+	}
+	run->min = lo;
+	run->max = hi;
+	run->sum = sum;
+	run->sumsq = sumsq;
+}
+
+#define LOAD_FLOAT32LE(p, i)	_load_float32(p, i, 0)
+#define LOAD_FLOAT32BE(p, i)	_load_float32(p, i, 1)
+
+HIST_RUN(_hist_float32le, LOAD_FLOAT32LE)
+HIST_RUN(_hist_float32be, LOAD_FLOAT32BE)
+
+static size_t _sample_size(int format)
+{
+	switch (format & ~VXI11_SAMPLE_BIG_ENDIAN) {
+	case VXI11_SAMPLE_INT8:
+	case VXI11_SAMPLE_UINT8:
+		return 1;
+	case VXI11_SAMPLE_INT16:
+	case VXI11_SAMPLE_UINT16:
+		return 2;
+	case VXI11_SAMPLE_FLOAT32:
+		return 4;
+	}
+	return 0;
+}
+
+static void _run(int format, const unsigned char *p, size_t n, struct _vxi11_run *run)
+{
+	int big_endian = format & VXI11_SAMPLE_BIG_ENDIAN;
+
+	switch (format & ~VXI11_SAMPLE_BIG_ENDIAN) {
+	case VXI11_SAMPLE_INT8:
+		_run_int8(p, n, run);
+		break;
+	case VXI11_SAMPLE_UINT8:
+		_run_uint8(p, n, run);
+		break;
+	case VXI11_SAMPLE_INT16:
+		if (big_endian) {
+			_run_int16be(p, n, run);
+		} else {
+			_run_int16le(p, n, run);
+		}
+		break;
+	case VXI11_SAMPLE_UINT16:
+		if (big_endian) {
+			_run_uint16be(p, n, run);
+		} else {
+			_run_uint16le(p, n, run);
+		}
+		break;
+	case VXI11_SAMPLE_FLOAT32:
+		_run_float32(p, n, big_endian, run);
+		break;
+	default:
+		/* The format was checked before we got here */
+		memset(run, 0, sizeof(*run));
+		break;
+	}
+}
+
+static void _hist(const unsigned char *p, size_t n, const VXI11_REDUCTION *r,
+		  double scale)
+{
+	int big_endian = r->format & VXI11_SAMPLE_BIG_ENDIAN;
+
+	switch (r->format & ~VXI11_SAMPLE_BIG_ENDIAN) {
+	case VXI11_SAMPLE_INT8:
+		_hist_int8(p, n, r, scale);
+		break;
+	case VXI11_SAMPLE_UINT8:
+		_hist_uint8(p, n, r, scale);
+		break;
+	case VXI11_SAMPLE_INT16:
+		if (big_endian) {
+			_hist_int16be(p, n, r, scale);
+		} else {
+			_hist_int16le(p, n, r, scale);
+		}
+		break;
+	case VXI11_SAMPLE_UINT16:
+		if (big_endian) {
+			_hist_uint16be(p, n, r, scale);
+		} else {
+			_hist_uint16le(p, n, r, scale);
+		}
+		break;
+	case VXI11_SAMPLE_FLOAT32:
+		if (big_endian) {
+			_hist_float32be(p, n, r, scale);
+		} else {
+			_hist_float32le(p, n, r, scale);
+		}
+		break;
+	}
+}
+
+struct _vxi11_reducer {
+	VXI11_REDUCTION *r;
+	size_t size;		/* of a sample */
+	size_t points;		/* envelope points being filled */
+	size_t index;		/* of the next sample */
+	size_t bucket;		/* envelope point being filled */
+	size_t bucket_end;	/* index of the first sample of the next point */
+	int bucket_empty;
+	double bin_scale;
+	double sum;
+	double sumsq;
+	unsigned char carry[4];	/* a sample split between two pieces */
+	size_t carry_len;
+};
+
+/* Fold n whole samples into the reduction. */
+static void _samples(struct _vxi11_reducer *red, const unsigned char *p, size_t n)
+{
+	VXI11_REDUCTION *r = red->r;
+	struct _vxi11_run run;
+	size_t count;
+
+	while (n > 0) {
+		/* Never run past the end of an envelope point */
+		count = n;
+		if (red->points && count > red->bucket_end - red->index) {
+			count = red->bucket_end - red->index;
+		}
+		_run(r->format, p, count, &run);
+
+		if (red->index == 0 || run.min < r->min) {
+			r->min = run.min;
+		}
+		if (red->index == 0 || run.max > r->max) {
+			r->max = run.max;
+		}
+		red->sum += run.sum;
+		red->sumsq += run.sumsq;
+
+		if (red->points) {
+			if (red->bucket_empty || run.min < r->env_min[red->bucket]) {
+				r->env_min[red->bucket] = run.min;
+			}
+			if (red->bucket_empty || run.max > r->env_max[red->bucket]) {
+				r->env_max[red->bucket] = run.max;
+			}
+			red->bucket_empty = 0;
+		}
+
+		if (r->bins) {
+			_hist(p, count, r, red->bin_scale);
+		}
+
+		red->index += count;
+		p += count * red->size;
+		n -= count;
+		if (red->points && red->index == red->bucket_end) {
+			red->bucket++;
+			red->bucket_end = (size_t)((unsigned long long)(red->bucket + 1)
+						   * r->samples / red->points);
+			red->bucket_empty = 1;
+		}
+	}
+}
+
+/* Fold a piece of the block's data into the reduction, keeping any part of a
+ * sample at the end for the next piece. */
+static void _piece(struct _vxi11_reducer *red, const unsigned char *p, size_t len)
+{
+	size_t n;
+
+	if (red->carry_len > 0) {
+		n = red->size - red->carry_len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(red->carry + red->carry_len, p, n);
+		red->carry_len += n;
+		p += n;
+		len -= n;
+		if (red->carry_len < red->size) {
+			return;
+		}
+		_samples(red, red->carry, 1);
+		red->carry_len = 0;
+	}
+	n = len / red->size;
+	_samples(red, p, n);
+	red->carry_len = len - n * red->size;
+	memcpy(red->carry, p + n * red->size, red->carry_len);
+}
+
+/* Throw away the rest of a reply that filled the buffer. Returns 0, or the
+ * error from receiving. */
+static ssize_t _discard_rest(VXI11_CLINK * clink, char *buf, unsigned long timeout)
+{
+	ssize_t ret;
+
+	do {
+		ret = _vxi11_receive(clink, buf, REDUCE_CHUNK, timeout);
+	} while (ret == -100);
+	return ret < 0 ? ret : 0;
+}
+
+ssize_t vxi11_receive_data_block_reduced(VXI11_CLINK * clink, VXI11_REDUCTION * r,
+					 unsigned long timeout)
+{
+	struct _vxi11_reducer red;
+	char *buf;
+	ssize_t ret;
+	size_t bytes_left;
+	size_t pos;
+	size_t n;
+	int ndigits;
+	int more;
+
+	memset(&red, 0, sizeof(red));
+	red.r = r;
+	red.size = _sample_size(r->format);
+	if (red.size == 0 || (r->points && (!r->env_min || !r->env_max))
+	    || (r->bins && (!r->histogram || !(r->hist_high > r->hist_low)))) {
+		return -5;
+	}
+	buf = (char *)malloc(REDUCE_CHUNK);
+	if (!buf) {
+		return -9;
+	}
+
+	ret = _vxi11_receive(clink, buf, REDUCE_CHUNK, timeout);
+	more = (ret == -100);
+	if (more) {
+		ret = REDUCE_CHUNK;
+	}
+	if (ret < 0) {
+		free(buf);
+		return ret;
+	}
+
+	/* The header, as in vxi11_receive_data_block(), but the length must be
+	 * known so "#0" won't do */
+	ndigits = ret >= 2 && buf[0] == '#' ? buf[1] - '0' : 0;
+	bytes_left = 0;
+	pos = 0;
+	if (ndigits >= 1 && ndigits <= 9 && ret >= ndigits + 2) {
+		for (pos = 2; pos < (size_t)ndigits + 2; pos++) {
+			if (buf[pos] < '0' || buf[pos] > '9') {
+				break;
+			}
+			bytes_left = bytes_left * 10 + (buf[pos] - '0');
+		}
+	}
+	if (pos == 0 || pos < (size_t)ndigits + 2) {
+		_vxi11_error("vxi11_receive_data_block_reduced", 0, 0, ret);
+		_vxi11_log(VXI11_LOG_ERROR, "vxi11_receive_data_block_reduced: no definite length block header. "
+			   "First characters received were: '%.*s'", (int)(ret < 20 ? ret : 20), buf);
+		/* Don't leave the link part way through the reply */
+		if (more) {
+			_discard_rest(clink, buf, timeout);
+		}
+		free(buf);
+		return -3;
+	}
+
+	r->samples = bytes_left / red.size;
+	red.points = r->points < r->samples ? r->points : r->samples;
+	r->points_filled = red.points;
+	if (red.points) {
+		red.bucket_end = r->samples / red.points;
+		red.bucket_empty = 1;
+	}
+	if (r->bins) {
+		memset(r->histogram, 0, r->bins * sizeof(unsigned long));
+		red.bin_scale = r->bins / (r->hist_high - r->hist_low);
+	}
+	r->min = r->max = 0.0;
+
+	/* Ignore any part of a sample at the end */
+	bytes_left = r->samples * red.size;
+	while (1) {
+		n = ret - pos;
+		if (n > bytes_left) {
+			n = bytes_left;
+		}
+		_piece(&red, (unsigned char *)buf + pos, n);
+		bytes_left -= n;
+		if (bytes_left == 0) {
+			break;
+		}
+		if (!more) {
+			_vxi11_error("vxi11_receive_data_block_reduced", 0, 0, red.index * red.size);
+			_vxi11_log(VXI11_LOG_ERROR, "vxi11_receive_data_block_reduced: block ended %lu bytes early",
+				   (unsigned long)bytes_left);
+			free(buf);
+			return -3;
+		}
+		ret = _vxi11_receive(clink, buf, REDUCE_CHUNK, timeout);
+		more = (ret == -100);
+		if (more) {
+			ret = REDUCE_CHUNK;
+		}
+		if (ret < 0) {
+			free(buf);
+			return ret;
+		}
+		pos = 0;
+	}
+
+	/* Throw away whatever follows the block, usually a newline */
+	ret = more ? _discard_rest(clink, buf, timeout) : 0;
+	free(buf);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (r->samples > 0) {
+		r->mean = red.sum / r->samples;
+		r->rms = sqrt(red.sumsq / r->samples);
+	} else {
+		r->mean = r->rms = 0.0;
+	}
+	r->pk_pk = r->max - r->min;
+	return (ssize_t)r->samples;
+}
+
+#endif
@@ -0,0 +1,598 @@
+/* vxi11_scheduler.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Periodic sampling. A scheduler holds a set of jobs, each a query sent to a
+ * link at a fixed period, and runs them all from one thread: a timerfd wakes
+ * it at the next deadline, and the queries are sent and their replies
+ * collected with the non-blocking functions in vxi11_async.c, so a slow
+ * instrument delays only its own readings. Jobs are kept in a heap ordered
+ * by deadline, and jobs whose links share a socket take turns on it.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vxi11_internal.h"
+
+#ifndef WIN32
+#  include <poll.h>
+#  include <time.h>
+#  include <unistd.h>
+#  include <sys/timerfd.h>
+#endif
+
+/* Room for each response, as with vxi11_obtain_double_value() there is no
+ * need for much more than one number. */
+#define SAMPLE_BUFFER	256
+
+#define NONE	((size_t)-1)
+
+enum _vxi11_job_state {
+	JOB_IDLE = 0,
+	JOB_QUEUED,		/* due, waiting for another job to finish with the socket */
+	JOB_PENDING,		/* non-blocking operation in progress */
+};
+
+struct _vxi11_job {
+	VXI11_CLINK *clink;
+	char *query;
+	size_t len;
+	unsigned long long period_us;
+	unsigned long timeout;
+	size_t slot;
+	size_t slot_index;	/* how many jobs were in the slot before it */
+	size_t next;		/* in its slot's queue */
+
+	enum _vxi11_job_state state;
+	unsigned long long deadline;	/* of the next reading */
+	unsigned long long scheduled;	/* of the reading in progress */
+	unsigned long long sent;
+	char buf[SAMPLE_BUFFER];
+
+	unsigned long samples;
+	unsigned long overruns;
+	unsigned long errors;
+	unsigned long max_late_us;
+};
+
+/* The jobs using one socket, of which only one can be in progress at a
+ * time. Links that can't do non-blocking operation each have their own. */
+struct _vxi11_slot {
+	int fd;
+	int events;
+	size_t jobs;
+	size_t busy;
+	size_t queue_head;
+	size_t queue_tail;
+};
+
+struct _VXI11_SCHEDULER {
+	struct _vxi11_job *jobs;
+	size_t count;
+	size_t alloc;
+	struct _vxi11_slot *slots;
+	size_t slot_count;
+	size_t *heap;		/* job indices, soonest deadline first */
+
+	vxi11_sample_callback callback;
+	void *user;
+	size_t batch;
+	unsigned long max_delay_us;
+	VXI11_SAMPLE *samples;
+	char *responses;	/* batch * SAMPLE_BUFFER */
+	size_t pending;
+	unsigned long long oldest;	/* when the first pending sample was taken */
+
+	volatile int stopped;
+};
+
+int vxi11_scheduler_create(VXI11_SCHEDULER **sched, vxi11_sample_callback callback,
+			   size_t batch, unsigned long max_delay_ms, void *user)
+{
+	VXI11_SCHEDULER *s;
+
+	*sched = NULL;
+	if (batch == 0) {
+		batch = 1;
+	}
+	s = (VXI11_SCHEDULER *) calloc(1, sizeof(VXI11_SCHEDULER));
+	if (!s) {
+		return 1;
+	}
+	s->samples = (VXI11_SAMPLE *) calloc(batch, sizeof(VXI11_SAMPLE));
+	s->responses = (char *)malloc(batch * SAMPLE_BUFFER);
+	if (!s->samples || !s->responses) {
+		free(s->samples);
+		free(s->responses);
+		free(s);
+		return 1;
+	}
+	s->callback = callback;
+	s->user = user;
+	s->batch = batch;
+	s->max_delay_us = max_delay_ms * 1000;
+	*sched = s;
+	return 0;
+}
+
+void vxi11_scheduler_free(VXI11_SCHEDULER *sched)
+{
+	size_t i;
+
+	if (!sched) {
+		return;
+	}
+	for (i = 0; i < sched->count; i++) {
+		free(sched->jobs[i].query);
+	}
+	free(sched->jobs);
+	free(sched->slots);
+	free(sched->heap);
+	free(sched->samples);
+	free(sched->responses);
+	free(sched);
+}
+
+ssize_t vxi11_scheduler_add(VXI11_SCHEDULER *sched, VXI11_CLINK *clink,
+			    const char *query, unsigned long period_us,
+			    unsigned long timeout)
+{
+	struct _vxi11_job *job;
+	struct _vxi11_slot *slot;
+	size_t alloc;
+	size_t i;
+	int fd;
+
+	if (period_us == 0) {
+		return -5;
+	}
+	if (sched->count == sched->alloc) {
+		alloc = sched->alloc ? sched->alloc * 2 : 16;
+		job = (struct _vxi11_job *)realloc(sched->jobs, alloc * sizeof(struct _vxi11_job));
+		if (!job) {
+			return -9;
+		}
+		sched->jobs = job;
+		slot = (struct _vxi11_slot *)realloc(sched->slots, alloc * sizeof(struct _vxi11_slot));
+		if (!slot) {
+			return -9;
+		}
+		sched->slots = slot;
+		sched->alloc = alloc;
+	}
+
+	job = &sched->jobs[sched->count];
+	memset(job, 0, sizeof(struct _vxi11_job));
+	job->query = strdup(query);
+	if (!job->query) {
+		return -9;
+	}
+	job->clink = clink;
+	job->len = strlen(query);
+	job->period_us = period_us;
+	job->timeout = timeout;
+	job->next = NONE;
+
+	fd = vxi11_async_fd(clink);
+	job->slot = NONE;
+	for (i = 0; fd >= 0 && i < sched->slot_count; i++) {
+		if (sched->slots[i].fd == fd) {
+			job->slot = i;
+			break;
+		}
+	}
+	if (job->slot == NONE) {
+		slot = &sched->slots[sched->slot_count];
+		slot->fd = fd;
+		slot->events = 0;
+		slot->jobs = 0;
+		slot->busy = NONE;
+		slot->queue_head = slot->queue_tail = NONE;
+		job->slot = sched->slot_count++;
+	}
+	job->slot_index = sched->slots[job->slot].jobs++;
+	return (ssize_t)sched->count++;
+}
+
+size_t vxi11_scheduler_size(VXI11_SCHEDULER *sched)
+{
+	return sched->count;
+}
+
+int vxi11_scheduler_stats(VXI11_SCHEDULER *sched, size_t job, unsigned long *samples,
+			  unsigned long *overruns, unsigned long *errors,
+			  unsigned long *max_late_us)
+{
+	struct _vxi11_job *j;
+
+	if (job >= sched->count) {
+		return -5;
+	}
+	j = &sched->jobs[job];
+	if (samples) {
+		*samples = j->samples;
+	}
+	if (overruns) {
+		*overruns = j->overruns;
+	}
+	if (errors) {
+		*errors = j->errors;
+	}
+	if (max_late_us) {
+		*max_late_us = j->max_late_us;
+	}
+	return 0;
+}
+
+void vxi11_scheduler_stop(VXI11_SCHEDULER *sched)
+{
+	sched->stopped = 1;
+}
+
+#ifdef WIN32
+
+int vxi11_scheduler_run(VXI11_SCHEDULER *sched, unsigned long duration_ms)
+{
+	return -8;
+}
+
+#else
+
+static void _flush(VXI11_SCHEDULER *s)
+{
+	size_t i;
+
+	if (s->pending == 0) {
+		return;
+	}
+	for (i = 0; i < s->pending; i++) {
+		s->samples[i].response = s->responses + i * SAMPLE_BUFFER;
+	}
+	if (s->callback) {
+		s->callback(s->samples, s->pending, s->user);
+	}
+	s->pending = 0;
+}
+
+/* Record the result of a job's reading. Only replies from the instrument go
+ * into the cache, storing one taken from it would keep it there for good. */
+static void _complete(VXI11_SCHEDULER *s, size_t index, ssize_t result, int from_cache)
+{
+	struct _vxi11_job *j = &s->jobs[index];
+	struct _vxi11_slot *slot = &s->slots[j->slot];
+	VXI11_SAMPLE *sample;
+	char *response;
+	unsigned long late;
+
+	if (slot->busy == index) {
+		slot->busy = NONE;
+	}
+	j->state = JOB_IDLE;
+	j->samples++;
+	late = (unsigned long)(j->sent - j->scheduled);
+	if (late > j->max_late_us) {
+		j->max_late_us = late;
+	}
+
+	if (s->pending == 0) {
+		s->oldest = j->scheduled;
+	}
+	sample = &s->samples[s->pending];
+	response = s->responses + s->pending * SAMPLE_BUFFER;
+	sample->job = index;
+	sample->result = result;
+	sample->scheduled_us = j->scheduled;
+	sample->sent_us = j->sent;
+	sample->received_us = _vxi11_now_us();
+	if (result >= 0) {
+		j->buf[result] = '\0';
+		if (!from_cache) {
+			_vxi11_cache_store(j->clink, j->query, j->buf, result);
+		}
+		memcpy(response, j->buf, result + 1);
+		sample->value = strtod(response, (char **)NULL);
+	} else {
+		j->errors++;
+		response[0] = '\0';
+		sample->value = 0.0;
+	}
+	if (++s->pending == s->batch) {
+		_flush(s);
+	}
+}
+
+/* Count an overrun for every other job that came due while a link without
+ * non-blocking support was served, from start to end, as its reading is
+ * late because of it. */
+static void _held_up(VXI11_SCHEDULER *s, size_t index, unsigned long long start,
+		     unsigned long long end)
+{
+	size_t i;
+
+	for (i = 0; i < s->count; i++) {
+		if (i != index && s->jobs[i].deadline >= start && s->jobs[i].deadline < end) {
+			s->jobs[i].overruns++;
+		}
+	}
+}
+
+/* Start the job at the head of a slot's queue, and any after it that
+ * finish at once. */
+static void _start_queued(VXI11_SCHEDULER *s, struct _vxi11_slot *slot)
+{
+	struct _vxi11_job *j;
+	size_t index;
+	ssize_t result;
+	int rc;
+
+	while (slot->busy == NONE && slot->queue_head != NONE) {
+		index = slot->queue_head;
+		j = &s->jobs[index];
+		slot->queue_head = j->next;
+		if (slot->queue_head == NONE) {
+			slot->queue_tail = NONE;
+		}
+		j->next = NONE;
+		j->sent = _vxi11_now_us();
+
+		if (slot->fd < 0) {
+			/* No non-blocking support, run it here and now */
+			rc = vxi11_send(j->clink, j->query, j->len);
+			if (rc != 0) {
+				result = rc == 1 ? -9 : rc;
+			} else {
+				result = vxi11_receive_timeout(j->clink, j->buf, SAMPLE_BUFFER - 1, j->timeout);
+			}
+			_complete(s, index, result, 0);
+			_held_up(s, index, j->sent, _vxi11_now_us());
+			continue;
+		}
+
+		rc = vxi11_async_start(j->clink, j->query, j->len, j->buf,
+				       SAMPLE_BUFFER - 1, j->timeout);
+		if (rc != 0) {
+			_complete(s, index, rc == 1 ? -9 : rc, 0);
+			continue;
+		}
+		j->state = JOB_PENDING;
+		slot->busy = index;
+		slot->events = vxi11_async_process(j->clink);
+		if (slot->events <= 0) {
+			_complete(s, index, vxi11_async_result(j->clink), 0);
+		}
+	}
+}
+
+/* A job's deadline has come round. */
+static void _due(VXI11_SCHEDULER *s, size_t index, unsigned long long now)
+{
+	struct _vxi11_job *j = &s->jobs[index];
+	struct _vxi11_slot *slot = &s->slots[j->slot];
+	unsigned long long scheduled = j->deadline;
+	unsigned long long missed;
+	ssize_t result;
+
+	/* Stay on the original grid, skipping any deadlines already past
+	 * (e.g. while a link without non-blocking support held us up) */
+	j->deadline += j->period_us;
+	if (j->deadline <= now) {
+		missed = (now - j->deadline) / j->period_us + 1;
+		j->overruns += missed;
+		j->deadline += missed * j->period_us;
+	}
+	if (j->state != JOB_IDLE) {
+		/* The last reading isn't finished, skip this one */
+		j->overruns++;
+		return;
+	}
+
+	j->scheduled = scheduled;
+	result = _vxi11_cache_lookup(j->clink, j->query, j->buf, SAMPLE_BUFFER - 1);
+	if (result >= 0) {
+		j->sent = now;
+		_complete(s, index, result, 1);
+		return;
+	}
+
+	j->state = JOB_QUEUED;
+	if (slot->queue_tail == NONE) {
+		slot->queue_head = index;
+	} else {
+		s->jobs[slot->queue_tail].next = index;
+	}
+	slot->queue_tail = index;
+	_start_queued(s, slot);
+}
+
+static void _sift_down(VXI11_SCHEDULER *s, size_t i)
+{
+	size_t *heap = s->heap;
+	size_t child;
+	size_t tmp;
+
+	while ((child = 2 * i + 1) < s->count) {
+		if (child + 1 < s->count
+		    && s->jobs[heap[child + 1]].deadline < s->jobs[heap[child]].deadline) {
+			child++;
+		}
+		if (s->jobs[heap[i]].deadline <= s->jobs[heap[child]].deadline) {
+			break;
+		}
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+static void _arm(int tfd, unsigned long long when_us)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = when_us / 1000000;
+	its.it_value.tv_nsec = (when_us % 1000000) * 1000;
+	timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+int vxi11_scheduler_run(VXI11_SCHEDULER *sched, unsigned long duration_ms)
+{
+	VXI11_SCHEDULER *s = sched;
+	struct pollfd *pfds;
+	size_t *polled;
+	unsigned long long now;
+	unsigned long long end;
+	unsigned long long wake;
+	unsigned long long expirations;
+	struct _vxi11_slot *slot;
+	struct _vxi11_job *j;
+	nfds_t n;
+	long t;
+	size_t i;
+	int tfd;
+	int rc;
+
+	if (s->count == 0) {
+		return -5;
+	}
+	free(s->heap);
+	s->heap = (size_t *)malloc(s->count * sizeof(size_t));
+	pfds = (struct pollfd *)malloc((s->slot_count + 1) * sizeof(struct pollfd));
+	polled = (size_t *)malloc((s->slot_count + 1) * sizeof(size_t));
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (!s->heap || !pfds || !polled || tfd < 0) {
+		free(pfds);
+		free(polled);
+		if (tfd >= 0) {
+			close(tfd);
+		}
+		return tfd < 0 ? -17 : -9;
+	}
+
+	/* Spread the first readings of jobs sharing a socket over their
+	 * periods, rather than queueing them all up at once */
+	now = _vxi11_now_us();
+	end = duration_ms ? now + (unsigned long long)duration_ms * 1000 : 0;
+	for (i = 0; i < s->count; i++) {
+		j = &s->jobs[i];
+		j->deadline = now + j->period_us * j->slot_index / s->slots[j->slot].jobs;
+		j->state = JOB_IDLE;
+		j->next = NONE;
+		s->heap[i] = i;
+	}
+	for (i = s->count / 2; i-- > 0;) {
+		_sift_down(s, i);
+	}
+	for (i = 0; i < s->slot_count; i++) {
+		s->slots[i].busy = NONE;
+		s->slots[i].queue_head = s->slots[i].queue_tail = NONE;
+	}
+	s->stopped = 0;
+
+	while (!s->stopped) {
+		now = _vxi11_now_us();
+		if (end && now >= end) {
+			break;
+		}
+		while (s->jobs[s->heap[0]].deadline <= now) {
+			_due(s, s->heap[0], now);
+			_sift_down(s, 0);
+		}
+		now = _vxi11_now_us();
+		if (s->pending > 0 && now - s->oldest >= s->max_delay_us) {
+			_flush(s);
+		}
+
+		/* Sleep until the next deadline, a reply or a timeout */
+		wake = s->jobs[s->heap[0]].deadline;
+		if (end && end < wake) {
+			wake = end;
+		}
+		if (s->pending > 0 && s->oldest + s->max_delay_us < wake) {
+			wake = s->oldest + s->max_delay_us;
+		}
+		n = 1;
+		pfds[0].fd = tfd;
+		pfds[0].events = POLLIN;
+		pfds[0].revents = 0;
+		for (i = 0; i < s->slot_count; i++) {
+			slot = &s->slots[i];
+			if (slot->busy == NONE) {
+				continue;
+			}
+			pfds[n].fd = slot->fd;
+			pfds[n].events = (slot->events & VXI11_ASYNC_WRITE) ? POLLOUT : POLLIN;
+			pfds[n].revents = 0;
+			polled[n] = i;
+			n++;
+			t = vxi11_async_timeout(s->jobs[slot->busy].clink);
+			if (t >= 0 && now + (unsigned long long)t * 1000 < wake) {
+				wake = now + (unsigned long long)t * 1000;
+			}
+		}
+		if (wake > now) {
+			_arm(tfd, wake);
+			rc = poll(pfds, n, -1);
+			if (rc <= 0) {
+				continue;
+			}
+			if (pfds[0].revents & POLLIN) {
+				if (read(tfd, &expirations, sizeof(expirations)) < 0) {
+					/* Nothing to do, it's only to clear it */
+				}
+			}
+		}
+
+		for (i = 1; i < n; i++) {
+			slot = &s->slots[polled[i]];
+			j = &s->jobs[slot->busy];
+			if (!pfds[i].revents && vxi11_async_timeout(j->clink) != 0) {
+				continue;
+			}
+			rc = vxi11_async_process(j->clink);
+			if (rc > 0) {
+				slot->events = rc;
+				continue;
+			}
+			_complete(s, slot->busy, vxi11_async_result(j->clink), 0);
+			_start_queued(s, slot);
+		}
+	}
+
+	/* Abandon anything still in progress */
+	for (i = 0; i < s->slot_count; i++) {
+		slot = &s->slots[i];
+		if (slot->busy != NONE) {
+			vxi11_async_cancel(s->jobs[slot->busy].clink);
+			slot->busy = NONE;
+		}
+		slot->queue_head = slot->queue_tail = NONE;
+	}
+	for (i = 0; i < s->count; i++) {
+		s->jobs[i].state = JOB_IDLE;
+	}
+	_flush(s);
+
+	close(tfd);
+	free(pfds);
+	free(polled);
+	return 0;
+}
+
+#endif
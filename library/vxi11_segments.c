@@ -0,0 +1,235 @@
+/* vxi11_segments.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Splitting a reply into its fields and blocks as it arrives. The reply is
+ * scanned once, a piece at a time as it is received, skipping over block
+ * data without looking at it, and the result is an index into the one
+ * buffer holding the reply.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vxi11_internal.h"
+
+/* Room after a block for a terminator of up to two characters and the null */
+#define	BLOCK_SLACK	3
+
+/* Segments the index starts with */
+#define	SEGMENTS_MIN	16
+
+/* What the scanner is in the middle of */
+#define	SCAN_FIELD	0	/* text, up to the next separator or block */
+#define	SCAN_INDEFINITE	1	/* an indefinite length block, to the end */
+
+/* Scanner state, kept between pieces of the reply. Positions are offsets,
+ * as the buffer moves when it grows. */
+struct _vxi11_scan {
+	VXI11_SEGMENTS *s;
+	size_t pos;		/* the next byte to scan, beyond the end of
+				   what has arrived while skipping a block */
+	size_t field_start;	/* where the current field began */
+	int state;
+	int quote;		/* inside a string */
+	int error;
+};
+
+static void _add(struct _vxi11_scan *sc, size_t offset, size_t len, size_t header_len)
+{
+	VXI11_SEGMENTS *s = sc->s;
+	VXI11_SEGMENT *bigger;
+	size_t alloc;
+
+	if (sc->error) {
+		return;
+	}
+	if (s->count == s->alloc) {
+		alloc = s->alloc ? s->alloc * 2 : SEGMENTS_MIN;
+		bigger = (VXI11_SEGMENT *)realloc(s->segments, alloc * sizeof(VXI11_SEGMENT));
+		if (!bigger) {
+			sc->error = -9;
+			return;
+		}
+		s->segments = bigger;
+		s->alloc = alloc;
+	}
+	s->segments[s->count].data = NULL;
+	s->segments[s->count].len = len;
+	s->segments[s->count].offset = offset;
+	s->segments[s->count].header_len = header_len;
+	s->count++;
+}
+
+static int _space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/* Add the text from start to end, less surrounding white space, as a field
+ * if anything is left. */
+static void _field(struct _vxi11_scan *sc, const char *buf, size_t start, size_t end)
+{
+	while (start < end && _space(buf[start])) {
+		start++;
+	}
+	while (end > start && _space(buf[end - 1])) {
+		end--;
+	}
+	if (end > start) {
+		_add(sc, start, end - start, 0);
+	}
+}
+
+/* Scan what has arrived since the last call. Returns the size of buffer the
+ * block being skipped needs, otherwise 0. */
+static size_t _scan(const char *buf, size_t len, void *state)
+{
+	struct _vxi11_scan *sc = (struct _vxi11_scan *)state;
+	size_t data_len;
+	size_t ndigits;
+	size_t i;
+	char c;
+
+	if (sc->error) {
+		return 0;
+	}
+	if (sc->state == SCAN_INDEFINITE) {
+		sc->pos = len;
+		return 0;
+	}
+	while (sc->pos < len) {
+		c = buf[sc->pos];
+		if (sc->quote) {
+			if (c == '"') {
+				sc->quote = 0;
+			}
+		} else if (c == '"') {
+			sc->quote = 1;
+		} else if (c == ',' || c == ';') {
+			_field(sc, buf, sc->field_start, sc->pos);
+			sc->field_start = sc->pos + 1;
+		} else if (c == '#') {
+			/* Wait for the rest of the header */
+			if (sc->pos + 1 >= len) {
+				return 0;
+			}
+			c = buf[sc->pos + 1];
+			if (c == '0') {
+				/* Runs to the end of the reply, which is
+				 * known once it has all arrived */
+				_field(sc, buf, sc->field_start, sc->pos);
+				_add(sc, sc->pos + 2, 0, 2);
+				sc->state = SCAN_INDEFINITE;
+				sc->pos = len;
+				return 0;
+			}
+			if (c >= '1' && c <= '9') {
+				ndigits = c - '0';
+				if (sc->pos + 2 + ndigits > len) {
+					return 0;
+				}
+				data_len = 0;
+				for (i = sc->pos + 2; i < sc->pos + 2 + ndigits; i++) {
+					if (buf[i] < '0' || buf[i] > '9') {
+						_vxi11_log(VXI11_LOG_ERROR, "vxi11_receive_segments: bad block header");
+						sc->error = -3;
+						return 0;
+					}
+					data_len = data_len * 10 + (buf[i] - '0');
+				}
+				_field(sc, buf, sc->field_start, sc->pos);
+				_add(sc, sc->pos + 2 + ndigits, data_len, 2 + ndigits);
+				sc->pos += 2 + ndigits + data_len;
+				sc->field_start = sc->pos;
+				continue;
+			}
+		}
+		sc->pos++;
+	}
+	return sc->pos > len ? sc->pos + BLOCK_SLACK : 0;
+}
+
+ssize_t vxi11_receive_segments(VXI11_CLINK * clink, VXI11_SEGMENTS * s, unsigned long timeout)
+{
+	struct _vxi11_scan sc;
+	VXI11_SEGMENT *seg;
+	ssize_t ret;
+	size_t len;
+	size_t i;
+
+	if (!s) {
+		return -5;
+	}
+	vxi11_release(clink, s->buffer);
+	s->buffer = NULL;
+	s->len = 0;
+	s->count = 0;
+
+	memset(&sc, 0, sizeof(sc));
+	sc.s = s;
+	ret = _vxi11_receive_scan(clink, &s->buffer, timeout, _scan, &sc);
+	if (ret < 0) {
+		s->count = 0;
+		return ret;
+	}
+	len = (size_t)ret;
+
+	if (sc.error) {
+		/* Bad header or out of memory, already set */
+	} else if (sc.state == SCAN_INDEFINITE) {
+		/* All that follows, less the terminator */
+		seg = &s->segments[s->count - 1];
+		i = len;
+		if (i > seg->offset && s->buffer[i - 1] == '\n') {
+			i--;
+		}
+		seg->len = i - seg->offset;
+	} else if (sc.pos > len) {
+		_vxi11_log(VXI11_LOG_ERROR, "vxi11_receive_segments: block ended %lu bytes early",
+			   (unsigned long)(sc.pos - len));
+		sc.error = -3;
+	} else if (sc.pos < len) {
+		_vxi11_log(VXI11_LOG_ERROR, "vxi11_receive_segments: reply ended in a block header");
+		sc.error = -3;
+	} else {
+		_field(&sc, s->buffer, sc.field_start, len);
+	}
+	if (sc.error) {
+		vxi11_release(clink, s->buffer);
+		s->buffer = NULL;
+		s->count = 0;
+		return sc.error;
+	}
+
+	for (i = 0; i < s->count; i++) {
+		s->segments[i].data = s->buffer + s->segments[i].offset;
+	}
+	s->len = len;
+	return (ssize_t)s->count;
+}
+
+void vxi11_segments_free(VXI11_CLINK * clink, VXI11_SEGMENTS * s)
+{
+	if (!s) {
+		return;
+	}
+	vxi11_release(clink, s->buffer);
+	free(s->segments);
+	memset(s, 0, sizeof(VXI11_SEGMENTS));
+}
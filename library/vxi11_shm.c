@@ -0,0 +1,433 @@
+/* vxi11_shm.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Publishing received blocks to other processes through a ring of slots in
+ * POSIX shared memory, which readers map and read in place. The publisher
+ * never waits for readers; a reader that falls more than a ring behind skips
+ * the blocks it missed. See vxi11_shm.h for the layout.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#ifdef WIN32
+
+#include "vxi11_internal.h"
+
+int vxi11_shm_create(VXI11_SHM ** shm, const char *name, size_t slots, size_t slot_size)
+{
+	return -8;
+}
+
+int vxi11_shm_open(VXI11_SHM ** shm, const char *name)
+{
+	return -8;
+}
+
+int vxi11_shm_publish(VXI11_SHM * shm, const char *data, size_t len)
+{
+	return -8;
+}
+
+ssize_t vxi11_shm_publish_data_block(VXI11_SHM * shm, VXI11_CLINK * clink, unsigned long timeout)
+{
+	return -8;
+}
+
+int vxi11_shm_next(VXI11_SHM * shm, VXI11_SHM_BLOCK * block, unsigned long timeout)
+{
+	return -8;
+}
+
+int vxi11_shm_valid(VXI11_SHM * shm, const VXI11_SHM_BLOCK * block)
+{
+	return 0;
+}
+
+void vxi11_shm_close(VXI11_SHM * shm)
+{
+}
+
+#else
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#  include <linux/futex.h>
+#  include <sys/syscall.h>
+#endif
+
+#include "vxi11_internal.h"
+#include "vxi11_shm.h"
+
+struct _VXI11_SHM {
+	char *base;
+	size_t size;
+	struct _vxi11_shm_header *header;
+	char *name;		/* publisher only, unlinked by vxi11_shm_close() */
+	uint64_t next;		/* reader only, the block vxi11_shm_next() wants */
+
+	/* Copied from the header, which doesn't change once it is valid */
+	uint64_t slots;
+	uint64_t slot_size;
+	uint64_t slot_stride;
+	uint64_t slots_offset;
+};
+
+static struct _vxi11_shm_slot *_slot(VXI11_SHM * shm, uint64_t seq)
+{
+	return (struct _vxi11_shm_slot *)(shm->base + shm->slots_offset
+					  + ((seq - 1) % shm->slots) * shm->slot_stride);
+}
+
+static int _fail(const char *function, const char *what, const char *name)
+{
+	_vxi11_error(function, 0, errno, 0);
+	_vxi11_log(VXI11_LOG_ERROR, "%s: %s %s: %s", function, what, name, strerror(errno));
+	return -17;
+}
+
+int vxi11_shm_create(VXI11_SHM ** shm, const char *name, size_t slots, size_t slot_size)
+{
+	VXI11_SHM *s;
+	size_t stride;
+	size_t offset;
+	int fd;
+
+	/* Slots start on cache lines, so readers and the publisher only share
+	 * the lines of the slot being written */
+	stride = (sizeof(struct _vxi11_shm_slot) + slot_size + VXI11_SHM_BLOCK_SLACK + 63) & ~(size_t)63;
+	offset = sysconf(_SC_PAGESIZE);
+	if (slots == 0 || slot_size == 0 || stride < slot_size || slots > (SIZE_MAX - offset) / stride) {
+		return -5;
+	}
+
+	s = (VXI11_SHM *) calloc(1, sizeof(VXI11_SHM));
+	if (!s) {
+		return -9;
+	}
+	s->name = strdup(name);
+	if (!s->name) {
+		free(s);
+		return -9;
+	}
+	s->slots = slots;
+	s->slot_size = slot_size;
+	s->slot_stride = stride;
+	s->slots_offset = offset;
+	s->size = offset + slots * stride;
+
+	/* Any ring left by a publisher that didn't close it goes. Its readers
+	 * keep their mapping, but see nothing more. */
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		free(s->name);
+		free(s);
+		return _fail("vxi11_shm_create", "could not create", name);
+	}
+	if (ftruncate(fd, s->size)) {
+		_fail("vxi11_shm_create", "could not size", name);
+		close(fd);
+		shm_unlink(name);
+		free(s->name);
+		free(s);
+		return -17;
+	}
+	s->base = (char *)mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (s->base == MAP_FAILED) {
+		_fail("vxi11_shm_create", "could not map", name);
+		close(fd);
+		shm_unlink(name);
+		free(s->name);
+		free(s);
+		return -17;
+	}
+	close(fd);
+
+	s->header = (struct _vxi11_shm_header *)s->base;
+	s->header->version = VXI11_SHM_VERSION;
+	s->header->slots = slots;
+	s->header->slot_size = slot_size;
+	s->header->slot_stride = stride;
+	s->header->slots_offset = offset;
+	__atomic_store_n(&s->header->magic, VXI11_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	*shm = s;
+	return 0;
+}
+
+int vxi11_shm_open(VXI11_SHM ** shm, const char *name)
+{
+	struct _vxi11_shm_header h;
+	struct stat st;
+	VXI11_SHM *s;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		return _fail("vxi11_shm_open", "could not open", name);
+	}
+	if (fstat(fd, &st)) {
+		_fail("vxi11_shm_open", "could not stat", name);
+		close(fd);
+		return -17;
+	}
+	if ((size_t)st.st_size < sizeof(h) || pread(fd, &h, sizeof(h), 0) != sizeof(h)
+	    || h.magic != VXI11_SHM_MAGIC
+	    || h.version != VXI11_SHM_VERSION || h.slots == 0
+	    || h.slots_offset + h.slots * h.slot_stride > (uint64_t)st.st_size) {
+		_vxi11_error("vxi11_shm_open", 0, 0, 0);
+		_vxi11_log(VXI11_LOG_ERROR, "vxi11_shm_open: %s is not a vxi11 ring", name);
+		close(fd);
+		return -17;
+	}
+
+	s = (VXI11_SHM *) calloc(1, sizeof(VXI11_SHM));
+	if (!s) {
+		close(fd);
+		return -9;
+	}
+	s->slots = h.slots;
+	s->slot_size = h.slot_size;
+	s->slot_stride = h.slot_stride;
+	s->slots_offset = h.slots_offset;
+	s->size = h.slots_offset + h.slots * h.slot_stride;
+	s->base = (char *)mmap(NULL, s->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (s->base == MAP_FAILED) {
+		_fail("vxi11_shm_open", "could not map", name);
+		close(fd);
+		free(s);
+		return -17;
+	}
+	close(fd);
+	s->header = (struct _vxi11_shm_header *)s->base;
+
+	/* Only blocks published from now on */
+	s->next = __atomic_load_n(&s->header->published, __ATOMIC_ACQUIRE) + 1;
+
+	*shm = s;
+	return 0;
+}
+
+/* Take the slot for the next block away from readers, and return where the
+ * block goes. */
+static char *_begin(VXI11_SHM * shm)
+{
+	struct _vxi11_shm_slot *slot = _slot(shm, shm->header->published + 1);
+
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return (char *)(slot + 1);
+}
+
+/* Hand the slot filled since _begin() to readers. */
+static void _commit(VXI11_SHM * shm, size_t offset, size_t len)
+{
+	uint64_t seq = shm->header->published + 1;
+	struct _vxi11_shm_slot *slot = _slot(shm, seq);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	__atomic_store_n(&slot->len, len, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->offset, offset, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->timestamp_us, (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&shm->header->published, seq, __ATOMIC_RELEASE);
+
+	__atomic_add_fetch(&shm->header->futex, 1, __ATOMIC_RELEASE);
+#ifdef __linux__
+	syscall(SYS_futex, &shm->header->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+int vxi11_shm_publish(VXI11_SHM * shm, const char *data, size_t len)
+{
+	if (!shm->name) {
+		return -5;
+	}
+	if (len > shm->slot_size) {
+		_vxi11_error("vxi11_shm_publish", 0, 0, len);
+		_vxi11_log(VXI11_LOG_ERROR, "vxi11_shm_publish: %lu byte block is larger than the "
+			   "%lu byte slots", (unsigned long)len, (unsigned long)shm->slot_size);
+		return -100;
+	}
+	memcpy(_begin(shm), data, len);
+	_commit(shm, 0, len);
+	return 0;
+}
+
+ssize_t vxi11_shm_publish_data_block(VXI11_SHM * shm, VXI11_CLINK * clink, unsigned long timeout)
+{
+	size_t room = shm->slot_size + VXI11_SHM_BLOCK_SLACK;
+	size_t len;
+	ssize_t ret;
+	char *buf;
+	int ndigits;
+	int i;
+
+	if (!shm->name) {
+		return -5;
+	}
+
+	/* Straight into the slot, header and all, and the data is left where
+	 * it lands */
+	buf = _begin(shm);
+	ret = _vxi11_receive(clink, buf, room, timeout);
+	if (ret == -100) {
+		/* Throw the rest away, so the link is ready for the next block */
+		while ((ret = _vxi11_receive(clink, buf, room, timeout)) == -100) {
+		}
+		_vxi11_error("vxi11_shm_publish_data_block", 0, 0, room);
+		_vxi11_log(VXI11_LOG_ERROR, "vxi11_shm_publish_data_block: block is larger than the "
+			   "%lu byte slots", (unsigned long)shm->slot_size);
+		return -100;
+	}
+	if (ret < 0) {
+		return ret;
+	}
+
+	ndigits = ret >= 2 && buf[0] == '#' ? buf[1] - '0' : -1;
+	if (ndigits < 0 || ndigits > 9 || ret < ndigits + 2) {
+		_vxi11_error("vxi11_shm_publish_data_block", 0, 0, ret);
+		_vxi11_log(VXI11_LOG_ERROR, "vxi11_shm_publish_data_block: data block does not begin with '#'. "
+			   "First characters received were: '%.*s'", (int)(ret < 20 ? ret : 20), buf);
+		return -3;
+	}
+	/* "#0", the instrument had nothing to send */
+	if (ndigits == 0) {
+		return 0;
+	}
+	len = 0;
+	for (i = 2; i < ndigits + 2; i++) {
+		len = len * 10 + (buf[i] - '0');
+	}
+	if (len > (size_t)ret - (ndigits + 2)) {
+		_vxi11_error("vxi11_shm_publish_data_block", 0, 0, ret);
+		_vxi11_log(VXI11_LOG_ERROR, "vxi11_shm_publish_data_block: header claims %lu bytes, "
+			   "but only %ld were received", (unsigned long)len, (long)(ret - (ndigits + 2)));
+		return -3;
+	}
+	_commit(shm, ndigits + 2, len);
+	return (ssize_t)len;
+}
+
+/* Sleep until futex moves on from value or the deadline passes. Returns 0, or
+ * -15 if the deadline has passed. */
+static int _wait(VXI11_SHM * shm, uint32_t value, unsigned long deadline)
+{
+	long left = (long)(deadline - _vxi11_now_ms());
+	struct timespec ts;
+
+	if (left <= 0) {
+		return -15;
+	}
+#ifdef __linux__
+	ts.tv_sec = left / 1000;
+	ts.tv_nsec = (left % 1000) * 1000000;
+	syscall(SYS_futex, &shm->header->futex, FUTEX_WAIT, value, &ts, NULL, 0);
+#else
+	ts.tv_sec = 0;
+	ts.tv_nsec = 1000000;
+	nanosleep(&ts, NULL);
+#endif
+	return 0;
+}
+
+int vxi11_shm_next(VXI11_SHM * shm, VXI11_SHM_BLOCK * block, unsigned long timeout)
+{
+	unsigned long deadline = _vxi11_now_ms() + timeout;
+	struct _vxi11_shm_slot *slot;
+	uint64_t published;
+	uint64_t seq;
+	uint64_t len;
+	uint64_t offset;
+	uint64_t timestamp;
+	uint32_t futex;
+	int ret;
+
+	if (shm->name) {
+		return -5;
+	}
+	block->lost = 0;
+	while (1) {
+		futex = __atomic_load_n(&shm->header->futex, __ATOMIC_ACQUIRE);
+		published = __atomic_load_n(&shm->header->published, __ATOMIC_ACQUIRE);
+		if (published < shm->next) {
+			ret = _wait(shm, futex, deadline);
+			if (ret) {
+				return ret;
+			}
+			continue;
+		}
+
+		/* Blocks older than the ring have gone */
+		if (published - shm->next >= shm->slots) {
+			block->lost += published - shm->slots + 1 - shm->next;
+			shm->next = published - shm->slots + 1;
+		}
+
+		seq = shm->next++;
+		slot = _slot(shm, seq);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == seq) {
+			len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+			offset = __atomic_load_n(&slot->offset, __ATOMIC_RELAXED);
+			timestamp = __atomic_load_n(&slot->timestamp_us, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq
+			    && offset + len <= shm->slot_size + VXI11_SHM_BLOCK_SLACK) {
+				block->data = (const char *)(slot + 1) + offset;
+				block->len = len;
+				block->seq = seq;
+				block->timestamp_us = timestamp;
+				return 0;
+			}
+		}
+		/* Being overwritten as we got to it */
+		block->lost++;
+	}
+}
+
+int vxi11_shm_valid(VXI11_SHM * shm, const VXI11_SHM_BLOCK * block)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&_slot(shm, block->seq)->seq, __ATOMIC_RELAXED) == block->seq;
+}
+
+void vxi11_shm_close(VXI11_SHM * shm)
+{
+	if (!shm) {
+		return;
+	}
+	munmap(shm->base, shm->size);
+	if (shm->name) {
+		shm_unlink(shm->name);
+		free(shm->name);
+	}
+	free(shm);
+}
+
+#endif
@@ -0,0 +1,69 @@
+/* vxi11_shm.h
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Layout of the POSIX shared memory ring written by vxi11_shm_publish() and
+ * read by vxi11_shm_next(). Everything is in host byte order, and only
+ * processes on the same machine share a ring, so this needs no encoding.
+ *
+ * The region starts with a struct _vxi11_shm_header, padded to
+ * slots_offset, followed by slots slots of slot_stride bytes each. Block n
+ * (counting from 1) goes in slot (n - 1) % slots. Each slot starts with a
+ * struct _vxi11_shm_slot, followed by the block as received, header and all,
+ * with the data offset bytes in.
+ *
+ * A slot's seq is a sequence lock. The publisher sets it to 0, writes the
+ * rest of the slot, then sets it to the block's sequence number. A reader
+ * that finds the same sequence number before and after reading a block has
+ * read it intact. The publisher never waits for readers.
+ *
+ * Not installed, this is not part of the public interface.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#ifndef	_VXI11_SHM_H_
+#define	_VXI11_SHM_H_
+
+#include <stdint.h>
+
+#define	VXI11_SHM_MAGIC		0x31317876	/* "vx11" */
+#define	VXI11_SHM_VERSION	1
+
+/* Room left in each slot for the "#<n><length>" header and the terminator
+ * that arrive with a block. */
+#define	VXI11_SHM_BLOCK_SLACK	16
+
+struct _vxi11_shm_header {
+	uint32_t magic;		/* written last, once the rest is valid */
+	uint32_t version;
+	uint64_t slots;
+	uint64_t slot_size;	/* the largest block a slot holds */
+	uint64_t slot_stride;	/* bytes from one slot to the next */
+	uint64_t slots_offset;	/* bytes from the start of the region to slot 0 */
+	uint64_t published;	/* sequence number of the newest block, 0 for none */
+	uint32_t futex;		/* incremented on every publish, for readers to wait on */
+};
+
+struct _vxi11_shm_slot {
+	uint64_t seq;		/* 0 while being written */
+	uint64_t len;		/* bytes of data */
+	uint64_t offset;	/* bytes from the end of this struct to the data */
+	uint64_t timestamp_us;	/* when the block was published, CLOCK_REALTIME */
+	uint64_t reserved[4];
+};
+
+#endif
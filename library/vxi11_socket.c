@@ -0,0 +1,362 @@
+/* vxi11_socket.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Raw socket transport for the VXI11 user library. Many instruments also
+ * accept SCPI directly over a TCP connection (usually port 5025), which saves
+ * the RPC and XDR work and the round trips of VXI11. Links are opened this way
+ * when vxi11_open_device() is given a VISA style address such as
+ * "TCPIP::192.168.1.10::5025::SOCKET".
+ *
+ * A byte stream has no message boundaries, so commands are terminated with a
+ * newline, and a response ends at the first newline that is not inside a
+ * definite length block (#<n><length><data>).
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#ifndef WIN32
+
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "vxi11_internal.h"
+
+#define SOCKET_RX_SIZE	65536
+
+/* Where the response parser is */
+enum _vxi11_socket_state {
+	SOCKET_TEXT = 0,	/* looking for the terminating newline */
+	SOCKET_HASH,		/* just seen a '#' that may start a block */
+	SOCKET_DIGITS,		/* reading a block's length */
+	SOCKET_BLOCK,		/* inside a block's data */
+};
+
+struct _vxi11_socket_link {
+	int fd;
+
+	/* Received but not yet returned */
+	char rx[SOCKET_RX_SIZE];
+	size_t rx_start;
+	size_t rx_end;
+
+	/* Response parser, kept between calls in case the caller's buffer
+	 * fills up part way through a response */
+	enum _vxi11_socket_state state;
+	int digits;
+	size_t block_left;
+	int at_token;		/* the next byte starts a response field */
+};
+
+int _vxi11_socket_address(const char *address, char *host, size_t hostlen,
+			  unsigned short *port)
+{
+	const char *p = address;
+	const char *end;
+	char *tail;
+	unsigned long n;
+
+	if (strncasecmp(p, "TCPIP", 5) != 0) {
+		return 0;
+	}
+	p += 5;
+	while (isdigit((unsigned char)*p)) {
+		p++;
+	}
+	if (strncmp(p, "::", 2) != 0) {
+		return 0;
+	}
+	p += 2;
+	end = strstr(p, "::");
+	if (!end || end == p || (size_t)(end - p) >= hostlen) {
+		return 0;
+	}
+	n = strtoul(end + 2, &tail, 10);
+	if (tail == end + 2 || n == 0 || n > 65535 || strcasecmp(tail, "::SOCKET") != 0) {
+		return 0;
+	}
+	memcpy(host, p, end - p);
+	host[end - p] = '\0';
+	*port = (unsigned short)n;
+	return 1;
+}
+
+int _vxi11_socket_open(VXI11_CLINK * clink, const char *host, unsigned short port)
+{
+	struct _vxi11_socket_link *s;
+	struct addrinfo hints, *res, *ai;
+	char service[8];
+	int one = 1;
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%u", port);
+	if (getaddrinfo(host, service, &hints, &res) != 0) {
+		_vxi11_error("vxi11_open_device", 0, 21, 0);
+		_vxi11_log(VXI11_LOG_ERROR, "vxi11_open_device: could not resolve %s", host);
+		return 1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		_vxi11_error("vxi11_open_device", 0, 17, 0);
+		_vxi11_log(VXI11_LOG_ERROR, "vxi11_open_device: could not connect to %s port %u",
+			   host, port);
+		return 1;
+	}
+	/* Commands are small and we wait for each reply, don't let Nagle
+	 * hold them back */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	s = (struct _vxi11_socket_link *)calloc(1, sizeof(struct _vxi11_socket_link));
+	if (!s) {
+		close(fd);
+		return 1;
+	}
+	s->fd = fd;
+	s->at_token = 1;
+	clink->socket = s;
+	return 0;
+}
+
+void _vxi11_socket_close(VXI11_CLINK * clink)
+{
+	struct _vxi11_socket_link *s = clink->socket;
+
+	if (s) {
+		close(s->fd);
+		free(s);
+		clink->socket = NULL;
+	}
+}
+
+int _vxi11_socket_send(VXI11_CLINK * clink, const char *cmd, size_t len)
+{
+	struct _vxi11_socket_link *s = clink->socket;
+	struct iovec iov[2];
+	struct msghdr msg;
+	size_t sent = 0;
+	ssize_t n;
+	int iovcnt = 1;
+
+	iov[0].iov_base = (void *)cmd;
+	iov[0].iov_len = len;
+	if (len == 0 || cmd[len - 1] != '\n') {
+		iov[1].iov_base = (void *)"\n";
+		iov[1].iov_len = 1;
+		iovcnt = 2;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	while (msg.msg_iovlen > 0) {
+		n = sendmsg(s->fd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			_vxi11_error("vxi11_send", 0, 17, sent);
+			_vxi11_log(VXI11_LOG_ERROR, "vxi11_send: socket error: %s", strerror(errno));
+			return -17;
+		}
+		sent += n;
+		while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+			n -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+			msg.msg_iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/* Wait until the deadline for data from the instrument, and read up to len
+ * bytes of it into dest. Returns the number of bytes read, or a negative
+ * error as for vxi11_receive(). */
+static ssize_t _recv(struct _vxi11_socket_link *s, char *dest, size_t len,
+		     unsigned long deadline)
+{
+	struct pollfd pfd;
+	unsigned long now;
+	ssize_t n;
+	int rc;
+
+	while (1) {
+		now = _vxi11_now_ms();
+		if (now >= deadline) {
+			return -15;
+		}
+		pfd.fd = s->fd;
+		pfd.events = POLLIN;
+		rc = poll(&pfd, 1, (int)(deadline - now));
+		if (rc < 0 && errno != EINTR) {
+			return -17;
+		} else if (rc <= 0) {
+			continue;
+		}
+		n = recv(s->fd, dest, len, 0);
+		if (n > 0) {
+			return n;
+		} else if (n == 0) {
+			return -17;
+		} else if (errno != EINTR && errno != EAGAIN) {
+			return -17;
+		}
+	}
+}
+
+ssize_t _vxi11_socket_receive(VXI11_CLINK * clink, char *buffer, size_t len,
+			      unsigned long timeout)
+{
+	struct _vxi11_socket_link *s = clink->socket;
+	unsigned long deadline = _vxi11_now_ms() + timeout;
+	size_t curr_pos = 0;
+	ssize_t rc;
+	size_t n;
+	char c;
+
+	while (1) {
+		if (curr_pos == len) {
+			return -100;
+		}
+		if (s->state == SOCKET_BLOCK) {
+			/* Move as much of the block as we can in one go, straight
+			 * from the socket if nothing is buffered */
+			n = s->block_left;
+			if (n > len - curr_pos) {
+				n = len - curr_pos;
+			}
+			if (s->rx_start == s->rx_end) {
+				rc = _recv(s, buffer + curr_pos, n, deadline);
+				if (rc < 0) {
+					_vxi11_error("vxi11_receive", 0, -rc, curr_pos);
+					return rc;
+				}
+				n = rc;
+			} else {
+				if (n > s->rx_end - s->rx_start) {
+					n = s->rx_end - s->rx_start;
+				}
+				memcpy(buffer + curr_pos, s->rx + s->rx_start, n);
+				s->rx_start += n;
+			}
+			curr_pos += n;
+			s->block_left -= n;
+			if (s->block_left == 0) {
+				s->state = SOCKET_TEXT;
+				s->at_token = 0;
+			}
+			continue;
+		}
+
+		if (s->rx_start == s->rx_end) {
+			rc = _recv(s, s->rx, SOCKET_RX_SIZE, deadline);
+			if (rc < 0) {
+				_vxi11_error("vxi11_receive", 0, -rc, curr_pos);
+				return rc;
+			}
+			s->rx_start = 0;
+			s->rx_end = rc;
+		}
+		c = s->rx[s->rx_start++];
+		buffer[curr_pos++] = c;
+		switch (s->state) {
+		case SOCKET_TEXT:
+			if (c == '\n') {
+				s->at_token = 1;
+				return curr_pos;
+			}
+			if (c == '#' && s->at_token) {
+				s->state = SOCKET_HASH;
+			}
+			s->at_token = (c == ',' || c == ';' || c == ' ');
+			break;
+		case SOCKET_HASH:
+			if (c >= '1' && c <= '9') {
+				s->digits = c - '0';
+				s->block_left = 0;
+				s->state = SOCKET_DIGITS;
+			} else {
+				/* #0 is an indefinite block, ended by the newline */
+				s->state = SOCKET_TEXT;
+				if (c == '\n') {
+					s->at_token = 1;
+					return curr_pos;
+				}
+			}
+			break;
+		case SOCKET_DIGITS:
+			if (!isdigit((unsigned char)c)) {
+				s->state = SOCKET_TEXT;
+				if (c == '\n') {
+					s->at_token = 1;
+					return curr_pos;
+				}
+				break;
+			}
+			s->block_left = s->block_left * 10 + (c - '0');
+			if (--s->digits == 0) {
+				s->state = s->block_left ? SOCKET_BLOCK : SOCKET_TEXT;
+			}
+			break;
+		case SOCKET_BLOCK:
+			break;
+		}
+	}
+}
+
+int _vxi11_socket_clear(VXI11_CLINK * clink)
+{
+	struct _vxi11_socket_link *s = clink->socket;
+	char buf[4096];
+
+	/* There is no device clear on a raw socket; the best we can do is
+	 * forget whatever the instrument has already sent. */
+	while (recv(s->fd, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+	s->rx_start = s->rx_end = 0;
+	s->state = SOCKET_TEXT;
+	s->at_token = 1;
+	return 0;
+}
+
+#endif
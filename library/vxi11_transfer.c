@@ -0,0 +1,603 @@
+/* vxi11_transfer.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Large transfers. Reading a big block one device_read at a time leaves the
+ * link idle for a round trip between chunks. Once the block header says how
+ * much is to come, the next device_read is sent before the reply to the last
+ * one has arrived, so the instrument always has a request waiting. No read is
+ * ever asked for beyond the end of the block, so none can be left waiting on
+ * an instrument that has nothing more to send.
+ *
+ * The requestSize used for each read is tuned per instrument, by trying each
+ * of a few sizes on large transfers and keeping the fastest, and the socket's
+ * receive buffer is sized to hold the reads in flight.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vxi11_internal.h"
+
+#ifdef WIN32
+
+int vxi11_set_large_transfers(VXI11_CLINK * clink, int enable)
+{
+	return -8;
+}
+
+int vxi11_transfer_stats(VXI11_CLINK * clink, VXI11_TRANSFER_STATS * stats)
+{
+	return -8;
+}
+
+#else
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* device_reads kept in flight */
+#define	TRANSFER_DEPTH	2
+
+/* How long past the io_timeout we give the instrument to reply, in ms */
+#define	TRANSFER_GRACE	1000
+
+/* Transfers smaller than this don't say much about the request size */
+#define	TUNE_MIN_BYTES	(1024 * 1024)
+
+/* Largest socket receive buffer asked for */
+#define	RCVBUF_MAX	(8 * 1024 * 1024)
+
+/* Space for an encoded device_read call */
+#define	CALL_LEN	256
+
+/* Reply overhead before the data: xid, direction, reply status, verifier,
+ * accept status, error, reason and data length */
+#define	READ_REPLY_MIN	36
+
+#define	LAST_FRAG	0x80000000UL
+
+/* requestSize values tried */
+static const size_t request_sizes[] = { 65536, 262144, 1048576, 4194304 };
+
+#define	NSIZES	(sizeof(request_sizes) / sizeof(request_sizes[0]))
+
+/* What has been learnt about one instrument, shared by all links to it */
+struct _vxi11_transfer_tune {
+	struct _vxi11_transfer_tune *next;
+	char peer[96];		/* numeric "host:port" */
+	double mb_per_s[NSIZES];	/* best seen with each size, 0 if untried */
+};
+
+static struct _vxi11_transfer_tune *tunes;
+static pthread_mutex_t tunes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct _vxi11_transfer_call {
+	Device_ReadParms parms;
+	u_int32_t xid;
+	unsigned long long capture;
+};
+
+struct _vxi11_transfer {
+	int fd;
+	u_int32_t xid;
+	struct _vxi11_transfer_tune *tune;
+	size_t remaining;	/* of the block being read, 0 if not known */
+	int in_reply;		/* part of a reply has been read */
+	int rcvbuf_size;	/* the request size rcvbuf was set for */
+	int mid_record;		/* a call or reply record is part way across */
+	char *rx;		/* reply record */
+	size_t rx_len;
+	size_t rx_alloc;
+	VXI11_TRANSFER_STATS stats;
+};
+
+/* Decoding device_read results straight into the caller's buffer, refusing
+ * more data than there is room for. */
+struct _vxi11_transfer_result {
+	Device_ReadResp resp;
+	u_int max;
+};
+
+static bool_t _xdr_result(XDR * xdrs, struct _vxi11_transfer_result *r)
+{
+	u_int len;
+
+	if (!xdr_Device_ErrorCode(xdrs, &r->resp.error) || !xdr_long(xdrs, &r->resp.reason) ||
+	    !xdr_u_int(xdrs, &len) || len > r->max) {
+		return FALSE;
+	}
+	r->resp.data.data_len = len;
+	return xdr_opaque(xdrs, r->resp.data.data_val, len);
+}
+
+static struct _vxi11_transfer_tune *_find_tune(int fd)
+{
+	struct _vxi11_transfer_tune *tune;
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	char host[64];		/* numeric, so room for IPv6 and a scope */
+	char serv[16];
+	char peer[sizeof(tune->peer)];
+
+	memset(&addr, 0, sizeof(addr));
+	if (getpeername(fd, (struct sockaddr *)&addr, &addr_len)
+	    || getnameinfo((struct sockaddr *)&addr, addr_len, host, sizeof(host), serv, sizeof(serv),
+			   NI_NUMERICHOST | NI_NUMERICSERV)) {
+		strcpy(host, "?");
+		strcpy(serv, "?");
+	}
+	snprintf(peer, sizeof(peer), "%s:%s", host, serv);
+
+	pthread_mutex_lock(&tunes_lock);
+	for (tune = tunes; tune; tune = tune->next) {
+		if (strcmp(tune->peer, peer) == 0) {
+			break;
+		}
+	}
+	if (!tune) {
+		tune = (struct _vxi11_transfer_tune *)calloc(1, sizeof(*tune));
+		if (tune) {
+			strcpy(tune->peer, peer);
+			tune->next = tunes;
+			tunes = tune;
+		}
+	}
+	pthread_mutex_unlock(&tunes_lock);
+	return tune;
+}
+
+/* The request size to use next: one not yet tried, else the fastest. Called
+ * with tunes_lock held. */
+static size_t _choose(struct _vxi11_transfer_tune *tune, int *tuned)
+{
+	size_t best = 0;
+	size_t i;
+
+	*tuned = 1;
+	for (i = 0; i < NSIZES; i++) {
+		if (tune->mb_per_s[i] == 0) {
+			*tuned = 0;
+			return i;
+		}
+		if (tune->mb_per_s[i] > tune->mb_per_s[best]) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+/* Room in the socket for every read in flight. The buffer is only ever made
+ * bigger, as setting it stops the system from growing it itself. */
+static void _set_rcvbuf(struct _vxi11_transfer *t, size_t request_size)
+{
+	socklen_t opt_len = sizeof(int);
+	size_t want = TRANSFER_DEPTH * request_size;
+	int size = 0;
+
+	if (t->rcvbuf_size == (int)request_size) {
+		return;
+	}
+	t->rcvbuf_size = (int)request_size;
+	if (want > RCVBUF_MAX) {
+		want = RCVBUF_MAX;
+	}
+	getsockopt(t->fd, SOL_SOCKET, SO_RCVBUF, &size, &opt_len);
+	if ((size_t)size < want) {
+		size = (int)want;
+		setsockopt(t->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+		opt_len = sizeof(int);
+		getsockopt(t->fd, SOL_SOCKET, SO_RCVBUF, &size, &opt_len);
+	}
+	t->stats.rcvbuf = size;
+}
+
+static int _send_call(VXI11_CLINK * clink, struct _vxi11_transfer_call *call)
+{
+	struct _vxi11_transfer *t = clink->transfer;
+	struct rpc_msg msg;
+	char buf[CALL_LEN];
+	u_int32_t mark;
+	size_t pos = 0;
+	ssize_t n;
+	XDR xdrs;
+	u_int len;
+
+	memset(&msg, 0, sizeof(msg));
+	call->xid = ++t->xid;
+	msg.rm_xid = call->xid;
+	msg.rm_direction = CALL;
+	msg.rm_call.cb_rpcvers = RPC_MSG_VERSION;
+	msg.rm_call.cb_prog = DEVICE_CORE;
+	msg.rm_call.cb_vers = DEVICE_CORE_VERSION;
+	msg.rm_call.cb_proc = device_read;
+	msg.rm_call.cb_cred = _null_auth;
+	msg.rm_call.cb_verf = _null_auth;
+
+	xdrmem_create(&xdrs, buf + 4, sizeof(buf) - 4, XDR_ENCODE);
+	if (!xdr_callmsg(&xdrs, &msg) || !xdr_Device_ReadParms(&xdrs, &call->parms)) {
+		xdr_destroy(&xdrs);
+		return -1;
+	}
+	len = xdr_getpos(&xdrs);
+	xdr_destroy(&xdrs);
+	mark = htonl(LAST_FRAG | len);
+	memcpy(buf, &mark, 4);
+
+	call->capture = _vxi11_capture_begin();
+	while (pos < len + 4) {
+		n = send(t->fd, buf + pos, len + 4 - pos, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		pos += n;
+		t->mid_record = 1;
+	}
+	t->mid_record = 0;
+	return 0;
+}
+
+static int _recv_all(struct _vxi11_transfer *t, char *buf, size_t len, unsigned long deadline)
+{
+	struct pollfd pfd;
+	unsigned long now;
+	ssize_t n;
+	int ready;
+
+	pfd.fd = t->fd;
+	pfd.events = POLLIN;
+	while (len > 0) {
+		now = _vxi11_now_ms();
+		if ((long)(deadline - now) <= 0) {
+			return -1;
+		}
+		ready = poll(&pfd, 1, (int)(deadline - now));
+		if (ready < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ready <= 0) {
+			return -1;
+		}
+		n = recv(t->fd, buf, len, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		t->mid_record = 1;
+	}
+	return 0;
+}
+
+/* Read one reply record into t->rx */
+static int _recv_record(struct _vxi11_transfer *t, unsigned long deadline)
+{
+	u_int32_t mark;
+	size_t frag;
+	char *bigger;
+	size_t alloc;
+
+	t->rx_len = 0;
+	do {
+		if (_recv_all(t, (char *)&mark, 4, deadline)) {
+			return -1;
+		}
+		mark = ntohl(mark);
+		frag = mark & ~LAST_FRAG;
+		if (t->rx_len + frag > t->rx_alloc) {
+			alloc = t->rx_alloc ? t->rx_alloc : 4096;
+			while (alloc < t->rx_len + frag) {
+				alloc *= 2;
+			}
+			bigger = (char *)realloc(t->rx, alloc);
+			if (!bigger) {
+				return -1;
+			}
+			t->rx = bigger;
+			t->rx_alloc = alloc;
+		}
+		if (_recv_all(t, t->rx + t->rx_len, frag, deadline)) {
+			return -1;
+		}
+		t->rx_len += frag;
+	} while (!(mark & LAST_FRAG));
+	t->mid_record = 0;
+	return 0;
+}
+
+/* Wait for the reply to call, skipping any stale replies to earlier calls,
+ * and decode its data into buffer, which has room for max bytes. */
+static int _recv_reply(struct _vxi11_transfer *t, struct _vxi11_transfer_call *call,
+		       struct _vxi11_transfer_result *result, char *buffer, size_t max)
+{
+	unsigned long deadline = _vxi11_now_ms() + call->parms.io_timeout + call->parms.lock_timeout + TRANSFER_GRACE;
+	struct rpc_msg reply;
+	u_int32_t xid;
+	XDR xdrs;
+	int ok;
+
+	do {
+		if (_recv_record(t, deadline) || t->rx_len < READ_REPLY_MIN) {
+			return -1;
+		}
+		memcpy(&xid, t->rx, 4);
+	} while (ntohl(xid) != call->xid);
+
+	memset(result, 0, sizeof(*result));
+	result->resp.data.data_val = buffer;
+	result->max = max;
+	memset(&reply, 0, sizeof(reply));
+	reply.acpted_rply.ar_verf = _null_auth;
+	reply.acpted_rply.ar_results.where = (caddr_t) result;
+	reply.acpted_rply.ar_results.proc = (xdrproc_t) _xdr_result;
+
+	xdrmem_create(&xdrs, t->rx, t->rx_len, XDR_DECODE);
+	ok = xdr_replymsg(&xdrs, &reply);
+	xdr_destroy(&xdrs);
+	if (!ok || reply.rm_reply.rp_stat != MSG_ACCEPTED || reply.acpted_rply.ar_stat != SUCCESS) {
+		return -1;
+	}
+	return 0;
+}
+
+/* If buf starts with a definite length block header, the length of the whole
+ * block, otherwise 0. */
+static size_t _block_len(const char *buf, size_t len)
+{
+	size_t data_len = 0;
+	size_t ndigits;
+	size_t i;
+
+	if (len < 2 || buf[0] != '#' || buf[1] < '1' || buf[1] > '9') {
+		return 0;
+	}
+	ndigits = buf[1] - '0';
+	if (len < ndigits + 2) {
+		return 0;
+	}
+	for (i = 2; i < ndigits + 2; i++) {
+		if (buf[i] < '0' || buf[i] > '9') {
+			return 0;
+		}
+		data_len = data_len * 10 + (buf[i] - '0');
+	}
+	return ndigits + 2 + data_len;
+}
+
+static void _record_speed(struct _vxi11_transfer *t, size_t size_index, size_t bytes,
+			  unsigned long long elapsed_us)
+{
+	double mb_per_s;
+
+	if (elapsed_us == 0) {
+		elapsed_us = 1;
+	}
+	mb_per_s = (double)bytes / elapsed_us;
+	t->stats.transfers++;
+	t->stats.bytes += bytes;
+	t->stats.last_mb_per_s = mb_per_s;
+	if (bytes < TUNE_MIN_BYTES) {
+		return;
+	}
+	pthread_mutex_lock(&tunes_lock);
+	if (mb_per_s > t->tune->mb_per_s[size_index]) {
+		t->tune->mb_per_s[size_index] = mb_per_s;
+	}
+	pthread_mutex_unlock(&tunes_lock);
+}
+
+ssize_t _vxi11_transfer_receive(VXI11_CLINK * clink, char *buffer, size_t len, unsigned long timeout)
+{
+	struct _vxi11_transfer *t = clink->transfer;
+	struct _vxi11_transfer_call calls[TRANSFER_DEPTH];
+	struct _vxi11_transfer_result result;
+	struct _vxi11_transfer_call *call;
+	unsigned long long start = _vxi11_now_us();
+	size_t request_size;
+	size_t size_index;
+	size_t pos = 0;
+	size_t issued = 0;	/* bytes asked for by the reads in flight */
+	size_t limit;
+	size_t block;
+	int head = 0;
+	int in_flight = 0;
+	int end = 0;
+	ssize_t ret = 0;
+	int tuned;
+
+	pthread_mutex_lock(&tunes_lock);
+	size_index = _choose(t->tune, &tuned);
+	pthread_mutex_unlock(&tunes_lock);
+	request_size = request_sizes[size_index];
+	t->stats.request_size = request_size;
+	t->stats.tuned = tuned;
+	_set_rcvbuf(t, request_size);
+
+	while (1) {
+		/* Several reads when the rest of the block is known, otherwise
+		 * one at a time as vxi11_receive() does */
+		while (!end && ret == 0 && in_flight < (t->remaining ? TRANSFER_DEPTH : 1)) {
+			limit = len - pos;
+			if (t->remaining && t->remaining < limit) {
+				limit = t->remaining;
+			}
+			if (issued >= limit) {
+				break;
+			}
+			call = &calls[(head + in_flight) % TRANSFER_DEPTH];
+			call->parms.lid = clink->link->lid;
+			call->parms.requestSize = limit - issued;
+			if (t->remaining && call->parms.requestSize > request_size) {
+				call->parms.requestSize = request_size;
+			}
+			call->parms.io_timeout = timeout;
+			call->parms.lock_timeout = clink->lock_timeout;
+			call->parms.flags = LOCK_FLAGS(clink);
+			call->parms.termChar = 0;
+			if (_send_call(clink, call)) {
+				_vxi11_error("vxi11_receive", RPC_CANTSEND, 0, pos);
+				ret = -VXI11_NULL_READ_RESP;
+				if (t->mid_record) {
+					/* Nothing more can be read either */
+					in_flight = 0;
+				}
+				break;
+			}
+			issued += call->parms.requestSize;
+			in_flight++;
+		}
+		if (in_flight == 0) {
+			break;
+		}
+
+		call = &calls[head];
+		head = (head + 1) % TRANSFER_DEPTH;
+		in_flight--;
+		issued -= call->parms.requestSize;
+		if (_recv_reply(t, call, &result, buffer + pos, end || ret ? 0 : call->parms.requestSize)) {
+			_vxi11_capture(device_read, (xdrproc_t) xdr_Device_ReadParms, &call->parms,
+				       (xdrproc_t) xdr_Device_ReadResp, NULL, call->capture);
+			if (!end && ret == 0) {
+				_vxi11_error("vxi11_receive", RPC_CANTRECV, 0, pos);
+				ret = -VXI11_NULL_READ_RESP;
+			}
+			/* Don't wait for the rest. Replies to reads still in
+			 * flight arrive as whole records, and are skipped by
+			 * their xid by whichever call reads next. */
+			break;
+		}
+		_vxi11_capture(device_read, (xdrproc_t) xdr_Device_ReadParms, &call->parms,
+			       (xdrproc_t) xdr_Device_ReadResp, &result.resp, call->capture);
+		if (end || ret) {
+			/* Draining reads sent before the reply ended or failed */
+			continue;
+		}
+		if (result.resp.error != 0) {
+			_vxi11_error("vxi11_receive", 0, result.resp.error, pos);
+			_vxi11_log(VXI11_LOG_ERROR, "vxi11_receive: read error: %d", (int)result.resp.error);
+			ret = -(ssize_t)result.resp.error;
+			continue;
+		}
+		if (!t->in_reply) {
+			block = _block_len(buffer, result.resp.data.data_len);
+			t->remaining = block > result.resp.data.data_len ? block - result.resp.data.data_len : 0;
+		} else if (t->remaining) {
+			t->remaining -= result.resp.data.data_len < t->remaining ? result.resp.data.data_len : t->remaining;
+		}
+		t->in_reply = 1;
+		pos += result.resp.data.data_len;
+		if (result.resp.reason & (RCV_END_BIT | RCV_CHR_BIT)) {
+			if (in_flight > 0) {
+				_vxi11_log(VXI11_LOG_WARNING, "vxi11_receive: reply ended before the end of its block");
+			}
+			end = 1;
+		}
+	}
+
+	if (t->mid_record) {
+		/* Given up part way through a record, and the next call can't
+		 * start there */
+		t->mid_record = 0;
+		_vxi11_connection_lost(clink);
+		ret = -17;
+	}
+	if (ret < 0 || end) {
+		t->remaining = 0;
+		t->in_reply = 0;
+	}
+	if (ret < 0) {
+		return ret;
+	}
+	_record_speed(t, size_index, pos, _vxi11_now_us() - start);
+	return end ? (ssize_t)pos : -100;
+}
+
+void _vxi11_transfer_sent(VXI11_CLINK * clink)
+{
+	clink->transfer->remaining = 0;
+	clink->transfer->in_reply = 0;
+}
+
+void _vxi11_transfer_free(VXI11_CLINK * clink)
+{
+	if (!clink->transfer) {
+		return;
+	}
+	free(clink->transfer->rx);
+	free(clink->transfer);
+	clink->transfer = NULL;
+}
+
+int vxi11_set_large_transfers(VXI11_CLINK * clink, int enable)
+{
+	struct _vxi11_transfer *t;
+	int fd;
+
+	if (clink->broker || clink->socket || clink->hislip) {
+		return -8;
+	}
+	if (!enable) {
+		_vxi11_transfer_free(clink);
+		return 0;
+	}
+	if (clink->transfer) {
+		return 0;
+	}
+	fd = vxi11_async_fd(clink);
+	if (fd < 0) {
+		return -8;
+	}
+	t = (struct _vxi11_transfer *)calloc(1, sizeof(struct _vxi11_transfer));
+	if (!t) {
+		return -9;
+	}
+	t->tune = _find_tune(fd);
+	if (!t->tune) {
+		free(t);
+		return -9;
+	}
+	t->fd = fd;
+	/* Keep well clear of the xids that clnt_call() is using. */
+	t->xid = (u_int32_t)(_vxi11_now_ms() << 16) ^ (u_int32_t)(uintptr_t)clink ^ 0x5a5a0000;
+	clink->transfer = t;
+	return 0;
+}
+
+int vxi11_transfer_stats(VXI11_CLINK * clink, VXI11_TRANSFER_STATS * stats)
+{
+	if (!clink->transfer || !stats) {
+		return -5;
+	}
+	*stats = clink->transfer->stats;
+	return 0;
+}
+
+#endif
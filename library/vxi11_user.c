@@ -27,28 +27,18 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "vxi11_user.h"
+#include "vxi11_internal.h"
+#include "vxi11_broker.h"
 
 #ifdef WIN32
-#  include <visa.h>
+#  include <windows.h>
 #else
-#  include <rpc/rpc.h>
-#  include "vxi11.h"
+#  include <pthread.h>
+#  include <time.h>
+#  include <netdb.h>
+#  include <netinet/in.h>
 #endif
 
-#define	VXI11_CLIENT		CLIENT
-#define	VXI11_LINK		Create_LinkResp
-
-struct _VXI11_CLINK {
-#ifdef WIN32
-	ViSession rm;
-	ViSession session;
-#else
-	VXI11_CLIENT *client;
-	VXI11_LINK *link;
-#endif
-};
-
 /***************************************************************************** 
  * GENERAL NOTES
  *****************************************************************************
@@ -65,19 +55,30 @@ struct _VXI11_CLINK {
 
 struct _vxi11_client_t {
 	struct _vxi11_client_t *next;
-	char address[20];
+	char address[64];	/* room for "host:port" */
 #ifndef WIN32
 	CLIENT *client_address;
 #endif
 	int link_count;
+	int lost;		/* a call was abandoned part way through a record,
+				   see _vxi11_connection_lost() */
 };
 
 static struct _vxi11_client_t *VXI11_CLIENTS = NULL;
+#ifndef WIN32
+/* Held while VXI11_CLIENTS or a link_count is looked at or changed, but not
+ * across calls to the instrument, so that devices at different addresses
+ * can be opened and closed from different threads at once. */
+static pthread_mutex_t VXI11_CLIENTS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 /* Internal function declarations. */
 static int _vxi11_open_link(VXI11_CLINK * clink, const char *address,
 			    char *device);
 static int _vxi11_close_link(VXI11_CLINK * clink, const char *address);
+#ifndef WIN32
+static CLIENT *_vxi11_clnt_create(const char *address);
+#endif
 
 
 int vxi11_lib_version(int *major, int *minor, int *revision)
@@ -89,6 +90,37 @@ int vxi11_lib_version(int *major, int *minor, int *revision)
 }
 
 
+unsigned long _vxi11_now_ms(void)
+{
+#ifdef WIN32
+	return (unsigned long)GetTickCount();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+unsigned long long _vxi11_now_us(void)
+{
+#ifdef WIN32
+	LARGE_INTEGER count;
+	LARGE_INTEGER freq;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (unsigned long long)(count.QuadPart / freq.QuadPart) * 1000000
+	    + (unsigned long long)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+
 /*****************************************************************************
  * KEY USER FUNCTIONS - USE THESE FROM YOUR PROGRAMS OR INSTRUMENT LIBRARIES *
  *****************************************************************************/
@@ -106,6 +138,10 @@ int vxi11_open_device(VXI11_CLINK **clink, const char *address, char *device)
 #else
 	int ret;
 	struct _vxi11_client_t *tail, *client = NULL;
+	const char *broker_path;
+	char host[256];
+	char sub[32];
+	unsigned short port;
 #endif
 	char default_device[6] = "inst0";
 	char *use_device;
@@ -124,31 +160,74 @@ int vxi11_open_device(VXI11_CLINK **clink, const char *address, char *device)
 #ifdef WIN32
 	status = viOpenDefaultRM(&clink->rm);
 	if (status != VI_SUCCESS) {
-		viStatusDesc(NULL, status, buf);
-		printf("%s\n", buf);
+		_vxi11_error("vxi11_open_device", status, 0, 0);
+		if (_vxi11_log_enabled(VXI11_LOG_ERROR)) {
+			viStatusDesc(NULL, status, buf);
+			_vxi11_log(VXI11_LOG_ERROR, "%s", buf);
+		}
 		free(*clink);
 		*clink = NULL;
 		return 1;
 	}
 	viOpen(clink->rm, (char *)address, VI_NULL, VI_NULL, &clink->session);
 	if (status != VI_SUCCESS) {
-		viStatusDesc(clink->rm, status, buf);
-		printf("%s\n", buf);
+		_vxi11_error("vxi11_open_device", status, 0, 0);
+		if (_vxi11_log_enabled(VXI11_LOG_ERROR)) {
+			viStatusDesc(clink->rm, status, buf);
+			_vxi11_log(VXI11_LOG_ERROR, "%s", buf);
+		}
 		free(*clink);
 		*clink = NULL;
 		return 1;
 	}
 #else
+	_vxi11_capture_env();
+
+	/* If there is a broker, it holds the real link for us */
+	broker_path = getenv(VXI11_BROKER_ENV);
+	if (broker_path && broker_path[0]) {
+		if (_vxi11_broker_open(*clink, broker_path, address, use_device)) {
+			free(*clink);
+			*clink = NULL;
+			return 1;
+		}
+		return 0;
+	}
+
+	/* Raw SCPI over TCP, each link has its own connection */
+	if (_vxi11_socket_address(address, host, sizeof(host), &port)) {
+		if (_vxi11_socket_open(*clink, host, port)) {
+			free(*clink);
+			*clink = NULL;
+			return 1;
+		}
+		return 0;
+	}
+
+	/* HiSLIP, likewise */
+	if (_vxi11_hislip_address(address, use_device, host, sizeof(host), &port, sub, sizeof(sub))) {
+		if (_vxi11_hislip_open(*clink, host, port, sub)) {
+			free(*clink);
+			*clink = NULL;
+			return 1;
+		}
+		return 0;
+	}
+
 	/* Have a look to see if we've already initialised an instrument with
 	 * this address */
+	pthread_mutex_lock(&VXI11_CLIENTS_LOCK);
 	tail = VXI11_CLIENTS;
 	while (tail) {
-		if (strcmp(address, tail->address) == 0) {
+		if (strcmp(address, tail->address) == 0 && !tail->lost) {
 			client = tail;
+			/* Keep it from being closed under us */
+			client->link_count++;
 			break;
 		}
 		tail = tail->next;
 	}
+	pthread_mutex_unlock(&VXI11_CLIENTS_LOCK);
 
 	/* Couldn't find a match, must be a new address */
 	if (!client) {
@@ -163,12 +242,13 @@ int vxi11_open_device(VXI11_CLINK **clink, const char *address, char *device)
 			return 1;
 		}
 
-		(*clink)->client =
-		    clnt_create(address, DEVICE_CORE, DEVICE_CORE_VERSION,
-				"tcp");
+		(*clink)->client = _vxi11_clnt_create(address);
 
 		if ((*clink)->client == NULL) {
-			clnt_pcreateerror(address);
+			_vxi11_error("vxi11_open_device", rpc_createerr.cf_stat, 0, 0);
+			if (_vxi11_log_enabled(VXI11_LOG_ERROR)) {
+				_vxi11_log(VXI11_LOG_ERROR, "%s", clnt_spcreateerror(address));
+			}
 			free(client);
 			free(*clink);
 			*clink = NULL;
@@ -183,17 +263,20 @@ int vxi11_open_device(VXI11_CLINK **clink, const char *address, char *device)
 			return 1;
 		}
 
-		strncpy(client->address, address, 20);
+		strncpy(client->address, address, sizeof(client->address) - 1);
 		client->client_address = (*clink)->client;
 		client->link_count = 1;
+		(*clink)->connection = client;
+		pthread_mutex_lock(&VXI11_CLIENTS_LOCK);
 		client->next = VXI11_CLIENTS;
 		VXI11_CLIENTS = client;
+		pthread_mutex_unlock(&VXI11_CLIENTS_LOCK);
 	} else {
 		/* Copy the client pointer address. Just establish a new link
-		 *  not a new client). Add one to the link count */
+		 *  not a new client). The link count was added to above */
 		(*clink)->client = client->client_address;
+		(*clink)->connection = client;
 		ret = _vxi11_open_link((*clink), address, use_device);
-		client->link_count++;
 	}
 #endif
 	return 0;
@@ -213,10 +296,35 @@ int vxi11_close_device(VXI11_CLINK * clink, const char *address)
 #else
 	struct _vxi11_client_t *tail, *last = NULL, *client = NULL;
 
-	/* Which instrument are we referring to? */
+	if (clink->broker) {
+		_vxi11_broker_close(clink);
+		_vxi11_cache_free(clink);
+		_vxi11_pool_free(clink);
+		free(clink);
+		return 0;
+	}
+	if (clink->socket) {
+		_vxi11_socket_close(clink);
+		_vxi11_cache_free(clink);
+		_vxi11_pool_free(clink);
+		free(clink);
+		return 0;
+	}
+	if (clink->hislip) {
+		_vxi11_hislip_close(clink);
+		_vxi11_cache_free(clink);
+		_vxi11_pool_free(clink);
+		free(clink);
+		return 0;
+	}
+
+	/* Which instrument are we referring to? A lost connection may share its
+	 * address with a newer one, so go by the link's own. */
+	pthread_mutex_lock(&VXI11_CLIENTS_LOCK);
 	tail = VXI11_CLIENTS;
 	while (tail) {
-		if (strncmp(address, tail->address, 20) == 0) {
+		if (tail == clink->connection
+		    && strncmp(address, tail->address, sizeof(tail->address) - 1) == 0) {
 			client = tail;
 			break;
 		}
@@ -224,32 +332,41 @@ int vxi11_close_device(VXI11_CLINK * clink, const char *address)
 		tail = tail->next;
 	}
 
+	if (client) {
+		client->link_count--;
+		if (client->link_count == 0) {
+			if (last) {
+				last->next = client->next;
+			} else {
+				VXI11_CLIENTS = client->next;
+			}
+		}
+	}
+	pthread_mutex_unlock(&VXI11_CLIENTS_LOCK);
+
 	/* Something's up if we can't find the address! */
 	if (!client) {
-		printf
-		    ("vxi11_close_device: error: I have no record of you ever opening device\n");
-		printf("                    with address %s\n", address);
+		_vxi11_error("vxi11_close_device", 0, 0, 0);
+		_vxi11_log(VXI11_LOG_ERROR, "vxi11_close_device: no device was opened with address %s",
+			   address);
 		ret = -4;
 	} else {		/* Found the address, there's more than one link to that instrument,
 				 * so keep track and just close the link */
-		if (client->link_count > 1) {
+		if (client->link_count > 0) {
 			ret = _vxi11_close_link(clink, address);
-			client->link_count--;
 		}
 		/* Found the address, it's the last link, so close the device (link
 		 * AND client) */
 		else {
 			ret = _vxi11_close_link(clink, address);
 			clnt_destroy(clink->client);
-
-			if (last) {
-				last->next = client->next;
-			} else {
-				VXI11_CLIENTS = client->next;
-			}
 		}
 	}
+	_vxi11_async_free(clink);
+	_vxi11_transfer_free(clink);
 #endif
+	_vxi11_cache_free(clink);
+	_vxi11_pool_free(clink);
 	free(clink);
 	return ret;
 }
@@ -292,10 +409,32 @@ int vxi11_send(VXI11_CLINK * clink, const char *cmd, size_t len)
 #else
 	Device_WriteParms write_parms;
 	char *send_cmd;
+	enum clnt_stat rpc_status;
+	unsigned long long capture;
 #endif
 	size_t bytes_left = len;
 	ssize_t write_count;
 
+	_vxi11_cache_sent(clink, cmd, len);
+
+#ifndef WIN32
+	if (clink->broker) {
+		return _vxi11_broker_send(clink, cmd, len);
+	}
+	if (clink->socket) {
+		return _vxi11_socket_send(clink, cmd, len);
+	}
+	if (clink->hislip) {
+		return _vxi11_hislip_send(clink, cmd, len);
+	}
+	if (clink->transfer) {
+		_vxi11_transfer_sent(clink);
+	}
+	if (_vxi11_connection_check(clink, "vxi11_send")) {
+		return -17;
+	}
+#endif
+
 #ifdef WIN32
 	send_cmd = (unsigned char *)malloc(len);
 	if (!send_cmd) {
@@ -311,8 +450,11 @@ int vxi11_send(VXI11_CLINK * clink, const char *cmd, size_t len)
 			bytes_left -= write_count;
 		} else {
 			free(send_cmd);
-			viStatusDesc(clink->session, status, buf);
-			printf("%s\n", buf);
+			_vxi11_error("vxi11_send", status, 0, len - bytes_left);
+			if (_vxi11_log_enabled(VXI11_LOG_ERROR)) {
+				viStatusDesc(clink->session, status, buf);
+				_vxi11_log(VXI11_LOG_ERROR, "%s", buf);
+			}
 			return status;
 		}
 	}
@@ -325,7 +467,7 @@ int vxi11_send(VXI11_CLINK * clink, const char *cmd, size_t len)
 
 	write_parms.lid = clink->link->lid;
 	write_parms.io_timeout = VXI11_DEFAULT_TIMEOUT;
-	write_parms.lock_timeout = VXI11_DEFAULT_TIMEOUT;
+	write_parms.lock_timeout = clink->lock_timeout;
 
 /* We can only write (link->maxRecvSize) bytes at a time, so we sit in a loop,
  * writing a chunk at a time, until we're done. */
@@ -334,11 +476,12 @@ int vxi11_send(VXI11_CLINK * clink, const char *cmd, size_t len)
 		Device_WriteResp write_resp;
 		memset(&write_resp, 0, sizeof(write_resp));
 
-		if (bytes_left <= clink->link->maxRecvSize) {
-			write_parms.flags = 8;
+		if (bytes_left <= clink->link->maxRecvSize
+		    || (clink->link->maxRecvSize == 0 && bytes_left <= 4096)) {
+			write_parms.flags = FLAG_END | LOCK_FLAGS(clink);
 			write_parms.data.data_len = bytes_left;
 		} else {
-			write_parms.flags = 0;
+			write_parms.flags = LOCK_FLAGS(clink);
 			/* We need to check that maxRecvSize is a sane value (ie >0). Believe it
 			 * or not, on some versions of Agilent Infiniium scope firmware the scope
 			 * returned "0", which breaks Rule B.6.3 of the VXI-11 protocol. Nevertheless
@@ -352,9 +495,14 @@ int vxi11_send(VXI11_CLINK * clink, const char *cmd, size_t len)
 		}
 		write_parms.data.data_val = send_cmd + (len - bytes_left);
 
-		if (device_write_1(&write_parms, &write_resp, clink->client) !=
-		    RPC_SUCCESS) {
+		capture = _vxi11_capture_begin();
+		rpc_status = device_write_1(&write_parms, &write_resp, clink->client);
+		_vxi11_capture(device_write, (xdrproc_t) xdr_Device_WriteParms, &write_parms,
+			       (xdrproc_t) xdr_Device_WriteResp,
+			       rpc_status == RPC_SUCCESS ? &write_resp : NULL, capture);
+		if (rpc_status != RPC_SUCCESS) {
 			free(send_cmd);
+			_vxi11_error("vxi11_send", rpc_status, 0, len - bytes_left);
 			return -VXI11_NULL_WRITE_RESP;	/* The instrument did not acknowledge the write, just completely
 							   dropped it. There was no vxi11 comms error as such, the 
 							   instrument is just being rude. Usually occurs when the instrument
@@ -362,11 +510,22 @@ int vxi11_send(VXI11_CLINK * clink, const char *cmd, size_t len)
 							   line causes a seg fault */
 		}
 		if (write_resp.error != 0) {
-			printf("vxi11_user: write error: %d\n",
-			       (int)write_resp.error);
+			_vxi11_error("vxi11_send", 0, write_resp.error, len - bytes_left);
+			_vxi11_log(VXI11_LOG_ERROR, "vxi11_send: write error: %d",
+				   (int)write_resp.error);
 			free(send_cmd);
 			return -(write_resp.error);
 		}
+		if ((write_resp.size == 0 && write_parms.data.data_len > 0)
+		    || write_resp.size > write_parms.data.data_len) {
+			/* A confused instrument: we would either run off the end or
+			 * never finish, and can't tell how much was taken */
+			_vxi11_error("vxi11_send", RPC_CANTDECODERES, 0, len - bytes_left);
+			_vxi11_log(VXI11_LOG_ERROR, "vxi11_send: instrument accepted %lu of %lu bytes",
+				   (unsigned long)write_resp.size, (unsigned long)write_parms.data.data_len);
+			free(send_cmd);
+			return -VXI11_NULL_WRITE_RESP;
+		}
 		bytes_left -= write_resp.size;
 	} while (bytes_left > 0);
 #endif
@@ -378,10 +537,6 @@ int vxi11_send(VXI11_CLINK * clink, const char *cmd, size_t len)
 /* RECEIVE FUNCTIONS *
  * ================= */
 
-#define RCV_END_BIT	0x04	// An end indicator has been read
-#define RCV_CHR_BIT	0x02	// A termchr is set in flags and a character which matches termChar is transferred
-#define RCV_REQCNT_BIT	0x01	// requestSize bytes have been transferred.  This includes a request size of zero.
-
 ssize_t vxi11_receive(VXI11_CLINK * clink, char *buffer, size_t len)
 {
 	return vxi11_receive_timeout(clink, buffer, len, VXI11_READ_TIMEOUT);
@@ -390,18 +545,58 @@ ssize_t vxi11_receive(VXI11_CLINK * clink, char *buffer, size_t len)
 ssize_t vxi11_receive_timeout(VXI11_CLINK * clink, char *buffer, size_t len,
 		   unsigned long timeout)
 {
-	size_t curr_pos = 0;
 #ifdef WIN32
+	size_t curr_pos = 0;
+
 	viRead(clink->session, (unsigned char *)buffer, len, &curr_pos);
+	return (curr_pos);
 #else
+	ssize_t ret;
+
+	ret = _vxi11_receive(clink, buffer, len, timeout);
+	if (ret == -100) {
+		_vxi11_error("vxi11_receive", 0, 0, len);
+		_vxi11_log(VXI11_LOG_ERROR, "vxi11_receive: buffer too small. Read %d bytes without hitting terminator.",
+			   (int)len);
+	}
+	return ret;
+#endif
+}
+
+#ifndef WIN32
+/* vxi11_receive_timeout() without reporting a full buffer as an error, so
+ * that a long response can be read a piece at a time: -100 means buffer has
+ * been filled and there is more to come. */
+ssize_t _vxi11_receive(VXI11_CLINK * clink, char *buffer, size_t len,
+		       unsigned long timeout)
+{
+	size_t curr_pos = 0;
 	Device_ReadParms read_parms;
 	Device_ReadResp read_resp;
+	enum clnt_stat rpc_status;
+	unsigned long long capture;
+
+	if (clink->broker) {
+		return _vxi11_broker_receive(clink, buffer, len, timeout);
+	}
+	if (clink->socket) {
+		return _vxi11_socket_receive(clink, buffer, len, timeout);
+	}
+	if (clink->hislip) {
+		return _vxi11_hislip_receive(clink, buffer, len, timeout);
+	}
+	if (_vxi11_connection_check(clink, "vxi11_receive")) {
+		return -17;
+	}
+	if (clink->transfer) {
+		return _vxi11_transfer_receive(clink, buffer, len, timeout);
+	}
 
 	read_parms.lid = clink->link->lid;
 	read_parms.requestSize = len;
 	read_parms.io_timeout = timeout;	/* in ms */
-	read_parms.lock_timeout = timeout;	/* in ms */
-	read_parms.flags = 0;
+	read_parms.lock_timeout = clink->lock_timeout;	/* in ms */
+	read_parms.flags = LOCK_FLAGS(clink);
 	read_parms.termChar = 0;
 
 	do {
@@ -410,7 +605,13 @@ ssize_t vxi11_receive_timeout(VXI11_CLINK * clink, char *buffer, size_t len,
 		read_resp.data.data_val = buffer + curr_pos;
 		read_parms.requestSize = len - curr_pos;	// Never request more total data than originally specified in len
 
-		if (device_read_1(&read_parms, &read_resp, clink->client) != RPC_SUCCESS) {
+		capture = _vxi11_capture_begin();
+		rpc_status = device_read_1(&read_parms, &read_resp, clink->client);
+		_vxi11_capture(device_read, (xdrproc_t) xdr_Device_ReadParms, &read_parms,
+			       (xdrproc_t) xdr_Device_ReadResp,
+			       rpc_status == RPC_SUCCESS ? &read_resp : NULL, capture);
+		if (rpc_status != RPC_SUCCESS) {
+			_vxi11_error("vxi11_receive", rpc_status, 0, curr_pos);
 			return -VXI11_NULL_READ_RESP;	/* there is nothing to read. Usually occurs after sending a query
 							   which times out on the instrument. If we don't check this first,
 							   then the following line causes a seg fault */
@@ -435,7 +636,9 @@ ssize_t vxi11_receive_timeout(VXI11_CLINK * clink, char *buffer, size_t len,
 			 *  29  channel already established
 			 */
 
-			printf("vxi11_user: read error: %d\n", (int)read_resp.error);
+			_vxi11_error("vxi11_receive", 0, read_resp.error, curr_pos);
+			_vxi11_log(VXI11_LOG_ERROR, "vxi11_receive: read error: %d",
+				   (int)read_resp.error);
 			return -(read_resp.error);
 		}
 
@@ -445,14 +648,12 @@ ssize_t vxi11_receive_timeout(VXI11_CLINK * clink, char *buffer, size_t len,
 		if ((read_resp.reason & RCV_END_BIT) || (read_resp.reason & RCV_CHR_BIT)) {
 			break;
 		} else if (curr_pos == len) {
-			printf("xvi11_user: read error: buffer too small. Read %d bytes without hitting terminator.\n",
-			     (int)curr_pos);
 			return -100;
 		}
 	} while (1);
-#endif
 	return (curr_pos);	/*actual number of bytes received */
 }
+#endif
 
 /*****************************************************************************
  * USEFUL ADDITIONAL HIGHER LEVER USER FUNCTIONS - USE THESE FROM YOUR       *
@@ -499,41 +700,74 @@ ssize_t vxi11_receive_data_block(VXI11_CLINK * clink, char *buffer,
  * 11 (#9 + 9 digits) */
 	size_t necessary_buffer_size;
 	char *in_buffer;
-	int ret;
+	ssize_t ret;
 	int ndigits;
 	size_t returned_bytes;
-	int l;
 	char scan_cmd[20];
 	necessary_buffer_size = len + 12;
-	in_buffer = (char *)malloc(necessary_buffer_size);
+	/* One more byte, so that sscanf() stops at the end of what arrived */
+	in_buffer = (char *)malloc(necessary_buffer_size + 1);
 	if (!in_buffer) {
+		_vxi11_error("vxi11_receive_data_block", 0, 0, 0);
 		return -1;
 	}
 	ret = vxi11_receive_timeout(clink, in_buffer, necessary_buffer_size, timeout);
 	if (ret < 0) {
+		free(in_buffer);
 		return ret;
 	}
-	if (in_buffer[0] != '#') {
-		printf("vxi11_user: data block error: data block does not begin with '#'\n");
-		printf("First 20 characters received were: '");
-		for (l = 0; l < 20; l++) {
-			printf("%c", in_buffer[l]);
-		}
-		printf("'\n");
+	in_buffer[ret] = '\0';
+	if (ret == 0 || in_buffer[0] != '#') {
+		_vxi11_error("vxi11_receive_data_block", 0, 0, ret);
+		_vxi11_log(VXI11_LOG_ERROR, "vxi11_receive_data_block: data block does not begin with '#'. "
+			   "First characters received were: '%.*s'", (int)(ret < 20 ? ret : 20), in_buffer);
+		free(in_buffer);
 		return -3;
 	}
 
 	/* first find out how many digits */
-	sscanf(in_buffer, "#%1d", &ndigits);
+	ndigits = 0;
+	if (sscanf(in_buffer, "#%1d", &ndigits) != 1 || ndigits < 0) {
+		_vxi11_error("vxi11_receive_data_block", 0, 0, ret);
+		_vxi11_log(VXI11_LOG_ERROR, "vxi11_receive_data_block: data block has no digit count. "
+			   "First characters received were: '%.*s'", (int)(ret < 20 ? ret : 20), in_buffer);
+		free(in_buffer);
+		return -3;
+	}
 	/* some instruments, if there is a problem acquiring the data, return only "#0" */
 	if (ndigits > 0) {
+		/* The whole header has to have arrived before it can be read */
+		if (ret < ndigits + 2) {
+			_vxi11_error("vxi11_receive_data_block", 0, 0, ret);
+			_vxi11_log(VXI11_LOG_ERROR, "vxi11_receive_data_block: only %ld bytes received, "
+				   "the header needs %d", (long)ret, ndigits + 2);
+			free(in_buffer);
+			return -3;
+		}
 		/* now that we know, we can convert the next <ndigits> bytes into an unsigned long */
 		sprintf(scan_cmd, "#%%1d%%%dlu", ndigits);
-		sscanf(in_buffer, scan_cmd, &ndigits, &returned_bytes);
+		returned_bytes = 0;
+		if (sscanf(in_buffer, scan_cmd, &ndigits, &returned_bytes) != 2) {
+			_vxi11_error("vxi11_receive_data_block", 0, 0, ret);
+			_vxi11_log(VXI11_LOG_ERROR, "vxi11_receive_data_block: data block length is not a number. "
+				   "First characters received were: '%.*s'", (int)(ret < 20 ? ret : 20), in_buffer);
+			free(in_buffer);
+			return -3;
+		}
+		/* Never trust the header further than what actually arrived */
+		if (returned_bytes > len || returned_bytes > (size_t)(ret - (ndigits + 2))) {
+			_vxi11_error("vxi11_receive_data_block", 0, 0, ret);
+			_vxi11_log(VXI11_LOG_ERROR, "vxi11_receive_data_block: header claims %lu bytes, "
+				   "but only %ld were received", (unsigned long)returned_bytes,
+				   (long)(ret - (ndigits + 2)));
+			free(in_buffer);
+			return -3;
+		}
 		memcpy(buffer, in_buffer + (ndigits + 2), returned_bytes);
 		free(in_buffer);
 		return (ssize_t )returned_bytes;
 	} else {
+		free(in_buffer);
 		return 0;
 	}
 }
@@ -548,38 +782,240 @@ int vxi11_send_and_receive(VXI11_CLINK * clink, const char *cmd, char *buf,
 {
 	int ret;
 	ssize_t bytes_returned;
+
+	if (_vxi11_cache_lookup(clink, cmd, buf, len) >= 0) {
+		return 0;
+	}
+
 	do {
 		ret = vxi11_send(clink, cmd, strlen(cmd));
 		if (ret != 0) {
 			if (ret != -VXI11_NULL_WRITE_RESP) {
-				printf
-				    ("Error: vxi11_send_and_receive: could not send cmd.\n");
-				printf
-				    ("       The function vxi11_send returned %d. ",
-				     ret);
+				_vxi11_log(VXI11_LOG_ERROR, "vxi11_send_and_receive: could not send cmd, "
+					   "vxi11_send returned %d", ret);
 				return -1;
 			} else {
-				printf("(Info: VXI11_NULL_WRITE_RESP in vxi11_send_and_receive, resending query)\n");
+				_vxi11_log(VXI11_LOG_WARNING, "vxi11_send_and_receive: "
+					   "VXI11_NULL_WRITE_RESP, resending query");
 			}
 		}
 
 		bytes_returned = vxi11_receive_timeout(clink, buf, len, timeout);
 		if (bytes_returned <= 0) {
-			if (bytes_returned > -VXI11_NULL_READ_RESP) {
-				printf
-				    ("Error: vxi11_send_and_receive: problem reading reply.\n");
-				printf
-				    ("       The function vxi11_receive returned %ld. ",
-				     bytes_returned);
+			if (bytes_returned != -VXI11_NULL_READ_RESP) {
+				_vxi11_log(VXI11_LOG_ERROR, "vxi11_send_and_receive: problem reading reply, "
+					   "vxi11_receive returned %ld", (long)bytes_returned);
 				return -2;
 			} else {
-				printf("(Info: VXI11_NULL_READ_RESP in vxi11_send_and_receive, resending query)\n");
+				_vxi11_log(VXI11_LOG_WARNING, "vxi11_send_and_receive: "
+					   "VXI11_NULL_READ_RESP, resending query");
 			}
 		}
 	} while (bytes_returned == -VXI11_NULL_READ_RESP || ret == -VXI11_NULL_WRITE_RESP);
+
+	_vxi11_cache_store(clink, cmd, buf, bytes_returned);
+	return 0;
+}
+
+/* DEVICE CLEAR FUNCTION *
+ * ===================== */
+
+int vxi11_device_clear(VXI11_CLINK * clink)
+{
+#ifdef WIN32
+	ViStatus status;
+#else
+	Device_GenericParms generic_parms;
+	Device_Error dev_error;
+	enum clnt_stat rpc_status;
+	unsigned long long capture;
+#endif
+
+	/* Whatever happens, we can no longer trust what we know about the
+	 * instrument's state. */
+	vxi11_cache_clear(clink);
+
+#ifdef WIN32
+	status = viClear(clink->session);
+	if (status != VI_SUCCESS) {
+		return -VXI11_NULL_WRITE_RESP;
+	}
+#else
+	if (clink->broker) {
+		return _vxi11_broker_clear(clink);
+	}
+	if (clink->socket) {
+		return _vxi11_socket_clear(clink);
+	}
+	if (clink->hislip) {
+		return _vxi11_hislip_clear(clink);
+	}
+	if (clink->transfer) {
+		_vxi11_transfer_sent(clink);
+	}
+	if (_vxi11_connection_check(clink, "vxi11_device_clear")) {
+		return -17;
+	}
+
+	generic_parms.lid = clink->link->lid;
+	generic_parms.flags = LOCK_FLAGS(clink);
+	generic_parms.lock_timeout = clink->lock_timeout;
+	generic_parms.io_timeout = VXI11_DEFAULT_TIMEOUT;
+	memset(&dev_error, 0, sizeof(dev_error));
+
+	capture = _vxi11_capture_begin();
+	rpc_status = device_clear_1(&generic_parms, &dev_error, clink->client);
+	_vxi11_capture(device_clear, (xdrproc_t) xdr_Device_GenericParms, &generic_parms,
+		       (xdrproc_t) xdr_Device_Error,
+		       rpc_status == RPC_SUCCESS ? &dev_error : NULL, capture);
+	if (rpc_status != RPC_SUCCESS || dev_error.error != 0) {
+		_vxi11_error("vxi11_device_clear", rpc_status, dev_error.error, 0);
+		return rpc_status != RPC_SUCCESS ? -VXI11_NULL_WRITE_RESP : -(dev_error.error);
+	}
+#endif
 	return 0;
 }
 
+/* LOCK FUNCTIONS *
+ * ============== */
+
+int vxi11_lock(VXI11_CLINK * clink, unsigned long timeout)
+{
+#ifdef WIN32
+	ViStatus status;
+#else
+	Device_LockParms lock_parms;
+	Device_Error dev_error;
+	enum clnt_stat rpc_status;
+	unsigned long long capture;
+#endif
+	unsigned long start = _vxi11_now_ms();
+	int ret = 0;
+
+#ifdef WIN32
+	status = viLock(clink->session, VI_EXCLUSIVE_LOCK, timeout, VI_NULL, VI_NULL);
+	if (status != VI_SUCCESS) {
+		ret = (status == VI_ERROR_TMO) ? -11 : -VXI11_NULL_WRITE_RESP;
+	}
+#else
+	if (clink->broker) {
+		ret = _vxi11_broker_lock(clink, timeout);
+	} else if (clink->socket) {
+		/* Raw sockets have no locking */
+		ret = -8;
+	} else if (clink->hislip) {
+		ret = _vxi11_hislip_lock(clink, timeout);
+	} else if (_vxi11_connection_check(clink, "vxi11_lock")) {
+		ret = -17;
+	} else {
+		lock_parms.lid = clink->link->lid;
+		lock_parms.flags = timeout ? FLAG_WAITLOCK : 0;
+		lock_parms.lock_timeout = timeout;
+		memset(&dev_error, 0, sizeof(dev_error));
+
+		capture = _vxi11_capture_begin();
+		rpc_status = device_lock_1(&lock_parms, &dev_error, clink->client);
+		_vxi11_capture(device_lock, (xdrproc_t) xdr_Device_LockParms, &lock_parms,
+			       (xdrproc_t) xdr_Device_Error,
+			       rpc_status == RPC_SUCCESS ? &dev_error : NULL, capture);
+		if (rpc_status != RPC_SUCCESS) {
+			ret = -VXI11_NULL_WRITE_RESP;
+		} else if (dev_error.error != 0) {
+			ret = -(dev_error.error);
+		}
+		if (ret) {
+			_vxi11_error("vxi11_lock", rpc_status, dev_error.error, 0);
+		}
+	}
+#endif
+
+	clink->lock_wait_ms += _vxi11_now_ms() - start;
+	if (ret == 0) {
+		clink->lock_count++;
+		/* 0 means not held, so never record that as the start time. */
+		clink->locked_since = _vxi11_now_ms() | 1;
+	} else {
+		clink->lock_failed++;
+	}
+	return ret;
+}
+
+int vxi11_unlock(VXI11_CLINK * clink)
+{
+#ifdef WIN32
+	ViStatus status;
+#else
+	Device_Error dev_error;
+	enum clnt_stat rpc_status;
+	unsigned long long capture;
+#endif
+	int ret = 0;
+
+#ifdef WIN32
+	status = viUnlock(clink->session);
+	if (status != VI_SUCCESS) {
+		ret = -12;
+	}
+#else
+	if (clink->broker) {
+		ret = _vxi11_broker_unlock(clink);
+	} else if (clink->socket) {
+		ret = -8;
+	} else if (clink->hislip) {
+		ret = _vxi11_hislip_unlock(clink);
+	} else if (_vxi11_connection_check(clink, "vxi11_unlock")) {
+		ret = -17;
+	} else {
+		memset(&dev_error, 0, sizeof(dev_error));
+		capture = _vxi11_capture_begin();
+		rpc_status = device_unlock_1(&clink->link->lid, &dev_error, clink->client);
+		_vxi11_capture(device_unlock, (xdrproc_t) xdr_Device_Link, &clink->link->lid,
+			       (xdrproc_t) xdr_Device_Error,
+			       rpc_status == RPC_SUCCESS ? &dev_error : NULL, capture);
+		if (rpc_status != RPC_SUCCESS) {
+			ret = -VXI11_NULL_WRITE_RESP;
+		} else if (dev_error.error != 0) {
+			ret = -(dev_error.error);
+		}
+		if (ret) {
+			_vxi11_error("vxi11_unlock", rpc_status, dev_error.error, 0);
+		}
+	}
+#endif
+
+	if (clink->locked_since && ret != -VXI11_NULL_WRITE_RESP) {
+		clink->lock_hold_ms += _vxi11_now_ms() - clink->locked_since;
+		clink->locked_since = 0;
+	}
+	return ret;
+}
+
+void vxi11_set_lock_timeout(VXI11_CLINK * clink, unsigned long timeout)
+{
+	clink->lock_timeout = timeout;
+}
+
+void vxi11_lock_stats(VXI11_CLINK * clink, unsigned long *count,
+		      unsigned long *failed, unsigned long *wait_ms,
+		      unsigned long *hold_ms)
+{
+	if (count) {
+		*count = clink->lock_count;
+	}
+	if (failed) {
+		*failed = clink->lock_failed;
+	}
+	if (wait_ms) {
+		*wait_ms = clink->lock_wait_ms;
+	}
+	if (hold_ms) {
+		*hold_ms = clink->lock_hold_ms;
+		if (clink->locked_since) {
+			*hold_ms += _vxi11_now_ms() - clink->locked_since;
+		}
+	}
+}
+
 /* FUNCTIONS TO RETURN A LONG INTEGER VALUE SENT AS RESPONSE TO A QUERY *
  * ==================================================================== */
 long vxi11_obtain_long_value(VXI11_CLINK * clink, const char *cmd)
@@ -593,7 +1029,7 @@ long vxi11_obtain_long_value_timeout(VXI11_CLINK * clink, const char *cmd,
 	char buf[50];		/* 50=arbitrary length... more than enough for one number in ascii */
 	memset(buf, 0, 50);
 	if (vxi11_send_and_receive(clink, cmd, buf, 50, timeout) != 0) {
-		printf("Returning 0\n");
+		_vxi11_log(VXI11_LOG_ERROR, "vxi11_obtain_long_value: returning 0");
 		return 0;
 	}
 	return strtol(buf, (char **)NULL, 10);
@@ -613,7 +1049,7 @@ double vxi11_obtain_double_value_timeout(VXI11_CLINK * clink, const char *cmd,
 	double val;
 	memset(buf, 0, 50);
 	if (vxi11_send_and_receive(clink, cmd, buf, 50, timeout) != 0) {
-		printf("Returning 0.0\n");
+		_vxi11_log(VXI11_LOG_ERROR, "vxi11_obtain_double_value: returning 0.0");
 		return 0.0;
 	}
 	val = strtod(buf, (char **)NULL);
@@ -628,11 +1064,74 @@ double vxi11_obtain_double_value_timeout(VXI11_CLINK * clink, const char *cmd,
 /* OPEN FUNCTIONS *
  * ============== */
 
+#ifndef WIN32
+/* Create the RPC client for an address. "host:port" connects straight to
+ * that port, bypassing the portmapper; anything else is looked up through
+ * the portmapper as usual. */
+static CLIENT *_vxi11_clnt_create(const char *address)
+{
+	struct addrinfo hints, *res;
+	struct sockaddr_in sin;
+	const char *colon = strchr(address, ':');
+	char host[64];
+	char *end;
+	unsigned long port;
+	int sock = RPC_ANYSOCK;
+
+	if (!colon || strchr(colon + 1, ':')
+	    || (size_t)(colon - address) >= sizeof(host)) {
+		return clnt_create(address, DEVICE_CORE, DEVICE_CORE_VERSION, "tcp");
+	}
+	port = strtoul(colon + 1, &end, 10);
+	if (*end != '\0' || port == 0 || port > 65535) {
+		rpc_createerr.cf_stat = RPC_UNKNOWNADDR;
+		return NULL;
+	}
+	memcpy(host, address, colon - address);
+	host[colon - address] = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+		rpc_createerr.cf_stat = RPC_UNKNOWNHOST;
+		return NULL;
+	}
+	memcpy(&sin, res->ai_addr, sizeof(sin));
+	freeaddrinfo(res);
+	sin.sin_port = htons((unsigned short)port);
+
+	return clnttcp_create(&sin, DEVICE_CORE, DEVICE_CORE_VERSION, &sock, 0, 0);
+}
+#endif
+
+#ifndef WIN32
+void _vxi11_connection_lost(VXI11_CLINK * clink)
+{
+	if (clink->connection && !clink->connection->lost) {
+		clink->connection->lost = 1;
+		_vxi11_log(VXI11_LOG_ERROR, "%s: a call was abandoned part way through, the connection can't be used again",
+			   clink->connection->address);
+	}
+}
+
+int _vxi11_connection_check(VXI11_CLINK * clink, const char *function)
+{
+	if (clink->connection && clink->connection->lost) {
+		_vxi11_error(function, RPC_CANTSEND, 0, 0);
+		return 1;
+	}
+	return 0;
+}
+#endif
+
 static int _vxi11_open_link(VXI11_CLINK * clink, const char *address,
 			    char *device)
 {
 #ifndef WIN32
 	Create_LinkParms link_parms;
+	enum clnt_stat rpc_status;
+	unsigned long long capture;
 
 	/* Set link parameters */
 	link_parms.clientId = (long)clink->client;
@@ -642,9 +1141,16 @@ static int _vxi11_open_link(VXI11_CLINK * clink, const char *address,
 
 	clink->link = (Create_LinkResp *) calloc(1, sizeof(Create_LinkResp));
 
-	if (create_link_1(&link_parms, clink->link, clink->client) !=
-	    RPC_SUCCESS) {
-		clnt_perror(clink->client, address);
+	capture = _vxi11_capture_begin();
+	rpc_status = create_link_1(&link_parms, clink->link, clink->client);
+	_vxi11_capture(create_link, (xdrproc_t) xdr_Create_LinkParms, &link_parms,
+		       (xdrproc_t) xdr_Create_LinkResp,
+		       rpc_status == RPC_SUCCESS ? clink->link : NULL, capture);
+	if (rpc_status != RPC_SUCCESS) {
+		_vxi11_error("vxi11_open_device", rpc_status, 0, 0);
+		if (_vxi11_log_enabled(VXI11_LOG_ERROR)) {
+			_vxi11_log(VXI11_LOG_ERROR, "%s", clnt_sperror(clink->client, address));
+		}
 		return -2;
 	}
 #endif
@@ -658,11 +1164,25 @@ static int _vxi11_close_link(VXI11_CLINK * clink, const char *address)
 {
 #ifndef WIN32
 	Device_Error dev_error;
+	enum clnt_stat rpc_status;
+	unsigned long long capture;
 	memset(&dev_error, 0, sizeof(dev_error));
 
-	if (destroy_link_1(&clink->link->lid, &dev_error, clink->client) !=
-	    RPC_SUCCESS) {
-		clnt_perror(clink->client, address);
+	if (clink->connection && clink->connection->lost) {
+		/* Nothing can be read back over it, just let it go */
+		return 0;
+	}
+
+	capture = _vxi11_capture_begin();
+	rpc_status = destroy_link_1(&clink->link->lid, &dev_error, clink->client);
+	_vxi11_capture(destroy_link, (xdrproc_t) xdr_Device_Link, &clink->link->lid,
+		       (xdrproc_t) xdr_Device_Error,
+		       rpc_status == RPC_SUCCESS ? &dev_error : NULL, capture);
+	if (rpc_status != RPC_SUCCESS) {
+		_vxi11_error("vxi11_close_device", rpc_status, 0, 0);
+		if (_vxi11_log_enabled(VXI11_LOG_ERROR)) {
+			_vxi11_log(VXI11_LOG_ERROR, "%s", clnt_sperror(clink->client, address));
+		}
 		return -1;
 	}
 #endif
@@ -51,6 +51,10 @@ extern "C" {
 
 
 typedef	struct _VXI11_CLINK VXI11_CLINK;
+typedef	struct _VXI11_GROUP VXI11_GROUP;
+typedef	struct _VXI11_SCHEDULER VXI11_SCHEDULER;
+typedef	struct _VXI11_SHM VXI11_SHM;
+typedef	struct _VXI11_ARCHIVE VXI11_ARCHIVE;
 
 /* Default timeout value to use, in ms. */
 #define	VXI11_DEFAULT_TIMEOUT	10000
@@ -93,10 +97,18 @@ vx_EXPORT int vxi11_lib_version(int *major, int *minor, int *revision);
  *  clink   - pointer to a VXI11_CLINK pointer, will be initialised on a
  *            successful connection.
  *  address - the IP address or (where supported) USB address for the
- *            instrument to connect to.
+ *            instrument to connect to. "host:port" connects directly to
+ *            that TCP port without asking the portmapper.
+ *            "TCPIP::host::port::SOCKET" talks SCPI over a plain TCP
+ *            connection instead of VXI11, for instruments that support it
+ *            (usually on port 5025). Such links can't be locked.
+ *            "TCPIP::host::hislip0::INSTR" (or "hislip0,port" for a port
+ *            other than 4880) uses HiSLIP instead of VXI11, which is
+ *            faster for large transfers.
  *  device   - some instruments have multiple interfaces, this allows you to
  *            specify which to connect to. Set to NULL to use the default of
- *            "inst0".
+ *            "inst0". A device of "hislip0" (or another "hislipN") uses
+ *            HiSLIP to "host" or "host:port".
  *
  * Returns:
  *  0 - on success
@@ -131,6 +143,8 @@ vx_EXPORT int vxi11_close_device(VXI11_CLINK *clink, const char *address);
  *  0                      - on success
  *  1                      - on out of memory
  *  -VXI11_NULL_WRITE_RESP - on send timeout (retry is acceptable)
+ *  -17                    - if the connection was lost, see
+ *                           vxi11_async_process()
  */
 vx_EXPORT int vxi11_send(VXI11_CLINK *clink, const char *cmd, size_t len);
 
@@ -183,10 +197,167 @@ vx_EXPORT ssize_t vxi11_receive(VXI11_CLINK *clink, char *buffer, size_t len);
  *  Number of bytes read  - on success
  *  -VXI11_NULL_READ_RESP - on timeout
  *  -100                  - on "buffer too small"
+ *  -17                   - if the connection was lost, see
+ *                          vxi11_async_process()
  */
 vx_EXPORT ssize_t vxi11_receive_timeout(VXI11_CLINK *clink, char *buffer, size_t len, unsigned long timeout);
 
 
+/* Function: vxi11_receive_alloc
+ *
+ * Receive a reply of any length into a buffer provided by the library. The
+ * buffer grows as the reply arrives, straight to the size of a definite
+ * length block once its header has been read, otherwise by doubling. Pass
+ * the buffer to vxi11_release() when done with it: buffers are kept per link
+ * and reused, so once the link has seen its largest replies, receiving
+ * allocates no memory.
+ *
+ * Parameters:
+ *  clink   - a valid VXI11_CLINK pointer.
+ *  buffer  - set to the reply, which is followed by a null.
+ *  timeout - the number of milliseconds to wait before returning if no data is
+ *            received.
+ *
+ * Returns:
+ *  Number of bytes read  - on success
+ *  -VXI11_NULL_READ_RESP - on timeout
+ *  -9                    - on out of memory
+ */
+vx_EXPORT ssize_t vxi11_receive_alloc(VXI11_CLINK *clink, char **buffer, unsigned long timeout);
+
+
+/* Function: vxi11_release
+ *
+ * Give back a buffer from vxi11_receive_alloc() for reuse. Every buffer must
+ * be released before its link is closed. The link keeps a few of the largest
+ * buffers until it is closed, and frees the rest.
+ *
+ * Parameters:
+ *  clink  - the link the buffer was received on.
+ *  buffer - the buffer, or NULL.
+ */
+vx_EXPORT void vxi11_release(VXI11_CLINK *clink, char *buffer);
+
+
+/* A field or block of a reply, found by vxi11_receive_segments(). */
+typedef struct {
+	const char *data;	/* into the reply, not null terminated */
+	size_t len;
+	size_t offset;		/* of data from the start of the reply */
+	size_t header_len;	/* of the "#<n><length>" header before a
+				   block's data, 0 for a field */
+} VXI11_SEGMENT;
+
+/* A reply and its index. Zero it before first use, and reuse it for later
+ * replies on the same link so the index is only allocated once. */
+typedef struct {
+	char *buffer;		/* the whole reply, followed by a null */
+	size_t len;
+	VXI11_SEGMENT *segments;
+	size_t count;
+	size_t alloc;		/* used by the library */
+} VXI11_SEGMENTS;
+
+/* Function: vxi11_receive_segments
+ *
+ * Receive a reply of any length, as vxi11_receive_alloc() does, and split it
+ * into fields and blocks in the same pass, without copying. This suits
+ * replies holding many blocks, e.g. a segmented capture, which can then be
+ * handled in place.
+ *
+ * Fields are separated by ',' or ';' outside double quoted strings, and have
+ * surrounding white space and the terminating newline removed. Empty fields
+ * are left out. A definite length block ("#<n><length><data>") is a segment
+ * of its own, as is any text before it, e.g. ":CURV #41000..." gives a field
+ * ":CURV" and a block. Block data is skipped, not scanned. An indefinite
+ * length block ("#0<data>") runs to the end of the reply, less the newline.
+ *
+ * Any reply previously received into s is released first.
+ *
+ * Parameters:
+ *  clink   - a valid VXI11_CLINK pointer.
+ *  s       - receives the reply and its segments.
+ *  timeout - the number of milliseconds to wait before returning if no data is
+ *            received.
+ *
+ * Returns:
+ *  Number of segments    - on success
+ *  -VXI11_NULL_READ_RESP - on timeout
+ *  -3                    - if a block header is bad, or the reply ends
+ *                          before the end of a block
+ *  -5                    - if s is NULL
+ *  -9                    - on out of memory
+ */
+vx_EXPORT ssize_t vxi11_receive_segments(VXI11_CLINK *clink, VXI11_SEGMENTS *s, unsigned long timeout);
+
+
+/* Function: vxi11_segments_free
+ *
+ * Release the reply held by s and free its index, leaving s zeroed. This
+ * must be done before the link is closed.
+ *
+ * Parameters:
+ *  clink - the link the replies were received on.
+ *  s     - as passed to vxi11_receive_segments().
+ */
+vx_EXPORT void vxi11_segments_free(VXI11_CLINK *clink, VXI11_SEGMENTS *s);
+
+/* Large transfer figures for a link, see vxi11_transfer_stats(). */
+typedef struct {
+	size_t request_size;	/* requestSize used for pipelined reads */
+	int tuned;		/* 1 once every request size has been tried
+				   on a large transfer to this instrument */
+	int rcvbuf;		/* the socket receive buffer, as the system
+				   reports it */
+	unsigned long transfers;	/* receives made */
+	unsigned long long bytes;	/* received by them */
+	double last_mb_per_s;	/* throughput of the last receive, in MB/s */
+} VXI11_TRANSFER_STATS;
+
+
+/* Function: vxi11_set_large_transfers
+ *
+ * Turn large transfer mode on or off for a link. In this mode, once a
+ * reply's definite length block header has arrived, the rest of the block is
+ * read with the next device_read always sent before the reply to the last
+ * one has arrived, so the instrument never waits for a round trip between
+ * chunks. No read asks for more than the block holds. Replies that are not
+ * blocks are read as usual.
+ *
+ * The requestSize for each read is tuned per instrument, shared by all links
+ * to it: each of a few sizes is tried on receives of 1 MB or more, and the
+ * fastest is then kept. The socket receive buffer is enlarged to hold the
+ * reads in flight.
+ *
+ * Parameters:
+ *  clink  - a valid VXI11_CLINK pointer.
+ *  enable - 1 to turn large transfers on, 0 to turn them off.
+ *
+ * Returns:
+ *  0  - on success
+ *  -8 - if the link does not use VXI11 RPC, e.g. a HiSLIP or raw socket link,
+ *       or a link through vxi11_broker, or not supported on this platform
+ *  -9 - on out of memory
+ */
+vx_EXPORT int vxi11_set_large_transfers(VXI11_CLINK *clink, int enable);
+
+
+/* Function: vxi11_transfer_stats
+ *
+ * Report the request size and throughput of large transfers on a link.
+ *
+ * Parameters:
+ *  clink - a valid VXI11_CLINK pointer.
+ *  stats - filled in with the figures.
+ *
+ * Returns:
+ *  0  - on success
+ *  -5 - if large transfers are not on
+ *  -8 - if not supported on this platform
+ */
+vx_EXPORT int vxi11_transfer_stats(VXI11_CLINK *clink, VXI11_TRANSFER_STATS *stats);
+
+
 /* Function: vxi11_send_data_block
  *
  * Utility function to send a command and a data block.
@@ -228,10 +399,79 @@ vx_EXPORT int vxi11_send_data_block(VXI11_CLINK *clink, const char *cmd, char *b
  *  Number of bytes read  - on success
  *  -VXI11_NULL_READ_RESP - on timeout
  *  -100                  - on "buffer too small"
+ *  -1                    - if out of memory
+ *  -3                    - if the response is not a complete block
+ *  Other negative values are errors from receiving the response. An
+ *  instrument's VXI-11 errors 1 and 3 also come back as -1 and -3; when the
+ *  failure is the block's own, vxi11_last_error() names
+ *  vxi11_receive_data_block with an error of 0.
  */
 vx_EXPORT ssize_t vxi11_receive_data_block(VXI11_CLINK *clink, char *buffer, size_t len, unsigned long timeout);
 
 
+/* Sample formats for vxi11_receive_data_block_reduced(). 16 and 32 bit
+ * samples are little endian unless VXI11_SAMPLE_BIG_ENDIAN is or'd in. */
+#define	VXI11_SAMPLE_INT8	1
+#define	VXI11_SAMPLE_UINT8	2
+#define	VXI11_SAMPLE_INT16	3
+#define	VXI11_SAMPLE_UINT16	4
+#define	VXI11_SAMPLE_FLOAT32	5
+#define	VXI11_SAMPLE_BIG_ENDIAN	0x100
+
+typedef struct {
+	/* Set by the caller */
+	int format;		/* VXI11_SAMPLE_INT8 etc. */
+	size_t points;		/* envelope points wanted, 0 for no envelope */
+	double *env_min;	/* arrays of points values, receiving the lowest */
+	double *env_max;	/* and highest sample of each envelope point */
+	size_t bins;		/* histogram bins, 0 for no histogram */
+	double hist_low;	/* range of values covered by the histogram */
+	double hist_high;
+	unsigned long *histogram;	/* array of bins counts */
+
+	/* Set by vxi11_receive_data_block_reduced() */
+	size_t samples;		/* in the whole block */
+	size_t points_filled;	/* envelope points, fewer than asked if the
+				   block has fewer samples than that */
+	double min;
+	double max;
+	double mean;
+	double rms;
+	double pk_pk;
+} VXI11_REDUCTION;
+
+
+/* Function: vxi11_receive_data_block_reduced
+ *
+ * Receive a definite-length block, as vxi11_receive_data_block() does, but
+ * instead of returning the data, reduce it as it arrives to a min/max
+ * envelope, summary statistics and a histogram of the samples. The block is
+ * read a piece at a time, so it can be any size without a buffer to hold it.
+ *
+ * Each envelope point covers an equal share of the samples, in order. The
+ * histogram bins divide hist_low to hist_high equally, and samples outside
+ * that range are counted in the first or last bin. Values are in the units
+ * of the raw samples.
+ *
+ * Parameters:
+ *  clink   - a valid VXI11_CLINK pointer.
+ *  r       - the reduction wanted, see VXI11_REDUCTION, which receives the
+ *            results.
+ *  timeout - the number of milliseconds to wait before returning if no data is
+ *            received.
+ *
+ * Returns:
+ *  Number of samples in the block - on success
+ *  -VXI11_NULL_READ_RESP - on timeout
+ *  -3                    - if the reply is not a definite-length block, or
+ *                          ends early
+ *  -5                    - if r is not valid
+ *  -8                    - if not supported on this platform
+ *  -9                    - on out of memory
+ */
+vx_EXPORT ssize_t vxi11_receive_data_block_reduced(VXI11_CLINK *clink, VXI11_REDUCTION *r, unsigned long timeout);
+
+
 /* Function: vxi11_send_and_receive
  *
  * Utility function to send a command and receive a response.
@@ -313,6 +553,1087 @@ vx_EXPORT double vxi11_obtain_double_value(VXI11_CLINK *clink, const char *cmd);
  */
 vx_EXPORT double vxi11_obtain_double_value_timeout(VXI11_CLINK *clink, const char *cmd, unsigned long timeout);
 
+
+/* Function: vxi11_device_clear
+ *
+ * Send a device clear to the instrument, which clears its input and output
+ * buffers. Also empties the query cache for this link.
+ *
+ * Parameters:
+ *  clink - a valid VXI11_CLINK pointer.
+ *
+ * Returns:
+ *  0                      - on success
+ *  -VXI11_NULL_WRITE_RESP - if the instrument did not respond
+ *  other negative values  - VXI-11 error code from the instrument
+ */
+vx_EXPORT int vxi11_device_clear(VXI11_CLINK *clink);
+
+
+/* LOCKING *
+ * ======= *
+ *
+ * A link can take the instrument's exclusive lock, so that a sequence of
+ * commands runs without another link (possibly on another computer) getting
+ * in between. By default, any operation on a link fails at once with error 11
+ * if another link holds the lock; vxi11_set_lock_timeout() makes operations
+ * wait for the lock to be released instead.
+ *
+ * The RPC layer gives up on any single call after 25 seconds, so lock waits
+ * should be kept shorter than that.
+ */
+
+/* Function: vxi11_lock
+ *
+ * Take the instrument's exclusive lock for this link.
+ *
+ * Parameters:
+ *  clink   - a valid VXI11_CLINK pointer.
+ *  timeout - how long to wait, in ms, if another link holds the lock. 0 to
+ *            fail at once.
+ *
+ * Returns:
+ *  0                      - on success
+ *  -11                    - if another link still holds the lock
+ *  -8                     - if the link does not support locking
+ *  -VXI11_NULL_WRITE_RESP - if the instrument did not respond
+ *  other negative values  - VXI-11 error code from the instrument
+ */
+vx_EXPORT int vxi11_lock(VXI11_CLINK *clink, unsigned long timeout);
+
+
+/* Function: vxi11_unlock
+ *
+ * Release the lock taken with vxi11_lock().
+ *
+ * Parameters:
+ *  clink - a valid VXI11_CLINK pointer.
+ *
+ * Returns:
+ *  0                      - on success
+ *  -12                    - if this link does not hold the lock
+ *  -VXI11_NULL_WRITE_RESP - if the instrument did not respond
+ */
+vx_EXPORT int vxi11_unlock(VXI11_CLINK *clink);
+
+
+/* Function: vxi11_set_lock_timeout
+ *
+ * Set how long send, receive and device clear operations on this link wait
+ * for a lock held by another link before failing with error 11.
+ *
+ * Parameters:
+ *  clink   - a valid VXI11_CLINK pointer.
+ *  timeout - in ms. The default is 0, fail at once.
+ */
+vx_EXPORT void vxi11_set_lock_timeout(VXI11_CLINK *clink, unsigned long timeout);
+
+
+/* Function: vxi11_lock_stats
+ *
+ * Return lock metrics for this link. Any pointer may be NULL.
+ *
+ * Parameters:
+ *  clink   - a valid VXI11_CLINK pointer.
+ *  count   - number of times the lock was taken.
+ *  failed  - number of vxi11_lock() calls that failed.
+ *  wait_ms - total time spent in vxi11_lock(), in ms.
+ *  hold_ms - total time the lock has been held, in ms, including the
+ *            current hold if the lock is held now.
+ */
+vx_EXPORT void vxi11_lock_stats(VXI11_CLINK *clink, unsigned long *count, unsigned long *failed, unsigned long *wait_ms, unsigned long *hold_ms);
+
+
+/* QUERY CACHE *
+ * =========== *
+ *
+ * vxi11_send_and_receive() and the vxi11_obtain_*() functions can keep the
+ * responses to queries whose values rarely change, and answer later identical
+ * queries without talking to the instrument. Each cache hit saves a
+ * device_write and a device_read round trip. Caching is off until a pattern
+ * is added with vxi11_cache_add().
+ *
+ * Patterns are matched case insensitively against the whole command, and '*'
+ * matches any run of characters. '?' is not a wildcard. SCPI common commands
+ * also start with '*', so a '*' at the start of a pattern followed by a
+ * letter is taken literally: "*IDN?" matches only "*IDN?", and "*RST" only
+ * "*RST". To match any command ending in "IDN?", use "**IDN?".
+ *
+ * Cached responses are dropped when:
+ *  - their time to live expires.
+ *  - a command with the same header is sent, e.g. sending ":CHAN1:SCAL 0.5"
+ *    drops ":CHAN1:SCAL?".
+ *  - a command matching a rule added with vxi11_cache_invalidate_on() is
+ *    sent.
+ *  - vxi11_device_clear() or vxi11_cache_clear() is called.
+ */
+
+/* Function: vxi11_cache_add
+ *
+ * Allow queries matching a pattern to be cached.
+ *
+ * Parameters:
+ *  clink         - a valid VXI11_CLINK pointer.
+ *  query_pattern - pattern for queries that can be cached, e.g. "*IDN?" or
+ *                  ":CHAN*:SCAL?"
+ *  ttl           - time in ms for which a response stays valid, or 0 to keep
+ *                  it until it is invalidated.
+ *
+ * Returns:
+ *  0 - on success
+ *  1 - on out of memory
+ */
+vx_EXPORT int vxi11_cache_add(VXI11_CLINK *clink, const char *query_pattern, unsigned long ttl);
+
+
+/* Function: vxi11_cache_invalidate_on
+ *
+ * Add a rule that drops cached queries when a command is sent.
+ *
+ * Parameters:
+ *  clink         - a valid VXI11_CLINK pointer.
+ *  send_pattern  - pattern for commands that change the instrument state,
+ *                  e.g. "*RST" or ":AUTOSCALE"
+ *  query_pattern - pattern for the cached queries to drop, e.g. "*" for all
+ *
+ * Returns:
+ *  0 - on success
+ *  1 - on out of memory
+ */
+vx_EXPORT int vxi11_cache_invalidate_on(VXI11_CLINK *clink, const char *send_pattern, const char *query_pattern);
+
+
+/* Function: vxi11_cache_clear
+ *
+ * Drop all cached responses for a link. The cacheable patterns and
+ * invalidation rules are kept.
+ *
+ * Parameters:
+ *  clink - a valid VXI11_CLINK pointer.
+ */
+vx_EXPORT void vxi11_cache_clear(VXI11_CLINK *clink);
+
+
+/* Function: vxi11_cache_stats
+ *
+ * Get the query cache counters for a link. Misses only count queries that
+ * match a cacheable pattern.
+ *
+ * Parameters:
+ *  clink  - a valid VXI11_CLINK pointer.
+ *  hits   - if not NULL, set to the number of queries answered from the cache
+ *  misses - if not NULL, set to the number of cacheable queries that had to
+ *           be sent to the instrument
+ */
+vx_EXPORT void vxi11_cache_stats(VXI11_CLINK *clink, unsigned long *hits, unsigned long *misses);
+
+
+/* NON-BLOCKING OPERATION *
+ * ====================== */
+
+/* vxi11_async_process() return flags: the socket from vxi11_async_fd() must
+ * become readable or writable before the operation can make progress. */
+#define	VXI11_ASYNC_READ	1
+#define	VXI11_ASYNC_WRITE	2
+
+
+/* Function: vxi11_async_fd
+ *
+ * Get the socket that non-blocking operations on this link use, so that it can
+ * be added to a poll(), epoll() or similar event loop. Links opened to the same
+ * address share a socket, and so can only have one non-blocking operation in
+ * progress between them, and must not be used with the blocking functions
+ * while one is in progress.
+ *
+ * Parameters:
+ *  clink - a valid VXI11_CLINK pointer.
+ *
+ * Returns:
+ *  the socket file descriptor, or -1 if non-blocking operation is not
+ *  supported on this link.
+ */
+vx_EXPORT int vxi11_async_fd(VXI11_CLINK *clink);
+
+
+/* Function: vxi11_async_start
+ *
+ * Start sending a command, and optionally receiving the reply, without
+ * blocking. Drive the operation to completion with vxi11_async_process().
+ *
+ * Parameters:
+ *  clink   - a valid VXI11_CLINK pointer.
+ *  cmd     - the command to send as an array of bytes. It is copied, so need
+ *            not remain valid after this call.
+ *  len     - the length of cmd. If 0, nothing is sent and only a receive is
+ *            carried out.
+ *  buffer  - valid memory location in which to receive the reply, or NULL
+ *            if no reply is expected. Must remain valid until the operation
+ *            completes.
+ *  buflen  - size of buffer.
+ *  timeout - the number of milliseconds to wait before returning if no data is
+ *            received.
+ *
+ * Returns:
+ *  0  - on success
+ *  1  - on out of memory
+ *  -8 - if non-blocking operation is not supported on this link, or another
+ *       operation is already in progress
+ *  -17 - if the connection was lost, see vxi11_async_process()
+ */
+vx_EXPORT int vxi11_async_start(VXI11_CLINK *clink, const char *cmd, size_t len, char *buffer, size_t buflen, unsigned long timeout);
+
+
+/* Function: vxi11_async_process
+ *
+ * Carry out as much of the operation started by vxi11_async_start() as is
+ * possible without blocking. Call this whenever the socket is ready, or when
+ * the time given by vxi11_async_timeout() has passed.
+ *
+ * On a timeout with a call or reply part way across the socket, this waits
+ * up to a second more for it to finish, as the next call on the socket can't
+ * start in the middle of one. If it doesn't, the connection is lost: calls on
+ * every link sharing it return -17 from then on, and the links have to be
+ * closed and opened again.
+ *
+ * Parameters:
+ *  clink - a valid VXI11_CLINK pointer.
+ *
+ * Returns:
+ *  VXI11_ASYNC_READ or VXI11_ASYNC_WRITE - still in progress, wait for the
+ *                           socket to become readable or writable.
+ *  0                      - complete, call vxi11_async_result() for the
+ *                           number of bytes received.
+ *  -VXI11_NULL_WRITE_RESP - on send timeout, or if the instrument claims to
+ *                           have taken none or more than all of a chunk
+ *  -VXI11_NULL_READ_RESP  - on receive timeout
+ *  -100                   - on "buffer too small"
+ *  -9                     - on out of memory
+ *  other negative values  - VXI-11 error code from the instrument
+ */
+vx_EXPORT int vxi11_async_process(VXI11_CLINK *clink);
+
+
+/* Function: vxi11_async_result
+ *
+ * Get the result of a completed non-blocking operation.
+ *
+ * Parameters:
+ *  clink - a valid VXI11_CLINK pointer.
+ *
+ * Returns:
+ *  Number of bytes received (0 if no reply was requested) - on success
+ *  The error returned by vxi11_async_process()            - on failure
+ *  -8 - if no operation has completed
+ */
+vx_EXPORT ssize_t vxi11_async_result(VXI11_CLINK *clink);
+
+
+/* Function: vxi11_async_timeout
+ *
+ * Get the time remaining before the operation in progress gives up waiting
+ * for the instrument, for use as a poll() timeout.
+ *
+ * Parameters:
+ *  clink - a valid VXI11_CLINK pointer.
+ *
+ * Returns:
+ *  milliseconds remaining, 0 if the deadline has passed (call
+ *  vxi11_async_process() to collect the timeout) or -1 if there is no
+ *  operation in progress.
+ */
+vx_EXPORT long vxi11_async_timeout(VXI11_CLINK *clink);
+
+
+/* Function: vxi11_async_cancel
+ *
+ * Abandon an operation in progress. Any reply that arrives later is
+ * discarded. A call or reply part way across the socket is finished first, as
+ * for a timeout in vxi11_async_process().
+ *
+ * Parameters:
+ *  clink - a valid VXI11_CLINK pointer.
+ */
+vx_EXPORT void vxi11_async_cancel(VXI11_CLINK *clink);
+
+/* GROUPS *
+ * ====== *
+ *
+ * A group sends the same command or query to many instruments at once. The
+ * members are driven concurrently with the non-blocking functions above, so a
+ * step over the whole group takes about as long as the slowest instrument.
+ * Links that do not support non-blocking operation (raw socket, HiSLIP and
+ * vxi11_broker links) are served blocking while the others are in flight.
+ * Members opened to the same address share a socket, so are served one after
+ * the other.
+ *
+ * Each member keeps its own result, and its own timeout counted from when its
+ * operation starts, so one slow or failed instrument does not hold up the
+ * results of the others. Members are numbered in the order they were added.
+ * Query caching (see vxi11_cache_add()) applies to each member as usual.
+ */
+
+/* Function: vxi11_group_create
+ *
+ * Create an empty group.
+ *
+ * Parameters:
+ *  group - pointer to a VXI11_GROUP pointer, initialised on success.
+ *
+ * Returns:
+ *  0 - on success
+ *  1 - on out of memory
+ */
+vx_EXPORT int vxi11_group_create(VXI11_GROUP **group);
+
+
+/* Function: vxi11_group_add
+ *
+ * Add a link to a group. The link remains owned by the caller, and must stay
+ * open for as long as it is in the group.
+ *
+ * Parameters:
+ *  group - a valid VXI11_GROUP pointer.
+ *  clink - a valid VXI11_CLINK pointer.
+ *
+ * Returns:
+ *  0 - on success
+ *  1 - on out of memory
+ */
+vx_EXPORT int vxi11_group_add(VXI11_GROUP *group, VXI11_CLINK *clink);
+
+
+/* Function: vxi11_group_free
+ *
+ * Free a group. Its links are not closed.
+ *
+ * Parameters:
+ *  group - a VXI11_GROUP pointer, or NULL.
+ */
+vx_EXPORT void vxi11_group_free(VXI11_GROUP *group);
+
+
+/* Function: vxi11_group_size
+ *
+ * Returns:
+ *  the number of members in the group.
+ */
+vx_EXPORT size_t vxi11_group_size(VXI11_GROUP *group);
+
+
+/* Function: vxi11_group_send
+ *
+ * Send a command to every member of a group.
+ *
+ * Parameters:
+ *  group - a valid VXI11_GROUP pointer.
+ *  cmd   - the command to send as an array of bytes
+ *  len   - the length of cmd
+ *
+ * Returns:
+ *  the number of members for which the send failed. Use vxi11_group_result()
+ *  to find out which.
+ */
+vx_EXPORT int vxi11_group_send(VXI11_GROUP *group, const char *cmd, size_t len);
+
+
+/* Function: vxi11_group_query
+ *
+ * Send a query to every member of a group and gather the replies. Each reply
+ * can be read with vxi11_group_response() until the next operation on the
+ * group.
+ *
+ * Parameters:
+ *  group   - a valid VXI11_GROUP pointer.
+ *  cmd     - the null terminated query to send, e.g. "MEAS:CURR?"
+ *  buflen  - the largest reply expected from any member.
+ *  timeout - the number of milliseconds each member waits for its reply.
+ *
+ * Returns:
+ *  the number of members for which the query failed. Use
+ *  vxi11_group_result() to find out which.
+ *  -5 - if buflen is 0
+ */
+vx_EXPORT int vxi11_group_query(VXI11_GROUP *group, const char *cmd, size_t buflen, unsigned long timeout);
+
+
+/* Function: vxi11_group_obtain_double_values
+ *
+ * Send a query to every member of a group and parse each reply as a double,
+ * as with vxi11_obtain_double_value().
+ *
+ * Parameters:
+ *  group   - a valid VXI11_GROUP pointer.
+ *  cmd     - the null terminated query to send, e.g. "MEAS:CURR?"
+ *  values  - array of vxi11_group_size() doubles, which receives the value
+ *            for each member, or 0.0 for members that failed.
+ *  timeout - the number of milliseconds each member waits for its reply.
+ *
+ * Returns:
+ *  the number of members for which the query failed.
+ */
+vx_EXPORT int vxi11_group_obtain_double_values(VXI11_GROUP *group, const char *cmd, double *values, unsigned long timeout);
+
+
+/* Function: vxi11_group_result
+ *
+ * Get one member's result from the last operation on a group.
+ *
+ * Parameters:
+ *  group  - a valid VXI11_GROUP pointer.
+ *  member - index of the member, from 0.
+ *
+ * Returns:
+ *  Number of bytes received (0 for vxi11_group_send()) - on success
+ *  The error the equivalent vxi11_send() or vxi11_receive() would have
+ *  returned, or -9 on out of memory                   - on failure
+ *  -5 - if there is no such member
+ */
+vx_EXPORT ssize_t vxi11_group_result(VXI11_GROUP *group, size_t member);
+
+
+/* Function: vxi11_group_response
+ *
+ * Get one member's reply from the last vxi11_group_query() on a group.
+ *
+ * Parameters:
+ *  group  - a valid VXI11_GROUP pointer.
+ *  member - index of the member, from 0.
+ *
+ * Returns:
+ *  the reply, null terminated, or NULL if the query failed for this member.
+ *  Its length is given by vxi11_group_result().
+ */
+vx_EXPORT const char *vxi11_group_response(VXI11_GROUP *group, size_t member);
+
+
+/* Function: vxi11_group_elapsed_us
+ *
+ * Get how long one member took over the last operation on a group, from
+ * sending its command until its reply came or it failed. This leaves out any
+ * time spent waiting for another member on the same socket.
+ *
+ * Parameters:
+ *  group  - a valid VXI11_GROUP pointer.
+ *  member - index of the member, from 0.
+ *
+ * Returns:
+ *  the time in microseconds, 0 if the reply came from the query cache or
+ *  there is no such member.
+ */
+vx_EXPORT unsigned long long vxi11_group_elapsed_us(VXI11_GROUP *group, size_t member);
+
+/* PERIODIC SAMPLING *
+ * ================= *
+ *
+ * A scheduler sends queries to links at fixed periods and collects the
+ * replies, all from the thread that calls vxi11_scheduler_run(). It sleeps
+ * on a timerfd until the next reading is due and uses the non-blocking
+ * functions above, so readings keep to their schedule however many links
+ * there are, and a slow instrument only delays its own readings. Links that
+ * do not support non-blocking operation, i.e. raw socket, HiSLIP and
+ * vxi11_broker links, and all links on Windows, are served blocking when
+ * due, which holds up every other job for the whole of their round trip;
+ * readings of other jobs that fall due meanwhile are counted as overruns.
+ * Jobs on links opened to the same address share a socket, so take turns.
+ *
+ * Readings are due on a fixed grid from when vxi11_scheduler_run() starts,
+ * and don't drift. The first readings of jobs sharing a socket are spread
+ * over their period. If a job's previous reading hasn't finished when the
+ * next is due, the next is skipped and counted as an overrun.
+ *
+ * Times are in microseconds of the monotonic clock (CLOCK_MONOTONIC).
+ */
+
+typedef struct {
+	size_t job;		/* as returned by vxi11_scheduler_add() */
+	ssize_t result;		/* bytes received, or the error vxi11_receive()
+				   would have returned */
+	double value;		/* the response as a double, 0.0 on failure */
+	const char *response;	/* null terminated, only valid during the callback */
+	unsigned long long scheduled_us;	/* when the reading was due */
+	unsigned long long sent_us;	/* when the query was sent */
+	unsigned long long received_us;	/* when the reply (or error) came */
+} VXI11_SAMPLE;
+
+/* Called by vxi11_scheduler_run() with a batch of readings, in the order they
+ * completed. It may call vxi11_scheduler_stop(), but must not add jobs. */
+typedef void (*vxi11_sample_callback)(const VXI11_SAMPLE *samples, size_t count, void *user);
+
+
+/* Function: vxi11_scheduler_create
+ *
+ * Create a scheduler with no jobs.
+ *
+ * Parameters:
+ *  sched        - pointer to a VXI11_SCHEDULER pointer, initialised on
+ *                 success.
+ *  callback     - receives the readings.
+ *  batch        - the most readings passed to each callback.
+ *  max_delay_ms - pass on a smaller batch once its first reading is this
+ *                 old. 0 to pass on readings as soon as they are taken.
+ *  user         - passed to callback.
+ *
+ * Returns:
+ *  0 - on success
+ *  1 - on out of memory
+ */
+vx_EXPORT int vxi11_scheduler_create(VXI11_SCHEDULER **sched, vxi11_sample_callback callback, size_t batch, unsigned long max_delay_ms, void *user);
+
+
+/* Function: vxi11_scheduler_add
+ *
+ * Add a job to a scheduler. The link remains owned by the caller, and must
+ * stay open for as long as the scheduler is used. Not to be called while
+ * vxi11_scheduler_run() is running.
+ *
+ * Parameters:
+ *  sched     - a valid VXI11_SCHEDULER pointer.
+ *  clink     - a valid VXI11_CLINK pointer.
+ *  query     - the null terminated query to send, e.g. "MEAS:VOLT:DC?". The
+ *              reply must fit in 255 bytes.
+ *  period_us - the time between readings, in microseconds.
+ *  timeout   - the number of milliseconds to wait for each reply.
+ *
+ * Returns:
+ *  the job number, counting from 0 - on success
+ *  -5 - if period_us is 0
+ *  -9 - on out of memory
+ */
+vx_EXPORT ssize_t vxi11_scheduler_add(VXI11_SCHEDULER *sched, VXI11_CLINK *clink, const char *query, unsigned long period_us, unsigned long timeout);
+
+
+/* Function: vxi11_scheduler_run
+ *
+ * Take readings until the duration has passed or vxi11_scheduler_stop() is
+ * called. Readings still in progress at the end are abandoned, and any
+ * readings not yet passed to the callback are passed on before returning.
+ * Calling it again starts a new schedule; job statistics carry on.
+ *
+ * Parameters:
+ *  sched       - a valid VXI11_SCHEDULER pointer.
+ *  duration_ms - how long to run for, 0 to run until stopped.
+ *
+ * Returns:
+ *  0   - on success
+ *  -5  - if the scheduler has no jobs
+ *  -8  - if not supported on this platform
+ *  -9  - on out of memory
+ *  -17 - if the timer could not be created
+ */
+vx_EXPORT int vxi11_scheduler_run(VXI11_SCHEDULER *sched, unsigned long duration_ms);
+
+
+/* Function: vxi11_scheduler_stop
+ *
+ * Make vxi11_scheduler_run() return. May be called from the callback, or from
+ * a signal handler.
+ *
+ * Parameters:
+ *  sched - a valid VXI11_SCHEDULER pointer.
+ */
+vx_EXPORT void vxi11_scheduler_stop(VXI11_SCHEDULER *sched);
+
+
+/* Function: vxi11_scheduler_stats
+ *
+ * Get a job's counters. Any pointer may be NULL.
+ *
+ * Parameters:
+ *  sched       - a valid VXI11_SCHEDULER pointer.
+ *  job         - the job number.
+ *  samples     - set to the number of readings taken, including failures
+ *  overruns    - set to the number of readings skipped because the previous
+ *                one had not finished, or held up while a link without
+ *                non-blocking support was served
+ *  errors      - set to the number of readings that failed
+ *  max_late_us - set to the longest time between a reading being due and its
+ *                query being sent
+ *
+ * Returns:
+ *  0  - on success
+ *  -5 - if there is no such job
+ */
+vx_EXPORT int vxi11_scheduler_stats(VXI11_SCHEDULER *sched, size_t job, unsigned long *samples, unsigned long *overruns, unsigned long *errors, unsigned long *max_late_us);
+
+
+/* Function: vxi11_scheduler_size
+ *
+ * Returns:
+ *  the number of jobs in the scheduler.
+ */
+vx_EXPORT size_t vxi11_scheduler_size(VXI11_SCHEDULER *sched);
+
+
+/* Function: vxi11_scheduler_free
+ *
+ * Free a scheduler. Its links are not closed.
+ *
+ * Parameters:
+ *  sched - a VXI11_SCHEDULER pointer, or NULL.
+ */
+vx_EXPORT void vxi11_scheduler_free(VXI11_SCHEDULER *sched);
+
+/* SHARED MEMORY PUBLISHING *
+ * ======================== *
+ *
+ * A publisher puts received blocks in a ring of slots in POSIX shared memory,
+ * and any number of reader processes on the same machine map the ring and
+ * read the blocks in place, without copying. Each block gets a sequence
+ * number, counting from 1, and a timestamp.
+ *
+ * The publisher never waits for readers. A reader that falls behind by more
+ * than the ring holds is told how many blocks it missed, and a block can be
+ * overwritten while a reader is still using it, so readers check with
+ * vxi11_shm_valid() once they are done with a block's data.
+ */
+
+typedef struct {
+	const char *data;	/* in the ring, read-only, not necessarily aligned */
+	size_t len;
+	unsigned long long seq;	/* the block's sequence number */
+	unsigned long long timestamp_us;	/* when it was published, in microseconds
+						   since the epoch */
+	unsigned long lost;	/* blocks overwritten before this reader got to them */
+} VXI11_SHM_BLOCK;
+
+
+/* Function: vxi11_shm_create
+ *
+ * Create a ring to publish to. A ring of the same name left by a publisher
+ * that didn't close it is replaced.
+ *
+ * Parameters:
+ *  shm       - pointer to a VXI11_SHM pointer, initialised on success.
+ *  name      - the shared memory object name, e.g. "/scope1".
+ *  slots     - the number of blocks the ring holds.
+ *  slot_size - the largest block, in bytes.
+ *
+ * Returns:
+ *  0   - on success
+ *  -5  - if slots or slot_size is 0, or the ring would be too large
+ *  -9  - on out of memory
+ *  -17 - if the shared memory could not be created
+ *  -8  - if not supported on this platform
+ */
+vx_EXPORT int vxi11_shm_create(VXI11_SHM **shm, const char *name, size_t slots, size_t slot_size);
+
+
+/* Function: vxi11_shm_open
+ *
+ * Open a ring to read from. Only blocks published after it is opened are
+ * read.
+ *
+ * Parameters:
+ *  shm  - pointer to a VXI11_SHM pointer, initialised on success.
+ *  name - the name given to vxi11_shm_create().
+ *
+ * Returns:
+ *  0   - on success
+ *  -9  - on out of memory
+ *  -17 - if there is no such ring
+ *  -8  - if not supported on this platform
+ */
+vx_EXPORT int vxi11_shm_open(VXI11_SHM **shm, const char *name);
+
+
+/* Function: vxi11_shm_publish
+ *
+ * Copy a block into a ring created with vxi11_shm_create().
+ *
+ * Parameters:
+ *  shm  - a VXI11_SHM pointer from vxi11_shm_create().
+ *  data - the block.
+ *  len  - its length, at most the ring's slot_size.
+ *
+ * Returns:
+ *  0    - on success
+ *  -5   - if the ring was opened with vxi11_shm_open()
+ *  -100 - if the block is larger than a slot
+ */
+vx_EXPORT int vxi11_shm_publish(VXI11_SHM *shm, const char *data, size_t len);
+
+
+/* Function: vxi11_shm_publish_data_block
+ *
+ * Receive a data block, as vxi11_receive_data_block() does, straight into the
+ * next slot of a ring created with vxi11_shm_create(), and publish it. The
+ * block's header is stripped by pointing past it rather than by copying.
+ *
+ * If the receive fails, nothing is published, but the oldest block in the ring
+ * is lost.
+ *
+ * Parameters:
+ *  shm     - a VXI11_SHM pointer from vxi11_shm_create().
+ *  clink   - a valid VXI11_CLINK pointer.
+ *  timeout - the number of milliseconds to wait for the block.
+ *
+ * Returns:
+ *  Number of bytes published - on success, 0 if the instrument sent "#0",
+ *                              which is not published
+ *  -3   - if the response is not a data block
+ *  -5   - if the ring was opened with vxi11_shm_open()
+ *  -100 - if the block is larger than a slot. The rest of it is read and
+ *         thrown away.
+ *  Any error vxi11_receive() would return - on failure
+ */
+vx_EXPORT ssize_t vxi11_shm_publish_data_block(VXI11_SHM *shm, VXI11_CLINK *clink, unsigned long timeout);
+
+
+/* Function: vxi11_shm_next
+ *
+ * Get the next block from a ring opened with vxi11_shm_open(), waiting for it
+ * to be published if need be. The block stays in the ring until the publisher
+ * comes round to its slot again.
+ *
+ * Parameters:
+ *  shm     - a VXI11_SHM pointer from vxi11_shm_open().
+ *  block   - filled in with the block.
+ *  timeout - the number of milliseconds to wait, 0 not to wait.
+ *
+ * Returns:
+ *  0   - on success
+ *  -5  - if the ring was created with vxi11_shm_create()
+ *  -15 - if no block was published in time
+ */
+vx_EXPORT int vxi11_shm_next(VXI11_SHM *shm, VXI11_SHM_BLOCK *block, unsigned long timeout);
+
+
+/* Function: vxi11_shm_valid
+ *
+ * Check that a block from vxi11_shm_next() has not been overwritten. Call it
+ * after using the block's data: if it returns 0, what was read may be a mix
+ * of the block and a later one, and should be discarded.
+ *
+ * Parameters:
+ *  shm   - a VXI11_SHM pointer from vxi11_shm_open().
+ *  block - the block.
+ *
+ * Returns:
+ *  1 - if the block is intact
+ *  0 - if it has been overwritten
+ */
+vx_EXPORT int vxi11_shm_valid(VXI11_SHM *shm, const VXI11_SHM_BLOCK *block);
+
+
+/* Function: vxi11_shm_close
+ *
+ * Unmap a ring. Closing a created ring also removes its name, but readers that
+ * have it open can still read the blocks in it.
+ *
+ * Parameters:
+ *  shm - a VXI11_SHM pointer, or NULL.
+ */
+vx_EXPORT void vxi11_shm_close(VXI11_SHM *shm);
+
+/* WAVEFORM ARCHIVES *
+ * ================= *
+ *
+ * An archive is a file of blocks, each stored with the query that fetched it,
+ * the instrument's preamble describing it and when it was written. Integer
+ * samples are compressed without loss by coding the differences between
+ * them, which suits waveforms well. Compression is done by worker threads, so
+ * that writing costs the receiving thread little more than a copy. Closing
+ * the archive writes an index, so a reader can go straight to any block; an
+ * archive left without one is still readable up to the last complete block.
+ */
+
+typedef struct {
+	int format;		/* as written */
+	size_t len;		/* bytes of samples */
+	size_t stored_len;	/* bytes they take in the file */
+	unsigned long long timestamp_us;	/* when it was written, in
+						   microseconds since the epoch */
+	const char *query;	/* "" if none was given */
+	const char *preamble;
+} VXI11_ARCHIVE_RECORD;
+
+
+/* Function: vxi11_archive_create
+ *
+ * Create an archive to write to, replacing any file of the same name.
+ *
+ * Parameters:
+ *  ar       - pointer to a VXI11_ARCHIVE pointer, initialised on success.
+ *  filename - the file to create.
+ *  threads  - the number of worker threads compressing blocks, 0 to compress
+ *             them in vxi11_archive_write() instead.
+ *
+ * Returns:
+ *  0   - on success
+ *  -5  - if threads is negative
+ *  -9  - on out of memory, or if the threads could not be started
+ *  -17 - if the file could not be created
+ *  -8  - if not supported on this platform
+ */
+vx_EXPORT int vxi11_archive_create(VXI11_ARCHIVE **ar, const char *filename, int threads);
+
+
+/* Function: vxi11_archive_write
+ *
+ * Add a block to an archive created with vxi11_archive_create(). The block is
+ * copied, and compressed and written to the file in the background. This
+ * waits only if the worker threads already have all the blocks they can hold.
+ * Only one thread at a time may write to an archive.
+ *
+ * Parameters:
+ *  ar       - a VXI11_ARCHIVE pointer from vxi11_archive_create().
+ *  format   - the samples' format, VXI11_SAMPLE_INT8 etc., see
+ *             vxi11_receive_data_block_reduced(), or 0 for bytes of any
+ *             kind. Only 8 and 16 bit integer samples are compressed.
+ *  data     - the block.
+ *  len      - its length, a whole number of samples.
+ *  query    - the query that fetched the block, or NULL.
+ *  preamble - the instrument's description of the block, e.g. the reply to
+ *             WFMPRE?, or NULL.
+ *
+ * Returns:
+ *  0   - on success
+ *  -5  - if format or len is not valid, or ar was opened for reading
+ *  -9  - on out of memory
+ *  -17 - if writing the file failed
+ *  Once writing an earlier block has failed, its error is returned.
+ */
+vx_EXPORT int vxi11_archive_write(VXI11_ARCHIVE *ar, int format, const void *data, size_t len, const char *query, const char *preamble);
+
+
+/* Function: vxi11_archive_write_data_block
+ *
+ * Receive a reply holding a data block, which may follow a header as in
+ * ":CURV #41000...", and add the block to an archive. The reply is received
+ * into one of the link's pooled buffers, see vxi11_receive_alloc(), so the
+ * only copy made is the one vxi11_archive_write() makes.
+ *
+ * Parameters:
+ *  ar       - a VXI11_ARCHIVE pointer from vxi11_archive_create().
+ *  clink    - a valid VXI11_CLINK pointer.
+ *  format   - as for vxi11_archive_write().
+ *  query    - as for vxi11_archive_write(). It is not sent.
+ *  preamble - as for vxi11_archive_write().
+ *  timeout  - the number of milliseconds to wait before returning if no data
+ *             is received.
+ *
+ * Returns:
+ *  Number of bytes in the block - on success
+ *  -3 - if the reply holds no data block
+ *  Any error vxi11_receive_segments() or vxi11_archive_write() would return
+ *  - on failure
+ */
+vx_EXPORT ssize_t vxi11_archive_write_data_block(VXI11_ARCHIVE *ar, VXI11_CLINK *clink, int format, const char *query, const char *preamble, unsigned long timeout);
+
+
+/* Function: vxi11_archive_open
+ *
+ * Open an archive to read from. The file is mapped into memory, and blocks are
+ * only read from it and decompressed when asked for.
+ *
+ * Parameters:
+ *  ar       - pointer to a VXI11_ARCHIVE pointer, initialised on success.
+ *  filename - the archive.
+ *
+ * Returns:
+ *  0   - on success
+ *  -3  - if the file is not an archive
+ *  -9  - on out of memory
+ *  -17 - if the file could not be opened or mapped
+ *  -8  - if not supported on this platform
+ */
+vx_EXPORT int vxi11_archive_open(VXI11_ARCHIVE **ar, const char *filename);
+
+
+/* Function: vxi11_archive_count
+ *
+ * Returns:
+ *  The number of blocks in an archive, or for one being written, written to
+ *  the file so far.
+ */
+vx_EXPORT size_t vxi11_archive_count(VXI11_ARCHIVE *ar);
+
+
+/* Function: vxi11_archive_record
+ *
+ * Describe a block in an archive opened with vxi11_archive_open(). The
+ * strings point into the mapped file, and remain valid until it is closed.
+ *
+ * Parameters:
+ *  ar    - a VXI11_ARCHIVE pointer from vxi11_archive_open().
+ *  index - the block, counting from 0 in the order written.
+ *  rec   - filled in with the block's details.
+ *
+ * Returns:
+ *  0  - on success
+ *  -3 - if the block is corrupt
+ *  -5 - if there is no such block
+ */
+vx_EXPORT int vxi11_archive_record(VXI11_ARCHIVE *ar, size_t index, VXI11_ARCHIVE_RECORD *rec);
+
+
+/* Function: vxi11_archive_read
+ *
+ * Read a block from an archive opened with vxi11_archive_open(), exactly as
+ * it was written. Any number of threads may read blocks at the same time.
+ *
+ * Parameters:
+ *  ar     - a VXI11_ARCHIVE pointer from vxi11_archive_open().
+ *  index  - the block, counting from 0 in the order written.
+ *  buffer - receives the block.
+ *  len    - the size of buffer.
+ *
+ * Returns:
+ *  Number of bytes in the block - on success
+ *  -3   - if the block is corrupt
+ *  -5   - if there is no such block
+ *  -100 - if buffer is smaller than the block, see vxi11_archive_record()
+ */
+vx_EXPORT ssize_t vxi11_archive_read(VXI11_ARCHIVE *ar, size_t index, void *buffer, size_t len);
+
+
+/* Function: vxi11_archive_close
+ *
+ * Close an archive. For one being written, this waits for the blocks written
+ * to reach the file, then writes the index.
+ *
+ * Parameters:
+ *  ar - a VXI11_ARCHIVE pointer, or NULL.
+ *
+ * Returns:
+ *  0   - on success
+ *  Any error writing a block or the index - on failure, in which case the
+ *  archive holds the blocks written before it.
+ */
+vx_EXPORT int vxi11_archive_close(VXI11_ARCHIVE *ar);
+
+/* DISCOVERY *
+ * ========= */
+
+/* vxi11_discover() flags */
+#define	VXI11_DISCOVER_IDN	0x01	/* also ask each instrument for *IDN? */
+
+/* Called by vxi11_discover() for each instrument found. address is the IP
+ * address, and port the TCP port of its VXI11 server, so "address:port" can
+ * be given to vxi11_open_device(). idn is the *IDN? response with any
+ * trailing newline removed, or NULL if it was not asked for or there was no
+ * answer. None of the strings remain valid after the callback returns. */
+typedef void (*vxi11_discover_callback)(const char *address, unsigned short port, const char *idn, void *user);
+
+
+/* Function: vxi11_discover
+ *
+ * Find VXI11 instruments by asking the portmapper at every address in a range
+ * where the VXI11 core service is. All addresses are probed at once over UDP,
+ * so a scan takes about the timeout however large the range is.
+ *
+ * Parameters:
+ *  target   - the address or host name to probe, or a range in CIDR notation
+ *             such as "192.168.1.0/22" (at most a /16), or a broadcast
+ *             address such as "192.168.1.255". May be followed by ":port" to
+ *             use a portmapper on a port other than 111.
+ *  timeout  - how long to wait for replies, in ms. Lost probes are resent
+ *             half way through. With VXI11_DISCOVER_IDN, also how long
+ *             the instruments found have to open, all at once, and then
+ *             to answer *IDN?. Those slower to open get a NULL idn.
+ *  flags    - 0, or VXI11_DISCOVER_IDN.
+ *  callback - called for each instrument found, after the scan.
+ *  user     - passed to callback.
+ *
+ * Returns:
+ *  the number of instruments found - on success
+ *  -5  - if target could not be parsed
+ *  -21 - if the host name in target could not be resolved
+ *  -9  - on out of memory
+ *  -17 - if the socket could not be created
+ *  -8  - if discovery is not supported on this platform
+ */
+vx_EXPORT int vxi11_discover(const char *target, unsigned long timeout, int flags, vxi11_discover_callback callback, void *user);
+
+/* SESSION CAPTURE *
+ * =============== *
+ *
+ * While a capture is running, every call the library makes to an instrument
+ * is recorded, with its timing, into a file that the vxi11_replay utility can
+ * serve back in place of the instrument. Setting VXI11_CAPTURE to a file name
+ * in the environment starts a capture when the first device is opened. Links
+ * that go through vxi11_broker are not captured; capture in the broker instead.
+ */
+
+/* Function: vxi11_capture_start
+ *
+ * Start recording all links to filename, replacing its contents. Stops any
+ * capture already running. Don't call this while another thread is using the
+ * library.
+ *
+ * Parameters:
+ *  filename - the file to write.
+ *
+ * Returns:
+ *  0  - on success
+ *  1  - if the file could not be written
+ *  -8 - if capture is not supported on this platform
+ */
+vx_EXPORT int vxi11_capture_start(const char *filename);
+
+
+/* Function: vxi11_capture_stop
+ *
+ * Stop recording and close the capture file, if a capture is running.
+ */
+vx_EXPORT void vxi11_capture_stop(void);
+
+/* ERROR REPORTING *
+ * =============== *
+ *
+ * The library does not print anything. When a function fails, the details
+ * are kept for the calling thread and can be fetched with vxi11_last_error().
+ * Messages describing errors and retries can be passed to a log callback
+ * instead; they are only formatted when a callback wants them, so by default
+ * a failure costs no I/O at all.
+ */
+
+/* Log levels */
+#define	VXI11_LOG_ERROR		1	/* an operation failed */
+#define	VXI11_LOG_WARNING	2	/* something went wrong, but is being retried */
+
+typedef void (*vxi11_log_callback)(int level, const char *message, void *user);
+
+typedef struct {
+	const char *function;	/* the library function that failed, NULL if none has */
+	int rpc_status;		/* enum clnt_stat of a failed RPC call (ViStatus on
+				   Windows), 0 if the call itself succeeded */
+	int error;		/* VXI-11 error code from the instrument, 0 if none */
+	size_t bytes;		/* bytes transferred before the failure */
+} VXI11_ERROR;
+
+
+/* Function: vxi11_last_error
+ *
+ * Get the details of the last failure in the calling thread. Like errno, this
+ * is not cleared by functions that succeed.
+ *
+ * Parameters:
+ *  error - filled in with the details.
+ */
+vx_EXPORT void vxi11_last_error(VXI11_ERROR *error);
+
+
+/* Function: vxi11_clear_error
+ *
+ * Forget the last failure in the calling thread.
+ */
+vx_EXPORT void vxi11_clear_error(void);
+
+
+/* Function: vxi11_set_log_callback
+ *
+ * Have messages about errors and retries passed to a function, e.g. to print
+ * them. The callback may be called from any thread that uses the library.
+ *
+ * Parameters:
+ *  callback - the function to call, or NULL to stop logging (the default).
+ *  level    - the least severe level to pass on, e.g. VXI11_LOG_WARNING for
+ *             everything.
+ *  user     - passed to callback.
+ */
+vx_EXPORT void vxi11_set_log_callback(vxi11_log_callback callback, int level, void *user);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,167 @@
+/* vxi11_hpp_test.cpp
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Drives the C++ wrapper in vxi11.hpp against vxi11_hislip_loopback, which
+ * it starts on a free-ish port and stops again when done. Exits 0 if every
+ * check passed.
+ *
+ * Usage: vxi11_hpp_test <path to vxi11_hislip_loopback>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "vxi11.hpp"
+
+static int failures;
+
+static void check(bool ok, const char *what, const std::error_code &ec)
+{
+	if (!ok) {
+		failures++;
+		printf("FAIL: %s (%s)\n", what, ec ? ec.message().c_str() : "no error");
+	}
+}
+
+static void test_query(vxi11::Device &dev)
+{
+	std::error_code ec;
+	double d;
+	int i;
+
+	/* The loopback echoes any query it does not know */
+	d = dev.query<double>("1.25?", ec);
+	check(!ec && d == 1.25, "query<double>", ec);
+	d = dev.query<double>(" +2.5E3?", ec);
+	check(!ec && d == 2500.0, "query<double> with leading space and '+'", ec);
+	i = dev.query<int>("-42?", ec);
+	check(!ec && i == -42, "query<int>", ec);
+	d = dev.query<double>("ABC?", ec);
+	check(ec == vxi11::errc::parse_error && d == 0.0, "query<double> of a non-number", ec);
+	check(dev.query<std::string>("*IDN?", ec).rfind("VXI11,", 0) == 0 && !ec,
+	      "query<std::string>", ec);
+
+	/* Replies longer than the stack buffer are read in full */
+	d = dev.query<double>("0.5," + std::string(200, '9') + "?", ec);
+	check(!ec && d == 0.5, "query<double> of a long list", ec);
+	d = dev.query<double>(std::string(100, ' ') + "3.25?", ec);
+	check(!ec && d == 3.25, "query<double> of a padded number", ec);
+	i = dev.query<int>("7?", ec);
+	check(!ec && i == 7, "query<int> after long replies", ec);
+}
+
+static void test_read_block(vxi11::Device &dev)
+{
+	std::array<int16_t, 100> samples;
+	std::array<unsigned char, 200> expected;
+	std::array<std::byte, 1024> rest;
+	std::error_code ec;
+	std::size_t n;
+	std::size_t i;
+
+	/* "BLOCK? n" returns bytes 0, 1, 2, ... */
+	for (i = 0; i < expected.size(); i++) {
+		expected[i] = (unsigned char)i;
+	}
+	samples.fill(0);
+	n = dev.read_block<int16_t>("BLOCK? 200", samples, ec);
+	check(!ec && n == 100 && memcmp(samples.data(), expected.data(), expected.size()) == 0,
+	      "read_block<int16_t>", ec);
+
+	/* An odd number of bytes leaves a partial element, which is not counted */
+	n = dev.read_block<int16_t>("BLOCK? 7", samples, ec);
+	check(!ec && n == 3, "read_block<int16_t> of an odd length", ec);
+
+	/* The rest of a response too big for the span is left to be read */
+	n = dev.read_block<int16_t>("BLOCK? 1000", samples, ec);
+	check(ec == vxi11::errc::buffer_too_small && n == 0, "read_block<int16_t> too big for the span", ec);
+	n = dev.receive_into(std::as_writable_bytes(std::span<std::byte>(rest)), ec);
+	check(!ec && n > 0 && rest[n - 1] == std::byte('\n'), "receive_into of the rest", ec);
+
+	/* A header promising more digits than arrived */
+	n = dev.read_block<int16_t>("#5?", samples, ec);
+	check(ec == vxi11::errc::bad_block && n == 0, "read_block<int16_t> of a bad block", ec);
+
+	/* The link is still usable after the failures */
+	n = dev.read_block<int16_t>("BLOCK? 4", samples, ec);
+	check(!ec && n == 2, "read_block<int16_t> after failures", ec);
+}
+
+int main(int argc, char *argv[])
+{
+	vxi11::Device dev;
+	std::error_code ec;
+	std::string address;
+	char port[16];
+	pid_t server;
+	int status;
+	int i;
+
+	if (argc != 2) {
+		printf("usage: %s <path to vxi11_hislip_loopback>\n", argv[0]);
+		return 2;
+	}
+	snprintf(port, sizeof(port), "%d", 20000 + (int)(getpid() % 20000));
+
+	server = fork();
+	if (server < 0) {
+		perror("fork");
+		return 2;
+	}
+	if (server == 0) {
+		execl(argv[1], argv[1], port, (char *)NULL);
+		perror(argv[1]);
+		_exit(127);
+	}
+
+	address = std::string("TCPIP::127.0.0.1::hislip0,") + port + "::INSTR";
+	for (i = 0; i < 50; i++) {
+		dev = vxi11::Device::open(address, ec);
+		if (!ec || waitpid(server, &status, WNOHANG) == server) {
+			break;
+		}
+		usleep(100000);
+	}
+	if (ec) {
+		printf("FAIL: could not connect to %s\n", address.c_str());
+		kill(server, SIGTERM);
+		waitpid(server, &status, 0);
+		return 1;
+	}
+
+	test_query(dev);
+	test_read_block(dev);
+	dev.close();
+
+	kill(server, SIGTERM);
+	waitpid(server, &status, 0);
+	if (failures) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
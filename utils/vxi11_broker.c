@@ -0,0 +1,946 @@
+/* vxi11_broker.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * A daemon that shares instruments between processes on the same host. It
+ * holds one VXI11 link per instrument and serves any number of local clients
+ * over a Unix domain socket. Programs using libvxi11 talk to it without any
+ * changes when the VXI11_BROKER environment variable is set to the socket
+ * path. Large transfers are handed over through shared memory.
+ *
+ * Requests for an instrument are served in the order they arrive. As each
+ * client has at most one request outstanding, that is round robin between
+ * clients. After a client sends a query (anything containing a '?'), the
+ * instrument is reserved for it until it has read the whole reply, sends
+ * something else, or goes away, so that the reply goes to the client that
+ * asked for it. If it takes longer than the grace period to do so while
+ * others are waiting, the broker reads the reply itself and throws it away,
+ * and the client's late receive fails with error 15 (I/O timeout).
+ *
+ * A client can also take the instrument's lock, in which case the broker takes
+ * the lock on its own link and serves only that client until it unlocks. Other
+ * clients' requests stay queued in order, and fail with error 11 once their
+ * lock timeout expires.
+ *
+ * Links to different devices at one address share the same RPC client, so
+ * library calls for them are made one at a time.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "vxi11_user.h"
+#include "vxi11_broker.h"
+
+/* Default time in ms that a client may take to read the reply to its query
+ * while others are waiting for the instrument. */
+#define DEFAULT_GRACE	10000
+
+/* Time in ms allowed for reading a reply being thrown away. */
+#define DISCARD_TIMEOUT	1000
+
+/* Largest OPEN payload we accept. */
+#define MAX_ADDRESS	1024
+
+struct client;
+
+/* Shared by the instruments at one address. */
+struct host {
+	struct host *next;
+	char *address;
+	int users;		/* instruments at this address */
+	pthread_mutex_t call_lock;	/* held for library calls on their links */
+};
+
+struct instrument {
+	struct instrument *next;
+	struct host *host;
+	char *address;
+	char *device;
+	VXI11_CLINK *clink;
+	int open_rc;
+	int users;		/* clients attached, including queued OPENs */
+	pthread_t thread;
+	pthread_cond_t cond;
+	struct client *queue_head;
+	struct client *queue_tail;
+	struct client *reserved_by;	/* sent a query, its reply is unread */
+	unsigned long reserved_until;	/* after which others needn't wait */
+	struct client *locked_by;
+	char *buf;		/* for replies not going through shared memory */
+	size_t buf_size;
+};
+
+struct client {
+	struct client *next;
+	struct client *queue_next;
+	int fd;
+	struct instrument *inst;
+	struct _vxi11_broker_msg req;
+	struct _vxi11_broker_msg in;	/* the next request, as it arrives */
+	size_t in_got;		/* bytes of it read so far */
+	size_t data_got;	/* bytes of its payload read so far */
+	int in_fd;		/* file descriptor passed with it, or -1 */
+	unsigned long deadline;	/* when a request queued behind a lock fails */
+	int expired;
+	char *data;
+	size_t data_alloc;
+	char *shm;
+	size_t shm_size;
+	int reply_lost;		/* its reply was thrown away, fail its receive */
+	int busy;		/* request queued or in progress */
+	int dead;		/* closed, waiting to be freed */
+};
+
+/* Protects everything above except the VXI11_CLINKs, which are only used by
+ * their instrument's thread, and idle clients' incoming requests, which are
+ * only used by the main thread. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* libvxi11 keeps a list of open clients that is not thread safe. */
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct host *hosts = NULL;
+static struct instrument *instruments = NULL;
+static struct client *clients = NULL;
+static int wake_pipe[2];
+static unsigned long grace = DEFAULT_GRACE;
+static const char *socket_path = VXI11_BROKER_DEFAULT_PATH;
+
+static unsigned long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *)buf;
+	struct pollfd pfd;
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* Client sockets are non-blocking */
+				pfd.fd = fd;
+				pfd.events = POLLOUT;
+				if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+					return -1;
+				}
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Read more of a client's next request, and its payload, without blocking.
+ * Returns 1 once it is all in c->in and c->data, 0 if more is to come, and
+ * -1 if the client has gone or sent something we can't accept. */
+static int read_request(struct client *c)
+{
+	struct msghdr mh;
+	struct iovec iov;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct cmsghdr *cmsg;
+	size_t want;
+	char *p;
+	ssize_t n;
+
+	while (c->in_got < sizeof(c->in)) {
+		memset(&mh, 0, sizeof(mh));
+		iov.iov_base = (char *)&c->in + c->in_got;
+		iov.iov_len = sizeof(c->in) - c->in_got;
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = control.buf;
+		mh.msg_controllen = sizeof(control.buf);
+		n = recvmsg(c->fd, &mh, MSG_CMSG_CLOEXEC);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		cmsg = CMSG_FIRSTHDR(&mh);
+		if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			if (c->in_fd >= 0) {
+				close(c->in_fd);
+			}
+			memcpy(&c->in_fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+		c->in_got += n;
+		if (c->in_got < sizeof(c->in)) {
+			continue;
+		}
+
+		/* Make room for the payload, unless it is in shared memory. */
+		c->data_got = 0;
+		if (!(c->in.flags & VXI11_BROKER_SHM_DATA)
+		    && (c->in.op == VXI11_BROKER_OPEN || c->in.op == VXI11_BROKER_SEND)) {
+			if (c->in.op == VXI11_BROKER_OPEN
+			    && (c->in.len < 2 || c->in.len > MAX_ADDRESS)) {
+				return -1;
+			}
+			if (c->data_alloc < (size_t)c->in.len + 1) {
+				p = (char *)realloc(c->data, (size_t)c->in.len + 1);
+				if (!p) {
+					return -1;
+				}
+				c->data = p;
+				c->data_alloc = (size_t)c->in.len + 1;
+			}
+		}
+	}
+
+	want = 0;
+	if (!(c->in.flags & VXI11_BROKER_SHM_DATA)
+	    && (c->in.op == VXI11_BROKER_OPEN || c->in.op == VXI11_BROKER_SEND)) {
+		want = c->in.len;
+	}
+	while (c->data_got < want) {
+		n = recv(c->fd, c->data + c->data_got, want - c->data_got, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		c->data_got += n;
+	}
+	if (want) {
+		c->data[want] = '\0';
+	}
+	c->in_got = 0;
+	c->data_got = 0;
+	return 1;
+}
+
+static void wake_main(void)
+{
+	char c = 0;
+
+	if (write(wake_pipe[1], &c, 1) < 0) {
+		/* The pipe is full, so main is going to wake up anyway. */
+	}
+}
+
+/* Find or create the host for an address. Called with lock held. */
+static struct host *attach_host(const char *address)
+{
+	struct host *h;
+
+	for (h = hosts; h; h = h->next) {
+		if (strcmp(h->address, address) == 0) {
+			h->users++;
+			return h;
+		}
+	}
+	h = (struct host *)calloc(1, sizeof(struct host));
+	if (!h) {
+		return NULL;
+	}
+	h->address = strdup(address);
+	if (!h->address) {
+		free(h);
+		return NULL;
+	}
+	pthread_mutex_init(&h->call_lock, NULL);
+	h->users = 1;
+	h->next = hosts;
+	hosts = h;
+	return h;
+}
+
+/* Drop an instrument's hold on its host. Called with lock held. */
+static void detach_host(struct host *h)
+{
+	struct host **ph;
+
+	if (--h->users > 0) {
+		return;
+	}
+	for (ph = &hosts; *ph; ph = &(*ph)->next) {
+		if (*ph == h) {
+			*ph = h->next;
+			break;
+		}
+	}
+	pthread_mutex_destroy(&h->call_lock);
+	free(h->address);
+	free(h);
+}
+
+/* Pick the next client to serve. Called and returns with lock held.
+ *
+ * The client holding the lock, or failing that the one the instrument is
+ * reserved for, goes first. Other requests wait, except that OPENs and CLOSEs
+ * are always served and requests waiting for a lock are failed at their
+ * deadline. Returns NULL if others have waited out the grace period of a
+ * reservation, for the caller to throw the unread reply away. */
+static struct client *next_request(struct instrument *inst)
+{
+	struct client **pc = NULL;
+	struct client *holder;
+	struct client *c;
+	struct timespec ts;
+	unsigned long now;
+	unsigned long wait_until;
+	int waiting;
+
+	while (1) {
+		now = now_ms();
+		holder = inst->locked_by ? inst->locked_by : inst->reserved_by;
+		wait_until = inst->locked_by ? 0 : inst->reserved_until;
+		waiting = 0;
+
+		for (pc = &inst->queue_head; *pc; pc = &(*pc)->queue_next) {
+			c = *pc;
+			if (!holder || c == holder || c->req.op == VXI11_BROKER_OPEN
+			    || c->req.op == VXI11_BROKER_CLOSE) {
+				break;
+			}
+			waiting = 1;
+			if (inst->locked_by) {
+				if (now >= c->deadline) {
+					c->expired = 1;
+					break;
+				}
+				if (!wait_until || c->deadline < wait_until) {
+					wait_until = c->deadline;
+				}
+			}
+		}
+		if (*pc) {
+			break;
+		}
+		if (waiting && !inst->locked_by && now >= inst->reserved_until) {
+			return NULL;
+		}
+
+		/* With nobody waiting, a reservation holds for as long as it takes */
+		if (holder && wait_until && waiting) {
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			ts.tv_sec += (wait_until - now) / 1000;
+			ts.tv_nsec += ((wait_until - now) % 1000) * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&inst->cond, &lock, &ts);
+		} else {
+			pthread_cond_wait(&inst->cond, &lock);
+		}
+	}
+
+	c = *pc;
+	*pc = c->queue_next;
+	c->queue_next = NULL;
+	if (inst->queue_tail == c) {
+		inst->queue_tail = NULL;
+		for (pc = &inst->queue_head; *pc; pc = &(*pc)->queue_next) {
+			inst->queue_tail = *pc;
+		}
+	}
+	return c;
+}
+
+/* Carry out a client's request on the instrument, returning the reply status.
+ * Called without lock held. */
+static int serve(struct instrument *inst, struct client *c)
+{
+	struct _vxi11_broker_msg reply;
+	const char *data;
+	char *buffer;
+	unsigned long now;
+	ssize_t ret;
+
+	memset(&reply, 0, sizeof(reply));
+	reply.op = c->req.op;
+
+	pthread_mutex_lock(&inst->host->call_lock);
+	if (c->expired) {
+		/* Another client held the lock for longer than we would wait */
+		reply.status = -11;
+		c->req.op = 0;
+	} else if (inst->open_rc == 0) {
+		vxi11_set_lock_timeout(inst->clink, c->req.lock_timeout);
+	}
+
+	switch (c->req.op) {
+	case VXI11_BROKER_OPEN:
+		reply.status = inst->open_rc ? 1 : 0;
+		break;
+
+	case VXI11_BROKER_SEND:
+		data = (c->req.flags & VXI11_BROKER_SHM_DATA) ? c->shm : c->data;
+		reply.status = vxi11_send(inst->clink, data, c->req.len);
+		break;
+
+	case VXI11_BROKER_RECEIVE:
+		if (c->reply_lost) {
+			c->reply_lost = 0;
+			reply.status = -15;
+			break;
+		}
+		if (c->req.flags & VXI11_BROKER_SHM_DATA) {
+			buffer = c->shm;
+			reply.flags = VXI11_BROKER_SHM_DATA;
+		} else {
+			if (inst->buf_size < c->req.len) {
+				buffer = (char *)realloc(inst->buf, c->req.len);
+				if (!buffer) {
+					reply.status = -9;
+					break;
+				}
+				inst->buf = buffer;
+				inst->buf_size = c->req.len;
+			}
+			buffer = inst->buf;
+		}
+		ret = vxi11_receive_timeout(inst->clink, buffer, c->req.len,
+					    c->req.timeout);
+		reply.status = (int32_t)ret;
+		if (ret == -100) {
+			reply.len = c->req.len;	/* the buffer is full */
+		} else {
+			reply.len = ret > 0 ? ret : 0;
+		}
+		break;
+
+	case VXI11_BROKER_CLEAR:
+		reply.status = vxi11_device_clear(inst->clink);
+		break;
+
+	case VXI11_BROKER_LOCK:
+		if (inst->locked_by == c) {
+			reply.status = -11;	/* as a VXI11 link would */
+		} else {
+			now = now_ms();
+			reply.status = vxi11_lock(inst->clink,
+						  now < c->deadline ? c->deadline - now : 0);
+		}
+		break;
+
+	case VXI11_BROKER_UNLOCK:
+		if (inst->locked_by == c) {
+			reply.status = vxi11_unlock(inst->clink);
+		} else {
+			reply.status = -12;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&inst->host->call_lock);
+
+	if (write_all(c->fd, &reply, sizeof(reply)) == 0
+	    && reply.len > 0 && !(reply.flags & VXI11_BROKER_SHM_DATA)) {
+		write_all(c->fd, inst->buf, reply.len);
+	}
+	return reply.status;
+}
+
+/* Read and throw away the reply to a query whose client has not come for it
+ * in time, so that nobody else gets it. Called and returns with lock held. */
+static void discard_reply(struct instrument *inst)
+{
+	char scratch[4096];
+	ssize_t ret;
+
+	fprintf(stderr, "vxi11_broker: %s %s: reply not read in time, discarding it\n",
+		inst->address, inst->device);
+	inst->reserved_by->reply_lost = 1;
+	inst->reserved_by = NULL;
+	pthread_mutex_unlock(&lock);
+
+	pthread_mutex_lock(&inst->host->call_lock);
+	do {
+		ret = vxi11_receive_timeout(inst->clink, scratch, sizeof(scratch),
+					    DISCARD_TIMEOUT);
+	} while (ret == -100);
+	pthread_mutex_unlock(&inst->host->call_lock);
+
+	pthread_mutex_lock(&lock);
+}
+
+static void *instrument_thread(void *arg)
+{
+	struct instrument *inst = (struct instrument *)arg;
+	struct instrument **pi;
+	struct client *c;
+	int rc;
+
+	pthread_mutex_lock(&inst->host->call_lock);
+	pthread_mutex_lock(&open_lock);
+	rc = vxi11_open_device(&inst->clink, inst->address, inst->device);
+	pthread_mutex_unlock(&open_lock);
+	pthread_mutex_unlock(&inst->host->call_lock);
+
+	pthread_mutex_lock(&lock);
+	inst->open_rc = rc;
+	if (rc) {
+		fprintf(stderr, "vxi11_broker: could not open %s %s\n",
+			inst->address, inst->device);
+	}
+
+	while (1) {
+		c = next_request(inst);
+		if (!c) {
+			discard_reply(inst);
+			continue;
+		}
+
+		if (c->req.op == VXI11_BROKER_CLOSE
+		    || (c->req.op == VXI11_BROKER_OPEN && inst->open_rc)) {
+			if (c->req.op == VXI11_BROKER_OPEN) {
+				pthread_mutex_unlock(&lock);
+				serve(inst, c);
+				pthread_mutex_lock(&lock);
+			}
+			c->inst = NULL;
+			if (inst->reserved_by == c) {
+				inst->reserved_by = NULL;
+			}
+			if (inst->locked_by == c) {
+				/* Don't leave the instrument locked for a client
+				 * that has gone */
+				pthread_mutex_unlock(&lock);
+				pthread_mutex_lock(&inst->host->call_lock);
+				vxi11_unlock(inst->clink);
+				pthread_mutex_unlock(&inst->host->call_lock);
+				pthread_mutex_lock(&lock);
+				inst->locked_by = NULL;
+			}
+			if (c->req.op == VXI11_BROKER_CLOSE) {
+				c->dead = 1;
+			}
+			c->busy = 0;
+			wake_main();
+			if (--inst->users == 0) {
+				break;
+			}
+			continue;
+		}
+
+		pthread_mutex_unlock(&lock);
+		rc = serve(inst, c);
+		pthread_mutex_lock(&lock);
+
+		if (c->req.op == VXI11_BROKER_LOCK && rc == 0) {
+			inst->locked_by = c;
+		} else if (c->req.op == VXI11_BROKER_UNLOCK && inst->locked_by == c) {
+			inst->locked_by = NULL;
+		} else if (c->req.op == VXI11_BROKER_SEND) {
+			c->reply_lost = 0;
+			if (rc == 0 && memchr((c->req.flags & VXI11_BROKER_SHM_DATA) ? c->shm : c->data,
+					      '?', c->req.len)) {
+				inst->reserved_by = c;
+				inst->reserved_until = now_ms() + grace;
+			} else if (inst->reserved_by == c) {
+				inst->reserved_by = NULL;
+			}
+		} else if (c->req.op == VXI11_BROKER_RECEIVE && inst->reserved_by == c) {
+			if (rc >= 0) {
+				/* The whole reply has been read */
+				inst->reserved_by = NULL;
+			} else if (rc == -100) {
+				/* More to come, as fast as the client reads it */
+				inst->reserved_until = now_ms() + grace;
+			}
+		}
+		c->busy = 0;
+		wake_main();
+	}
+
+	/* Last user gone. Once off the list, nobody else can find us. */
+	for (pi = &instruments; *pi; pi = &(*pi)->next) {
+		if (*pi == inst) {
+			*pi = inst->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (inst->open_rc == 0) {
+		pthread_mutex_lock(&inst->host->call_lock);
+		pthread_mutex_lock(&open_lock);
+		vxi11_close_device(inst->clink, inst->address);
+		pthread_mutex_unlock(&open_lock);
+		pthread_mutex_unlock(&inst->host->call_lock);
+	}
+	pthread_mutex_lock(&lock);
+	detach_host(inst->host);
+	pthread_mutex_unlock(&lock);
+	pthread_cond_destroy(&inst->cond);
+	free(inst->address);
+	free(inst->device);
+	free(inst->buf);
+	free(inst);
+	return NULL;
+}
+
+/* Queue a client's request on its instrument. Called with lock held. */
+static void enqueue(struct client *c)
+{
+	struct instrument *inst = c->inst;
+
+	c->busy = 1;
+	c->expired = 0;
+	c->deadline = now_ms() + (c->req.op == VXI11_BROKER_LOCK
+				  ? c->req.timeout : c->req.lock_timeout);
+	c->queue_next = NULL;
+	if (inst->queue_tail) {
+		inst->queue_tail->queue_next = c;
+	} else {
+		inst->queue_head = c;
+	}
+	inst->queue_tail = c;
+	pthread_cond_signal(&inst->cond);
+}
+
+/* Find or create the instrument for an OPEN request. Called with lock held. */
+static struct instrument *attach(const char *address, const char *device)
+{
+	struct instrument *inst;
+	pthread_condattr_t attr;
+
+	for (inst = instruments; inst; inst = inst->next) {
+		if (strcmp(inst->address, address) == 0
+		    && strcmp(inst->device, device) == 0) {
+			inst->users++;
+			return inst;
+		}
+	}
+
+	inst = (struct instrument *)calloc(1, sizeof(struct instrument));
+	if (!inst) {
+		return NULL;
+	}
+	inst->address = strdup(address);
+	inst->device = strdup(device);
+	inst->host = attach_host(address);
+	if (!inst->address || !inst->device || !inst->host) {
+		if (inst->host) {
+			detach_host(inst->host);
+		}
+		free(inst->address);
+		free(inst->device);
+		free(inst);
+		return NULL;
+	}
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&inst->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	inst->users = 1;
+
+	if (pthread_create(&inst->thread, NULL, instrument_thread, inst)) {
+		pthread_cond_destroy(&inst->cond);
+		detach_host(inst->host);
+		free(inst->address);
+		free(inst->device);
+		free(inst);
+		return NULL;
+	}
+	pthread_detach(inst->thread);
+	inst->next = instruments;
+	instruments = inst;
+	return inst;
+}
+
+/* Read from an idle client, and dispatch its request once it has all
+ * arrived. Called without lock held, which is only taken to queue the request,
+ * so a slow client holds up nobody else. Returns nonzero if the client should
+ * be dropped. */
+static int handle_request(struct client *c)
+{
+	struct _vxi11_broker_msg msg;
+	struct _vxi11_broker_msg reply;
+	struct instrument *inst;
+	char *p;
+	int fd;
+	int rc;
+
+	rc = read_request(c);
+	if (rc <= 0) {
+		return rc < 0;
+	}
+	msg = c->in;
+	fd = c->in_fd;
+	c->in_fd = -1;
+
+	if (msg.op == VXI11_BROKER_SHM) {
+		memset(&reply, 0, sizeof(reply));
+		reply.op = msg.op;
+		p = fd < 0 ? MAP_FAILED
+		    : (char *)mmap(NULL, msg.len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED) {
+			reply.status = 1;
+		} else {
+			if (c->shm) {
+				munmap(c->shm, c->shm_size);
+			}
+			c->shm = p;
+			c->shm_size = msg.len;
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+		return write_all(c->fd, &reply, sizeof(reply));
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	if ((msg.flags & VXI11_BROKER_SHM_DATA) && msg.len > c->shm_size) {
+		return 1;
+	}
+
+	switch (msg.op) {
+	case VXI11_BROKER_OPEN:
+		if (c->inst || memchr(c->data, '\0', msg.len - 1) == NULL) {
+			return 1;
+		}
+		break;
+
+	case VXI11_BROKER_CLOSE:
+	case VXI11_BROKER_SEND:
+	case VXI11_BROKER_RECEIVE:
+	case VXI11_BROKER_CLEAR:
+	case VXI11_BROKER_LOCK:
+	case VXI11_BROKER_UNLOCK:
+		if (!c->inst) {
+			return 1;
+		}
+		break;
+
+	default:
+		return 1;
+	}
+
+	pthread_mutex_lock(&lock);
+	c->req = msg;
+	if (msg.op == VXI11_BROKER_OPEN) {
+		inst = attach(c->data, c->data + strlen(c->data) + 1);
+		if (!inst) {
+			pthread_mutex_unlock(&lock);
+			return 1;
+		}
+		c->inst = inst;
+	}
+	enqueue(c);
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+static void free_client(struct client *c)
+{
+	close(c->fd);
+	if (c->in_fd >= 0) {
+		close(c->in_fd);
+	}
+	if (c->shm) {
+		munmap(c->shm, c->shm_size);
+	}
+	free(c->data);
+	free(c);
+}
+
+static void cleanup(int sig)
+{
+	unlink(socket_path);
+	_exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_un sun;
+	struct pollfd *pfds = NULL;
+	struct client **polled = NULL;
+	size_t npfds_alloc = 0;
+	size_t npfds;
+	size_t i;
+	struct client *c;
+	struct client **pc;
+	char drain[64];
+	int listen_fd;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:g:")) != -1) {
+		switch (opt) {
+		case 's':
+			socket_path = optarg;
+			break;
+		case 'g':
+			grace = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			printf("usage: %s [-s socket_path] [-g grace_ms]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	/* We hold the real links, don't go through ourselves. */
+	unsetenv(VXI11_BROKER_ENV);
+
+	if (strlen(socket_path) >= sizeof(sun.sun_path)) {
+		printf("Error: socket path too long\n");
+		exit(1);
+	}
+	if (pipe2(wake_pipe, O_NONBLOCK | O_CLOEXEC)) {
+		perror("pipe");
+		exit(1);
+	}
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, socket_path);
+	unlink(socket_path);
+	if (bind(listen_fd, (struct sockaddr *)&sun, sizeof(sun)) || listen(listen_fd, 64)) {
+		perror(socket_path);
+		exit(2);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, cleanup);
+	signal(SIGTERM, cleanup);
+
+	pthread_mutex_lock(&lock);
+	while (1) {
+		/* Free clients that have gone, and poll the idle ones. */
+		npfds = 2;
+		for (pc = &clients; *pc;) {
+			c = *pc;
+			if (c->dead) {
+				*pc = c->next;
+				free_client(c);
+				continue;
+			}
+			if (!c->busy) {
+				npfds++;
+			}
+			pc = &c->next;
+		}
+		if (npfds > npfds_alloc) {
+			free(pfds);
+			free(polled);
+			pfds = (struct pollfd *)malloc(npfds * sizeof(struct pollfd));
+			polled = (struct client **)malloc(npfds * sizeof(struct client *));
+			if (!pfds || !polled) {
+				printf("Error: out of memory\n");
+				exit(3);
+			}
+			npfds_alloc = npfds;
+		}
+		pfds[0].fd = listen_fd;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = wake_pipe[0];
+		pfds[1].events = POLLIN;
+		npfds = 2;
+		for (c = clients; c; c = c->next) {
+			if (!c->busy) {
+				pfds[npfds].fd = c->fd;
+				pfds[npfds].events = POLLIN;
+				polled[npfds] = c;
+				npfds++;
+			}
+		}
+		pthread_mutex_unlock(&lock);
+
+		if (poll(pfds, npfds, -1) < 0 && errno != EINTR) {
+			perror("poll");
+			exit(3);
+		}
+
+		pthread_mutex_lock(&lock);
+		if (pfds[1].revents) {
+			while (read(wake_pipe[0], drain, sizeof(drain)) > 0);
+		}
+		if (pfds[0].revents) {
+			int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+			if (fd >= 0) {
+				c = (struct client *)calloc(1, sizeof(struct client));
+				if (c) {
+					c->fd = fd;
+					c->in_fd = -1;
+					c->next = clients;
+					clients = c;
+				} else {
+					close(fd);
+				}
+			}
+		}
+		pthread_mutex_unlock(&lock);
+
+		/* The polled clients are idle, so only we touch them until their
+		 * requests are queued. */
+		for (i = 2; i < npfds; i++) {
+			c = polled[i];
+			if (!pfds[i].revents) {
+				continue;
+			}
+			if (handle_request(c)) {
+				pthread_mutex_lock(&lock);
+				if (c->inst) {
+					/* Let the instrument thread detach it. */
+					c->req.op = VXI11_BROKER_CLOSE;
+					enqueue(c);
+				} else {
+					c->dead = 1;
+				}
+				pthread_mutex_unlock(&lock);
+			}
+		}
+		pthread_mutex_lock(&lock);
+	}
+	return 0;
+}
@@ -5,20 +5,23 @@
  * a device enabled with the VXI11 RPC ethernet protocol. Uses the files
  * generated by rpcgen vxi11.x, and the vxi11_user.h user libraries.
  *
+ * Given a script with -f, it runs the commands in it instead of prompting,
+ * timing each one, and can repeat the script at a fixed rate for load tests.
+ *
  * This program is free software; you can redistribute it and/or
  * modify it under the terms of the GNU General Public License
  * as published by the Free Software Foundation; either version 2
  * of the License, or (at your option) any later version.
- * 
+ *
  * This program is distributed in the hope that it will be useful,
  * but WITHOUT ANY WARRANTY; without even the implied warranty of
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
- * 
+ *
  * You should have received a copy of the GNU General Public License
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
- * 
+ *
  * The author's email address is steve.sharples@nottingham.ac.uk
  */
 
@@ -27,63 +30,432 @@
 #include <string.h>
 
 #include "vxi11_user.h"
-#define BUF_LEN 100000
 
 #ifdef WIN32
-#define strncasecmp(a, b, c) stricmp(a, b)
+#  include <windows.h>
+#  define strncasecmp(a, b, c) stricmp(a, b)
+#else
+#  include <time.h>
+#endif
+
+/* One line of a script. file is where the reply goes, or NULL. */
+struct line {
+	char *cmd;
+	char *file;
+	int query;
+};
+
+/* The reply to the line being run, and the totals for the summary */
+static char *buf;
+static unsigned long lines_run;
+static unsigned long lines_failed;
+static double total_ms;
+static double min_ms;
+static double max_ms;
+
+/* The library is silent unless asked, show its messages to the user */
+static void log_message(int level, const char *message, void *user)
+{
+	fprintf(stderr, "%s\n", message);
+}
+
+static double now_ms(void)
+{
+#ifdef WIN32
+	LARGE_INTEGER count;
+	LARGE_INTEGER freq;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double)count.QuadPart * 1000.0 / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
 #endif
+}
+
+static void sleep_ms(double ms)
+{
+#ifdef WIN32
+	Sleep((DWORD)ms);
+#else
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)(ms / 1000.0);
+	ts.tv_nsec = (long)((ms - ts.tv_sec * 1000.0) * 1000000.0);
+	nanosleep(&ts, NULL);
+#endif
+}
+
+/* Read a line of any length, without its newline. Returns NULL at the end of
+ * the file. */
+static char *read_line(FILE *f)
+{
+	size_t size = 256;
+	size_t len = 0;
+	char *line = (char *)malloc(size);
+
+	if (!line) {
+		return NULL;
+	}
+	while (fgets(line + len, size - len, f)) {
+		len += strlen(line + len);
+		if (len > 0 && line[len - 1] == '\n') {
+			break;
+		}
+		if (len < size - 1) {
+			continue;
+		}
+		size *= 2;
+		line = (char *)realloc(line, size);
+		if (!line) {
+			return NULL;
+		}
+	}
+	if (len == 0 && feof(f)) {
+		free(line);
+		return NULL;
+	}
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+		line[--len] = '\0';
+	}
+	return line;
+}
+
+static char *trim(char *s)
+{
+	char *end;
+
+	while (*s == ' ' || *s == '\t') {
+		s++;
+	}
+	end = s + strlen(s);
+	while (end > s && (end[-1] == ' ' || end[-1] == '\t')) {
+		*--end = '\0';
+	}
+	return s;
+}
+
+/* Split "command > file" and work out whether the command expects a reply,
+ * ignoring any '?' or '>' inside quoted strings. */
+static void parse_line(char *text, struct line *l)
+{
+	char *redirect = NULL;
+	char quote = 0;
+	char *p;
+
+	l->query = 0;
+	for (p = text; *p; p++) {
+		if (quote) {
+			if (*p == quote) {
+				quote = 0;
+			}
+		} else if (*p == '"' || *p == '\'') {
+			quote = *p;
+		} else if (*p == '?') {
+			l->query = 1;
+		} else if (*p == '>') {
+			redirect = p;
+		}
+	}
+	l->file = NULL;
+	if (redirect) {
+		*redirect = '\0';
+		l->file = trim(redirect + 1);
+	}
+	l->cmd = trim(text);
+}
+
+/* Length of the "#<n><length>" header if reply is a definite length block,
+ * and the length of its data. */
+static int block_header(const char *reply, long len, unsigned long *data_len)
+{
+	int ndigits;
+	int i;
+
+	if (len < 2 || reply[0] != '#' || reply[1] < '1' || reply[1] > '9') {
+		return 0;
+	}
+	ndigits = reply[1] - '0';
+	if (len < ndigits + 2) {
+		return 0;
+	}
+	*data_len = 0;
+	for (i = 2; i < ndigits + 2; i++) {
+		*data_len = *data_len * 10 + (reply[i] - '0');
+	}
+	if (*data_len > (unsigned long)len - (ndigits + 2)) {
+		return 0;
+	}
+	return ndigits + 2;
+}
+
+/* Write a reply to a file. Only the data of a block is written. On later
+ * passes over a script, replies are added to the end. Returns the number of
+ * bytes written, or -1. */
+static long save_reply(const char *file, const char *reply, long len, int append)
+{
+	unsigned long data_len = len;
+	int header = block_header(reply, len, &data_len);
+	FILE *f;
+
+	f = fopen(file, append ? "ab" : "wb");
+	if (!f) {
+		fprintf(stderr, "Error: could not write %s\n", file);
+		return -1;
+	}
+	if (fwrite(reply + header, 1, data_len, f) != data_len) {
+		fprintf(stderr, "Error: could not write %s\n", file);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	return (long)data_len;
+}
+
+/* Show the outcome of a line, ret being what sending it, or receiving its
+ * reply into buf, returned. In a script, show how long it took unless quiet.
+ * Returns 0, or the error. */
+static long show_line(struct line *l, long ret, double ms, int batch, int quiet,
+		      int pass)
+{
+	unsigned long data_len;
+
+	if (!batch) {
+		if (ret > 0 && l->file) {
+			save_reply(l->file, buf, ret, 0);
+		} else if (ret > 0) {
+			printf("%s\n", buf);
+		} else if (ret == -15) {
+			printf("*** [ NOTHING RECEIVED ] ***\n");
+			ret = 0;
+		}
+		return ret < 0 ? ret : 0;
+	}
+
+	if (ret < 0) {
+		lines_failed++;
+		printf("%.3f ms\t%s\t*** [ ERROR %ld ] ***\n", ms, l->cmd, ret);
+		return ret;
+	}
+	if (l->file && l->query) {
+		ret = save_reply(l->file, buf, ret, pass > 1);
+		if (ret < 0) {
+			lines_failed++;
+			return ret;
+		}
+	}
+	if (quiet) {
+		return 0;
+	}
+	printf("%.3f ms\t%s", ms, l->cmd);
+	if (l->query && l->file) {
+		printf("\t[ %ld bytes to %s ]", ret, l->file);
+	} else if (l->query) {
+		while (ret > 0 && (buf[ret - 1] == '\n' || buf[ret - 1] == '\r')) {
+			buf[--ret] = '\0';
+		}
+		if (block_header(buf, ret, &data_len)) {
+			printf("\t[ block of %lu bytes ]", data_len);
+		} else {
+			printf("\t%s", buf);
+		}
+	}
+	printf("\n");
+	return 0;
+}
+
+/* Send a line, and read and show the reply if it is a query. Returns 0, or
+ * the error. */
+static long run_line(VXI11_CLINK *clink, struct line *l, int batch, int quiet,
+		     int pass, unsigned long timeout)
+{
+	double start;
+	double ms;
+	long ret;
+
+	buf = NULL;
+	start = now_ms();
+	ret = vxi11_send(clink, l->cmd, strlen(l->cmd));
+	if (ret == 0 && l->query) {
+		ret = vxi11_receive_alloc(clink, &buf, timeout);
+	}
+	ms = now_ms() - start;
+
+	lines_run++;
+	total_ms += ms;
+	if (lines_run == 1 || ms < min_ms) {
+		min_ms = ms;
+	}
+	if (ms > max_ms) {
+		max_ms = ms;
+	}
+
+	ret = show_line(l, ret, ms, batch, quiet, pass);
+	vxi11_release(clink, buf);
+	return ret;
+}
+
+/* Read a script, leaving out blank lines and comments. */
+static struct line *read_script(const char *name, size_t *count)
+{
+	struct line *lines = NULL;
+	size_t alloc = 0;
+	char *text;
+	FILE *f;
+
+	f = strcmp(name, "-") == 0 ? stdin : fopen(name, "r");
+	if (!f) {
+		return NULL;
+	}
+	*count = 0;
+	while ((text = read_line(f)) != NULL) {
+		if (*trim(text) == '\0' || *trim(text) == '#') {
+			free(text);
+			continue;
+		}
+		if (*count == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			lines = (struct line *)realloc(lines, alloc * sizeof(struct line));
+			if (!lines) {
+				return NULL;
+			}
+		}
+		parse_line(text, &lines[(*count)++]);
+	}
+	if (f != stdin) {
+		fclose(f);
+	}
+	return lines;
+}
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [-f script] [-r repeat] [-R rate] [-t timeout_ms] [-q] your.inst.ip.addr [device_name]\n", prog);
+	printf("  -f, --file     run the commands in script ('-' for stdin) instead of prompting\n");
+	printf("  -r, --repeat   run the script this many times\n");
+	printf("  -R, --rate     start at most this many runs of the script a second\n");
+	printf("  -t, --timeout  how long to wait for each reply, in ms\n");
+	printf("  -q, --quiet    only show failures and the summary\n");
+	printf("A line ending in '> file' writes its reply to file, just the data if it\n");
+	printf("is a block.\n");
+	exit(1);
+}
+
+static int option(const char *arg, const char *short_name, const char *long_name)
+{
+	return strcmp(arg, short_name) == 0 || strcmp(arg, long_name) == 0;
+}
 
 int main(int argc, char *argv[])
 {
 
 	char *device_ip;
 	char *device_name = NULL;
-	char cmd[256];
-	char buf[BUF_LEN];
+	char *script = NULL;
+	char *text;
+	unsigned long repeat = 1;
+	unsigned long timeout = VXI11_READ_TIMEOUT;
+	double rate = 0.0;
+	double start;
+	double elapsed;
+	int quiet = 0;
 	int ret;
-	long bytes_returned;
+	unsigned long pass;
+	size_t count = 0;
+	size_t n;
+	int i;
+	struct line *lines = NULL;
+	struct line l;
 	VXI11_CLINK *clink;
 
-	if (argc < 2) {
-		printf("usage: %s your.inst.ip.addr [device_name]\n", argv[0]);
-		exit(1);
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (option(argv[i], "-f", "--file") && i + 1 < argc) {
+			script = argv[++i];
+		} else if (option(argv[i], "-r", "--repeat") && i + 1 < argc) {
+			repeat = strtoul(argv[++i], NULL, 10);
+		} else if (option(argv[i], "-R", "--rate") && i + 1 < argc) {
+			rate = atof(argv[++i]);
+		} else if (option(argv[i], "-t", "--timeout") && i + 1 < argc) {
+			timeout = strtoul(argv[++i], NULL, 10);
+		} else if (option(argv[i], "-q", "--quiet")) {
+			quiet = 1;
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (i == argc) {
+		usage(argv[0]);
+	}
+
+	vxi11_set_log_callback(log_message, VXI11_LOG_WARNING, NULL);
+
+	device_ip = argv[i];
+	if (i + 1 < argc) {
+		device_name = argv[i + 1];
 	}
 
-	device_ip = argv[1];
-	if (argc > 2) {
-		device_name = argv[2];
+	if (script) {
+		lines = read_script(script, &count);
+		if (!lines) {
+			printf("Error: could not read %s, quitting\n", script);
+			exit(1);
+		}
 	}
+
 	if(vxi11_open_device(&clink, device_ip, device_name)){
 		printf("Error: could not open device %s, quitting\n",
 		       device_ip);
 		exit(2);
 	}
 
-	while (1) {
-		memset(cmd, 0, 256);	// initialize command string
-		memset(buf, 0, BUF_LEN);	// initialize buffer
-		printf("Input command or query ('q' to exit): ");
-		fgets(cmd, 256, stdin);
-		cmd[strlen(cmd) - 1] = 0;	// just gets rid of the \n
-		if (strncasecmp(cmd, "q", 1) == 0) {
-			break;
+	if (!script) {
+		while (1) {
+			printf("Input command or query ('q' to exit): ");
+			fflush(stdout);
+			text = read_line(stdin);
+			if (!text) {
+				break;
+			}
+			parse_line(text, &l);
+			if (strncasecmp(l.cmd, "q", 1) == 0) {
+				free(text);
+				break;
+			}
+			ret = run_line(clink, &l, 0, 0, 1, timeout);
+			free(text);
+			if (ret < 0) {
+				break;
+			}
 		}
+		ret = vxi11_close_device(clink, device_ip);
+		return 0;
+	}
 
-		if (vxi11_send(clink, cmd, strlen(cmd)) < 0) {
-			break;
-		}
-		if (strstr(cmd, "?") != 0) {
-			bytes_returned = vxi11_receive(clink, buf, BUF_LEN);
-			if (bytes_returned > 0) {
-				printf("%s\n", buf);
-			} else if (bytes_returned == -15) {
-				printf("*** [ NOTHING RECEIVED ] ***\n");
-			} else {
-				break;
+	ret = 0;
+	start = now_ms();
+	for (pass = 1; pass <= repeat && ret == 0; pass++) {
+		if (rate > 0.0) {
+			elapsed = now_ms() - start;
+			if (elapsed < (pass - 1) * 1000.0 / rate) {
+				sleep_ms((pass - 1) * 1000.0 / rate - elapsed);
 			}
 		}
+		for (n = 0; n < count && ret == 0; n++) {
+			ret = run_line(clink, &lines[n], 1, quiet, pass, timeout);
+		}
 	}
+	elapsed = now_ms() - start;
 
-	ret = vxi11_close_device(clink, device_ip);
-	return 0;
+	if (lines_run > 0) {
+		fprintf(stderr, "%lu commands in %.3f s (%.1f/s), %lu failed, "
+			"min/mean/max %.3f/%.3f/%.3f ms\n",
+			lines_run, elapsed / 1000.0, elapsed > 0.0 ? lines_run * 1000.0 / elapsed : 0.0,
+			lines_failed, min_ms, total_ms / lines_run, max_ms);
+	}
+
+	vxi11_close_device(clink, device_ip);
+	return lines_failed > 0 ? 3 : 0;
 }
@@ -0,0 +1,77 @@
+/* vxi11_discover.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * A simple utility that lists the VXI11 enabled instruments on a network,
+ * using vxi11_discover() from the user library.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ * 
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vxi11_user.h"
+
+static void found(const char *address, unsigned short port, const char *idn,
+		  void *user)
+{
+	if (idn) {
+		printf("%s:%u\t%s\n", address, port, idn);
+	} else {
+		printf("%s:%u\n", address, port);
+	}
+}
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [-i] [-t timeout_ms] address[/prefix][:pmap_port] ...\n", prog);
+	printf("  -i  ask each instrument found for *IDN?\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long timeout = 1000;
+	int flags = 0;
+	int total = 0;
+	int ret;
+	int i;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-i") == 0) {
+			flags |= VXI11_DISCOVER_IDN;
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			timeout = strtoul(argv[++i], NULL, 10);
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (i == argc) {
+		usage(argv[0]);
+	}
+
+	for (; i < argc; i++) {
+		ret = vxi11_discover(argv[i], timeout, flags, found, NULL);
+		if (ret < 0) {
+			printf("Error: could not scan %s (%d)\n", argv[i], ret);
+			exit(2);
+		}
+		total += ret;
+	}
+	return total > 0 ? 0 : 3;
+}
@@ -0,0 +1,646 @@
+/* vxi11_hislip_loopback.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * A minimal HiSLIP (IVI-6.1) instrument, for trying out the library's HiSLIP
+ * transport without hardware. It answers "*IDN?", "BLOCK? <n>" with an n byte
+ * definite length block, and echoes any other query (anything containing a
+ * '?') back unchanged. Commands get no response.
+ *
+ * Device clear, locking, status queries and the maximum message size
+ * negotiation are supported, in either synchronized or overlapped mode.
+ * Responses are always sent, whether or not the client has read the previous
+ * one, so the Interrupted messages of synchronized mode are never used.
+ *
+ * Connect with vxi11_open_device(&clink, "TCPIP::127.0.0.1::hislip0::INSTR",
+ * NULL), adding ",port" to "hislip0" if not listening on 4880.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "vxi11_hislip.h"
+
+#define MAX_CONNS	64
+
+/* Stop reading requests from a client that is this far behind with reading
+ * our responses. */
+#define OUT_HIGH_WATER	(4 * 1024 * 1024)
+
+/* Longest command accepted, over all its Data messages */
+#define MAX_COMMAND	(64 * 1024 * 1024)
+
+/* Error codes, for Error and FatalError messages */
+#define ERROR_UNRECOGNIZED_TYPE		1
+#define ERROR_MESSAGE_TOO_LARGE		4
+#define FATAL_INVALID_INITIALIZATION	3
+
+#define IDN	"VXI11,HiSLIP loopback,0,1.0"
+
+enum channel {
+	CHANNEL_NEW = 0,	/* not initialized yet */
+	CHANNEL_SYNC,
+	CHANNEL_ASYNC,
+};
+
+struct buffer {
+	char *data;
+	size_t len;
+	size_t alloc;
+};
+
+struct conn {
+	int fd;
+	struct buffer in;
+	struct buffer out;
+	size_t out_pos;		/* how much of out has been written */
+	enum channel channel;
+	uint16_t session;
+
+	/* Synchronous channel: the command being received */
+	struct buffer message;
+
+	/* Asynchronous channel: a lock request waiting for another session
+	 * to unlock, until lock_deadline */
+	int lock_waiting;
+	unsigned long lock_deadline;
+};
+
+static struct conn *conns[MAX_CONNS];
+static uint64_t max_message_size = 1024 * 1024;
+static int overlapped;
+static int verbose;
+static uint16_t next_session = 1;
+static uint16_t lock_owner;	/* session holding the lock, 0 for none */
+
+static struct {
+	unsigned long sessions;
+	unsigned long messages;
+	unsigned long queries;
+	unsigned long clears;
+	unsigned long locks;
+} stats;
+
+static unsigned long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int buffer_append(struct buffer *b, const char *data, size_t len)
+{
+	char *p;
+	size_t alloc;
+
+	if (b->len + len > b->alloc) {
+		alloc = b->alloc ? b->alloc : 4096;
+		while (alloc < b->len + len) {
+			alloc *= 2;
+		}
+		p = (char *)realloc(b->data, alloc);
+		if (!p) {
+			return 1;
+		}
+		b->data = p;
+		b->alloc = alloc;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	return 0;
+}
+
+static void buffer_consume(struct buffer *b, size_t len)
+{
+	memmove(b->data, b->data + len, b->len - len);
+	b->len -= len;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+	    | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+	return ((uint64_t)get32(p) << 32) | get32(p + 4);
+}
+
+static int send_message(struct conn *c, int type, int control, uint32_t parameter,
+			const void *payload, uint64_t len)
+{
+	unsigned char h[HISLIP_HEADER_SIZE];
+	int i;
+
+	h[0] = 'H';
+	h[1] = 'S';
+	h[2] = (unsigned char)type;
+	h[3] = (unsigned char)control;
+	for (i = 0; i < 4; i++) {
+		h[4 + i] = (unsigned char)(parameter >> (24 - 8 * i));
+	}
+	for (i = 0; i < 8; i++) {
+		h[8 + i] = (unsigned char)(len >> (56 - 8 * i));
+	}
+	return buffer_append(&c->out, (char *)h, sizeof(h))
+	    || buffer_append(&c->out, (const char *)payload, len);
+}
+
+static int send_error(struct conn *c, int type, int code, const char *text)
+{
+	if (verbose) {
+		printf("session %u: %s\n", c->session, text);
+	}
+	return send_message(c, type, code, 0, text, strlen(text));
+}
+
+static struct conn *find_channel(uint16_t session, enum channel channel)
+{
+	int i;
+
+	for (i = 0; i < MAX_CONNS; i++) {
+		if (conns[i] && conns[i]->session == session
+		    && conns[i]->channel == channel) {
+			return conns[i];
+		}
+	}
+	return NULL;
+}
+
+/* Send a response as Data messages of at most max_message_size, the last of
+ * them DataEND. */
+static int respond(struct conn *c, uint32_t message_id, const char *data, size_t len)
+{
+	size_t chunk = max_message_size - HISLIP_HEADER_SIZE;
+	size_t pos = 0;
+
+	do {
+		if (len - pos <= chunk) {
+			return send_message(c, HISLIP_DATA_END, 0, message_id,
+					    data + pos, len - pos);
+		}
+		if (send_message(c, HISLIP_DATA, 0, message_id, data + pos, chunk)) {
+			return 1;
+		}
+		pos += chunk;
+	} while (1);
+}
+
+/* Act on a whole command from the client. */
+static int handle_command(struct conn *c, uint32_t message_id)
+{
+	char *cmd;
+	char *resp;
+	size_t len = c->message.len;
+	size_t n;
+	size_t i;
+	int digits;
+	int rc;
+
+	stats.messages++;
+	while (len > 0 && (c->message.data[len - 1] == '\n' || c->message.data[len - 1] == '\r')) {
+		len--;
+	}
+	cmd = (char *)malloc(len + 1);
+	if (!cmd) {
+		return 1;
+	}
+	memcpy(cmd, c->message.data, len);
+	cmd[len] = '\0';
+	c->message.len = 0;
+
+	if (!memchr(cmd, '?', len)) {
+		free(cmd);
+		return 0;
+	}
+	stats.queries++;
+	if (strcasecmp(cmd, "*IDN?") == 0) {
+		rc = respond(c, message_id, IDN "\n", strlen(IDN "\n"));
+	} else if (strncasecmp(cmd, "BLOCK?", 6) == 0) {
+		n = strtoul(cmd + 6, NULL, 10);
+		resp = (char *)malloc(n + 32);
+		if (!resp) {
+			free(cmd);
+			return 1;
+		}
+		digits = snprintf(resp + 2, 30, "%lu", (unsigned long)n);
+		resp[0] = '#';
+		resp[1] = '0' + digits;
+		for (i = 0; i < n; i++) {
+			resp[2 + digits + i] = (char)i;
+		}
+		resp[2 + digits + n] = '\n';
+		rc = respond(c, message_id, resp, 2 + digits + n + 1);
+		free(resp);
+	} else {
+		cmd[len] = '\n';
+		rc = respond(c, message_id, cmd, len + 1);
+	}
+	free(cmd);
+	return rc;
+}
+
+static int grant_lock(struct conn *c, int control)
+{
+	c->lock_waiting = 0;
+	if (control == 1) {
+		lock_owner = c->session;
+		stats.locks++;
+	}
+	return send_message(c, HISLIP_ASYNC_LOCK_RESPONSE, control, 0, NULL, 0);
+}
+
+static int handle_message(struct conn *c, const unsigned char *header,
+			  const char *payload, uint64_t len)
+{
+	int type = header[2];
+	int control = header[3];
+	uint32_t parameter = get32(header + 4);
+	struct conn *sync;
+	unsigned char size[8];
+	int i;
+
+	if (c->channel == CHANNEL_NEW) {
+		if (type == HISLIP_INITIALIZE) {
+			c->channel = CHANNEL_SYNC;
+			c->session = next_session++;
+			if (next_session == 0) {
+				next_session = 1;
+			}
+			stats.sessions++;
+			if (verbose) {
+				printf("session %u: %.*s\n", c->session, (int)len, payload);
+			}
+			return send_message(c, HISLIP_INITIALIZE_RESPONSE, overlapped,
+					    ((uint32_t)HISLIP_VERSION << 16) | c->session, NULL, 0);
+		}
+		if (type == HISLIP_ASYNC_INITIALIZE
+		    && find_channel((uint16_t)parameter, CHANNEL_SYNC)
+		    && !find_channel((uint16_t)parameter, CHANNEL_ASYNC)) {
+			c->channel = CHANNEL_ASYNC;
+			c->session = (uint16_t)parameter;
+			return send_message(c, HISLIP_ASYNC_INITIALIZE_RESPONSE, 0,
+					    HISLIP_VENDOR_ID, NULL, 0);
+		}
+		send_error(c, HISLIP_FATAL_ERROR, FATAL_INVALID_INITIALIZATION,
+			   "Invalid initialization sequence");
+		return 0;
+	}
+
+	switch (type) {
+	case HISLIP_DATA:
+	case HISLIP_DATA_END:
+		if (c->channel != CHANNEL_SYNC) {
+			break;
+		}
+		if (c->message.len + len > MAX_COMMAND) {
+			c->message.len = 0;
+			return send_error(c, HISLIP_ERROR, ERROR_MESSAGE_TOO_LARGE,
+					  "Message too large");
+		}
+		if (buffer_append(&c->message, payload, len)) {
+			return 1;
+		}
+		return type == HISLIP_DATA_END ? handle_command(c, parameter) : 0;
+
+	case HISLIP_TRIGGER:
+		return 0;
+
+	case HISLIP_DEVICE_CLEAR_COMPLETE:
+		if (c->channel != CHANNEL_SYNC) {
+			break;
+		}
+		c->message.len = 0;
+		return send_message(c, HISLIP_DEVICE_CLEAR_ACKNOWLEDGE, overlapped, 0, NULL, 0);
+
+	case HISLIP_ASYNC_MAXIMUM_MESSAGE_SIZE:
+		for (i = 0; i < 8; i++) {
+			size[i] = (unsigned char)(max_message_size >> (56 - 8 * i));
+		}
+		return send_message(c, HISLIP_ASYNC_MAXIMUM_MESSAGE_SIZE_RESPONSE, 0, 0, size, 8);
+
+	case HISLIP_ASYNC_DEVICE_CLEAR:
+		stats.clears++;
+		sync = find_channel(c->session, CHANNEL_SYNC);
+		if (sync) {
+			sync->message.len = 0;
+		}
+		return send_message(c, HISLIP_ASYNC_DEVICE_CLEAR_ACKNOWLEDGE, overlapped, 0, NULL, 0);
+
+	case HISLIP_ASYNC_LOCK:
+		if (control == 0) {
+			if (lock_owner != c->session) {
+				return send_message(c, HISLIP_ASYNC_LOCK_RESPONSE, 3, 0, NULL, 0);
+			}
+			lock_owner = 0;
+			return send_message(c, HISLIP_ASYNC_LOCK_RESPONSE, 1, 0, NULL, 0);
+		}
+		if (lock_owner == 0 || lock_owner == c->session) {
+			return grant_lock(c, 1);
+		}
+		if (parameter == 0) {
+			return grant_lock(c, 0);
+		}
+		c->lock_waiting = 1;
+		c->lock_deadline = now_ms() + parameter;
+		return 0;
+
+	case HISLIP_ASYNC_REMOTE_LOCAL_CONTROL:
+		return send_message(c, HISLIP_ASYNC_REMOTE_LOCAL_RESPONSE, 0, 0, NULL, 0);
+
+	case HISLIP_ASYNC_STATUS_QUERY:
+		return send_message(c, HISLIP_ASYNC_STATUS_RESPONSE, 0, 0, NULL, 0);
+
+	case HISLIP_ASYNC_LOCK_INFO:
+		return send_message(c, HISLIP_ASYNC_LOCK_INFO_RESPONSE, lock_owner != 0,
+				    lock_owner != 0, NULL, 0);
+	}
+	return send_error(c, HISLIP_ERROR, ERROR_UNRECOGNIZED_TYPE,
+			  "Unrecognized message type");
+}
+
+/* Answer lock requests that can now be granted or have timed out. Returns
+ * the poll timeout until the next deadline, or -1 if there is none. */
+static int check_locks(void)
+{
+	unsigned long now = now_ms();
+	int timeout = -1;
+	int i;
+
+	for (i = 0; i < MAX_CONNS; i++) {
+		if (!conns[i] || !conns[i]->lock_waiting) {
+			continue;
+		}
+		if (lock_owner == 0) {
+			grant_lock(conns[i], 1);
+		} else if (now >= conns[i]->lock_deadline) {
+			grant_lock(conns[i], 0);
+		} else if (timeout < 0 || conns[i]->lock_deadline - now < (unsigned long)timeout) {
+			timeout = (int)(conns[i]->lock_deadline - now);
+		}
+	}
+	return timeout;
+}
+
+static void close_conn(int i)
+{
+	struct conn *c = conns[i];
+	int j;
+
+	conns[i] = NULL;
+	if (c->channel != CHANNEL_NEW && lock_owner == c->session) {
+		lock_owner = 0;
+	}
+	/* A session ends when either of its channels does */
+	if (c->channel != CHANNEL_NEW) {
+		for (j = 0; j < MAX_CONNS; j++) {
+			if (conns[j] && conns[j]->channel != CHANNEL_NEW
+			    && conns[j]->session == c->session) {
+				close_conn(j);
+			}
+		}
+	}
+	close(c->fd);
+	free(c->in.data);
+	free(c->out.data);
+	free(c->message.data);
+	free(c);
+}
+
+static void open_conn(int listen_fd)
+{
+	struct conn *c;
+	int one = 1;
+	int fd;
+	int i;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0) {
+		return;
+	}
+	for (i = 0; i < MAX_CONNS && conns[i]; i++);
+	c = i < MAX_CONNS ? (struct conn *)calloc(1, sizeof(struct conn)) : NULL;
+	if (!c) {
+		close(fd);
+		return;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	c->fd = fd;
+	conns[i] = c;
+}
+
+/* Handle all the whole messages in c->in. */
+static int handle_input(struct conn *c)
+{
+	const unsigned char *h;
+	uint64_t len;
+	size_t pos = 0;
+
+	while (c->in.len - pos >= HISLIP_HEADER_SIZE
+	       && c->out.len - c->out_pos < OUT_HIGH_WATER) {
+		h = (const unsigned char *)c->in.data + pos;
+		if (h[0] != 'H' || h[1] != 'S') {
+			return 1;
+		}
+		len = get64(h + 8);
+		if (len > max_message_size) {
+			return 1;
+		}
+		if (c->in.len - pos < HISLIP_HEADER_SIZE + len) {
+			break;
+		}
+		if (handle_message(c, h, c->in.data + pos + HISLIP_HEADER_SIZE, len)) {
+			return 1;
+		}
+		pos += HISLIP_HEADER_SIZE + len;
+	}
+	buffer_consume(&c->in, pos);
+	return 0;
+}
+
+static int service(struct conn *c, short revents)
+{
+	char buf[65536];
+	ssize_t n;
+
+	if (revents & (POLLIN | POLLHUP | POLLERR)) {
+		while ((n = read(c->fd, buf, sizeof(buf))) > 0) {
+			if (buffer_append(&c->in, buf, n)) {
+				return 1;
+			}
+		}
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			return 1;
+		}
+	}
+	if (handle_input(c)) {
+		return 1;
+	}
+	while (c->out_pos < c->out.len) {
+		n = write(c->fd, c->out.data + c->out_pos, c->out.len - c->out_pos);
+		if (n > 0) {
+			c->out_pos += n;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		} else {
+			return 1;
+		}
+	}
+	if (c->out_pos == c->out.len) {
+		c->out.len = 0;
+		c->out_pos = 0;
+	}
+	return 0;
+}
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int sig)
+{
+	stopping = 1;
+}
+
+static void report(void)
+{
+	printf("sessions %lu messages %lu queries %lu clears %lu locks %lu\n",
+	       stats.sessions, stats.messages, stats.queries, stats.clears, stats.locks);
+}
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [-o] [-m size] [-v] [listen_port]\n", prog);
+	printf("  -o       offer overlapped mode instead of synchronized\n");
+	printf("  -m size  maximum message size, larger transfers are split (default 1048576)\n");
+	printf("  -v       log sessions and errors\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct pollfd pfds[1 + MAX_CONNS];
+	int idx[1 + MAX_CONNS];
+	struct sockaddr_in sin;
+	int port = HISLIP_PORT;
+	int listen_fd;
+	int timeout;
+	int one = 1;
+	int n;
+	int i;
+	int c;
+
+	while ((c = getopt(argc, argv, "om:v")) != -1) {
+		switch (c) {
+		case 'o':
+			overlapped = 1;
+			break;
+		case 'm':
+			max_message_size = strtoull(optarg, NULL, 10);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind > 1 || max_message_size <= HISLIP_HEADER_SIZE) {
+		usage(argv[0]);
+	}
+	if (argc - optind == 1) {
+		port = atoi(argv[optind]);
+	}
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		perror("socket");
+		exit(2);
+	}
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(listen_fd, (struct sockaddr *)&sin, sizeof(sin)) || listen(listen_fd, 16)) {
+		perror("bind");
+		exit(2);
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+
+	while (!stopping) {
+		timeout = check_locks();
+		n = 0;
+		pfds[n].fd = listen_fd;
+		pfds[n].events = POLLIN;
+		idx[n++] = -1;
+		for (i = 0; i < MAX_CONNS; i++) {
+			if (!conns[i]) {
+				continue;
+			}
+			pfds[n].fd = conns[i]->fd;
+			pfds[n].events = 0;
+			if (conns[i]->out.len - conns[i]->out_pos < OUT_HIGH_WATER) {
+				pfds[n].events |= POLLIN;
+			}
+			if (conns[i]->out_pos < conns[i]->out.len) {
+				pfds[n].events |= POLLOUT;
+			}
+			idx[n++] = i;
+		}
+
+		if (poll(pfds, n, timeout) < 0 && errno != EINTR) {
+			perror("poll");
+			exit(3);
+		}
+		if (stopping) {
+			break;
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			open_conn(listen_fd);
+		}
+		for (i = 1; i < n; i++) {
+			if (conns[idx[i]] && service(conns[idx[i]], pfds[i].revents)) {
+				close_conn(idx[i]);
+			}
+		}
+	}
+	report();
+	return 0;
+}
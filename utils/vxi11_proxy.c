@@ -0,0 +1,700 @@
+/* vxi11_proxy.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * A TCP proxy that sits between libvxi11 and a VXI11 server and makes the
+ * instrument misbehave on demand: slow or jittery replies, limited bandwidth,
+ * lost replies, injected error codes and rewritten create_link responses
+ * (e.g. a maxRecvSize of 0, as some Infiniium firmware returns). Random
+ * choices come from a seeded generator, so a run can be repeated exactly.
+ *
+ * Point a program at the proxy with an address of the form "host:port", e.g.
+ * vxi11_open_device(&clink, "127.0.0.1:9009", NULL).
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define LAST_FRAG	0x80000000UL
+
+/* DEVICE_CORE procedure numbers, from vxi11.x */
+#define PROC_CREATE_LINK	10
+#define PROC_DEVICE_WRITE	11
+#define PROC_DEVICE_READ	12
+
+/* How many calls in flight we remember per connection, to know which
+ * procedure each reply belongs to. */
+#define XID_SLOTS	64
+
+#define MAX_CONNS	64
+
+struct buffer {
+	char *data;
+	size_t len;
+	size_t alloc;
+};
+
+/* A reply held back until its release time. */
+struct held {
+	struct held *next;
+	unsigned long release;
+	char *data;
+	size_t len;
+};
+
+struct conn {
+	int client;
+	int upstream;
+	struct buffer from_client;	/* partial records */
+	struct buffer from_upstream;
+	struct buffer to_client;	/* released, not yet written */
+	struct buffer to_upstream;
+	struct held *held_head;
+	struct held *held_tail;
+	unsigned long last_release;
+	uint32_t xids[XID_SLOTS];
+	uint32_t procs[XID_SLOTS];
+	int next_slot;
+};
+
+struct options {
+	unsigned long delay;
+	unsigned long jitter;
+	unsigned long bandwidth;	/* bytes per second, 0 for unlimited */
+	int drop_read;			/* percent */
+	int drop_write;
+	int error_code;
+	int error_pct;
+	long max_recv_size;		/* -1 to leave alone */
+	int verbose;
+};
+
+static struct options opt = { 0, 0, 0, 0, 0, 0, 0, -1, 0 };
+static struct conn *conns[MAX_CONNS];
+static struct sockaddr_in upstream_addr;
+static unsigned long rng_state = 1;
+
+static struct {
+	unsigned long calls;
+	unsigned long replies;
+	unsigned long dropped;
+	unsigned long errors;
+	unsigned long rewritten;
+} stats;
+
+static unsigned long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Our own generator, so that a seed gives the same run on any libc. */
+static unsigned long rng(void)
+{
+	rng_state = rng_state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (unsigned long)(rng_state >> 33);
+}
+
+static int chance(int pct)
+{
+	return pct > 0 && (int)(rng() % 100) < pct;
+}
+
+static int buffer_append(struct buffer *b, const char *data, size_t len)
+{
+	char *p;
+	size_t alloc;
+
+	if (b->len + len > b->alloc) {
+		alloc = b->alloc ? b->alloc : 4096;
+		while (alloc < b->len + len) {
+			alloc *= 2;
+		}
+		p = (char *)realloc(b->data, alloc);
+		if (!p) {
+			return 1;
+		}
+		b->data = p;
+		b->alloc = alloc;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	return 0;
+}
+
+static void buffer_consume(struct buffer *b, size_t len)
+{
+	memmove(b->data, b->data + len, b->len - len);
+	b->len -= len;
+}
+
+static uint32_t get32(const char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return ntohl(v);
+}
+
+static void put32(char *p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, 4);
+}
+
+/* Take one complete record out of a buffer, joining its fragments. Returns
+ * the record length, 0 if it is not all here yet, or -1 if malformed. */
+static ssize_t take_record(struct buffer *in, char **record)
+{
+	size_t pos = 0;
+	size_t len = 0;
+	uint32_t mark;
+	char *rec;
+
+	/* First find out whether the last fragment has arrived */
+	while (1) {
+		if (in->len < pos + 4) {
+			return 0;
+		}
+		mark = get32(in->data + pos);
+		if ((mark & ~LAST_FRAG) > (1 << 24)) {
+			return -1;
+		}
+		if (in->len < pos + 4 + (mark & ~LAST_FRAG)) {
+			return 0;
+		}
+		len += mark & ~LAST_FRAG;
+		pos += 4 + (mark & ~LAST_FRAG);
+		if (mark & LAST_FRAG) {
+			break;
+		}
+	}
+
+	rec = (char *)malloc(len + 4);
+	if (!rec) {
+		return -1;
+	}
+	put32(rec, LAST_FRAG | len);
+	pos = 0;
+	len = 4;
+	do {
+		mark = get32(in->data + pos);
+		memcpy(rec + len, in->data + pos + 4, mark & ~LAST_FRAG);
+		len += mark & ~LAST_FRAG;
+		pos += 4 + (mark & ~LAST_FRAG);
+	} while (!(mark & LAST_FRAG));
+	buffer_consume(in, pos);
+	*record = rec;
+	return (ssize_t)len;
+}
+
+/* Note which procedure a call is for, then pass it on unchanged. */
+static int handle_call(struct conn *c, char *rec, size_t len)
+{
+	int ret;
+
+	/* mark, xid, CALL, rpcvers, prog, vers, proc */
+	if (len >= 28 && get32(rec + 8) == 0) {
+		c->xids[c->next_slot] = get32(rec + 4);
+		c->procs[c->next_slot] = get32(rec + 24);
+		c->next_slot = (c->next_slot + 1) % XID_SLOTS;
+		stats.calls++;
+	}
+	ret = buffer_append(&c->to_upstream, rec, len);
+	free(rec);
+	return ret;
+}
+
+/* Which procedure a reply is for, 0 if we don't know. */
+static uint32_t lookup_proc(struct conn *c, uint32_t xid)
+{
+	uint32_t proc;
+	int i;
+
+	for (i = 0; i < XID_SLOTS; i++) {
+		if (c->procs[i] && c->xids[i] == xid) {
+			proc = c->procs[i];
+			c->procs[i] = 0;
+			return proc;
+		}
+	}
+	return 0;
+}
+
+/* Offset of the procedure results in an accepted, successful reply record,
+ * or 0 if the reply is anything else. */
+static size_t results_offset(const char *rec, size_t len)
+{
+	size_t verf_len;
+
+	/* mark, xid, REPLY, MSG_ACCEPTED, verf flavor, verf length */
+	if (len < 24 || get32(rec + 8) != 1 || get32(rec + 12) != 0) {
+		return 0;
+	}
+	verf_len = (get32(rec + 20) + 3) & ~3U;
+	if (len < 24 + verf_len + 4 || get32(rec + 24 + verf_len) != 0) {
+		return 0;
+	}
+	return 24 + verf_len + 4;
+}
+
+/* Apply the faults to a reply, then hold it until it is due. Takes
+ * ownership of rec. */
+static int handle_reply(struct conn *c, char *rec, size_t len)
+{
+	struct held *h;
+	unsigned long release;
+	uint32_t proc;
+	size_t res;
+
+	stats.replies++;
+	proc = len >= 8 ? lookup_proc(c, get32(rec + 4)) : 0;
+	res = results_offset(rec, len);
+
+	if (res && proc == PROC_CREATE_LINK && opt.max_recv_size >= 0
+	    && len >= res + 16) {
+		/* error, lid, abortPort, maxRecvSize */
+		put32(rec + res + 12, (uint32_t)opt.max_recv_size);
+		stats.rewritten++;
+	}
+
+	if ((proc == PROC_DEVICE_READ && chance(opt.drop_read))
+	    || (proc == PROC_DEVICE_WRITE && chance(opt.drop_write))) {
+		if (opt.verbose) {
+			printf("drop %s reply\n", proc == PROC_DEVICE_READ ? "read" : "write");
+		}
+		stats.dropped++;
+		free(rec);
+		return 0;
+	}
+
+	if (res && (proc == PROC_DEVICE_READ || proc == PROC_DEVICE_WRITE)
+	    && chance(opt.error_pct)) {
+		/* Both start with the error code. A read becomes error, reason
+		 * 0 and no data; a write becomes error and size 0. */
+		if (len >= res + (proc == PROC_DEVICE_READ ? 12 : 8)) {
+			put32(rec + res, (uint32_t)opt.error_code);
+			put32(rec + res + 4, 0);
+			if (proc == PROC_DEVICE_READ) {
+				put32(rec + res + 8, 0);
+				len = res + 12;
+			} else {
+				len = res + 8;
+			}
+			put32(rec, LAST_FRAG | (len - 4));
+			if (opt.verbose) {
+				printf("error %d on %s reply\n", opt.error_code,
+				       proc == PROC_DEVICE_READ ? "read" : "write");
+			}
+			stats.errors++;
+		}
+	}
+
+	/* Delay and jitter, never letting a reply overtake an earlier one */
+	release = now_ms() + opt.delay;
+	if (opt.jitter) {
+		release += rng() % (opt.jitter + 1);
+	}
+	if (release < c->last_release) {
+		release = c->last_release;
+	}
+	/* Bandwidth: the reply can't finish arriving before its bytes would
+	 * have been sent at the limit after the previous one */
+	if (opt.bandwidth) {
+		release += (unsigned long)((unsigned long long)len * 1000 / opt.bandwidth);
+	}
+	c->last_release = release;
+
+	h = (struct held *)calloc(1, sizeof(struct held));
+	if (!h) {
+		free(rec);
+		return 1;
+	}
+	h->release = release;
+	h->data = rec;
+	h->len = len;
+	if (c->held_tail) {
+		c->held_tail->next = h;
+	} else {
+		c->held_head = h;
+	}
+	c->held_tail = h;
+	return 0;
+}
+
+/* Move replies that are due into the client's output buffer. */
+static int release_due(struct conn *c, unsigned long now)
+{
+	struct held *h;
+
+	while ((h = c->held_head) && h->release <= now) {
+		c->held_head = h->next;
+		if (!c->held_head) {
+			c->held_tail = NULL;
+		}
+		if (buffer_append(&c->to_client, h->data, h->len)) {
+			return 1;
+		}
+		free(h->data);
+		free(h);
+	}
+	return 0;
+}
+
+static void close_conn(int i)
+{
+	struct conn *c = conns[i];
+	struct held *h;
+
+	close(c->client);
+	close(c->upstream);
+	while ((h = c->held_head)) {
+		c->held_head = h->next;
+		free(h->data);
+		free(h);
+	}
+	free(c->from_client.data);
+	free(c->from_upstream.data);
+	free(c->to_client.data);
+	free(c->to_upstream.data);
+	free(c);
+	conns[i] = NULL;
+	if (opt.verbose) {
+		printf("connection %d closed\n", i);
+	}
+}
+
+static void open_conn(int listen_fd)
+{
+	struct conn *c;
+	int client;
+	int upstream;
+	int one = 1;
+	int i;
+
+	client = accept(listen_fd, NULL, NULL);
+	if (client < 0) {
+		return;
+	}
+	for (i = 0; i < MAX_CONNS && conns[i]; i++);
+	upstream = socket(AF_INET, SOCK_STREAM, 0);
+	if (i == MAX_CONNS || upstream < 0
+	    || connect(upstream, (struct sockaddr *)&upstream_addr, sizeof(upstream_addr))) {
+		perror("vxi11_proxy: upstream");
+		close(client);
+		if (upstream >= 0) {
+			close(upstream);
+		}
+		return;
+	}
+	c = (struct conn *)calloc(1, sizeof(struct conn));
+	if (!c) {
+		close(client);
+		close(upstream);
+		return;
+	}
+	setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(upstream, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+	fcntl(upstream, F_SETFL, fcntl(upstream, F_GETFL) | O_NONBLOCK);
+	c->client = client;
+	c->upstream = upstream;
+	conns[i] = c;
+	if (opt.verbose) {
+		printf("connection %d opened\n", i);
+	}
+}
+
+/* Read what is available from fd into in. Returns nonzero on EOF or error. */
+static int fill(int fd, struct buffer *in)
+{
+	char buf[65536];
+	ssize_t n;
+
+	while (1) {
+		n = read(fd, buf, sizeof(buf));
+		if (n > 0) {
+			if (buffer_append(in, buf, n)) {
+				return 1;
+			}
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		}
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		return 1;
+	}
+}
+
+/* Write what we can of out to fd. Returns nonzero on error. */
+static int flush(int fd, struct buffer *out)
+{
+	ssize_t n;
+
+	while (out->len > 0) {
+		n = write(fd, out->data, out->len);
+		if (n > 0) {
+			buffer_consume(out, n);
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		}
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/* Handle whatever has happened on a connection. Returns nonzero if it
+ * should be closed. */
+static int service(struct conn *c, short client_ev, short upstream_ev)
+{
+	ssize_t len;
+	char *rec;
+
+	if ((client_ev & (POLLIN | POLLHUP | POLLERR)) && fill(c->client, &c->from_client)) {
+		return 1;
+	}
+	while ((len = take_record(&c->from_client, &rec)) > 0) {
+		if (handle_call(c, rec, len)) {
+			return 1;
+		}
+	}
+	if (len < 0) {
+		return 1;
+	}
+
+	if ((upstream_ev & (POLLIN | POLLHUP | POLLERR)) && fill(c->upstream, &c->from_upstream)) {
+		return 1;
+	}
+	while ((len = take_record(&c->from_upstream, &rec)) > 0) {
+		if (handle_reply(c, rec, len)) {
+			return 1;
+		}
+	}
+	if (len < 0) {
+		return 1;
+	}
+
+	if (release_due(c, now_ms())) {
+		return 1;
+	}
+	return flush(c->upstream, &c->to_upstream) || flush(c->client, &c->to_client);
+}
+
+static int resolve_upstream(const char *address)
+{
+	struct addrinfo hints, *res;
+	char host[256];
+	const char *colon = strrchr(address, ':');
+	size_t len;
+
+	if (!colon) {
+		printf("Error: upstream must be given as host:port\n");
+		return 1;
+	}
+	len = colon - address;
+	if (len >= sizeof(host)) {
+		return 1;
+	}
+	memcpy(host, address, len);
+	host[len] = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, colon + 1, &hints, &res) != 0) {
+		printf("Error: could not resolve %s\n", address);
+		return 1;
+	}
+	memcpy(&upstream_addr, res->ai_addr, sizeof(upstream_addr));
+	freeaddrinfo(res);
+	return 0;
+}
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int sig)
+{
+	stopping = 1;
+}
+
+static void report(void)
+{
+	printf("calls %lu replies %lu dropped %lu errors %lu rewritten %lu\n",
+	       stats.calls, stats.replies, stats.dropped, stats.errors,
+	       stats.rewritten);
+}
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [options] listen_port upstream_host:port\n", prog);
+	printf("  -d ms        delay every reply\n");
+	printf("  -j ms        add up to this much random delay to every reply\n");
+	printf("  -b bytes/s   limit reply bandwidth\n");
+	printf("  -r percent   drop this many device_read replies\n");
+	printf("  -w percent   drop this many device_write replies\n");
+	printf("  -e code:pct  replace this many read/write results with an error\n");
+	printf("  -m size      rewrite maxRecvSize in create_link replies\n");
+	printf("  -s seed      seed for the random choices (default 1)\n");
+	printf("  -v           log each fault\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct pollfd pfds[1 + 2 * MAX_CONNS];
+	int idx[1 + 2 * MAX_CONNS];
+	struct sockaddr_in sin;
+	unsigned long now;
+	unsigned long next;
+	int listen_fd;
+	int timeout;
+	int one = 1;
+	int n;
+	int i;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:j:b:r:w:e:m:s:v")) != -1) {
+		switch (c) {
+		case 'd':
+			opt.delay = strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			opt.jitter = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			opt.bandwidth = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			opt.drop_read = atoi(optarg);
+			break;
+		case 'w':
+			opt.drop_write = atoi(optarg);
+			break;
+		case 'e':
+			if (sscanf(optarg, "%d:%d", &opt.error_code, &opt.error_pct) != 2) {
+				usage(argv[0]);
+			}
+			break;
+		case 'm':
+			opt.max_recv_size = strtol(optarg, NULL, 10);
+			break;
+		case 's':
+			rng_state = strtoul(optarg, NULL, 10);
+			break;
+		case 'v':
+			opt.verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2) {
+		usage(argv[0]);
+	}
+	if (resolve_upstream(argv[optind + 1])) {
+		exit(2);
+	}
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		perror("socket");
+		exit(2);
+	}
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(atoi(argv[optind]));
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(listen_fd, (struct sockaddr *)&sin, sizeof(sin)) || listen(listen_fd, 16)) {
+		perror("bind");
+		exit(2);
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+
+	while (!stopping) {
+		n = 0;
+		pfds[n].fd = listen_fd;
+		pfds[n].events = POLLIN;
+		idx[n++] = -1;
+		now = now_ms();
+		next = 0;
+		for (i = 0; i < MAX_CONNS; i++) {
+			if (!conns[i]) {
+				continue;
+			}
+			pfds[n].fd = conns[i]->client;
+			pfds[n].events = POLLIN | (conns[i]->to_client.len ? POLLOUT : 0);
+			idx[n++] = i;
+			pfds[n].fd = conns[i]->upstream;
+			pfds[n].events = POLLIN | (conns[i]->to_upstream.len ? POLLOUT : 0);
+			idx[n++] = i;
+			if (conns[i]->held_head
+			    && (!next || conns[i]->held_head->release < next)) {
+				next = conns[i]->held_head->release;
+			}
+		}
+		timeout = next ? (next > now ? (int)(next - now) : 0) : -1;
+
+		if (poll(pfds, n, timeout) < 0 && errno != EINTR) {
+			perror("poll");
+			exit(3);
+		}
+		if (stopping) {
+			break;
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			open_conn(listen_fd);
+		}
+		for (i = 1; i < n; i += 2) {
+			if (conns[idx[i]]
+			    && service(conns[idx[i]], pfds[i].revents, pfds[i + 1].revents)) {
+				close_conn(idx[i]);
+			}
+		}
+	}
+	report();
+	return 0;
+}
@@ -0,0 +1,649 @@
+/* vxi11_replay.c
+ * Copyright (C) 2006 Steve D. Sharples
+ *
+ * Serves a session recorded with vxi11_capture_start() (or VXI11_CAPTURE)
+ * back to a client, standing in for the instrument. Each call is answered
+ * with the next recorded reply to the same procedure on the same link, after
+ * the time the instrument originally took, divided by the speed factor. A
+ * recorded call that got no reply gets none this time either.
+ *
+ * Connect with an address of the form "host:port", e.g.
+ * vxi11_open_device(&clink, "127.0.0.1:9009", NULL).
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * The author's email address is steve.sharples@nottingham.ac.uk
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "vxi11_capture.h"
+
+#define LAST_FRAG	0x80000000UL
+
+/* DEVICE_CORE procedure numbers, from vxi11.x */
+#define PROC_CREATE_LINK	10
+#define PROC_DEVICE_WRITE	11
+#define PROC_DEVICE_READ	12
+#define PROC_DEVICE_READSTB	13
+#define PROC_DEVICE_DOCMD	22
+
+/* Error returned for calls that have no recorded reply: I/O error */
+#define ERROR_UNMATCHED	17
+
+#define MAX_CONNS	64
+
+struct record {
+	uint32_t proc;
+	uint32_t flags;
+	uint32_t lid;		/* from the arguments, unused for create_link */
+	unsigned long duration_us;
+	const char *res;
+	size_t res_len;
+	int used;
+};
+
+struct buffer {
+	char *data;
+	size_t len;
+	size_t alloc;
+};
+
+/* A reply waiting until the instrument would have sent it. */
+struct held {
+	struct held *next;
+	unsigned long long release;
+	char *data;
+	size_t len;
+};
+
+struct conn {
+	int fd;
+	struct buffer in;
+	struct buffer out;
+	struct held *held_head;
+	struct held *held_tail;
+};
+
+static struct record *records;
+static size_t record_count;
+static size_t first_unused;
+static struct conn *conns[MAX_CONNS];
+static double speed = 1.0;	/* 0 for no delays at all */
+static int verbose;
+static int loop;
+
+static struct {
+	unsigned long calls;
+	unsigned long replayed;
+	unsigned long dropped;
+	unsigned long unmatched;
+} stats;
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int buffer_append(struct buffer *b, const char *data, size_t len)
+{
+	char *p;
+	size_t alloc;
+
+	if (b->len + len > b->alloc) {
+		alloc = b->alloc ? b->alloc : 4096;
+		while (alloc < b->len + len) {
+			alloc *= 2;
+		}
+		p = (char *)realloc(b->data, alloc);
+		if (!p) {
+			return 1;
+		}
+		b->data = p;
+		b->alloc = alloc;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	return 0;
+}
+
+static void buffer_consume(struct buffer *b, size_t len)
+{
+	memmove(b->data, b->data + len, b->len - len);
+	b->len -= len;
+}
+
+static uint32_t get32(const char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return ntohl(v);
+}
+
+static void put32(char *p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, 4);
+}
+
+/* Read a whole capture file into records. The records point into the file's
+ * contents, which are never freed. */
+static int load(const char *filename)
+{
+	struct _vxi11_capture_header header;
+	struct _vxi11_capture_record rec;
+	struct record *r;
+	size_t alloc = 0;
+	size_t size;
+	size_t pos;
+	char *data;
+	FILE *f;
+
+	f = fopen(filename, "rb");
+	if (!f) {
+		perror(filename);
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data = (char *)malloc(size ? size : 1);
+	if (!data || fread(data, 1, size, f) != size) {
+		printf("Error: could not read %s\n", filename);
+		fclose(f);
+		return 1;
+	}
+	fclose(f);
+
+	memcpy(&header, data, size < sizeof(header) ? size : sizeof(header));
+	if (size < sizeof(header)
+	    || memcmp(header.magic, VXI11_CAPTURE_MAGIC, sizeof(header.magic))
+	    || ntohl(header.version) != VXI11_CAPTURE_VERSION) {
+		printf("Error: %s is not a vxi11 capture\n", filename);
+		return 1;
+	}
+
+	pos = sizeof(header);
+	while (pos + sizeof(rec) <= size) {
+		memcpy(&rec, data + pos, sizeof(rec));
+		pos += sizeof(rec);
+		rec.args_len = ntohl(rec.args_len);
+		rec.res_len = ntohl(rec.res_len);
+		if (rec.args_len > size - pos || rec.res_len > size - pos - rec.args_len) {
+			/* Cut short, probably still being written */
+			break;
+		}
+		if (record_count == alloc) {
+			alloc = alloc ? alloc * 2 : 256;
+			r = (struct record *)realloc(records, alloc * sizeof(struct record));
+			if (!r) {
+				return 1;
+			}
+			records = r;
+		}
+		r = &records[record_count++];
+		r->proc = ntohl(rec.proc);
+		r->flags = ntohl(rec.flags);
+		r->lid = rec.args_len >= 4 ? get32(data + pos) : 0;
+		r->duration_us = ntohl(rec.duration_us);
+		r->res = data + pos + rec.args_len;
+		r->res_len = rec.res_len;
+		r->used = 0;
+		pos += rec.args_len + rec.res_len;
+	}
+	return 0;
+}
+
+/* The next unused record for a call, or NULL. Calls are matched in the order
+ * they were recorded, by procedure and, except for create_link, by link. With
+ * -l, a create_link after the capture has been used up starts it again. */
+static struct record *match(uint32_t proc, uint32_t lid)
+{
+	size_t i;
+
+	if (loop && proc == PROC_CREATE_LINK) {
+		for (i = first_unused; i < record_count; i++) {
+			if (!records[i].used && records[i].proc == PROC_CREATE_LINK) {
+				break;
+			}
+		}
+		if (i == record_count) {
+			for (i = 0; i < record_count; i++) {
+				records[i].used = 0;
+			}
+			first_unused = 0;
+		}
+	}
+
+	while (first_unused < record_count && records[first_unused].used) {
+		first_unused++;
+	}
+	for (i = first_unused; i < record_count; i++) {
+		if (!records[i].used && records[i].proc == proc
+		    && (proc == PROC_CREATE_LINK || records[i].lid == lid)) {
+			records[i].used = 1;
+			return &records[i];
+		}
+	}
+	return NULL;
+}
+
+/* Results for a call that was never recorded: ERROR_UNMATCHED followed by
+ * zeroes for the rest of the procedure's result structure. */
+static size_t unmatched_results(uint32_t proc, char *res)
+{
+	size_t words;
+
+	switch (proc) {
+	case PROC_CREATE_LINK:
+		words = 4;	/* error, lid, abortPort, maxRecvSize */
+		break;
+	case PROC_DEVICE_READ:
+		words = 3;	/* error, reason, data length */
+		break;
+	case PROC_DEVICE_WRITE:
+	case PROC_DEVICE_READSTB:
+	case PROC_DEVICE_DOCMD:
+		words = 2;
+		break;
+	default:
+		words = 1;
+		break;
+	}
+	memset(res, 0, words * 4);
+	put32(res, ERROR_UNMATCHED);
+	return words * 4;
+}
+
+/* Take one complete call record out of the input buffer, joining its
+ * fragments. Returns its length, 0 if it is not all here yet, or -1 if
+ * malformed. */
+static ssize_t take_record(struct buffer *in, char **record)
+{
+	size_t pos = 0;
+	size_t len = 0;
+	uint32_t mark;
+	char *rec;
+
+	while (1) {
+		if (in->len < pos + 4) {
+			return 0;
+		}
+		mark = get32(in->data + pos);
+		if ((mark & ~LAST_FRAG) > (1 << 24)) {
+			return -1;
+		}
+		if (in->len < pos + 4 + (mark & ~LAST_FRAG)) {
+			return 0;
+		}
+		len += mark & ~LAST_FRAG;
+		pos += 4 + (mark & ~LAST_FRAG);
+		if (mark & LAST_FRAG) {
+			break;
+		}
+	}
+
+	rec = (char *)malloc(len);
+	if (!rec) {
+		return -1;
+	}
+	pos = 0;
+	len = 0;
+	do {
+		mark = get32(in->data + pos);
+		memcpy(rec + len, in->data + pos + 4, mark & ~LAST_FRAG);
+		len += mark & ~LAST_FRAG;
+		pos += 4 + (mark & ~LAST_FRAG);
+	} while (!(mark & LAST_FRAG));
+	buffer_consume(in, pos);
+	*record = rec;
+	return (ssize_t)len;
+}
+
+/* Answer one call, queueing the reply for when it is due. */
+static int handle_call(struct conn *c, const char *call, size_t len)
+{
+	char unmatched[16];
+	struct record *r;
+	struct held *h;
+	const char *res;
+	size_t res_len;
+	size_t pos;
+	uint32_t proc;
+	uint32_t lid;
+	uint32_t xid;
+	unsigned long long delay = 0;
+
+	/* xid, CALL, rpcvers, prog, vers, proc, cred, verf, args */
+	if (len < 24 || get32(call + 4) != 0) {
+		return 1;
+	}
+	xid = get32(call);
+	proc = get32(call + 20);
+	pos = 24;
+	pos += 8 + ((get32(call + pos + 4) + 3) & ~3U);	/* cred */
+	if (pos + 8 > len) {
+		return 1;
+	}
+	pos += 8 + ((get32(call + pos + 4) + 3) & ~3U);	/* verf */
+	lid = pos + 4 <= len ? get32(call + pos) : 0;
+	stats.calls++;
+
+	if (proc == 0) {
+		/* NULLPROC */
+		res = NULL;
+		res_len = 0;
+	} else if ((r = match(proc, lid))) {
+		if (r->flags & VXI11_CAPTURE_NO_REPLY) {
+			if (verbose) {
+				printf("proc %u: no reply, as recorded\n", proc);
+			}
+			stats.dropped++;
+			return 0;
+		}
+		res = r->res;
+		res_len = r->res_len;
+		if (speed > 0) {
+			delay = (unsigned long long)(r->duration_us / speed);
+		}
+		stats.replayed++;
+	} else {
+		if (verbose) {
+			printf("proc %u on link %u: nothing recorded\n", proc, lid);
+		}
+		res = unmatched;
+		res_len = unmatched_results(proc, unmatched);
+		stats.unmatched++;
+	}
+
+	/* mark, xid, REPLY, MSG_ACCEPTED, AUTH_NONE verifier, SUCCESS */
+	h = (struct held *)calloc(1, sizeof(struct held));
+	if (!h) {
+		return 1;
+	}
+	h->len = 28 + res_len;
+	h->data = (char *)malloc(h->len);
+	if (!h->data) {
+		free(h);
+		return 1;
+	}
+	put32(h->data, LAST_FRAG | (h->len - 4));
+	put32(h->data + 4, xid);
+	put32(h->data + 8, 1);
+	put32(h->data + 12, 0);
+	put32(h->data + 16, 0);
+	put32(h->data + 20, 0);
+	put32(h->data + 24, 0);
+	if (res_len) {
+		memcpy(h->data + 28, res, res_len);
+	}
+	h->release = now_us() + delay;
+	/* Replies go out in order, as from a real instrument */
+	if (c->held_tail && h->release < c->held_tail->release) {
+		h->release = c->held_tail->release;
+	}
+	if (c->held_tail) {
+		c->held_tail->next = h;
+	} else {
+		c->held_head = h;
+	}
+	c->held_tail = h;
+	return 0;
+}
+
+static void close_conn(int i)
+{
+	struct conn *c = conns[i];
+	struct held *h;
+
+	close(c->fd);
+	while ((h = c->held_head)) {
+		c->held_head = h->next;
+		free(h->data);
+		free(h);
+	}
+	free(c->in.data);
+	free(c->out.data);
+	free(c);
+	conns[i] = NULL;
+}
+
+static void open_conn(int listen_fd)
+{
+	struct conn *c;
+	int one = 1;
+	int fd;
+	int i;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0) {
+		return;
+	}
+	for (i = 0; i < MAX_CONNS && conns[i]; i++);
+	c = i < MAX_CONNS ? (struct conn *)calloc(1, sizeof(struct conn)) : NULL;
+	if (!c) {
+		close(fd);
+		return;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	c->fd = fd;
+	conns[i] = c;
+}
+
+/* Handle whatever has happened on a connection. Returns nonzero if it should
+ * be closed. */
+static int service(struct conn *c, short revents)
+{
+	char buf[65536];
+	struct held *h;
+	unsigned long long now;
+	ssize_t n;
+	char *call;
+
+	if (revents & (POLLIN | POLLHUP | POLLERR)) {
+		while ((n = read(c->fd, buf, sizeof(buf))) > 0) {
+			if (buffer_append(&c->in, buf, n)) {
+				return 1;
+			}
+		}
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			return 1;
+		}
+	}
+	while ((n = take_record(&c->in, &call)) > 0) {
+		if (handle_call(c, call, n)) {
+			free(call);
+			return 1;
+		}
+		free(call);
+	}
+	if (n < 0) {
+		return 1;
+	}
+
+	now = now_us();
+	while ((h = c->held_head) && h->release <= now) {
+		c->held_head = h->next;
+		if (!c->held_head) {
+			c->held_tail = NULL;
+		}
+		if (buffer_append(&c->out, h->data, h->len)) {
+			return 1;
+		}
+		free(h->data);
+		free(h);
+	}
+	while (c->out.len > 0) {
+		n = write(c->fd, c->out.data, c->out.len);
+		if (n > 0) {
+			buffer_consume(&c->out, n);
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		} else {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int sig)
+{
+	stopping = 1;
+}
+
+static void report(void)
+{
+	printf("calls %lu replayed %lu dropped %lu unmatched %lu\n",
+	       stats.calls, stats.replayed, stats.dropped, stats.unmatched);
+}
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [-x speed] [-l] [-v] listen_port capture_file\n", prog);
+	printf("  -x speed  replay this many times faster, 0 for no delays (default 1)\n");
+	printf("  -l        start again from the beginning when the capture is used up\n");
+	printf("  -v        log calls that are not replayed\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct pollfd pfds[1 + MAX_CONNS];
+	int idx[1 + MAX_CONNS];
+	struct sockaddr_in sin;
+	unsigned long long now;
+	unsigned long long next;
+	int listen_fd;
+	int timeout;
+	int one = 1;
+	int n;
+	int i;
+	int c;
+
+	while ((c = getopt(argc, argv, "x:lv")) != -1) {
+		switch (c) {
+		case 'x':
+			speed = strtod(optarg, NULL);
+			break;
+		case 'l':
+			loop = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2 || speed < 0) {
+		usage(argv[0]);
+	}
+	if (load(argv[optind + 1])) {
+		exit(2);
+	}
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		perror("socket");
+		exit(2);
+	}
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(atoi(argv[optind]));
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(listen_fd, (struct sockaddr *)&sin, sizeof(sin)) || listen(listen_fd, 16)) {
+		perror("bind");
+		exit(2);
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	if (verbose) {
+		printf("%lu calls loaded\n", (unsigned long)record_count);
+	}
+
+	while (!stopping) {
+		n = 0;
+		pfds[n].fd = listen_fd;
+		pfds[n].events = POLLIN;
+		idx[n++] = -1;
+		next = 0;
+		for (i = 0; i < MAX_CONNS; i++) {
+			if (!conns[i]) {
+				continue;
+			}
+			pfds[n].fd = conns[i]->fd;
+			pfds[n].events = POLLIN | (conns[i]->out.len ? POLLOUT : 0);
+			idx[n++] = i;
+			if (conns[i]->held_head
+			    && (!next || conns[i]->held_head->release < next)) {
+				next = conns[i]->held_head->release;
+			}
+		}
+		now = now_us();
+		if (!next) {
+			timeout = -1;
+		} else if (next <= now) {
+			timeout = 0;
+		} else {
+			/* Round up, so we don't wake just before it is due */
+			timeout = (int)((next - now + 999) / 1000);
+		}
+
+		if (poll(pfds, n, timeout) < 0 && errno != EINTR) {
+			perror("poll");
+			exit(3);
+		}
+		if (stopping) {
+			break;
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			open_conn(listen_fd);
+		}
+		for (i = 1; i < n; i++) {
+			if (conns[idx[i]] && service(conns[idx[i]], pfds[i].revents)) {
+				close_conn(idx[i]);
+			}
+		}
+	}
+	report();
+	return 0;
+}
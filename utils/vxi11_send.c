@@ -5,20 +5,23 @@
  * a device enabled with the VXI11 RPC ethernet protocol. Uses the files
  * generated by rpcgen vxi11.x, and the vxi11_user.h user libraries.
  *
+ * Given several devices, it sends the command to all of them at once and
+ * reports how long each one took.
+ *
  * This program is free software; you can redistribute it and/or
  * modify it under the terms of the GNU General Public License
  * as published by the Free Software Foundation; either version 2
  * of the License, or (at your option) any later version.
- * 
+ *
  * This program is distributed in the hope that it will be useful,
  * but WITHOUT ANY WARRANTY; without even the implied warranty of
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
- * 
+ *
  * You should have received a copy of the GNU General Public License
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
- * 
+ *
  * The author's email address is steve.sharples@nottingham.ac.uk
  */
 
@@ -32,28 +35,136 @@
 #define strncasecmp(a, b, c) stricmp(a, b)
 #endif
 
+/* The longest reply shown for a query */
+#define BUF_LEN 65536
+
+/* The library is silent unless asked, show its messages to the user */
+static void log_message(int level, const char *message, void *user)
+{
+	fprintf(stderr, "%s\n", message);
+}
+
+/* Whether cmd expects a reply, ignoring any '?' inside quoted strings. */
+static int is_query(const char *cmd)
+{
+	char quote = 0;
+
+	for (; *cmd; cmd++) {
+		if (quote) {
+			if (*cmd == quote) {
+				quote = 0;
+			}
+		} else if (*cmd == '"' || *cmd == '\'') {
+			quote = *cmd;
+		} else if (*cmd == '?') {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [-t timeout_ms] your.inst.ip.addr [more.inst.ip.addrs ...] command\n", prog);
+	printf("The command goes to every device at once. The reply to a query is shown,\n");
+	printf("and with more than one device, how long each took.\n");
+	exit(1);
+}
+
 int main(int argc, char *argv[])
 {
+	unsigned long timeout = VXI11_READ_TIMEOUT;
+	VXI11_CLINK **clinks;
+	VXI11_GROUP *group;
+	const char *cmd;
+	const char *reply;
+	size_t *members;
+	size_t len;
+	int devices;
+	int first;
+	int query;
+	int failed = 0;
+	ssize_t ret;
+	int i;
 
-	static char *device_ip;
-	char cmd[256];
-	VXI11_CLINK *clink;
+	for (first = 1; first < argc && argv[first][0] == '-'; first++) {
+		if (strcmp(argv[first], "-t") == 0 && first + 1 < argc) {
+			timeout = strtoul(argv[++first], NULL, 10);
+		} else {
+			usage(argv[0]);
+		}
+	}
+	devices = argc - first - 1;
+	if (devices < 1) {
+		usage(argv[0]);
+	}
+	cmd = argv[argc - 1];
+	query = is_query(cmd);
+
+	vxi11_set_log_callback(log_message, VXI11_LOG_WARNING, NULL);
 
-	if (argc < 2) {
-		printf("usage: %s your.inst.ip.addr command\n", argv[0]);
+	clinks = (VXI11_CLINK **)calloc(devices, sizeof(VXI11_CLINK *));
+	members = (size_t *)calloc(devices, sizeof(size_t));
+	if (!clinks || !members || vxi11_group_create(&group)) {
 		exit(1);
 	}
 
-	device_ip = argv[1];
-	if(vxi11_open_device(&clink, device_ip, NULL)){
-		printf("Error: could not open device %s, quitting\n",
-		       device_ip);
+	/* Carry on without any device that can't be opened */
+	for (i = 0; i < devices; i++) {
+		if (vxi11_open_device(&clinks[i], argv[first + i], NULL)) {
+			printf("Error: could not open device %s\n", argv[first + i]);
+			clinks[i] = NULL;
+			failed++;
+			continue;
+		}
+		members[i] = vxi11_group_size(group);
+		if (vxi11_group_add(group, clinks[i])) {
+			exit(1);
+		}
+	}
+	if (vxi11_group_size(group) == 0) {
 		exit(2);
 	}
 
-	memset(cmd, 0, 256);	// initialize command string
-	strncpy(cmd, argv[2], 256);
-	vxi11_send(clink, cmd, strlen(cmd));
-	vxi11_close_device(clink, device_ip);
-	return 0;
+	if (query) {
+		vxi11_group_query(group, cmd, BUF_LEN, timeout);
+	} else {
+		vxi11_group_send(group, cmd, strlen(cmd));
+	}
+
+	for (i = 0; i < devices; i++) {
+		if (!clinks[i]) {
+			continue;
+		}
+		ret = vxi11_group_result(group, members[i]);
+		if (ret < 0) {
+			failed++;
+		}
+		if (devices > 1) {
+			printf("%s\t%.3f ms\t", argv[first + i],
+			       vxi11_group_elapsed_us(group, members[i]) / 1000.0);
+		}
+		if (ret < 0) {
+			printf("*** [ ERROR %ld ] ***\n", (long)ret);
+		} else if (query) {
+			reply = vxi11_group_response(group, members[i]);
+			len = strlen(reply);
+			while (len > 0 && (reply[len - 1] == '\n' || reply[len - 1] == '\r')) {
+				len--;
+			}
+			printf("%.*s\n", (int)len, reply);
+		} else if (devices > 1) {
+			printf("ok\n");
+		}
+	}
+
+	for (i = 0; i < devices; i++) {
+		if (clinks[i]) {
+			vxi11_close_device(clinks[i], argv[first + i]);
+		}
+	}
+	vxi11_group_free(group);
+	free(members);
+	free(clinks);
+	return failed > 0 ? 3 : 0;
 }